@@ -51,12 +51,24 @@
 # included as definitions at compile time
         COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP SHADOWD GETCWD UPREEMPT"
 # As above, but not booleans
-        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE BOCHS_INSTALL_DIR"
+        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE BOCHS_INSTALL_DIR RAMDISK_IMAGE"
+
+# Image to preload ram0 with, e.g. a copy of the disk image made by
+# fsmaker. It is linked into the kernel, and the bootloader loads the
+# kernel into low memory, so keep it to a few hundred kilobytes. A
+# relative path is relative to kernel/, where it is assembled, so use
+# e.g. ../disk0.img for an image at the top of the tree. Leave empty
+# for an empty ram0.
+        RAMDISK_IMAGE=
 
 # Parameters for the hard disk we build (must be compatible!)
 # If the FS is too big for the disk, BAD things happen!
         DISK_BLOCKS=1024 # For fsmaker
         DISK_INODES=240 # for fsmaker
+        DISK_EXTENTS=0 # 1 to map the files fsmaker makes with extents
+        DISK_DIR_INDEX=0 # 1 to index large directories
+        DISK_JOURNAL=0 # blocks of metadata journal, 0 for none
+        DISK_INLINE_DATA=0 # 1 to keep small files in their inode
 
 # Debug message behavior. Note that this can be changed at runtime by
 # modifying the dbg_modes global variable.
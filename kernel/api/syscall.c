@@ -19,8 +19,14 @@
 #include "mm/pframe.h"
 #include "mm/kmalloc.h"
 
+#include "drivers/blockdev.h"
+
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
+#ifdef __S5FS__
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_icache.h"
+#endif
 
 #include "test/kshell/kshell.h"
 
@@ -52,6 +58,10 @@ init_func(syscall_init);
  *  - page_free() your buffer
  *  - return the number of bytes actually read, or if anything goes wrong
  *    set curthr->kt_errno and return -1
+ * For files opened with O_DIRECT (f_mode & FMODE_DIRECT) the user's
+ * buffer can be handed to do_read() as it is, without the temporary
+ * buffer: the direct_io vnode operation looks up and pins the user
+ * pages itself.
  */
 static int
 sys_read(read_args_t *arg)
@@ -485,7 +495,14 @@ static void *sys_brk(void *addr)
 
 static void sys_sync(void)
 {
+#ifdef __S5FS__
+        /* Inodes changed in memory go into their blocks, and committed
+         * pages can be written back, the others are pinned */
+        s5_icache_flush_all();
+        s5_journal_commit_all();
+#endif
         pframe_clean_all();
+        blockdev_flush_caches();
 }
 
 static void sys_halt(void)
@@ -2,9 +2,18 @@
 #include "types.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
 
 #include "drivers/blockdev.h"
+#include "drivers/dev.h"
 #include "drivers/disk/ata.h"
+#include "drivers/disk/md.h"
+#include "drivers/disk/ramdisk.h"
+#include "drivers/iosched.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
 
 #include "mm/pframe.h"
 #include "mm/mmobj.h"
@@ -32,8 +41,10 @@ void
 blockdev_init()
 {
         list_init(&blockdevs);
-        /* Initialize all subsystems */
+        /* Initialize all subsystems; layered devices go last */
         ata_init();
+        ramdisk_init();
+        md_init();
 }
 
 int
@@ -55,6 +66,7 @@ blockdev_register(blockdev_t *dev)
 
         /* Initialize its object here */
         mmobj_init(&dev->bd_mmobj, &blockdev_mmobj_ops);
+        memset(&dev->bd_stats, 0, sizeof(dev->bd_stats));
 
         list_insert_tail(&blockdevs, &dev->bd_link);
         return 0;
@@ -71,6 +83,307 @@ blockdev_lookup(devid_t id)
         return NULL;
 }
 
+/* Names of block devices, by major number */
+static const struct {
+        const char *bn_prefix;
+        int         bn_major;
+} blockdev_names[] = {
+        { "disk", DISK_MAJOR },
+        { "md",   MD_MAJOR },
+        { "ram",  RAMDISK_MAJOR },
+        { NULL,   0 }
+};
+
+blockdev_t *
+blockdev_lookup_name(const char *name)
+{
+        size_t len;
+        int i, minor;
+        char c;
+
+        for (i = 0; NULL != blockdev_names[i].bn_prefix; i++) {
+                len = strlen(blockdev_names[i].bn_prefix);
+                if (strncmp(name, blockdev_names[i].bn_prefix, len))
+                        continue;
+                /* The %c makes sure nothing follows the number */
+                if (1 != sscanf(name + len, "%d%c", &minor, &c)
+                    || 0 > minor || (int) MINOR_MASK < minor)
+                        return NULL;
+                return blockdev_lookup(MKDEVID(blockdev_names[i].bn_major, minor));
+        }
+        return NULL;
+}
+
+void
+blockdev_req_init(blockdev_req_t *req, blockdev_t *bdev, int write,
+                  char *buf, blocknum_t blocknum, size_t count,
+                  blockdev_done_func_t done_func, void *private)
+{
+        KASSERT(PAGE_ALIGNED(buf));
+        KASSERT(0 < count || NULL == buf);
+
+        req->br_bdev = bdev;
+        req->br_write = write;
+        req->br_buf = buf;
+        req->br_blocknum = blocknum;
+        req->br_count = count;
+        req->br_done_func = done_func;
+        req->br_private = private;
+        req->br_flags = 0;
+
+        req->br_done = 0;
+        req->br_status = 0;
+        sched_queue_init(&req->br_waitq);
+        req->br_submit_time = 0;
+
+        list_link_init(&req->br_link);
+        req->br_nblocks_done = 0;
+        req->br_npending = 0;
+        req->br_error = 0;
+
+        list_link_init(&req->br_fifo_link);
+        req->br_merge_next = NULL;
+        req->br_merge_last = req;
+        req->br_merge_nblocks = count;
+}
+
+void
+blockdev_req_init_flush(blockdev_req_t *req, blockdev_t *bdev,
+                        blockdev_done_func_t done_func, void *private)
+{
+        blockdev_req_init(req, bdev, 1, NULL, 0, 0, done_func, private);
+        req->br_flags = BLOCKDEV_REQ_BARRIER;
+}
+
+void
+blockdev_submit(blockdev_req_t *req)
+{
+        blockdev_t *bd = req->br_bdev;
+        blockdev_stats_t *st = &bd->bd_stats;
+        uint8_t oldipl;
+        int ret;
+
+        KASSERT(!req->br_done);
+
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+        req->br_submit_time = rdtsc();
+        if (0 == st->bs_inflight++)
+                st->bs_busy_since = req->br_submit_time;
+        intr_setipl(oldipl);
+
+        if (NULL != bd->bd_ops->submit) {
+                bd->bd_ops->submit(bd, req);
+                return;
+        }
+
+        /* Done synchronously, everything before a barrier has already
+         * completed; it only has to be flushed around it */
+        ret = 0;
+        if ((req->br_flags & BLOCKDEV_REQ_BARRIER) && NULL != bd->bd_ops->flush)
+                ret = bd->bd_ops->flush(bd);
+        if (0 == ret && 0 < req->br_count) {
+                if (req->br_write)
+                        ret = bd->bd_ops->write_block(bd, req->br_buf, req->br_blocknum,
+                                                      req->br_count);
+                else
+                        ret = bd->bd_ops->read_block(bd, req->br_buf, req->br_blocknum,
+                                                     req->br_count);
+                if (0 == ret && (req->br_flags & BLOCKDEV_REQ_BARRIER)
+                    && NULL != bd->bd_ops->flush)
+                        ret = bd->bd_ops->flush(bd);
+        }
+        blockdev_req_done(req, ret);
+}
+
+int
+blockdev_wait(blockdev_req_t *req)
+{
+        /* Keep the completion interrupt from sneaking in between
+         * checking br_done and going to sleep */
+        uint8_t oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+        while (!req->br_done)
+                sched_sleep_on(&req->br_waitq);
+        intr_setipl(oldipl);
+
+        return req->br_status;
+}
+
+/* Returns the latency histogram bucket for a number of cycles */
+static int
+blockdev_hist_bucket(uint64_t cycles)
+{
+        uint32_t hi = (uint32_t)(cycles >> 32), lo = (uint32_t) cycles;
+        int bucket = 0;
+
+        if (0 != hi) {
+                bucket = 32;
+                lo = hi;
+        }
+        while (lo >>= 1)
+                bucket++;
+        return MIN(bucket, BLOCKDEV_HIST_NBUCKETS - 1);
+}
+
+static void
+blockdev_stats_done(blockdev_req_t *req, int status)
+{
+        blockdev_stats_t *st = &req->br_bdev->bd_stats;
+        uint64_t now = rdtsc();
+        uint8_t oldipl;
+
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+
+        if (0 > status) {
+                st->bs_nerrors++;
+        } else if (0 == req->br_count) {
+                st->bs_nflushes++;
+        } else if (req->br_write) {
+                st->bs_nwrites++;
+                st->bs_nblocks_written += req->br_count;
+        } else {
+                st->bs_nreads++;
+                st->bs_nblocks_read += req->br_count;
+        }
+        st->bs_latency[blockdev_hist_bucket(now - req->br_submit_time)]++;
+
+        KASSERT(0 < st->bs_inflight);
+        if (0 == --st->bs_inflight)
+                st->bs_busy_cycles += now - st->bs_busy_since;
+
+        intr_setipl(oldipl);
+}
+
+int
+blockdev_flush_cache(blockdev_t *bd)
+{
+        if (NULL == bd->bd_ops->flush)
+                return 0;
+        return bd->bd_ops->flush(bd);
+}
+
+void
+blockdev_flush_caches()
+{
+        blockdev_t *bd;
+        int err;
+
+        list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+                if (0 > (err = blockdev_flush_cache(bd)))
+                        dbg(DBG_DISK, "failed to flush write cache of device "
+                            "%u:%u: %d\n", MAJOR(bd->bd_id), MINOR(bd->bd_id), err);
+        } list_iterate_end();
+}
+
+void
+blockdev_stats_service(blockdev_t *bd, uint64_t cycles)
+{
+        KASSERT(intr_getipl() >= BLOCKDEV_IPL);
+
+        bd->bd_stats.bs_ncommands++;
+        bd->bd_stats.bs_service[blockdev_hist_bucket(cycles)]++;
+}
+
+/* Writes the name of a block device, e.g. "disk0" */
+static void
+blockdev_print_name(char **buf, size_t *size, devid_t id)
+{
+        int i;
+
+        for (i = 0; NULL != blockdev_names[i].bn_prefix; i++) {
+                if ((int) MAJOR(id) == blockdev_names[i].bn_major) {
+                        iprintf(buf, size, "%s%u", blockdev_names[i].bn_prefix,
+                                MINOR(id));
+                        return;
+                }
+        }
+        iprintf(buf, size, "%u:%u", MAJOR(id), MINOR(id));
+}
+
+static void
+blockdev_print_hist(char **buf, size_t *size, const char *title,
+                    const uint32_t *hist)
+{
+        int i;
+
+        iprintf(buf, size, "%s (log2 cycles: count)\n", title);
+        for (i = 0; i < BLOCKDEV_HIST_NBUCKETS; i++) {
+                if (0 != hist[i])
+                        iprintf(buf, size, "  %2d: %u\n", i, hist[i]);
+        }
+}
+
+size_t
+blockdev_info(const void *arg, char *buf, size_t osize)
+{
+        const blockdev_t *bd = (const blockdev_t *)arg;
+        const blockdev_stats_t *st;
+        size_t size = osize;
+        uint32_t sectors_per_block = BLOCK_SIZE / 512;
+
+        KASSERT(NULL != buf);
+
+        if (NULL == bd) {
+                iprintf(&buf, &size, "%-8s %8s %8s %10s %10s %6s %5s %12s\n",
+                        "device", "reads", "writes", "rsectors", "wsectors",
+                        "errors", "busy", "busy Mcyc");
+                list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+                        char name[16], *np = name;
+                        size_t nsize = sizeof(name);
+
+                        st = &bd->bd_stats;
+                        blockdev_print_name(&np, &nsize, bd->bd_id);
+                        iprintf(&buf, &size, "%-8s %8u %8u %10u %10u %6u %5u %12u\n",
+                                name, st->bs_nreads, st->bs_nwrites,
+                                st->bs_nblocks_read * sectors_per_block,
+                                st->bs_nblocks_written * sectors_per_block,
+                                st->bs_nerrors, st->bs_inflight,
+                                (uint32_t)(st->bs_busy_cycles >> 20));
+                } list_iterate_end();
+                return size;
+        }
+
+        st = &bd->bd_stats;
+        blockdev_print_name(&buf, &size, bd->bd_id);
+        iprintf(&buf, &size, ": %u blocks\n", bd->bd_nblocks);
+        iprintf(&buf, &size, "reads %u (%u sectors), writes %u (%u sectors), "
+                "flushes %u, errors %u\n",
+                st->bs_nreads, st->bs_nblocks_read * sectors_per_block,
+                st->bs_nwrites, st->bs_nblocks_written * sectors_per_block,
+                st->bs_nflushes, st->bs_nerrors);
+        iprintf(&buf, &size, "in flight %u, busy %u Mcycles\n", st->bs_inflight,
+                (uint32_t)(st->bs_busy_cycles >> 20));
+        if (NULL != bd->bd_iosched) {
+                size_t left = iosched_info(bd->bd_iosched, buf, size);
+                buf += size - left;
+                size = left;
+        }
+        blockdev_print_hist(&buf, &size, "request latency", st->bs_latency);
+        if (0 != st->bs_ncommands) {
+                iprintf(&buf, &size, "commands %u\n", st->bs_ncommands);
+                blockdev_print_hist(&buf, &size, "command service time",
+                                    st->bs_service);
+        }
+
+        return size;
+}
+
+void
+blockdev_req_done(blockdev_req_t *req, int status)
+{
+        KASSERT(!req->br_done);
+
+        blockdev_stats_done(req, status);
+
+        req->br_status = status;
+        req->br_done = 1;
+        sched_broadcast_on(&req->br_waitq);
+        if (NULL != req->br_done_func)
+                req->br_done_func(req);
+}
+
 /*
  * Clean and then free all resident pages belonging to this
  * particular block device.
@@ -138,6 +451,21 @@ blockdev_cleanpage(mmobj_t *o, pframe_t *pf)
         KASSERT(pf && pf->pf_obj);
         /* Find the corresponding blockdev */
         blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
-        /* Clean the corresponding page by writing it back */
-        return bd->bd_ops->write_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+        blockdev_req_t req;
+        int ret;
+
+        /* Clean the corresponding page by writing it back, as a barrier
+         * if the filesystem asked for that. Pages are written one at a
+         * time in the order they are cleaned in; the barrier only makes
+         * this one stable before returning. */
+        if (!pframe_is_barrier(pf))
+                return bd->bd_ops->write_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+
+        pframe_clear_barrier(pf);
+        blockdev_req_init(&req, bd, 1, pf->pf_addr, pf->pf_pagenum, 1, NULL, NULL);
+        req.br_flags = BLOCKDEV_REQ_BARRIER;
+        blockdev_submit(&req);
+        if (0 > (ret = blockdev_wait(&req)))
+                pframe_set_barrier(pf);
+        return ret;
 }
@@ -1,5 +1,8 @@
+#include "kernel.h"
 #include "types.h"
+#include "errno.h"
 
+#include "main/cpuid.h"
 #include "main/interrupt.h"
 #include "main/io.h"
 
@@ -10,6 +13,7 @@
 
 #include "drivers/blockdev.h"
 #include "drivers/dev.h"
+#include "drivers/iosched.h"
 #include "drivers/disk/dma.h"
 
 #include "proc/sched.h"
@@ -24,9 +28,8 @@
 
 /*
  * Huge pile of helpful definitions (copied from OSDev). Note that we
- * do not support busmaster, drive detection, or LBA48 We support
- * secondary channel and slave drive, but probably won't ever use
- * them.
+ * do not support drive detection. We support secondary channel and
+ * slave drive, but probably won't ever use them.
  */
 
 /* Interface type (we will only use ATA) */
@@ -91,6 +94,21 @@ static struct ata_channel {
 
 #define ATA_SECTOR_SIZE 512 /* Pretty much always true */
 
+/* The most sectors one 28-bit or 48-bit LBA command can transfer (a
+ * sector count of 0 means the maximum) */
+#define ATA_MAX_SECTORS     256
+#define ATA_MAX_SECTORS_EXT 65536
+
+/* The most blocks one command transfers */
+#define ATA_MAX_BLOCKS     (ATA_MAX_SECTORS / (BLOCK_SIZE / ATA_SECTOR_SIZE))
+#define ATA_MAX_BLOCKS_EXT (ATA_MAX_SECTORS_EXT / (BLOCK_SIZE / ATA_SECTOR_SIZE))
+
+/* Sectors at and above this one need 48-bit LBA */
+#define ATA_LBA28_LIMIT (1ULL << 28)
+
+/* The most buffers one command transfers from */
+#define ATA_MAX_SG IOSCHED_MAX_MERGE
+
 /* Port address offsets for registers */
 /* Command registers */
 #define ATA_REG_DATA       0x00 /* Data register (read/write address) */
@@ -160,7 +178,14 @@ static struct ata_channel {
 #define ATA_DRIVEHEAD_CHS 0x00
 #define ATA_DRIVEHEAD_LBA 0x40
 
-#define ATA_IDENT_MAX_LBA 30
+/* Indices into the identification buffer, which we read 32 bits at a
+ * time, so these are half of the word numbers */
+#define ATA_IDENT_MAX_LBA     30 /* words 60-61 */
+#define ATA_IDENT_CMDSET      41 /* words 82-83 */
+#define ATA_IDENT_MAX_LBA_EXT 50 /* words 100-103 */
+
+/* Word 83 bit 10: 48-bit addressing is supported */
+#define ATA_IDENT_CMDSET_LBA48 (1 << (16 + 10))
 
 /* Reads from the command registers, NOT the control registers */
 #define ata_inb_reg(channel, reg) inb(ATA_CHANNELS[channel].atac_cmd + reg)
@@ -175,6 +200,11 @@ static struct ata_channel {
 #define ata_outl_reg(channel, reg, data) \
         outl(ATA_CHANNELS[(channel)].atac_cmd + (reg), (data))
 
+/* The 48-bit "high order byte" registers share ports with their low
+ * counterparts; they are written first */
+#define ata_outb_hob(channel, reg, data) \
+        ata_outb_reg((channel), (reg) - ATA_REG_SECCOUNT1 + ATA_REG_SECCOUNT0, (data))
+
 /* Helpful for delaying, etc. */
 #define ata_inb_altstatus(channel) \
         inb(ATA_CHANNELS[(channel)].atac_ctrl + ATA_REG_ALTSTATUS)
@@ -207,22 +237,42 @@ typedef struct ata_disk {
         uint8_t    ata_drive;
 
         /* Size of disk in number of sectors */
-        uint32_t   ata_size;
+        uint64_t   ata_size;
+
+        /* True if the disk supports 48-bit LBA */
+        int        ata_lba48;
 
         uint32_t   ata_sectors_per_block;
 
-        /* Threads making blocking disk operations wait one this
-         * queue, and disk interrupt wakes them up */
-        ktqueue_t  ata_waitq;
+        /* Requests waiting for the disk. Only touched with disk
+         * interrupts blocked. */
+        iosched_queue_t ata_queue;
+
+        /* The request the disk is working on, or NULL. This walks
+         * down the merge chain the scheduler handed us; the disk
+         * interrupt finishes the blocks of the current command and
+         * starts the next one. */
+        blockdev_req_t *ata_active;
+
+        /* Number of blocks the current command transfers, starting at
+         * the active request's next block and possibly continuing into
+         * the requests merged into it, or 0 if the disk is idle */
+        uint32_t   ata_nblocks;
 
-        /* Disk mutex since only one process can be using the disk at
-         * any time */
-        kmutex_t   ata_mutex;
+        /* True while a FLUSH CACHE command for the active (barrier)
+         * request is running */
+        int        ata_flushing;
+
+        /* rdtsc() when the current command was started */
+        uint64_t   ata_cmd_start;
 
         /* Underlying block device */
         blockdev_t ata_bdev;
 } ata_disk_t;
 
+/* True if the disk is running a command */
+#define ata_busy(adisk) (0 != (adisk)->ata_nblocks || (adisk)->ata_flushing)
+
 #define NDISKS __NDISKS__
 
 static void ata_intr_wrapper(regs_t *regs);
@@ -230,13 +280,20 @@ static int ata_read(blockdev_t *bdev, char *data,
                     blocknum_t blocknum, unsigned int count);
 static int ata_write(blockdev_t *bdev, const char *data,
                      blocknum_t blocknum, unsigned int count);
-static int ata_do_operation(ata_disk_t *adisk, char *data, \
-                            blocknum_t sectornum, int write);
+static void ata_submit(blockdev_t *bdev, blockdev_req_t *req);
+static int ata_flush(blockdev_t *bdev);
+static void ata_start(ata_disk_t *adisk);
+static void ata_req_done(ata_disk_t *adisk, int status);
+static uint32_t ata_do_operation(ata_disk_t *adisk, const dma_sg_t *sg,
+                                 int nsg, blocknum_t blocknum, int write);
+static void ata_do_flush(ata_disk_t *adisk);
 static void ata_intr(regs_t *regs, void *arg);
 
 static blockdev_ops_t ata_disk_ops = {
         .read_block  = ata_read,
-        .write_block = ata_write
+        .write_block = ata_write,
+        .submit      = ata_submit,
+        .flush       = ata_flush
 };
 
 void
@@ -290,19 +347,34 @@ ata_init()
                                                    ATA_REG_DATA);
                 }
                 /* Determine disk size */
-                adisk->ata_size = ident_buf[ATA_IDENT_MAX_LBA];
+                adisk->ata_lba48 = !!(ident_buf[ATA_IDENT_CMDSET]
+                                      & ATA_IDENT_CMDSET_LBA48);
+                if (adisk->ata_lba48) {
+                        adisk->ata_size = ident_buf[ATA_IDENT_MAX_LBA_EXT]
+                                          | ((uint64_t) ident_buf[ATA_IDENT_MAX_LBA_EXT + 1] << 32);
+                } else {
+                        adisk->ata_size = ident_buf[ATA_IDENT_MAX_LBA];
+                }
+                /* Our block numbers are 32 bits */
+                if (adisk->ata_size > (uint64_t) 0xffffffff * (BLOCK_SIZE / ATA_SECTOR_SIZE))
+                        adisk->ata_size = (uint64_t) 0xffffffff * (BLOCK_SIZE / ATA_SECTOR_SIZE);
                 /* In theory we could use this identification buffer
                  * to find out lots of other things but we don't
                  * really need to know any of them */
 
                 adisk->ata_sectors_per_block = BLOCK_SIZE / ATA_SECTOR_SIZE;
 
-                sched_queue_init(&adisk->ata_waitq);
-                kmutex_init(&adisk->ata_mutex);
+                iosched_init(&adisk->ata_queue);
+                adisk->ata_active = NULL;
+                adisk->ata_nblocks = 0;
+                adisk->ata_flushing = 0;
 
-                dbg(DBG_DISK, "Initialized ATA device %d, channel %s, drive %s, size %d\n",
+                dbg(DBG_DISK, "Initialized ATA device %d, channel %s, drive %s, "
+                    "size %u MiB%s\n",
                     ii, (adisk->ata_channel ? "SECONDARY" : "PRIMARY"),
-                    (adisk->ata_drive ? "SLAVE" : "MASTER"), adisk->ata_size);
+                    (adisk->ata_drive ? "SLAVE" : "MASTER"),
+                    (uint32_t)(adisk->ata_size >> 11),
+                    (adisk->ata_lba48 ? ", LBA48" : ""));
 
                 /* Set up corresponding handler */
                 intr_register(ATA_CHANNELS[adisk->ata_channel].atac_intr,
@@ -312,6 +384,9 @@ ata_init()
 
                 adisk->ata_bdev.bd_id = MKDEVID(DISK_MAJOR, ii);
                 adisk->ata_bdev.bd_ops = &ata_disk_ops;
+                adisk->ata_bdev.bd_nblocks =
+                        (blocknum_t)(adisk->ata_size / (BLOCK_SIZE / ATA_SECTOR_SIZE));
+                adisk->ata_bdev.bd_iosched = &adisk->ata_queue;
                 blockdev_register(&adisk->ata_bdev);
         }
         intr_setipl(oldipl);
@@ -351,8 +426,11 @@ ata_intr_wrapper(regs_t *regs)
 static int
 ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum, unsigned int count)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_read");
-        return -1;
+        blockdev_req_t req;
+
+        blockdev_req_init(&req, bdev, 0, data, blocknum, count, NULL, NULL);
+        blockdev_submit(&req);
+        return blockdev_wait(&req);
 }
 
 /**
@@ -368,109 +446,235 @@ ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum, unsigned int count)
 static int
 ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int count)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_write");
-        return -1;
+        blockdev_req_t req;
+
+        blockdev_req_init(&req, bdev, 1, (char *)data, blocknum, count, NULL, NULL);
+        blockdev_submit(&req);
+        return blockdev_wait(&req);
 }
 
 /**
- * Read/write the given block.
+ * Hands a request to the disk's I/O scheduler and starts the disk if it
+ * is idle.
  *
- * @param adisk the disk to perform the operation on
- * @param data the buffer to write from or read into
- * @param blocknum which block on the disk to read or write
- * @param write true if writing, false if reading
- * @return 0 on sucess or <0 on error
+ * @param bdev the disk
+ * @param req the request
  */
-/*
- * In this function you will perform a disk operation using
- * direct memory access (DMA). Follow these steps _VERY_
- * carefully. The steps are as follows:
- *
- *     o Lock the mutex and set the IPL. We don't want to
- *     other threads trying to perform an operation while we
- *     are in the middle of this operation. We also don't want
- *     to receive a disk interrupt, which is supposed to wake
- *     up this thread to alert us that the DMA operation has
- *     completed, before the thread goes to sleep and puts
- *     itself on the wait queue. Since the only interrupts we
- *     care about are disk interrupts, we do not have to mask
- *     all interrupts, just disk interrupts (and consequently,
- *     all interrupts with lower priority than disk
- *     interrupts). Try INTR_DISK_SECONDARY.
- *
- *     o Initialize DMA for this operation (see the dma_load()
- *     function)
- *
- *     o Write to the disk's registers to tell it the number
- *     of sectors that will be read/writen and the starting
- *     sector. Use the ata_outb_reg() function for writing
- *     to the hardware registers (as these are each one byte
- *     in size).
- *
- *     We use logical block addressing (LBA) to specify the
- *     starting sector. Our interface supports 24-bit sector
- *     numbers, and up to 256* sectors to be read/written at a
- *     time. Write the number of sectors to ATA_REG_SECCOUNT0.
- *     Write the sector number in little-endian order to
- *     ATA_REG_LBA{0-2} (least-significant eight bits to
- *     ATA_REG_LBA0, middle eight bits to ATA_REG_LBA1,
- *     most-significant eight bits to ATA_REG_LBA2).
- *
- *     (* Note that the special value 0 when written to this
- *     register will in fact write 256 sectors, though you will
- *     not ever be writing this value)
- *
- *     o Write to the disk's registers to tell it the type of
- *     operation it will be performing.
- *
- *     You should write either ATA_CMD_WRITE_DMA or
- *     ATA_CMD_READ_DMA to the ATA_REG_COMMAND register.
- *
- *     o Pause to make sure the disk is ready to go (see the
- *     ata_pause() function).
+static void
+ata_submit(blockdev_t *bdev, blockdev_req_t *req)
+{
+        ata_disk_t *adisk = bd_to_ata(bdev);
+        uint8_t oldipl;
+
+        if (((uint64_t) req->br_blocknum + req->br_count)
+            * adisk->ata_sectors_per_block > adisk->ata_size) {
+                dbg(DBG_DISK, "ATA request for blocks %u-%u past the end of the disk\n",
+                    req->br_blocknum, req->br_blocknum + req->br_count - 1);
+                blockdev_req_done(req, -EINVAL);
+                return;
+        }
+
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+        iosched_add(&adisk->ata_queue, req);
+        if (!ata_busy(adisk))
+                ata_start(adisk);
+        intr_setipl(oldipl);
+}
+
+/**
+ * Writes the disk's write cache to the platters by queueing a flush
+ * request behind everything submitted so far and waiting for it.
  *
- *     o Start the DMA operation (see the dma_start() function).
+ * @param bdev the disk
+ * @return 0 on success, -EIO if the disk reported an error
+ */
+static int
+ata_flush(blockdev_t *bdev)
+{
+        blockdev_req_t req;
+
+        blockdev_req_init_flush(&req, bdev, NULL, NULL);
+        blockdev_submit(&req);
+        return blockdev_wait(&req);
+}
+
+/**
+ * Starts the next command, asking the scheduler for the next request if
+ * there is no active one. A command covers as much of the rest of the
+ * active request and the requests merged into it as one command and
+ * one PRD table allow. Called with disk interrupts blocked.
  *
- *     o Now that we have given the disk and the DMA
- *     controller the necessary information, all we have to do
- *     is wait. This is the whole point of DMA: this process
- *     can yield, allowing the CPU to perform other tasks
- *     while we wait for the disk to seek and perform the
- *     requested operation.
+ * A barrier request (which the scheduler hands out on its own) is
+ * bracketed by cache flushes: the first one makes the writes before it
+ * stable, the one after its transfer (see ata_intr()) makes its own
+ * blocks stable. A barrier without blocks is just the first flush.
  *
- *     Specifically, we want to sleep on the disk's wait queue
- *     so we can be woken up by the interrupt handler, which
- *     will be called when the DMA operation is completed.
+ * @param adisk the disk
+ */
+static void
+ata_start(ata_disk_t *adisk)
+{
+        dma_sg_t sg[ATA_MAX_SG];
+        blockdev_req_t *req;
+        uint32_t maxblocks, nblocks = 0, n;
+        int nsg = 0;
+
+        if (NULL == adisk->ata_active) {
+                if (NULL == (adisk->ata_active = iosched_next(&adisk->ata_queue)))
+                        return;
+                if (adisk->ata_active->br_flags & BLOCKDEV_REQ_BARRIER) {
+                        KASSERT(NULL == adisk->ata_active->br_merge_next);
+                        ata_do_flush(adisk);
+                        return;
+                }
+        }
+
+        maxblocks = adisk->ata_lba48 ? ATA_MAX_BLOCKS_EXT : ATA_MAX_BLOCKS;
+        req = adisk->ata_active;
+        n = req->br_nblocks_done;
+        while (NULL != req && nblocks < maxblocks && nsg < ATA_MAX_SG) {
+                sg[nsg].ds_addr = req->br_buf + n * BLOCK_SIZE;
+                n = req->br_count - n;
+                if (n > maxblocks - nblocks)
+                        n = maxblocks - nblocks;
+                sg[nsg].ds_len = n * BLOCK_SIZE;
+                nsg++;
+                nblocks += n;
+
+                req = req->br_merge_next;
+                n = 0;
+        }
+
+        req = adisk->ata_active;
+        adisk->ata_nblocks = ata_do_operation(adisk, sg, nsg,
+                                              req->br_blocknum + req->br_nblocks_done,
+                                              req->br_write);
+}
+
+/**
+ * Starts a DMA read or write of the given blocks and returns without
+ * waiting for it; the disk interrupts once it is done. Called with disk
+ * interrupts blocked, so that the interrupt can not arrive before we
+ * are ready for it.
  *
- *     o Once we have woken up from sleep, we need to read
- *     the status of the DMA operation from the disk's
- *     ATA_REG_STATUS register (see the ata_inb_reg()
- *     function).
+ * When the transfer fits, we use 28-bit logical block addressing (LBA)
+ * to specify the starting sector: the least-significant 24 bits go to
+ * ATA_REG_LBA{0-2} and the top four to the low bits of
+ * ATA_REG_DRIVEHEAD. Otherwise we use the 48-bit commands, which take
+ * the next 24 bits of the sector and the high byte of a 16-bit sector
+ * count through the same registers, written before the low ones.
  *
- *     o Next, we check the status to see if the error bit is
- *     set (for status flags, see ATA_SR_* values). If there
- *     is an error, read the error code from the disk's
- *     ATA_REG_ERROR register (propagate it up as -error).
+ * @param adisk the disk to perform the operation on
+ * @param sg the buffers to write from or read into, at most
+ * ATA_MAX_BLOCKS (ATA_MAX_BLOCKS_EXT for LBA48 disks) blocks in total
+ * @param nsg the number of buffers
+ * @param blocknum the first block on the disk to read or write
+ * @param write true if writing, false if reading
+ * @return the number of blocks transferred, which is less than the
+ * length of the buffers if they did not fit into the PRD table
+ */
+static uint32_t
+ata_do_operation(ata_disk_t *adisk, const dma_sg_t *sg, int nsg,
+                 blocknum_t blocknum, int write)
+{
+        uint8_t channel = adisk->ata_channel;
+        uint64_t sector = (uint64_t) blocknum * adisk->ata_sectors_per_block;
+        uint32_t nblocks, nsectors;
+        uint8_t drive;
+        int lba48;
+
+        KASSERT(intr_getipl() >= INTR_DISK_PRIMARY);
+
+        nblocks = dma_load_sg(channel, sg, nsg, write) / BLOCK_SIZE;
+        nsectors = nblocks * adisk->ata_sectors_per_block;
+        lba48 = (nsectors > ATA_MAX_SECTORS
+                 || sector + nsectors > ATA_LBA28_LIMIT);
+        KASSERT(0 < nblocks);
+        KASSERT(!lba48 || (adisk->ata_lba48 && nsectors <= ATA_MAX_SECTORS_EXT));
+
+        drive = (adisk->ata_drive ? ATA_DRIVEHEAD_SLAVE : ATA_DRIVEHEAD_MASTER)
+                | ATA_DRIVEHEAD_LBA;
+        /* Truncation of the sector count to 0 for the maximum is
+         * intended */
+        if (lba48) {
+                ata_outb_reg(channel, ATA_REG_DRIVEHEAD, drive);
+                ata_outb_hob(channel, ATA_REG_SECCOUNT1, (nsectors >> 8) & 0xff);
+                ata_outb_hob(channel, ATA_REG_LBA3, (sector >> 24) & 0xff);
+                ata_outb_hob(channel, ATA_REG_LBA4, (sector >> 32) & 0xff);
+                ata_outb_hob(channel, ATA_REG_LBA5, (sector >> 40) & 0xff);
+        } else {
+                ata_outb_reg(channel, ATA_REG_DRIVEHEAD,
+                             drive | ((sector >> 24) & 0x0f));
+        }
+        ata_outb_reg(channel, ATA_REG_SECCOUNT0, nsectors & 0xff);
+        ata_outb_reg(channel, ATA_REG_LBA0, sector & 0xff);
+        ata_outb_reg(channel, ATA_REG_LBA1, (sector >> 8) & 0xff);
+        ata_outb_reg(channel, ATA_REG_LBA2, (sector >> 16) & 0xff);
+
+        if (lba48)
+                ata_outb_reg(channel, ATA_REG_COMMAND,
+                             (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT));
+        else
+                ata_outb_reg(channel, ATA_REG_COMMAND,
+                             (write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA));
+        ata_pause(channel);
+
+        adisk->ata_cmd_start = rdtsc();
+        dma_start(channel);
+
+        return nblocks;
+}
+
+/**
+ * Starts a FLUSH CACHE command, which interrupts once everything the
+ * disk has acknowledged so far is on stable storage. Called with disk
+ * interrupts blocked.
  *
- *     o Alert the DMA controller that we have received the
- *     interrupt and, if necessary, clear the error bit (see
- *     dma_reset() function).
+ * @param adisk the disk
+ */
+static void
+ata_do_flush(ata_disk_t *adisk)
+{
+        uint8_t channel = adisk->ata_channel;
+
+        KASSERT(intr_getipl() >= INTR_DISK_PRIMARY);
+        KASSERT(!ata_busy(adisk));
+
+        ata_outb_reg(channel, ATA_REG_DRIVEHEAD,
+                     (adisk->ata_drive ? ATA_DRIVEHEAD_SLAVE : ATA_DRIVEHEAD_MASTER)
+                     | ATA_DRIVEHEAD_LBA);
+        ata_outb_reg(channel, ATA_REG_COMMAND,
+                     (adisk->ata_lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH));
+        ata_pause(channel);
+
+        adisk->ata_flushing = 1;
+        adisk->ata_cmd_start = rdtsc();
+}
+
+/**
+ * Completes the active request and moves on to the next request merged
+ * into it, if any. The next request is looked up first since the
+ * completion callback may resubmit the request.
  *
- *     o Now we are finished. Restore the IPL, release any
- *     locks we have, and return the status of the DMA
- *     operation.
+ * @param adisk the disk
+ * @param status 0 or -errno
  */
-static int
-ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
+static void
+ata_req_done(ata_disk_t *adisk, int status)
 {
+        blockdev_req_t *req = adisk->ata_active;
 
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_do_operation");
-        return -1;
+        adisk->ata_active = req->br_merge_next;
+        iosched_complete(&adisk->ata_queue, req);
+        blockdev_req_done(req, status);
 }
 
 /**
  * Interrupt handler called by the disk when an operation has
- * completed.
+ * completed. Completes every request whose last block was part of the
+ * command (or every request the command touched, if the disk reported
+ * an error) and keeps the disk busy with the next command.
  *
  * @param regs the register state
  * @param arg the disk the operation was performed on. This should be
@@ -479,6 +683,69 @@ ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
 static void
 ata_intr(regs_t *regs, void *arg)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_intr");
-}
+        ata_disk_t *adisk = (ata_disk_t *)arg;
+        blockdev_req_t *req = adisk->ata_active;
+        uint32_t nblocks, n;
+        uint8_t status;
+        int err = 0, postflush = 0;
+
+        status = ata_inb_reg(adisk->ata_channel, ATA_REG_STATUS);
+        dma_reset(adisk->ata_channel);
+
+        if (!ata_busy(adisk)) {
+                dbg(DBG_DISK, "Spurious ATA interrupt on channel %d\n",
+                    adisk->ata_channel);
+                return;
+        }
+
+        blockdev_stats_service(&adisk->ata_bdev, rdtsc() - adisk->ata_cmd_start);
+
+        /* A cache flush either comes before the barrier's blocks or
+         * after all of them. Like below, the disk stays busy while the
+         * request completes. */
+        if (adisk->ata_flushing) {
+                if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+                        dbg(DBG_DISK, "ATA cache flush failed, status 0x%x error 0x%x\n",
+                            status, ata_inb_reg(adisk->ata_channel, ATA_REG_ERROR));
+                        err = -EIO;
+                }
+                if (err || req->br_nblocks_done == req->br_count)
+                        ata_req_done(adisk, err);
+                adisk->ata_flushing = 0;
+                ata_start(adisk);
+                return;
+        }
 
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+                dbg(DBG_DISK, "ATA %s of blocks %u-%u failed, status 0x%x error 0x%x\n",
+                    (req->br_write ? "write" : "read"),
+                    req->br_blocknum + req->br_nblocks_done,
+                    req->br_blocknum + req->br_nblocks_done + adisk->ata_nblocks - 1,
+                    status, ata_inb_reg(adisk->ata_channel, ATA_REG_ERROR));
+                err = -EIO;
+        }
+
+        /* We can not tell which blocks of a failed command made it, so
+         * fail every request it touched. The disk counts as busy until
+         * we are done, so that completion callbacks which submit new
+         * requests only queue them. */
+        for (nblocks = adisk->ata_nblocks; 0 < nblocks; nblocks -= n) {
+                req = adisk->ata_active;
+                KASSERT(NULL != req);
+                n = req->br_count - req->br_nblocks_done;
+                if (n > nblocks)
+                        n = nblocks;
+                req->br_nblocks_done += n;
+                if (!err && req->br_nblocks_done == req->br_count
+                    && (req->br_flags & BLOCKDEV_REQ_BARRIER))
+                        postflush = 1;
+                else if (err || req->br_nblocks_done == req->br_count)
+                        ata_req_done(adisk, err);
+        }
+        adisk->ata_nblocks = 0;
+
+        if (postflush)
+                ata_do_flush(adisk);
+        else
+                ata_start(adisk);
+}
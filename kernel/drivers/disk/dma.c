@@ -46,35 +46,91 @@ typedef struct {
         uint16_t prd_last;
 } prd_t;
 
-static prd_t prd_table[2] __attribute__((aligned(32)));
+/* Marks the last entry of a PRD table */
+#define PRD_LAST (1 << 15)
+
+/* A PRD table may not cross a 64K boundary; aligning both tables to
+ * their combined size guarantees that */
+static prd_t prd_table[2][DMA_MAX_PRDS]
+__attribute__((aligned(2 * DMA_MAX_PRDS * sizeof(prd_t))));
 
 static prd_t *DMA_PRDS[2];
 
 void
 dma_init()
 {
-        /* Clear the table */
-        memset(prd_table, 0, sizeof(prd_t) * 2);
-        /* Set pointers to it; note each channel only needs one PRD entry */
-        DMA_PRDS[0] = prd_table;
-        DMA_PRDS[1] = prd_table + 1;
-
+        /* Clear the tables */
+        memset(prd_table, 0, sizeof(prd_table));
+        /* Set pointers to them */
+        DMA_PRDS[0] = prd_table[0];
+        DMA_PRDS[1] = prd_table[1];
 }
 
 void
 dma_load(uint8_t channel, void *start, int count, int write)
 {
-        KASSERT(PAGE_ALIGNED(start));
-        memset(DMA_PRDS[channel], 0, 8);
-        dma_reset(channel);
-        DMA_PRDS[channel]->prd_addr = pt_virt_to_phys((uintptr_t) start);
+        dma_sg_t sg;
+
+        KASSERT(0 < count && count <= (int) PAGE_SIZE);
+        sg.ds_addr = start;
+        sg.ds_len = PAGE_SIZE;
+        dma_load_sg(channel, &sg, 1, write);
         DMA_PRDS[channel]->prd_count = (uint16_t) count;
-        DMA_PRDS[channel]->prd_last = (1 << 15);
-        dma_outl_reg(channel, DMA_PRD,
-                     pt_virt_to_phys((uintptr_t) DMA_PRDS[channel]));
+}
+
+uint32_t
+dma_load_sg(uint8_t channel, const dma_sg_t *sg, int nsg, int write)
+{
+        prd_t *prd = DMA_PRDS[channel];
+        int nprds = 0;
+        uint32_t total = 0;
+        uint32_t phys, len;
+        int i;
+
+        KASSERT(0 < nsg);
+        dma_reset(channel);
+
+        for (i = 0; i < nsg; i++) {
+                uintptr_t addr = (uintptr_t) sg[i].ds_addr;
+                uintptr_t end = addr + sg[i].ds_len;
+
+                KASSERT(PAGE_ALIGNED(addr) && PAGE_ALIGNED(end) && addr < end);
+
+                /* A page never crosses a 64K boundary, so look pages up
+                 * one at a time and extend the previous entry when a
+                 * page follows it physically and stays within its 64K
+                 * region. A count of 0 means 64K. */
+                for (; addr < end; addr += PAGE_SIZE) {
+                        phys = pt_virt_to_phys(addr);
+                        if (0 < nprds) {
+                                len = prd[nprds - 1].prd_count
+                                      ? prd[nprds - 1].prd_count
+                                      : DMA_PRD_MAX_BYTES;
+                                if (prd[nprds - 1].prd_addr + len == phys
+                                    && 0 != (phys & (DMA_PRD_MAX_BYTES - 1))) {
+                                        prd[nprds - 1].prd_count =
+                                                (uint16_t)(len + PAGE_SIZE);
+                                        total += PAGE_SIZE;
+                                        continue;
+                                }
+                        }
+                        if (DMA_MAX_PRDS == nprds)
+                                goto done;
+                        prd[nprds].prd_addr = phys;
+                        prd[nprds].prd_count = PAGE_SIZE;
+                        prd[nprds].prd_last = 0;
+                        nprds++;
+                        total += PAGE_SIZE;
+                }
+        }
+
+done:
+        prd[nprds - 1].prd_last = PRD_LAST;
+        dma_outl_reg(channel, DMA_PRD, pt_virt_to_phys((uintptr_t) prd));
         /* Write out the command's read/write code */
         dma_outb_reg(channel, DMA_COMMAND,
                      (write ? DMA_CMD_WRITE : DMA_CMD_READ));
+        return total;
 }
 
 uint8_t
@@ -0,0 +1,418 @@
+#include "kernel.h"
+#include "config.h"
+#include "types.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/disk/md.h"
+
+#include "mm/kmalloc.h"
+
+/* A request to a member, issued on behalf of a request to the array */
+typedef struct md_child {
+        blockdev_req_t   mc_req;
+        blockdev_req_t  *mc_parent;
+        struct md_dev   *mc_md;
+        int              mc_disk;       /* member the request went to */
+        int              mc_ntries;     /* members tried (RAID-1 reads) */
+        list_link_t      mc_link;       /* link on md_free */
+} md_child_t;
+
+#define bd_to_md(bd) (CONTAINER_OF((bd), md_dev_t, md_bdev))
+
+typedef struct md_dev {
+        int              md_level;
+        blocknum_t       md_chunk;
+        int              md_ndisks;
+        blockdev_t      *md_disks[MD_MAX_DISKS];
+
+        /* Requests in flight to each member and where the last one to
+         * each member ended, for balancing RAID-1 reads */
+        int              md_inflight[MD_MAX_DISKS];
+        blocknum_t       md_last[MD_MAX_DISKS];
+
+        /* Requests to the array which have not been completely handed
+         * to the members yet (br_link), oldest first, and the child
+         * requests available to do so. Both are only touched with disk
+         * interrupts blocked. */
+        list_t           md_pending;
+        list_t           md_free;
+        md_child_t       md_children[MD_NCHILDREN];
+        int              md_nbusy;      /* children not on md_free */
+        int              md_dispatching;
+
+        /* The barrier request being worked on, if any; nothing behind
+         * it is handed to the members until it has completed */
+        blockdev_req_t  *md_barrier;
+
+        blockdev_t       md_bdev;
+} md_dev_t;
+
+static int md_read(blockdev_t *bdev, char *data,
+                   blocknum_t blocknum, size_t count);
+static int md_write(blockdev_t *bdev, const char *data,
+                    blocknum_t blocknum, size_t count);
+static void md_submit(blockdev_t *bdev, blockdev_req_t *req);
+static int md_flush(blockdev_t *bdev);
+static void md_dispatch(md_dev_t *md);
+static void md_child_done(blockdev_req_t *creq);
+
+static blockdev_ops_t md_ops = {
+        .read_block  = md_read,
+        .write_block = md_write,
+        .submit      = md_submit,
+        .flush       = md_flush
+};
+
+static int md_narrays = 0;
+
+void
+md_init()
+{
+#ifdef MD_LEVEL
+        blockdev_t *disks[MD_MAX_DISKS];
+        int i;
+
+        KASSERT(MD_NDISKS <= MD_MAX_DISKS);
+        for (i = 0; i < MD_NDISKS; i++) {
+                if (NULL == (disks[i] = blockdev_lookup(MKDEVID(DISK_MAJOR, i))))
+                        panic("md0 needs %d disks, but disk%d does not exist\n",
+                              MD_NDISKS, i);
+        }
+        if (NULL == md_create(MD_LEVEL, MD_CHUNK_BLOCKS, disks, MD_NDISKS))
+                panic("could not build md0\n");
+#endif
+}
+
+blockdev_t *
+md_create(int level, blocknum_t chunk, blockdev_t **disks, int ndisks)
+{
+        md_dev_t *md;
+        blocknum_t size;
+        int i;
+
+        if (ndisks < 1 || ndisks > MD_MAX_DISKS
+            || (MD_RAID0 != level && MD_RAID1 != level)
+            || (MD_RAID0 == level && 0 == chunk))
+                return NULL;
+
+        if (NULL == (md = (md_dev_t *)kmalloc(sizeof(md_dev_t))))
+                return NULL;
+        memset(md, 0, sizeof(*md));
+
+        md->md_level = level;
+        md->md_chunk = chunk;
+        md->md_ndisks = ndisks;
+        size = disks[0]->bd_nblocks;
+        for (i = 0; i < ndisks; i++) {
+                md->md_disks[i] = disks[i];
+                if (disks[i]->bd_nblocks < size)
+                        size = disks[i]->bd_nblocks;
+        }
+
+        list_init(&md->md_pending);
+        list_init(&md->md_free);
+        for (i = 0; i < MD_NCHILDREN; i++) {
+                md->md_children[i].mc_md = md;
+                list_insert_tail(&md->md_free, &md->md_children[i].mc_link);
+        }
+
+        /* RAID-0 only uses whole chunks of each member */
+        if (MD_RAID0 == level)
+                size = (size - size % chunk) * ndisks;
+
+        md->md_bdev.bd_id = MKDEVID(MD_MAJOR, md_narrays);
+        md->md_bdev.bd_ops = &md_ops;
+        md->md_bdev.bd_nblocks = size;
+        md->md_bdev.bd_iosched = NULL;
+        if (0 > blockdev_register(&md->md_bdev)) {
+                kfree(md);
+                return NULL;
+        }
+        md_narrays++;
+
+        dbg(DBG_DISK, "md%u: RAID-%d over %d disks, %u blocks\n",
+            MINOR(md->md_bdev.bd_id), level, ndisks, size);
+        return &md->md_bdev;
+}
+
+static int
+md_read(blockdev_t *bdev, char *data, blocknum_t blocknum, size_t count)
+{
+        blockdev_req_t req;
+
+        blockdev_req_init(&req, bdev, 0, data, blocknum, count, NULL, NULL);
+        blockdev_submit(&req);
+        return blockdev_wait(&req);
+}
+
+static int
+md_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, size_t count)
+{
+        blockdev_req_t req;
+
+        blockdev_req_init(&req, bdev, 1, (char *)data, blocknum, count, NULL, NULL);
+        blockdev_submit(&req);
+        return blockdev_wait(&req);
+}
+
+/* Flushes the write caches of all members */
+static int
+md_flush(blockdev_t *bdev)
+{
+        blockdev_req_t req;
+
+        blockdev_req_init_flush(&req, bdev, NULL, NULL);
+        blockdev_submit(&req);
+        return blockdev_wait(&req);
+}
+
+/*
+ * Requests to the array use br_nblocks_done for the number of blocks
+ * handed to members so far, br_npending for the number of child
+ * requests in flight and br_error for the first error one of them
+ * reported.
+ */
+static void
+md_submit(blockdev_t *bdev, blockdev_req_t *req)
+{
+        md_dev_t *md = bd_to_md(bdev);
+        uint8_t oldipl;
+
+        if ((uint64_t) req->br_blocknum + req->br_count > bdev->bd_nblocks) {
+                blockdev_req_done(req, -EINVAL);
+                return;
+        }
+
+        req->br_npending = 0;
+        req->br_error = 0;
+
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+        list_insert_tail(&md->md_pending, &req->br_link);
+        md_dispatch(md);
+        intr_setipl(oldipl);
+}
+
+/* Picks the member to read a block from */
+static int
+md_pick_mirror(md_dev_t *md, blocknum_t blocknum)
+{
+        uint32_t dist, bestdist = 0;
+        int i, best = -1;
+
+        for (i = 0; i < md->md_ndisks; i++) {
+                dist = (blocknum > md->md_last[i] ? blocknum - md->md_last[i]
+                        : md->md_last[i] - blocknum);
+                if (-1 == best || md->md_inflight[i] < md->md_inflight[best]
+                    || (md->md_inflight[i] == md->md_inflight[best] && dist < bestdist)) {
+                        best = i;
+                        bestdist = dist;
+                }
+        }
+        return best;
+}
+
+static md_child_t *
+md_child_get(md_dev_t *md)
+{
+        md_child_t *child = list_head(&md->md_free, md_child_t, mc_link);
+
+        list_remove(&child->mc_link);
+        md->md_nbusy++;
+        return child;
+}
+
+static void
+md_child_submit(md_dev_t *md, md_child_t *child, blockdev_req_t *parent,
+                int disk, char *buf, blocknum_t blocknum, size_t count)
+{
+        child->mc_parent = parent;
+        child->mc_disk = disk;
+        md->md_inflight[disk]++;
+        md->md_last[disk] = blocknum + count;
+        blockdev_req_init(&child->mc_req, md->md_disks[disk], parent->br_write,
+                          buf, blocknum, count, md_child_done, child);
+        child->mc_req.br_flags = parent->br_flags;
+        blockdev_submit(&child->mc_req);
+}
+
+/* Flushes the write cache of a member on behalf of a barrier */
+static void
+md_child_flush(md_dev_t *md, md_child_t *child, blockdev_req_t *parent, int disk)
+{
+        child->mc_parent = parent;
+        child->mc_disk = disk;
+        md->md_inflight[disk]++;
+        blockdev_req_init_flush(&child->mc_req, md->md_disks[disk],
+                                md_child_done, child);
+        blockdev_submit(&child->mc_req);
+}
+
+/*
+ * Starts a barrier request, once every child issued before it has
+ * completed, by flushing the caches of all members. A barrier without
+ * blocks is done when they are; otherwise its blocks are handed out
+ * afterwards, as barriers to the members they live on, which flush
+ * them too. The request may have completed when this returns.
+ */
+static void
+md_barrier_start(md_dev_t *md, blockdev_req_t *req)
+{
+        int i;
+
+        KASSERT(NULL == md->md_barrier);
+        KASSERT(0 == md->md_nbusy && MD_NCHILDREN >= md->md_ndisks);
+
+        md->md_barrier = req;
+        if (0 == req->br_count)
+                list_remove(&req->br_link);
+        req->br_npending += md->md_ndisks;
+        for (i = 0; i < md->md_ndisks; i++)
+                md_child_flush(md, md_child_get(md), req, i);
+}
+
+/*
+ * Hands as much of the pending requests to the members as there are
+ * free child requests for. The bookkeeping for a piece is done before
+ * its child request is submitted, since the child may complete (and
+ * call back into us) before blockdev_submit() returns. Nothing passes a
+ * barrier (see md_barrier_start()). Called with disk interrupts
+ * blocked.
+ */
+static void
+md_dispatch(md_dev_t *md)
+{
+        blockdev_req_t *req;
+        md_child_t *child;
+        blocknum_t block, chunk, off;
+        size_t done, n;
+        char *buf;
+        int i;
+
+        KASSERT(intr_getipl() >= BLOCKDEV_IPL);
+
+        /* A child completing synchronously comes back here; the outer
+         * call will notice the child it freed */
+        if (md->md_dispatching)
+                return;
+        md->md_dispatching = 1;
+
+        while (!list_empty(&md->md_pending) && !list_empty(&md->md_free)) {
+                req = list_head(&md->md_pending, blockdev_req_t, br_link);
+                if (NULL != md->md_barrier && md->md_barrier != req)
+                        break;
+                if ((req->br_flags & BLOCKDEV_REQ_BARRIER) && md->md_barrier != req) {
+                        if (0 != md->md_nbusy)
+                                break;
+                        md_barrier_start(md, req);
+                        continue;
+                }
+                if (md->md_barrier == req && 0 == req->br_nblocks_done) {
+                        /* Wait for the flushes before the first block */
+                        if (0 != req->br_npending)
+                                break;
+                        /* No point in writing the blocks if the caches
+                         * could not be flushed */
+                        if (0 != req->br_error) {
+                                list_remove(&req->br_link);
+                                md->md_barrier = NULL;
+                                blockdev_req_done(req, req->br_error);
+                                continue;
+                        }
+                }
+
+                done = req->br_nblocks_done;
+                buf = req->br_buf + done * BLOCK_SIZE;
+                block = req->br_blocknum + done;
+
+                if (MD_RAID0 == md->md_level) {
+                        chunk = block / md->md_chunk;
+                        off = block % md->md_chunk;
+                        n = md->md_chunk - off;
+                        if (n > req->br_count - done)
+                                n = req->br_count - done;
+
+                        req->br_nblocks_done += n;
+                        if (req->br_nblocks_done == req->br_count)
+                                list_remove(&req->br_link);
+                        req->br_npending++;
+                        md_child_submit(md, md_child_get(md), req,
+                                        chunk % md->md_ndisks, buf,
+                                        (chunk / md->md_ndisks) * md->md_chunk + off, n);
+                } else if (!req->br_write) {
+                        n = req->br_count;
+                        req->br_nblocks_done = n;
+                        list_remove(&req->br_link);
+                        req->br_npending++;
+                        child = md_child_get(md);
+                        child->mc_ntries = 1;
+                        md_child_submit(md, child, req, md_pick_mirror(md, block),
+                                        buf, block, n);
+                } else {
+                        /* A mirrored write needs a child for every member */
+                        n = 0;
+                        list_iterate_begin(&md->md_free, child, md_child_t, mc_link) {
+                                n++;
+                        } list_iterate_end();
+                        if (n < (size_t) md->md_ndisks)
+                                break;
+
+                        req->br_nblocks_done = req->br_count;
+                        list_remove(&req->br_link);
+                        req->br_npending += md->md_ndisks;
+                        for (i = 0; i < md->md_ndisks; i++) {
+                                md_child_submit(md, md_child_get(md), req, i, buf,
+                                                block, req->br_count);
+                        }
+                }
+        }
+
+        md->md_dispatching = 0;
+}
+
+static void
+md_child_done(blockdev_req_t *creq)
+{
+        md_child_t *child = (md_child_t *)creq->br_private;
+        md_dev_t *md = child->mc_md;
+        blockdev_req_t *parent = child->mc_parent;
+        int disk;
+
+        md->md_inflight[child->mc_disk]--;
+
+        /* A failed mirrored read gets another chance on the next
+         * member */
+        if (MD_RAID1 == md->md_level && !parent->br_write && 0 < creq->br_count
+            && 0 > creq->br_status && child->mc_ntries < md->md_ndisks) {
+                disk = (child->mc_disk + 1) % md->md_ndisks;
+                dbg(DBG_DISK, "md%u: read of block %u failed on member %d, "
+                    "retrying on member %d\n", MINOR(md->md_bdev.bd_id),
+                    creq->br_blocknum, child->mc_disk, disk);
+                child->mc_ntries++;
+                md_child_submit(md, child, parent, disk, creq->br_buf,
+                                creq->br_blocknum, creq->br_count);
+                return;
+        }
+
+        if (0 > creq->br_status && 0 == parent->br_error)
+                parent->br_error = creq->br_status;
+        list_insert_tail(&md->md_free, &child->mc_link);
+        md->md_nbusy--;
+
+        if (0 == --parent->br_npending
+            && parent->br_nblocks_done == parent->br_count) {
+                if (md->md_barrier == parent)
+                        md->md_barrier = NULL;
+                blockdev_req_done(parent, parent->br_error);
+        }
+
+        md_dispatch(md);
+}
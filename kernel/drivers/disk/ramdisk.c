@@ -0,0 +1,176 @@
+#include "kernel.h"
+#include "config.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/disk/ramdisk.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+#define bd_to_rd(bd) (CONTAINER_OF((bd), ramdisk_t, rd_bdev))
+
+typedef struct ramdisk {
+        /* The page holding each block, or NULL if the block has never
+         * been written */
+        char           **rd_blocks;
+
+        /* Number of blocks with a page */
+        blocknum_t       rd_nresident;
+
+        blockdev_t       rd_bdev;
+} ramdisk_t;
+
+#ifdef __RAMDISK_IMAGE__
+/* See ramdisk_image.S */
+extern char ramdisk_image[];
+extern char ramdisk_image_end[];
+#endif
+
+static int ramdisk_read(blockdev_t *bdev, char *data,
+                        blocknum_t blocknum, size_t count);
+static int ramdisk_write(blockdev_t *bdev, const char *data,
+                         blocknum_t blocknum, size_t count);
+
+/* No submit operation: transfers are memory copies, so blockdev_submit()
+ * doing them synchronously is as fast as it gets. There is no cache to
+ * flush either. */
+static blockdev_ops_t ramdisk_ops = {
+        .read_block  = ramdisk_read,
+        .write_block = ramdisk_write,
+        .submit      = NULL,
+        .flush       = NULL
+};
+
+static ramdisk_t *
+ramdisk_create(int minor, blocknum_t nblocks)
+{
+        ramdisk_t *rd;
+
+        if (NULL == (rd = (ramdisk_t *)kmalloc(sizeof(ramdisk_t))))
+                return NULL;
+        if (NULL == (rd->rd_blocks = (char **)kmalloc(nblocks * sizeof(char *)))) {
+                kfree(rd);
+                return NULL;
+        }
+        memset(rd->rd_blocks, 0, nblocks * sizeof(char *));
+        rd->rd_nresident = 0;
+
+        rd->rd_bdev.bd_id = MKDEVID(RAMDISK_MAJOR, minor);
+        rd->rd_bdev.bd_ops = &ramdisk_ops;
+        rd->rd_bdev.bd_nblocks = nblocks;
+        rd->rd_bdev.bd_iosched = NULL;
+        return rd;
+}
+
+void
+ramdisk_init()
+{
+        blocknum_t nblocks;
+        ramdisk_t *rd;
+        int i;
+#ifdef __RAMDISK_IMAGE__
+        size_t imgsize = ramdisk_image_end - ramdisk_image;
+#endif
+
+        for (i = 0; i < RAMDISK_NDEVS; i++) {
+                nblocks = RAMDISK_NBLOCKS;
+#ifdef __RAMDISK_IMAGE__
+                if (0 == i && nblocks * BLOCK_SIZE < imgsize)
+                        nblocks = (imgsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+#endif
+                if (NULL == (rd = ramdisk_create(i, nblocks)))
+                        panic("Not enough memory for ramdisk %d\n", i);
+
+#ifdef __RAMDISK_IMAGE__
+                /* Copy through a zeroed page so that a partial last
+                 * block is padded with zeros */
+                if (0 == i) {
+                        blocknum_t b;
+                        char *buf;
+
+                        if (NULL == (buf = page_alloc()))
+                                panic("Not enough memory to load ramdisk image\n");
+                        for (b = 0; b * BLOCK_SIZE < imgsize; b++) {
+                                size_t len = imgsize - b * BLOCK_SIZE;
+                                if (len > BLOCK_SIZE)
+                                        len = BLOCK_SIZE;
+                                memset(buf, 0, BLOCK_SIZE);
+                                memcpy(buf, ramdisk_image + b * BLOCK_SIZE, len);
+                                if (0 > ramdisk_write(&rd->rd_bdev, buf, b, 1))
+                                        panic("Not enough memory to load ramdisk image\n");
+                        }
+                        page_free(buf);
+                        dbg(DBG_DISK, "Loaded %u byte image into ram0\n", imgsize);
+                }
+#endif
+
+                blockdev_register(&rd->rd_bdev);
+                dbg(DBG_DISK, "Initialized ramdisk %d, %u blocks\n", i, nblocks);
+        }
+}
+
+/**
+ * Reads blocks, filling blocks which were never written with zeros.
+ *
+ * @param bdev the ramdisk
+ * @param data buffer to write to
+ * @param blocknum the block number to start reading at
+ * @param count the number of blocks to read
+ * @return 0 on success, -EINVAL if the blocks are past the end of the
+ * ramdisk
+ */
+static int
+ramdisk_read(blockdev_t *bdev, char *data, blocknum_t blocknum, size_t count)
+{
+        ramdisk_t *rd = bd_to_rd(bdev);
+        size_t i;
+
+        if ((uint64_t) blocknum + count > bdev->bd_nblocks)
+                return -EINVAL;
+
+        for (i = 0; i < count; i++, data += BLOCK_SIZE) {
+                if (NULL == rd->rd_blocks[blocknum + i])
+                        memset(data, 0, BLOCK_SIZE);
+                else
+                        memcpy(data, rd->rd_blocks[blocknum + i], BLOCK_SIZE);
+        }
+        return 0;
+}
+
+/**
+ * Writes blocks, allocating pages for blocks written for the first
+ * time.
+ *
+ * @param bdev the ramdisk
+ * @param data buffer to read data from
+ * @param blocknum the block number to start writing at
+ * @param count the number of blocks to write
+ * @return 0 on success, -EINVAL if the blocks are past the end of the
+ * ramdisk, -ENOSPC if there is no memory for them (some of the blocks
+ * may have been written)
+ */
+static int
+ramdisk_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, size_t count)
+{
+        ramdisk_t *rd = bd_to_rd(bdev);
+        size_t i;
+
+        if ((uint64_t) blocknum + count > bdev->bd_nblocks)
+                return -EINVAL;
+
+        for (i = 0; i < count; i++, data += BLOCK_SIZE) {
+                if (NULL == rd->rd_blocks[blocknum + i]) {
+                        if (NULL == (rd->rd_blocks[blocknum + i] = page_alloc()))
+                                return -ENOSPC;
+                        rd->rd_nresident++;
+                }
+                memcpy(rd->rd_blocks[blocknum + i], data, BLOCK_SIZE);
+        }
+        return 0;
+}
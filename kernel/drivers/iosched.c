@@ -0,0 +1,340 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/iosched.h"
+
+/* Latencies are reported in units of 2^IOSCHED_LATENCY_SHIFT cycles,
+ * which keeps the arithmetic in 32 bits */
+#define IOSCHED_LATENCY_SHIFT   10
+
+static void noop_add(iosched_queue_t *q, blockdev_req_t *req);
+static blockdev_req_t *noop_merge(iosched_queue_t *q, blockdev_req_t *req);
+static blockdev_req_t *noop_next(iosched_queue_t *q);
+
+static void deadline_add(iosched_queue_t *q, blockdev_req_t *req);
+static blockdev_req_t *deadline_merge(iosched_queue_t *q, blockdev_req_t *req);
+static blockdev_req_t *deadline_next(iosched_queue_t *q);
+
+static iosched_ops_t iosched_noop = {
+        .is_name  = "noop",
+        .is_add   = noop_add,
+        .is_merge = noop_merge,
+        .is_next  = noop_next
+};
+
+static iosched_ops_t iosched_deadline = {
+        .is_name  = "deadline",
+        .is_add   = deadline_add,
+        .is_merge = deadline_merge,
+        .is_next  = deadline_next
+};
+
+static iosched_ops_t *iosched_all[] = {
+        &iosched_noop,
+        &iosched_deadline,
+        NULL
+};
+
+static iosched_ops_t *
+iosched_lookup(const char *name)
+{
+        iosched_ops_t **ops;
+
+        for (ops = iosched_all; NULL != *ops; ops++) {
+                if (0 == strcmp((*ops)->is_name, name))
+                        return *ops;
+        }
+        return NULL;
+}
+
+void
+iosched_init(iosched_queue_t *q)
+{
+        memset(q, 0, sizeof(*q));
+        q->iq_ops = iosched_lookup(IOSCHED_DEFAULT);
+        KASSERT(NULL != q->iq_ops);
+
+        list_init(&q->iq_sorted);
+        list_init(&q->iq_fifo[0]);
+        list_init(&q->iq_fifo[1]);
+        list_init(&q->iq_held);
+}
+
+int
+iosched_set(iosched_queue_t *q, const char *name)
+{
+        iosched_ops_t *ops;
+        uint8_t oldipl;
+        int ret = 0;
+
+        if (NULL == (ops = iosched_lookup(name)))
+                return -EINVAL;
+
+        /* The schedulers keep their requests on the same lists in
+         * different orders, so only switch between them when nothing
+         * is queued */
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+        if (!list_empty(&q->iq_sorted) || !list_empty(&q->iq_held))
+                ret = -EBUSY;
+        else
+                q->iq_ops = ops;
+        intr_setipl(oldipl);
+
+        return ret;
+}
+
+int
+iosched_can_merge(blockdev_req_t *head, blockdev_req_t *req)
+{
+        blockdev_req_t *last = head->br_merge_last;
+
+        return !(head->br_flags & BLOCKDEV_REQ_BARRIER)
+               && !(req->br_flags & BLOCKDEV_REQ_BARRIER)
+               && head->br_write == req->br_write
+               && last->br_blocknum + last->br_count == req->br_blocknum
+               && head->br_merge_nblocks + req->br_count <= IOSCHED_MAX_MERGE;
+}
+
+/* Hands a request to the scheduler */
+static void
+iosched_queue(iosched_queue_t *q, blockdev_req_t *req)
+{
+        blockdev_req_t *head;
+
+        if (NULL != (head = q->iq_ops->is_merge(q, req))) {
+                KASSERT(iosched_can_merge(head, req));
+                head->br_merge_last->br_merge_next = req;
+                head->br_merge_last = req;
+                head->br_merge_nblocks += req->br_count;
+                q->iq_nmerged++;
+                dbg(DBG_DISK, "merged blocks %u-%u into request at block %u\n",
+                    req->br_blocknum, req->br_blocknum + req->br_count - 1,
+                    head->br_blocknum);
+                return;
+        }
+
+        q->iq_ops->is_add(q, req);
+}
+
+void
+iosched_add(iosched_queue_t *q, blockdev_req_t *req)
+{
+        KASSERT(intr_getipl() >= BLOCKDEV_IPL);
+
+        req->br_merge_next = NULL;
+        req->br_merge_last = req;
+        req->br_merge_nblocks = req->br_count;
+
+        q->iq_nsubmitted++;
+        if (++q->iq_depth > q->iq_max_depth)
+                q->iq_max_depth = q->iq_depth;
+
+        if (req->br_flags & BLOCKDEV_REQ_BARRIER)
+                q->iq_nbarriers++;
+
+        if ((req->br_flags & BLOCKDEV_REQ_BARRIER) || !list_empty(&q->iq_held))
+                list_insert_tail(&q->iq_held, &req->br_link);
+        else
+                iosched_queue(q, req);
+}
+
+blockdev_req_t *
+iosched_next(iosched_queue_t *q)
+{
+        blockdev_req_t *req, *r;
+
+        KASSERT(intr_getipl() >= BLOCKDEV_IPL);
+
+        if (list_empty(&q->iq_sorted)) {
+                /* Everything in front of the held requests has to be
+                 * done before any of them go */
+                if (list_empty(&q->iq_held) || 0 != q->iq_ndispatched)
+                        return NULL;
+
+                req = list_head(&q->iq_held, blockdev_req_t, br_link);
+                if (req->br_flags & BLOCKDEV_REQ_BARRIER) {
+                        list_remove(&req->br_link);
+                        q->iq_ndispatched++;
+                        return req;
+                }
+
+                /* The barrier in front of them has completed */
+                do {
+                        list_remove(&req->br_link);
+                        iosched_queue(q, req);
+                        if (list_empty(&q->iq_held))
+                                break;
+                        req = list_head(&q->iq_held, blockdev_req_t, br_link);
+                } while (!(req->br_flags & BLOCKDEV_REQ_BARRIER));
+        }
+
+        req = q->iq_ops->is_next(q);
+        KASSERT(NULL != req);
+        q->iq_next_block = req->br_merge_last->br_blocknum
+                           + req->br_merge_last->br_count;
+        for (r = req; NULL != r; r = r->br_merge_next)
+                q->iq_ndispatched++;
+        return req;
+}
+
+void
+iosched_complete(iosched_queue_t *q, blockdev_req_t *req)
+{
+        uint64_t latency = rdtsc() - req->br_submit_time;
+
+        KASSERT(0 < q->iq_depth);
+        KASSERT(0 < q->iq_ndispatched);
+        q->iq_depth--;
+        q->iq_ndispatched--;
+        q->iq_ncompleted++;
+        q->iq_total_latency += latency;
+        if (latency > q->iq_max_latency)
+                q->iq_max_latency = latency;
+}
+
+/* The noop scheduler keeps iq_sorted in arrival order and only merges
+ * into the request at its tail. */
+
+static void
+noop_add(iosched_queue_t *q, blockdev_req_t *req)
+{
+        list_insert_tail(&q->iq_sorted, &req->br_link);
+}
+
+static blockdev_req_t *
+noop_merge(iosched_queue_t *q, blockdev_req_t *req)
+{
+        blockdev_req_t *tail;
+
+        if (list_empty(&q->iq_sorted))
+                return NULL;
+        tail = list_tail(&q->iq_sorted, blockdev_req_t, br_link);
+        return iosched_can_merge(tail, req) ? tail : NULL;
+}
+
+static blockdev_req_t *
+noop_next(iosched_queue_t *q)
+{
+        blockdev_req_t *req = list_head(&q->iq_sorted, blockdev_req_t, br_link);
+
+        list_remove(&req->br_link);
+        return req;
+}
+
+/* The deadline scheduler keeps iq_sorted in block order, and every
+ * request on it also on the FIFO for its direction. */
+
+static void
+deadline_add(iosched_queue_t *q, blockdev_req_t *req)
+{
+        blockdev_req_t *r;
+
+        list_insert_tail(&q->iq_fifo[req->br_write ? 1 : 0], &req->br_fifo_link);
+
+        list_iterate_begin(&q->iq_sorted, r, blockdev_req_t, br_link) {
+                if (r->br_blocknum > req->br_blocknum) {
+                        list_insert_before(&r->br_link, &req->br_link);
+                        return;
+                }
+        } list_iterate_end();
+        list_insert_tail(&q->iq_sorted, &req->br_link);
+}
+
+static blockdev_req_t *
+deadline_merge(iosched_queue_t *q, blockdev_req_t *req)
+{
+        blockdev_req_t *r;
+
+        list_iterate_begin(&q->iq_sorted, r, blockdev_req_t, br_link) {
+                if (iosched_can_merge(r, req))
+                        return r;
+        } list_iterate_end();
+        return NULL;
+}
+
+/* Returns the oldest request of a direction if it has expired */
+static blockdev_req_t *
+deadline_expired(iosched_queue_t *q, int write, uint64_t now)
+{
+        blockdev_req_t *req;
+
+        if (list_empty(&q->iq_fifo[write]))
+                return NULL;
+        req = list_head(&q->iq_fifo[write], blockdev_req_t, br_fifo_link);
+        if (now - req->br_submit_time
+            < (write ? IOSCHED_WRITE_EXPIRE : IOSCHED_READ_EXPIRE))
+                return NULL;
+        return req;
+}
+
+static blockdev_req_t *
+deadline_next(iosched_queue_t *q)
+{
+        uint64_t now = rdtsc();
+        blockdev_req_t *req;
+
+        /* Reads first: someone is usually waiting for them */
+        if (NULL != (req = deadline_expired(q, 0, now))
+            || NULL != (req = deadline_expired(q, 1, now))) {
+                q->iq_nexpired++;
+                goto found;
+        }
+
+        /* Otherwise continue the sweep from where the last request
+         * ended, going back to the start of the disk at the end */
+        list_iterate_begin(&q->iq_sorted, req, blockdev_req_t, br_link) {
+                if (req->br_blocknum >= q->iq_next_block)
+                        goto found;
+        } list_iterate_end();
+        req = list_head(&q->iq_sorted, blockdev_req_t, br_link);
+
+found:
+        list_remove(&req->br_link);
+        list_remove(&req->br_fifo_link);
+        return req;
+}
+
+size_t
+iosched_info(const void *arg, char *buf, size_t osize)
+{
+        const iosched_queue_t *q = (const iosched_queue_t *)arg;
+        iosched_ops_t **ops;
+        uint32_t avg = 0;
+        size_t size = osize;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "scheduler:");
+        for (ops = iosched_all; NULL != *ops; ops++) {
+                if (*ops == q->iq_ops)
+                        iprintf(&buf, &size, " [%s]", (*ops)->is_name);
+                else
+                        iprintf(&buf, &size, " %s", (*ops)->is_name);
+        }
+        iprintf(&buf, &size, "\n");
+
+        if (0 != q->iq_ncompleted)
+                avg = (uint32_t)(q->iq_total_latency >> IOSCHED_LATENCY_SHIFT)
+                      / q->iq_ncompleted;
+
+        iprintf(&buf, &size, "depth %u (max %u)\n", q->iq_depth, q->iq_max_depth);
+        iprintf(&buf, &size, "submitted %u, merged %u, completed %u, expired %u, "
+                "barriers %u\n", q->iq_nsubmitted, q->iq_nmerged, q->iq_ncompleted,
+                q->iq_nexpired, q->iq_nbarriers);
+        iprintf(&buf, &size, "latency avg %u, max %u (x%u cycles)\n", avg,
+                (uint32_t)(q->iq_max_latency >> IOSCHED_LATENCY_SHIFT),
+                1U << IOSCHED_LATENCY_SHIFT);
+
+        return size;
+}
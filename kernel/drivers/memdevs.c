@@ -9,6 +9,7 @@
 #include "mm/mmobj.h"
 #include "mm/kmalloc.h"
 #include "mm/pframe.h"
+#include "mm/slab.h"
 
 #include "drivers/bytedev.h"
 
@@ -22,6 +23,9 @@ static int null_write(bytedev_t *dev, int offset, const void *buf, int count);
 static int zero_read(bytedev_t *dev, int offset, void *buf, int count);
 static int zero_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 
+static int slabinfo_read(bytedev_t *dev, int offset, void *buf, int count);
+static int slabinfo_write(bytedev_t *dev, int offset, const void *buf, int count);
+
 bytedev_ops_t null_dev_ops = {
         null_read,
         null_write,
@@ -40,14 +44,29 @@ bytedev_ops_t zero_dev_ops = {
         NULL
 };
 
+bytedev_ops_t slabinfo_dev_ops = {
+        slabinfo_read,
+        slabinfo_write,
+        NULL,
+        NULL,
+        NULL,
+        NULL
+};
+
+static bytedev_t null_dev = { .cd_id = MEM_NULL_DEVID, .cd_ops = &null_dev_ops };
+static bytedev_t zero_dev = { .cd_id = MEM_ZERO_DEVID, .cd_ops = &zero_dev_ops };
+static bytedev_t slabinfo_dev = { .cd_id = MEM_SLABINFO_DEVID, .cd_ops = &slabinfo_dev_ops };
+
 /*
  * The byte device code needs to know about these mem devices, so create
- * bytedev_t's for null and zero, fill them in, and register them.
+ * bytedev_t's for null, zero and slabinfo, fill them in, and register them.
  */
 void
 memdevs_init()
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: memdevs_init");
+        if (bytedev_register(&null_dev) || bytedev_register(&zero_dev)
+            || bytedev_register(&slabinfo_dev))
+                panic("memdevs_init: could not register memory devices\n");
 }
 
 /**
@@ -103,6 +122,49 @@ zero_read(bytedev_t *dev, int offset, void *buf, int count)
         return 0;
 }
 
+/**
+ * Reads the current slab allocator statistics (see
+ * slab_allocators_info()). The statistics are regenerated on every
+ * read, so a reader which reads in several chunks may see counters
+ * which changed in between.
+ *
+ * @param dev the slabinfo device
+ * @param offset the offset into the statistics to read from
+ * @param buf the buffer to write to
+ * @param count the maximum number of bytes to read
+ * @return the number of bytes read, 0 at the end of the statistics
+ */
+static int
+slabinfo_read(bytedev_t *dev, int offset, void *buf, int count)
+{
+        char *info;
+        int len;
+
+        if (NULL == (info = page_alloc_n(SLABINFO_NPAGES)))
+                return -ENOMEM;
+
+        len = (PAGE_SIZE * SLABINFO_NPAGES)
+              - slab_allocators_info(NULL, info, PAGE_SIZE * SLABINFO_NPAGES);
+        if (offset >= len) {
+                count = 0;
+        } else {
+                count = MIN(count, len - offset);
+                memcpy(buf, info + offset, count);
+        }
+
+        page_free_n(info, SLABINFO_NPAGES);
+        return count;
+}
+
+/**
+ * The slabinfo device is read-only.
+ */
+static int
+slabinfo_write(bytedev_t *dev, int offset, const void *buf, int count)
+{
+        return -EINVAL;
+}
+
 /* Don't worry about these until VM. Once you're there, they shouldn't be hard. */
 
 static int
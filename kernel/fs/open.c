@@ -39,9 +39,9 @@ get_empty_fd(proc_t *p)
  *      1. Get the next empty file descriptor.
  *      2. Call fget to get a fresh file_t.
  *      3. Save the file_t in curproc's file descriptor table.
- *      4. Set file_t->f_mode to OR of FMODE_(READ|WRITE|APPEND) based on
- *         oflags, which can be O_RDONLY, O_WRONLY or O_RDWR, possibly OR'd with
- *         O_APPEND.
+ *      4. Set file_t->f_mode to OR of FMODE_(READ|WRITE|APPEND|DIRECT) based
+ *         on oflags, which can be O_RDONLY, O_WRONLY or O_RDWR, possibly OR'd
+ *         with O_APPEND and O_DIRECT.
  *      5. Use open_namev() to get the vnode for the file_t.
  *      6. Fill in the fields of the file_t.
  *      7. Return new fd.
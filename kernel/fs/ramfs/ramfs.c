@@ -66,6 +66,7 @@ static int ramfs_stat(vnode_t *file, struct stat *buf);
 static vnode_ops_t ramfs_dir_vops = {
         .read = NULL,
         .write = NULL,
+        .direct_io = NULL,
         .mmap = NULL,
         .create = ramfs_create,
         .mknod = ramfs_mknod,
@@ -84,6 +85,7 @@ static vnode_ops_t ramfs_dir_vops = {
 static vnode_ops_t ramfs_file_vops = {
         .read = ramfs_read,
         .write = ramfs_write,
+        .direct_io = NULL,
         .mmap = NULL,
         .create = NULL,
         .mknod = NULL,
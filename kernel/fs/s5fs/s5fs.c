@@ -17,6 +17,8 @@
 
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_icache.h"
 #include "fs/dirent.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
@@ -48,6 +50,7 @@ static int  s5fs_umount(fs_t *fs);
 /* vnode_t entry points: */
 static int  s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
 static int  s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len);
+static int  s5fs_direct_io(vnode_t *vnode, off_t offset, void *buf, size_t len, int write);
 static int  s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 static int  s5fs_create(vnode_t *vdir, const char *name, size_t namelen, vnode_t **result);
 static int  s5fs_mknod(struct vnode *dir, const char *name, size_t namelen, int mode, devid_t devid);
@@ -73,6 +76,7 @@ fs_ops_t s5fs_fsops = {
 static vnode_ops_t s5fs_dir_vops = {
         .read = NULL,
         .write = NULL,
+        .direct_io = NULL,
         .mmap = NULL,
         .create = s5fs_create,
         .mknod = s5fs_mknod,
@@ -92,6 +96,7 @@ static vnode_ops_t s5fs_dir_vops = {
 static vnode_ops_t s5fs_file_vops = {
         .read = s5fs_read,
         .write = s5fs_write,
+        .direct_io = s5fs_direct_io,
         .mmap = s5fs_mmap,
         .create = NULL,
         .mknod = NULL,
@@ -119,18 +124,14 @@ static vnode_ops_t s5fs_file_vops = {
 int
 s5fs_mount(struct fs *fs)
 {
-        int num;
         blockdev_t *dev;
         s5fs_t *s5;
         pframe_t *vp;
+        int err;
 
         KASSERT(fs);
 
-        if (sscanf(fs->fs_dev, "disk%d", &num) != 1) {
-                return -EINVAL;
-        }
-
-        if (!(dev = blockdev_lookup(MKDEVID(1, num)))) {
+        if (!(dev = blockdev_lookup_name(fs->fs_dev))) {
                 return -EINVAL;
         }
 
@@ -142,6 +143,15 @@ s5fs_mount(struct fs *fs)
 
         /*     init s5f_disk: */
         s5->s5f_bdev  = dev;
+        s5->s5f_journal = NULL;
+        s5->s5f_icache = NULL;
+
+        /* Whatever the journal has must be in place before any of it is
+         * read through the page cache */
+        if (0 > (err = s5_journal_recover(dev))) {
+                kfree(s5);
+                return err;
+        }
 
         /*     init s5f_super: */
         pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &vp);
@@ -158,12 +168,46 @@ s5fs_mount(struct fs *fs)
 
         pframe_pin(vp);
 
-        /*     init s5f_mutex: */
-        kmutex_init(&s5->s5f_mutex);
+        /*     init s5f_block_mutex and s5f_inode_mutex: */
+        kmutex_init(&s5->s5f_block_mutex);
+        kmutex_init(&s5->s5f_inode_mutex);
+        kmutex_init(&s5->s5f_delalloc_mutex);
+
+        s5->s5f_nreserved = 0;
+        if (NULL == (s5->s5f_ireserved = (uint32_t *)kmalloc(s5->s5f_super->s5s_num_inodes
+                                                             * sizeof(uint32_t)))) {
+                pframe_unpin(vp);
+                kfree(s5);
+                return -ENOMEM;
+        }
+        memset(s5->s5f_ireserved, 0, s5->s5f_super->s5s_num_inodes * sizeof(uint32_t));
 
         /*     init s5f_fs: */
         s5->s5f_fs = fs;
 
+        if (0 > (err = s5_icache_init(s5))) {
+                pframe_unpin(vp);
+                kfree(s5->s5f_ireserved);
+                kfree(s5);
+                return err;
+        }
+
+        if (0 > (err = s5_journal_init(s5))) {
+                s5_icache_destroy(s5);
+                pframe_unpin(vp);
+                kfree(s5->s5f_ireserved);
+                kfree(s5);
+                return err;
+        }
+
+        /* New files start after the metadata */
+        if (s5->s5f_super->s5s_features & S5_FEATURE_JOURNAL)
+                s5->s5f_alloc_hint = s5->s5f_super->s5s_journal_block
+                                     + s5->s5f_super->s5s_journal_nblocks;
+        else
+                s5->s5f_alloc_hint = s5->s5f_super->s5s_bitmap_block
+                                     + s5->s5f_super->s5s_bitmap_nblocks;
+
 
         /* Init the members of fs that we (the fs-implementation) are
          * responsible for initializing: */
@@ -193,10 +237,11 @@ s5fs_mount(struct fs *fs)
  * flag to indicate that the VFS is using a file. However, this is
  * simpler to implement.
  *
- * To get the inode you need to use pframe_get then use the pf_addr
- * and the S5_INODE_OFFSET(vnode) to get the inode
+ * To get the inode use s5_icache_get(), which returns the copy kept by
+ * the inode cache (reading it from its block if need be) rather than
+ * the block itself, so nothing has to be pinned; vn_i points to it.
  *
- * Don't forget to update linkcounts and pin the page.
+ * Don't forget to update linkcounts.
  *
  * Note that the devid is stored in the indirect_block in the case of
  * a char or block device
@@ -208,7 +253,41 @@ s5fs_mount(struct fs *fs)
 static void
 s5fs_read_vnode(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_read_vnode");
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode;
+
+        if (NULL == (inode = s5_icache_get(fs, vnode->vn_vno)))
+                panic("s5fs_read_vnode: out of memory for inode %d\n", vnode->vn_vno);
+
+        inode->s5_linkcount++;
+        s5_dirty_inode(fs, inode);
+
+        vnode->vn_i = inode;
+        vnode->vn_len = inode->s5_size;
+
+        switch (inode->s5_type) {
+                case S5_TYPE_DATA:
+                        vnode->vn_mode = S_IFREG;
+                        vnode->vn_ops = &s5fs_file_vops;
+                        break;
+                case S5_TYPE_DIR:
+                        vnode->vn_mode = S_IFDIR;
+                        vnode->vn_ops = &s5fs_dir_vops;
+                        break;
+                case S5_TYPE_CHR:
+                        vnode->vn_mode = S_IFCHR;
+                        vnode->vn_ops = NULL;
+                        vnode->vn_devid = (devid_t)inode->s5_indirect_block;
+                        break;
+                case S5_TYPE_BLK:
+                        vnode->vn_mode = S_IFBLK;
+                        vnode->vn_ops = NULL;
+                        vnode->vn_devid = (devid_t)inode->s5_indirect_block;
+                        break;
+                default:
+                        panic("s5fs_read_vnode: inode %d has bad type %d\n",
+                              vnode->vn_vno, inode->s5_type);
+        }
 }
 
 /*
@@ -217,12 +296,25 @@ s5fs_read_vnode(vnode_t *vnode)
  * When this function returns, the inode refcount should be decremented.
  *
  * You probably want to use s5_free_inode() if there are no more links to
- * the inode, and dont forget to unpin the page
+ * the inode, and dont forget to s5_icache_put() the inode afterwards.
  */
 static void
 s5fs_delete_vnode(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_delete_vnode");
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+
+        KASSERT(0 < inode->s5_linkcount);
+
+        s5_journal_start(fs);
+        inode->s5_linkcount--;
+        s5_dirty_inode(fs, inode);
+        if (0 == inode->s5_linkcount)
+                s5_free_inode(vnode);
+        s5_journal_stop(fs);
+
+        vnode->vn_i = NULL;
+        s5_icache_put(fs, inode);
 }
 
 /*
@@ -235,8 +327,7 @@ s5fs_delete_vnode(vnode_t *vnode)
 static int
 s5fs_query_vnode(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_query_vnode");
-        return 0;
+        return 1 < VNODE_TO_S5INODE(vnode)->s5_linkcount;
 }
 
 /*
@@ -251,6 +342,9 @@ s5fs_umount(fs_t *fs)
         pframe_t *sbp;
         int ret;
 
+        /* The running transaction holds references on directories */
+        s5_journal_commit(s5);
+
         if (s5fs_check_refcounts(fs)) {
                 dbg(DBG_PRINT, "s5fs_umount: WARNING: linkcount corruption "
                     "discovered in fs on block device with major %d "
@@ -266,6 +360,15 @@ s5fs_umount(fs_t *fs)
 
         vput(fs->fs_root);
 
+        /* Putting the vnodes of the transaction changes their inodes,
+         * which the cache then writes back into the next one */
+        s5_journal_commit(s5);
+        s5_icache_destroy(s5);
+
+        /* Leaves the journal empty, so that it is not replayed over
+         * the changes made by a later mount without it */
+        s5_journal_destroy(s5);
+
         if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &sbp))) {
                 panic("s5fs_umount: failed to pframe_get super block. "
                       "This should never happen (the page should already "
@@ -278,9 +381,15 @@ s5fs_umount(fs_t *fs)
 
         pframe_unpin(sbp);
 
+        if (0 != s5->s5f_nreserved) {
+                dbg(DBG_PRINT, "s5fs_umount: WARNING: %u blocks are still reserved "
+                    "for pages which could not be written back\n", s5->s5f_nreserved);
+        }
+        kfree(s5->s5f_ireserved);
         kfree(s5);
 
         blockdev_flush_all(bd);
+        blockdev_flush_cache(bd);
 
         return 0;
 }
@@ -296,14 +405,30 @@ s5fs_umount(fs_t *fs)
  */
 
 /*
- * You will need to lock the vnode's mutex before doing anything that can block.
- * pframe functions can block, so probably what you want to do
- * is just lock the mutex in the s5fs_* functions listed below, and then not
- * worry about the mutexes in s5fs_subr.c.
+ * You will need to lock the vnode's vn_lock before doing anything that can
+ * block. pframe functions can block, so probably what you want to do
+ * is just lock it in the s5fs_* functions listed below, and then not
+ * worry about the locks in s5fs_subr.c.
  *
  * Note that you will not be calling pframe functions directly, but
  * s5fs_subr.c functions will be, so you need to lock around them.
  *
+ * Functions which only look at a vnode (read, lookup, readdir, stat)
+ * should take the lock with krwlock_rdlock(), so that they can run at
+ * the same time as each other; functions which change it (write,
+ * create, mknod, link, unlink, mkdir, rmdir) need krwlock_wrlock().
+ * Operations on two directories lock the one being changed. Release
+ * either with krwlock_unlock(). Block and inode allocation have their
+ * own locks in s5fs_subr.c, so operations on different vnodes do not
+ * wait for each other.
+ *
+ * Functions which change anything on disk (write, create, mknod, link,
+ * unlink, mkdir, rmdir, and delete_vnode when it frees the inode) make
+ * their changes between s5_journal_start() and s5_journal_stop(), so
+ * that they go into one journal transaction. Start the handle before
+ * taking vn_lock: starting it may wait for the other handles to be
+ * stopped, and their threads may be waiting for vn_lock.
+ *
  * DO NOT TRY to do fine grained locking your first time through,
  * as it will break, and you will cry.
  *
@@ -317,16 +442,45 @@ s5fs_umount(fs_t *fs)
 static int
 s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_read");
-        return -1;
+        int ret;
+
+        krwlock_rdlock(&vnode->vn_lock);
+        ret = s5_read_file(vnode, offset, (char *)buf, len);
+        krwlock_unlock(&vnode->vn_lock);
+        return ret;
 }
 
 /* Simply call s5_write_file. */
 static int
 s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_write");
-        return -1;
+        int ret;
+
+        s5_journal_start(VNODE_TO_S5FS(vnode));
+        krwlock_wrlock(&vnode->vn_lock);
+        ret = s5_write_file(vnode, offset, (const char *)buf, len);
+        krwlock_unlock(&vnode->vn_lock);
+        s5_journal_stop(VNODE_TO_S5FS(vnode));
+        return ret;
+}
+
+/* Like s5fs_read() and s5fs_write(), for files opened with O_DIRECT */
+static int
+s5fs_direct_io(vnode_t *vnode, off_t offset, void *buf, size_t len, int write)
+{
+        int ret;
+
+        if (write) {
+                s5_journal_start(VNODE_TO_S5FS(vnode));
+                krwlock_wrlock(&vnode->vn_lock);
+        } else {
+                krwlock_rdlock(&vnode->vn_lock);
+        }
+        ret = s5_direct_io(vnode, offset, (char *)buf, len, write);
+        krwlock_unlock(&vnode->vn_lock);
+        if (write)
+                s5_journal_stop(VNODE_TO_S5FS(vnode));
+        return ret;
 }
 
 /* This function is deceptivly simple, just return the vnode's
@@ -354,8 +508,30 @@ s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
 static int
 s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_create");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        vnode_t *vn;
+        int ino, err = 0;
+
+        s5_journal_start(fs);
+        krwlock_wrlock(&dir->vn_lock);
+
+        if (0 > (ino = s5_alloc_inode(dir->vn_fs, S5_TYPE_DATA, 0))) {
+                err = ino;
+                goto out;
+        }
+        vn = vget(dir->vn_fs, ino);
+        if (0 > (err = s5_link(dir, vn, name, namelen))) {
+                /* Frees the inode, which nothing links to */
+                vput(vn);
+                goto out;
+        }
+        KASSERT(2 == VNODE_TO_S5INODE(vn)->s5_linkcount && 1 == vn->vn_refcount);
+        *result = vn;
+
+out:
+        krwlock_unlock(&dir->vn_lock);
+        s5_journal_stop(fs);
+        return err;
 }
 
 
@@ -370,8 +546,30 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 static int
 s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t devid)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_mknod");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        vnode_t *vn;
+        uint16_t type;
+        int ino, err;
+
+        if (S_ISCHR(mode))
+                type = S5_TYPE_CHR;
+        else if (S_ISBLK(mode))
+                type = S5_TYPE_BLK;
+        else
+                return -EINVAL;
+
+        s5_journal_start(fs);
+        krwlock_wrlock(&dir->vn_lock);
+
+        if (0 <= (err = ino = s5_alloc_inode(dir->vn_fs, type, devid))) {
+                vn = vget(dir->vn_fs, ino);
+                err = s5_link(dir, vn, name, namelen);
+                vput(vn);
+        }
+
+        krwlock_unlock(&dir->vn_lock);
+        s5_journal_stop(fs);
+        return (0 > err) ? err : 0;
 }
 
 /*
@@ -382,8 +580,17 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
 int
 s5fs_lookup(vnode_t *base, const char *name, size_t namelen, vnode_t **result)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_lookup");
-        return -1;
+        int ino;
+
+        krwlock_rdlock(&base->vn_lock);
+        ino = s5_find_dirent(base, name, namelen);
+        krwlock_unlock(&base->vn_lock);
+
+        /* "." is base itself, which vget() finds without blocking */
+        if (0 > ino)
+                return ino;
+        *result = vget(base->vn_fs, ino);
+        return 0;
 }
 
 /*
@@ -397,8 +604,14 @@ s5fs_lookup(vnode_t *base, const char *name, size_t namelen, vnode_t **result)
 static int
 s5fs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_link");
-        return -1;
+        int err;
+
+        s5_journal_start(VNODE_TO_S5FS(dir));
+        krwlock_wrlock(&dir->vn_lock);
+        err = s5_link(dir, src, name, namelen);
+        krwlock_unlock(&dir->vn_lock);
+        s5_journal_stop(VNODE_TO_S5FS(dir));
+        return err;
 }
 
 /*
@@ -412,8 +625,14 @@ s5fs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_unlink");
-        return -1;
+        int err;
+
+        s5_journal_start(VNODE_TO_S5FS(dir));
+        krwlock_wrlock(&dir->vn_lock);
+        err = s5_remove_dirent(dir, name, namelen);
+        krwlock_unlock(&dir->vn_lock);
+        s5_journal_stop(VNODE_TO_S5FS(dir));
+        return err;
 }
 
 /*
@@ -437,8 +656,40 @@ s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_mkdir");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        s5_inode_t *parent = VNODE_TO_S5INODE(dir);
+        vnode_t *vn;
+        int ino, err;
+
+        s5_journal_start(fs);
+        krwlock_wrlock(&dir->vn_lock);
+
+        if (0 <= (err = s5_find_dirent(dir, name, namelen))) {
+                err = -EEXIST;
+                goto out;
+        }
+        if (-ENOENT != err)
+                goto out;
+        if (0 > (err = ino = s5_alloc_inode(dir->vn_fs, S5_TYPE_DIR, 0)))
+                goto out;
+
+        /* Nobody else can find the new directory yet, so it needs no lock */
+        vn = vget(dir->vn_fs, ino);
+        KASSERT(1 == VNODE_TO_S5INODE(vn)->s5_linkcount);
+        if (0 <= (err = s5_link(vn, vn, ".", 1))
+            && 0 <= (err = s5_link(vn, dir, "..", 2))
+            && 0 > (err = s5_link(dir, vn, name, namelen))) {
+                /* The ".." going away with the new directory */
+                parent->s5_linkcount--;
+                s5_dirty_inode(fs, parent);
+        }
+        KASSERT(0 > err || 2 == VNODE_TO_S5INODE(vn)->s5_linkcount);
+        vput(vn);
+
+out:
+        krwlock_unlock(&dir->vn_lock);
+        s5_journal_stop(fs);
+        return (0 > err) ? err : 0;
 }
 
 /*
@@ -454,8 +705,58 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_rmdir");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(parent);
+        s5_inode_t *inode = VNODE_TO_S5INODE(parent);
+        s5_dirent_t d;
+        vnode_t *vn;
+        off_t offset;
+        int ino, err;
+
+        if (name_match(".", name, namelen))
+                return -EINVAL;
+        if (name_match("..", name, namelen))
+                return -ENOTEMPTY;
+
+        s5_journal_start(fs);
+        krwlock_wrlock(&parent->vn_lock);
+
+        if (0 > (err = ino = s5_find_dirent(parent, name, namelen)))
+                goto out;
+        vn = vget(parent->vn_fs, ino);
+        if (!S_ISDIR(vn->vn_mode)) {
+                err = -ENOTDIR;
+                goto put;
+        }
+
+        /* Empty but for "." and "..", and the unused entries fsmaker
+         * leaves */
+        krwlock_rdlock(&vn->vn_lock);
+        for (offset = 0; sizeof(d) == (err = s5_read_file(vn, offset, (char *)&d,
+                                                           sizeof(d)));
+             offset += sizeof(d)) {
+                d.s5d_name[S5_NAME_LEN - 1] = '\0';
+                if ('\0' != d.s5d_name[0] && 0 != strcmp(d.s5d_name, ".")
+                    && 0 != strcmp(d.s5d_name, "..")) {
+                        err = -ENOTEMPTY;
+                        break;
+                }
+        }
+        krwlock_unlock(&vn->vn_lock);
+        if (0 > err)
+                goto put;
+
+        if (0 <= (err = s5_remove_dirent(parent, name, namelen))) {
+                /* Its ".." no longer links to parent */
+                inode->s5_linkcount--;
+                s5_dirty_inode(fs, inode);
+        }
+
+put:
+        vput(vn);
+out:
+        krwlock_unlock(&parent->vn_lock);
+        s5_journal_stop(fs);
+        return (0 > err) ? err : 0;
 }
 
 
@@ -470,8 +771,30 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 static int
 s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_readdir");
-        return -1;
+        s5_dirent_t dirent;
+        off_t next = offset;
+        int ret;
+
+        KASSERT(0 == offset % sizeof(s5_dirent_t));
+
+        krwlock_rdlock(&vnode->vn_lock);
+        /* Entries with an empty name are unused */
+        do {
+                ret = s5_read_file(vnode, next, (char *)&dirent, sizeof(dirent));
+                next += sizeof(dirent);
+        } while (sizeof(dirent) == ret && '\0' == dirent.s5d_name[0]);
+        krwlock_unlock(&vnode->vn_lock);
+
+        if (0 >= ret)
+                return ret;
+        if (sizeof(dirent) != ret)
+                return -EIO;
+
+        d->d_ino = dirent.s5d_inode;
+        d->d_off = next;
+        strncpy(d->d_name, dirent.s5d_name, S5_NAME_LEN - 1);
+        d->d_name[S5_NAME_LEN - 1] = '\0';
+        return next - offset;
 }
 
 
@@ -487,8 +810,21 @@ s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
 static int
 s5fs_stat(vnode_t *vnode, struct stat *ss)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_stat");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+
+        krwlock_rdlock(&vnode->vn_lock);
+        memset(ss, 0, sizeof(struct stat));
+        ss->st_mode    = vnode->vn_mode;
+        ss->st_ino     = (int) inode->s5_number;
+        if (S_ISCHR(vnode->vn_mode) || S_ISBLK(vnode->vn_mode))
+                ss->st_rdev = (int) vnode->vn_devid;
+        /* Not counting the link the vnode holds */
+        ss->st_nlink   = inode->s5_linkcount - 1;
+        ss->st_size    = (int) inode->s5_size;
+        ss->st_blksize = (int) S5_BLOCK_SIZE;
+        ss->st_blocks  = s5_inode_blocks(vnode);
+        krwlock_unlock(&vnode->vn_lock);
+        return 0;
 }
 
 
@@ -497,12 +833,30 @@ s5fs_stat(vnode_t *vnode, struct stat *ss)
  *
  * You'll probably want to use s5_seek_to_block and the device's
  * read_block function.
+ *
+ * The data of an inode with S5_INODE_INLINE set is in the inode itself:
+ * use s5_inline_fill() for it.
  */
 static int
 s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_fillpage");
-        return -1;
+        blockdev_t *bdev = VNODE_TO_S5FS(vnode)->s5f_bdev;
+        int block;
+
+        if (VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_INLINE) {
+                s5_inline_fill(vnode, offset, pagebuf);
+                return 0;
+        }
+
+        if (0 > (block = s5_seek_to_block(vnode, offset, 0)))
+                return block;
+
+        /* Sparse blocks read as zeros */
+        if (0 == block) {
+                memset(pagebuf, 0, S5_BLOCK_SIZE);
+                return 0;
+        }
+        return bdev->bd_ops->read_block(bdev, (char *)pagebuf, block, 1);
 }
 
 
@@ -519,22 +873,68 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
  *         - dirty the page containing this inode
  *
  * Much of this can be done with s5_seek_to_block()
+ *
+ * Only directories get their block right away, though. For data files,
+ * just reserve one with s5_reserve_block() (which fails with -ENOSPC
+ * when there are not enough free blocks); cleanpage allocates it.
+ *
+ * A file with inline data (S5_INODE_INLINE) has no blocks: return 0.
  */
 static int
 s5fs_dirtypage(vnode_t *vnode, off_t offset)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_dirtypage");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        int block;
+
+        if (VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_INLINE)
+                return 0;
+
+        if (S5_TYPE_DIR == VNODE_TO_S5INODE(vnode)->s5_type) {
+                s5_journal_start(fs);
+                block = s5_seek_to_block(vnode, offset, 1);
+                s5_journal_stop(fs);
+                return (0 > block) ? block : 0;
+        }
+
+        if (0 > (block = s5_seek_to_block(vnode, offset, 0)))
+                return block;
+        if (0 < block)
+                return 0;
+        return s5_reserve_block(vnode);
 }
 
 /*
  * Like fillpage, but for writing.
+ *
+ * A page of a data file whose block is still sparse has a block
+ * reserved by dirtypage; s5_alloc_delayed() allocates it (and the ones
+ * of the dirty pages after it).
+ *
+ * For a file with inline data (S5_INODE_INLINE), s5_inline_update()
+ * writes the page back to the inode instead.
  */
 static int
 s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_cleanpage");
-        return -1;
+        blockdev_t *bdev = VNODE_TO_S5FS(vnode)->s5f_bdev;
+        int block;
+
+        /* Only page 0 holds any of the inline data */
+        if (VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_INLINE) {
+                if (0 == S5_DATA_BLOCK(offset))
+                        s5_inline_update(vnode, pagebuf);
+                return 0;
+        }
+
+        if (0 > (block = s5_seek_to_block(vnode, offset, 0)))
+                return block;
+        if (0 == block) {
+                KASSERT(S5_TYPE_DATA == VNODE_TO_S5INODE(vnode)->s5_type
+                        && "dirty directory page without a block");
+                if (0 > (block = s5_alloc_delayed(vnode, offset)))
+                        return block;
+        }
+        return bdev->bd_ops->write_block(bdev, (const char *)pagebuf, block, 1);
 }
 
 /* Diagnostic/Utility: */
@@ -557,6 +957,24 @@ s5_check_super(s5_super_t *super)
                     super->s5s_version, S5_CURRENT_VERSION);
                 return -1;
         }
+        if (!(0 < super->s5s_bitmap_block
+              && super->s5s_bitmap_block + super->s5s_bitmap_nblocks <= super->s5s_nblocks
+              && super->s5s_bitmap_nblocks
+              == (super->s5s_nblocks + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK
+              && super->s5s_nfree < super->s5s_nblocks))
+                return -1;
+        if ((super->s5s_features & S5_FEATURE_JOURNAL)
+            && !(super->s5s_bitmap_block + super->s5s_bitmap_nblocks
+                 <= super->s5s_journal_block
+                 && S5_JOURNAL_MIN_BLOCKS <= super->s5s_journal_nblocks
+                 && super->s5s_journal_block + super->s5s_journal_nblocks
+                 <= super->s5s_nblocks))
+                return -1;
+        if (super->s5s_features & ~S5_FEATURES_SUPPORTED) {
+                dbg(DBG_PRINT, "Filesystem has unsupported features 0x%x.\n",
+                    super->s5s_features & ~S5_FEATURES_SUPPORTED);
+                return -1;
+        }
         return 0;
 }
 
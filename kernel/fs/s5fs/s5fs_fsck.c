@@ -0,0 +1,584 @@
+/*
+ *   FILE: s5fs_fsck.c
+ *  DESCR: S5 consistency checker
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "proc/kmutex.h"
+#include "proc/krwlock.h"
+
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "fs/vnode.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+
+#define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
+
+/*
+ * s5fs_fsck() checks a mounted file system in three passes; the first
+ * two read each block at most once, and the third reads the inode
+ * blocks a second time:
+ *
+ *  - the inode blocks, in order: each inode and the blocks it maps,
+ *    which are marked in a bitmap of the disk, catching blocks used
+ *    twice; then the free inode list and the free block bitmap against
+ *    what the inodes use;
+ *  - the blocks of each directory: its entries, counting the ones
+ *    naming each inode;
+ *  - the inode blocks again: the link counts against those counts, and
+ *    that every directory is in the directory its ".." names.
+ *
+ * The first pass holds the inode and block locks, so inodes and blocks
+ * are not allocated or freed meanwhile, but nothing keeps the file
+ * system from being changed between the passes: a file created,
+ * unlinked or written to while the check runs can show up as a problem
+ * which is not there. The results can only be relied on when nothing
+ * else uses the file system. Nothing is repaired.
+ *
+ * The inode cache is written back first, so that the inode blocks are
+ * current, and the last pass takes link counts from the cached copies,
+ * which the vnodes in memory keep changing.
+ */
+
+/* Problems past this many are counted, but not described */
+#define S5_FSCK_MAX_REPORT      32
+
+#define S5_FSCK_NONE            ((uint32_t) -1)
+
+#define S5_FSCK_WORDS(n)        (((n) + 31) / 32)
+#define s5_fsck_test(map, n)    ((map)[(n) / 32] & (1U << ((n) % 32)))
+#define s5_fsck_set(map, n)     do { (map)[(n) / 32] |= 1U << ((n) % 32); } while (0)
+
+typedef struct s5_fsck {
+        s5fs_t   *ck_fs;
+        uint32_t  ck_meta;      /* the first block after the metadata */
+        uint32_t *ck_used;      /* blocks of the metadata or of an inode */
+        uint32_t *ck_inuse;     /* inodes of a type other than free */
+        uint32_t *ck_isfree;    /* inodes of type free */
+        uint32_t *ck_listed;    /* inodes on the free inode list */
+        uint32_t *ck_dirs;      /* directories */
+        uint32_t *ck_refs;      /* entries naming each inode, but "." */
+        uint32_t *ck_parent;    /* the directory naming a directory, or
+                                 * the next free inode of a free one */
+        uint32_t *ck_dotdot;    /* the ".." of each directory */
+        uint32_t  ck_ninuse;
+        uint32_t  ck_ndirs;
+        uint32_t  ck_nfree;     /* free blocks in the bitmap */
+        int       ck_nproblems;
+        char     *ck_buf;
+        size_t    ck_size;
+} s5_fsck_t;
+
+static void
+s5_fsck_problem(s5_fsck_t *ck, const char *fmt, ...)
+{
+        char line[128];
+        va_list args;
+
+        va_start(args, fmt);
+        vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+
+        dprintf("fsck: %s", line);
+        if (ck->ck_nproblems++ < S5_FSCK_MAX_REPORT)
+                iprintf(&ck->ck_buf, &ck->ck_size, "%s", line);
+}
+
+/*
+ * Marks block as used by inode ino. Returns 0, or -1 if the block can
+ * not be one of an inode or is used already.
+ */
+static int
+s5_fsck_block(s5_fsck_t *ck, uint32_t ino, uint32_t block)
+{
+        if (block < ck->ck_meta || block >= ck->ck_fs->s5f_super->s5s_nblocks) {
+                s5_fsck_problem(ck, "inode %u maps block %u, which is %s\n", ino, block,
+                                (block < ck->ck_meta) ? "metadata" : "past the end of the disk");
+                return -1;
+        }
+        if (s5_fsck_test(ck->ck_used, block)) {
+                s5_fsck_problem(ck, "inode %u maps block %u, which is used already\n",
+                                ino, block);
+                return -1;
+        }
+        s5_fsck_set(ck->ck_used, block);
+        return 0;
+}
+
+/* Marks an indirect block of depth 1 to 3 and the blocks below it */
+static void
+s5_fsck_indirect(s5_fsck_t *ck, uint32_t ino, uint32_t block, int depth)
+{
+        pframe_t *pf;
+        uint32_t *b;
+        uint32_t i;
+
+        if (s5_fsck_block(ck, ino, block))
+                return;
+        if (0 > pframe_get(S5FS_TO_VMOBJ(ck->ck_fs), block, &pf)) {
+                s5_fsck_problem(ck, "cannot read block %u of inode %u\n", block, ino);
+                return;
+        }
+        pframe_pin(pf);
+
+        b = (uint32_t *)pf->pf_addr;
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                if (0 == b[i])
+                        continue;
+                if (1 < depth)
+                        s5_fsck_indirect(ck, ino, b[i], depth - 1);
+                else
+                        s5_fsck_block(ck, ino, b[i]);
+        }
+
+        pframe_unpin(pf);
+}
+
+/* Marks the blocks below an extent tree node of the given depth, which
+ * has room for max entries */
+static void
+s5_fsck_extents(s5_fsck_t *ck, uint32_t ino, s5_extent_header_t *hdr,
+                int depth, uint16_t max)
+{
+        s5_extent_t *e = S5_EXTENT_ENTRIES(hdr);
+        pframe_t *pf;
+        uint32_t i, j;
+
+        if (S5_EXTENT_MAGIC != hdr->s5eh_magic || hdr->s5eh_depth != depth
+            || hdr->s5eh_max > max || hdr->s5eh_nentries > hdr->s5eh_max) {
+                s5_fsck_problem(ck, "inode %u has a bad extent tree node\n", ino);
+                return;
+        }
+
+        for (i = 0; i < hdr->s5eh_nentries; ++i) {
+                if (0 < i && e[i].s5e_fblock < e[i - 1].s5e_fblock
+                    + ((0 == depth) ? e[i - 1].s5e_len : 1)) {
+                        s5_fsck_problem(ck, "inode %u has extents out of order at file "
+                                        "block %u\n", ino, e[i].s5e_fblock);
+                }
+                if (0 == depth) {
+                        if (0 == e[i].s5e_len)
+                                s5_fsck_problem(ck, "inode %u has an empty extent\n", ino);
+                        for (j = 0; j < e[i].s5e_len; ++j) {
+                                if (s5_fsck_block(ck, ino, e[i].s5e_block + j))
+                                        break;
+                        }
+                        continue;
+                }
+
+                if (s5_fsck_block(ck, ino, e[i].s5e_block))
+                        continue;
+                if (0 > pframe_get(S5FS_TO_VMOBJ(ck->ck_fs), e[i].s5e_block, &pf)) {
+                        s5_fsck_problem(ck, "cannot read block %u of inode %u\n",
+                                        e[i].s5e_block, ino);
+                        continue;
+                }
+                pframe_pin(pf);
+                s5_fsck_extents(ck, ino, (s5_extent_header_t *)pf->pf_addr, depth - 1,
+                                S5_EXTENTS_PER_BLOCK);
+                pframe_unpin(pf);
+        }
+}
+
+/* The first pass over an inode: its fields and the blocks it maps */
+static void
+s5_fsck_inode(s5_fsck_t *ck, uint32_t ino, s5_inode_t *inode)
+{
+        int i;
+
+        if (inode->s5_number != ino)
+                s5_fsck_problem(ck, "inode %u is numbered %u\n", ino, inode->s5_number);
+
+        switch (inode->s5_type) {
+                case S5_TYPE_FREE:
+                        s5_fsck_set(ck->ck_isfree, ino);
+                        ck->ck_parent[ino] = inode->s5_next_free;
+                        return;
+                case S5_TYPE_DIR:
+                        s5_fsck_set(ck->ck_dirs, ino);
+                        ck->ck_ndirs++;
+                        /* fall through */
+                case S5_TYPE_DATA:
+                case S5_TYPE_CHR:
+                case S5_TYPE_BLK:
+                        s5_fsck_set(ck->ck_inuse, ino);
+                        ck->ck_ninuse++;
+                        break;
+                default:
+                        s5_fsck_problem(ck, "inode %u has bad type 0x%x\n", ino,
+                                        inode->s5_type);
+                        return;
+        }
+
+        if (0 > inode->s5_linkcount)
+                s5_fsck_problem(ck, "inode %u has link count %d\n", ino, inode->s5_linkcount);
+        if ((S5_TYPE_CHR == inode->s5_type) || (S5_TYPE_BLK == inode->s5_type))
+                return;
+        if (S5_TYPE_DIR == inode->s5_type && 0 != inode->s5_size % sizeof(s5_dirent_t)) {
+                s5_fsck_problem(ck, "directory %u has size %u, which is not a multiple "
+                                "of the entry size\n", ino, inode->s5_size);
+        }
+
+        if (inode->s5_flags & S5_INODE_INLINE) {
+                if (inode->s5_size > S5_INLINE_SIZE) {
+                        s5_fsck_problem(ck, "inode %u has %u bytes of inline data\n", ino,
+                                        inode->s5_size);
+                }
+        } else if (inode->s5_flags & S5_INODE_EXTENTS) {
+                if (inode->s5_extent_hdr.s5eh_depth >= S5_EXTENT_MAX_DEPTH)
+                        s5_fsck_problem(ck, "inode %u has a bad extent tree node\n", ino);
+                else
+                        s5_fsck_extents(ck, ino, &inode->s5_extent_hdr,
+                                        inode->s5_extent_hdr.s5eh_depth,
+                                        S5_EXTENTS_PER_INODE);
+        } else {
+                for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
+                        if (inode->s5_direct_blocks[i])
+                                s5_fsck_block(ck, ino, inode->s5_direct_blocks[i]);
+                }
+                if (inode->s5_indirect_block)
+                        s5_fsck_indirect(ck, ino, inode->s5_indirect_block, 1);
+                if (inode->s5_dindirect_block)
+                        s5_fsck_indirect(ck, ino, inode->s5_dindirect_block, 2);
+                if (inode->s5_tindirect_block)
+                        s5_fsck_indirect(ck, ino, inode->s5_tindirect_block, 3);
+        }
+}
+
+/* Checks the free inode list against the inodes of type free */
+static void
+s5_fsck_free_inodes(s5_fsck_t *ck)
+{
+        s5_super_t *s = ck->ck_fs->s5f_super;
+        uint32_t ino;
+
+        for (ino = s->s5s_free_inode; S5_FSCK_NONE != ino; ino = ck->ck_parent[ino]) {
+                if (ino >= s->s5s_num_inodes || !s5_fsck_test(ck->ck_isfree, ino)) {
+                        s5_fsck_problem(ck, "the free inode list has inode %u, which is "
+                                        "not free\n", ino);
+                        break;
+                }
+                if (s5_fsck_test(ck->ck_listed, ino)) {
+                        s5_fsck_problem(ck, "the free inode list loops at inode %u\n", ino);
+                        break;
+                }
+                s5_fsck_set(ck->ck_listed, ino);
+        }
+
+        for (ino = 0; ino < s->s5s_num_inodes; ++ino) {
+                if (s5_fsck_test(ck->ck_isfree, ino) && !s5_fsck_test(ck->ck_listed, ino))
+                        s5_fsck_problem(ck, "inode %u is free, but not on the free inode "
+                                        "list\n", ino);
+        }
+}
+
+/* Checks the free block bitmap against the blocks the inodes use */
+static void
+s5_fsck_free_blocks(s5_fsck_t *ck)
+{
+        s5_super_t *s = ck->ck_fs->s5f_super;
+        uint32_t i, w, first, valid, diff, bits, bit;
+        pframe_t *pf;
+
+        for (i = 0; i < s->s5s_bitmap_nblocks; ++i) {
+                if (0 > pframe_get(S5FS_TO_VMOBJ(ck->ck_fs), s->s5s_bitmap_block + i, &pf)) {
+                        s5_fsck_problem(ck, "cannot read block %u of the free block "
+                                        "bitmap\n", i);
+                        continue;
+                }
+                for (w = 0; w < S5_BITS_PER_BLOCK / 32; ++w) {
+                        first = i * S5_BITS_PER_BLOCK + w * 32;
+                        if (first >= s->s5s_nblocks)
+                                break;
+                        valid = (s->s5s_nblocks - first >= 32)
+                                ? ~0U : (1U << (s->s5s_nblocks - first)) - 1;
+
+                        bits = ~((uint32_t *)pf->pf_addr)[w] & valid;
+                        while (bits) {
+                                bits &= bits - 1;
+                                ck->ck_nfree++;
+                        }
+
+                        /* The words only differ where something is wrong */
+                        diff = (((uint32_t *)pf->pf_addr)[w] ^ ck->ck_used[first / 32]) & valid;
+                        for (bit = 0; diff; ++bit, diff >>= 1) {
+                                if (!(diff & 1))
+                                        continue;
+                                if (s5_fsck_test(ck->ck_used, first + bit))
+                                        s5_fsck_problem(ck, "block %u is in use, but marked "
+                                                        "free\n", first + bit);
+                                else
+                                        s5_fsck_problem(ck, "block %u is marked in use, but "
+                                                        "nothing uses it\n", first + bit);
+                        }
+                }
+        }
+
+        if (ck->ck_nfree != s->s5s_nfree)
+                s5_fsck_problem(ck, "the superblock counts %u free blocks, the bitmap "
+                                "has %u\n", s->s5s_nfree, ck->ck_nfree);
+}
+
+/* The first pass */
+static void
+s5_fsck_pass1(s5_fsck_t *ck)
+{
+        s5fs_t *fs = ck->ck_fs;
+        uint32_t ino, i;
+        pframe_t *pf = NULL;
+
+        kmutex_lock(&fs->s5f_inode_mutex);
+        kmutex_lock(&fs->s5f_block_mutex);
+
+        for (i = 0; i < ck->ck_meta; ++i)
+                s5_fsck_set(ck->ck_used, i);
+
+        for (ino = 0; ino < fs->s5f_super->s5s_num_inodes; ++ino) {
+                if (0 == S5_INODE_OFFSET(ino)) {
+                        if (pf)
+                                pframe_unpin(pf);
+                        if (0 > pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(ino), &pf)) {
+                                s5_fsck_problem(ck, "cannot read the block of inode %u\n",
+                                                ino);
+                                pf = NULL;
+                                ino += S5_INODES_PER_BLOCK - 1;
+                                continue;
+                        }
+                        pframe_pin(pf);
+                }
+                s5_fsck_inode(ck, ino, (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino));
+        }
+        if (pf)
+                pframe_unpin(pf);
+
+        s5_fsck_free_inodes(ck);
+        s5_fsck_free_blocks(ck);
+
+        kmutex_unlock(&fs->s5f_block_mutex);
+        kmutex_unlock(&fs->s5f_inode_mutex);
+}
+
+/* The second pass over one directory: its entries */
+static void
+s5_fsck_dir(s5_fsck_t *ck, uint32_t ino)
+{
+        s5fs_t *fs = ck->ck_fs;
+        s5_dirent_t *d;
+        pframe_t *pf = NULL;
+        vnode_t *vn;
+        uint32_t slot, child;
+        size_t namelen;
+        int ndot = 0, ndotdot = 0;
+
+        /* vget() must not read in an inode freed since the first pass */
+        if (0 > pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(ino), &pf))
+                return;
+        if (S5_TYPE_DIR != ((s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino))->s5_type)
+                return;
+        pf = NULL;
+
+        vn = vget(fs->s5f_fs, ino);
+        krwlock_rdlock(&vn->vn_lock);
+
+        for (slot = 0; slot < VNODE_TO_S5INODE(vn)->s5_size / sizeof(s5_dirent_t); ++slot) {
+                if (0 == slot % S5_DIRENTS_PER_BLOCK) {
+                        if (pf)
+                                pframe_unpin(pf);
+                        if (0 > pframe_get(&vn->vn_mmobj, slot / S5_DIRENTS_PER_BLOCK, &pf)) {
+                                s5_fsck_problem(ck, "cannot read block %u of directory "
+                                                "%u\n", slot / S5_DIRENTS_PER_BLOCK, ino);
+                                pf = NULL;
+                                break;
+                        }
+                        pframe_pin(pf);
+                }
+                d = (s5_dirent_t *)pf->pf_addr + slot % S5_DIRENTS_PER_BLOCK;
+                namelen = strnlen(d->s5d_name, S5_NAME_LEN);
+                child = d->s5d_inode;
+
+                /* fsmaker leaves the entries it removes empty */
+                if (0 == namelen)
+                        continue;
+                if (S5_NAME_LEN == namelen) {
+                        s5_fsck_problem(ck, "directory %u has a bad name in entry %u\n",
+                                        ino, slot);
+                        continue;
+                }
+                if (child >= fs->s5f_super->s5s_num_inodes
+                    || !s5_fsck_test(ck->ck_inuse, child)) {
+                        s5_fsck_problem(ck, "entry %s of directory %u names inode %u, "
+                                        "which is not in use\n", d->s5d_name, ino, child);
+                        continue;
+                }
+
+                if (0 == strcmp(d->s5d_name, ".")) {
+                        ndot++;
+                        if (child != ino)
+                                s5_fsck_problem(ck, "\".\" of directory %u is inode %u\n",
+                                                ino, child);
+                        continue;
+                }
+                ck->ck_refs[child]++;
+                if (0 == strcmp(d->s5d_name, "..")) {
+                        ndotdot++;
+                        ck->ck_dotdot[ino] = child;
+                        if (!s5_fsck_test(ck->ck_dirs, child))
+                                s5_fsck_problem(ck, "\"..\" of directory %u is inode %u, "
+                                                "which is not a directory\n", ino, child);
+                } else if (s5_fsck_test(ck->ck_dirs, child)) {
+                        if (S5_FSCK_NONE != ck->ck_parent[child])
+                                s5_fsck_problem(ck, "directory %u is in directories %u and "
+                                                "%u\n", child, ck->ck_parent[child], ino);
+                        else
+                                ck->ck_parent[child] = ino;
+                }
+        }
+        if (pf)
+                pframe_unpin(pf);
+
+        krwlock_unlock(&vn->vn_lock);
+        vput(vn);
+
+        if (1 != ndot || 1 != ndotdot)
+                s5_fsck_problem(ck, "directory %u has %d \".\" and %d \"..\" entries\n",
+                                ino, ndot, ndotdot);
+}
+
+/* The third pass over an inode in use: its link count and, for a
+ * directory, its place in the tree */
+static void
+s5_fsck_links(s5_fsck_t *ck, uint32_t ino, s5_inode_t *inode)
+{
+        uint32_t root = ck->ck_fs->s5f_super->s5s_root_inode;
+        s5_inode_t *cached;
+        int incore;
+
+        if (!s5_fsck_test(ck->ck_inuse, ino) || S5_TYPE_FREE == inode->s5_type)
+                return;
+        if (NULL != (cached = s5_icache_lookup(ck->ck_fs, ino)))
+                inode = cached;
+
+        if (s5_fsck_test(ck->ck_dirs, ino)) {
+                if (ino == root) {
+                        if (ck->ck_dotdot[ino] != root)
+                                s5_fsck_problem(ck, "\"..\" of the root directory is "
+                                                "inode %u\n", ck->ck_dotdot[ino]);
+                } else if (S5_FSCK_NONE == ck->ck_parent[ino]) {
+                        s5_fsck_problem(ck, "directory %u is in no directory\n", ino);
+                } else if (ck->ck_parent[ino] != ck->ck_dotdot[ino]) {
+                        s5_fsck_problem(ck, "directory %u is in directory %u, but its "
+                                        "\"..\" is %u\n", ino, ck->ck_parent[ino],
+                                        ck->ck_dotdot[ino]);
+                }
+        }
+
+        /* The vnode of the inode holds a link while it is in memory
+         * (see s5fs_read_vnode()); an unlinked file can have only that */
+        incore = vnode_incore(ck->ck_fs->s5f_fs, ino);
+        if (0 == ck->ck_refs[ino] && !incore)
+                s5_fsck_problem(ck, "inode %u is in use, but in no directory\n", ino);
+        else if ((uint32_t)inode->s5_linkcount != ck->ck_refs[ino] + incore)
+                s5_fsck_problem(ck, "inode %u has link count %d, but %u entries name "
+                                "it\n", ino, inode->s5_linkcount - incore, ck->ck_refs[ino]);
+}
+
+/*
+ * Checks the s5fs file system fs, which stays mounted, writing the
+ * problems found and a summary into the string buf of size bytes; they
+ * are only reliable if fs is idle (see above). Returns the number of problems, or -errno if the check
+ * could not be made.
+ */
+int
+s5fs_fsck(fs_t *fs, char *buf, size_t size)
+{
+        s5fs_t *s5 = FS_TO_S5FS(fs);
+        s5_super_t *s = s5->s5f_super;
+        s5_fsck_t ck;
+        uint32_t nblockw, ninodew, nwords, npages, ino;
+        uint32_t *mem;
+        pframe_t *pf = NULL;
+
+        KASSERT(NULL != buf && 0 < size);
+
+        s5_icache_flush(s5);
+
+        nblockw = S5_FSCK_WORDS(s->s5s_nblocks);
+        ninodew = S5_FSCK_WORDS(s->s5s_num_inodes);
+        nwords = nblockw + 4 * ninodew + 3 * s->s5s_num_inodes;
+        npages = (nwords * sizeof(uint32_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (NULL == (mem = page_alloc_n(npages)))
+                return -ENOMEM;
+        memset(mem, 0, (nblockw + 4 * ninodew + s->s5s_num_inodes) * sizeof(uint32_t));
+
+        memset(&ck, 0, sizeof(ck));
+        ck.ck_fs = s5;
+        ck.ck_buf = buf;
+        ck.ck_size = size;
+        ck.ck_buf[0] = '\0';
+        if (s->s5s_features & S5_FEATURE_JOURNAL)
+                ck.ck_meta = s->s5s_journal_block + s->s5s_journal_nblocks;
+        else
+                ck.ck_meta = s->s5s_bitmap_block + s->s5s_bitmap_nblocks;
+
+        ck.ck_used = mem;
+        ck.ck_inuse = ck.ck_used + nblockw;
+        ck.ck_isfree = ck.ck_inuse + ninodew;
+        ck.ck_listed = ck.ck_isfree + ninodew;
+        ck.ck_dirs = ck.ck_listed + ninodew;
+        ck.ck_refs = ck.ck_dirs + ninodew;
+        ck.ck_parent = ck.ck_refs + s->s5s_num_inodes;
+        ck.ck_dotdot = ck.ck_parent + s->s5s_num_inodes;
+        memset(ck.ck_parent, 0xff, 2 * s->s5s_num_inodes * sizeof(uint32_t));
+
+        s5_fsck_pass1(&ck);
+
+        if (s->s5s_root_inode >= s->s5s_num_inodes
+            || !s5_fsck_test(ck.ck_dirs, s->s5s_root_inode))
+                s5_fsck_problem(&ck, "the root inode %u is not a directory\n",
+                                s->s5s_root_inode);
+
+        for (ino = 0; ino < s->s5s_num_inodes; ++ino) {
+                if (s5_fsck_test(ck.ck_dirs, ino))
+                        s5_fsck_dir(&ck, ino);
+        }
+
+        for (ino = 0; ino < s->s5s_num_inodes; ++ino) {
+                if (0 == S5_INODE_OFFSET(ino)) {
+                        if (pf)
+                                pframe_unpin(pf);
+                        if (0 > pframe_get(S5FS_TO_VMOBJ(s5), S5_INODE_BLOCK(ino), &pf)) {
+                                pf = NULL;
+                                ino += S5_INODES_PER_BLOCK - 1;
+                                continue;
+                        }
+                        pframe_pin(pf);
+                }
+                s5_fsck_links(&ck, ino, (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino));
+        }
+        if (pf)
+                pframe_unpin(pf);
+
+        if (ck.ck_nproblems > S5_FSCK_MAX_REPORT)
+                iprintf(&ck.ck_buf, &ck.ck_size, "(and %d more)\n",
+                        ck.ck_nproblems - S5_FSCK_MAX_REPORT);
+        iprintf(&ck.ck_buf, &ck.ck_size, "%u inodes in use (%u directories), "
+                "%u of %u blocks free: ", ck.ck_ninuse, ck.ck_ndirs, ck.ck_nfree,
+                s->s5s_nblocks);
+        if (ck.ck_nproblems)
+                iprintf(&ck.ck_buf, &ck.ck_size, "%d problems\n", ck.ck_nproblems);
+        else
+                iprintf(&ck.ck_buf, &ck.ck_size, "clean\n");
+
+        page_free_n(mem, npages);
+        return ck.ck_nproblems;
+}
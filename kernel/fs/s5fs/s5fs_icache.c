@@ -0,0 +1,410 @@
+/*
+ *   FILE: s5fs_icache.c
+ *  DESCR: S5 in-core inode cache
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "mm/kmalloc.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "fs/vnode.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_icache.h"
+
+#define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
+
+/*
+ * The inodes of vnodes in memory (vn_i) are copies kept by this cache,
+ * not pointers into the pages of the inode blocks, so that a file in
+ * use does not keep a whole block pinned, and so that the changes to
+ * an inode are written into its block in batches rather than dirtying
+ * the block every time.
+ *
+ * s5_dirty_inode() only marks the copy dirty. Dirty copies are written
+ * into their blocks by s5_icache_flush(), every inode of a block at
+ * once: when the journal commits (so that they are in the transaction
+ * which made the changes, see s5fs_journal.c), once S5_ICACHE_BATCH of
+ * them are dirty, on sync(2), and at unmount. The blocks are then
+ * written back like any other metadata.
+ *
+ * When its vnode goes away, a copy stays cached, least recently used
+ * first, until there are more than S5_ICACHE_MAX_UNUSED such copies.
+ *
+ * Free inodes are never cached: s5_alloc_inode() works on the inode
+ * blocks directly, and s5_free_inode() writes the freed inode back and
+ * drops it from the cache (s5_icache_evict()) before anyone can
+ * allocate it again.
+ */
+
+#define S5_ICACHE_NBUCKETS      64
+
+/* Copies not used by a vnode kept around */
+#define S5_ICACHE_MAX_UNUSED    128
+
+/* Dirty copies written back together when a vnode goes away */
+#define S5_ICACHE_BATCH         32
+
+typedef struct s5_incore {
+        s5_inode_t       si_inode;      /* first, this is what vn_i points to */
+        int              si_refcount;   /* the vnode, and s5_icache_flush() */
+        list_link_t      si_hlink;      /* on sic_hash, unless evicted */
+        list_link_t      si_dlink;      /* on sic_dirty while dirty */
+        list_link_t      si_ulink;      /* on sic_unused while not referenced */
+} s5_incore_t;
+
+#define S5_INCORE(inode)        ((s5_incore_t *)(inode))
+
+typedef struct s5_icache {
+        s5fs_t           *sic_fs;
+        list_t            sic_hash[S5_ICACHE_NBUCKETS];
+        list_t            sic_dirty;
+        list_t            sic_unused;    /* least recently used first */
+        uint32_t          sic_ndirty;
+        uint32_t          sic_nunused;
+        list_link_t       sic_link;      /* link on s5_icaches */
+} s5_icache_t;
+
+/* All the inode caches of mounted file systems, for sync(2) */
+static list_t s5_icaches;
+
+static slab_allocator_t *s5_incore_allocator = NULL;
+
+static void
+s5_icache_global_init(void)
+{
+        list_init(&s5_icaches);
+        s5_incore_allocator = slab_allocator_create("s5incore", sizeof(s5_incore_t),
+                                                    NULL, NULL);
+        KASSERT(NULL != s5_incore_allocator);
+}
+init_func(s5_icache_global_init);
+
+static s5_incore_t *
+s5_icache_find(s5_icache_t *ic, uint32_t ino)
+{
+        s5_incore_t *si;
+
+        list_iterate_begin(&ic->sic_hash[ino % S5_ICACHE_NBUCKETS], si,
+                           s5_incore_t, si_hlink) {
+                if (si->si_inode.s5_number == ino)
+                        return si;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+s5_icache_hold(s5_icache_t *ic, s5_incore_t *si)
+{
+        if (0 == si->si_refcount++) {
+                list_remove(&si->si_ulink);
+                ic->sic_nunused--;
+        }
+}
+
+/* Drops a reference, keeping the copy around if it is still cached */
+static void
+s5_icache_release(s5_icache_t *ic, s5_incore_t *si)
+{
+        KASSERT(0 < si->si_refcount);
+        if (0 < --si->si_refcount)
+                return;
+
+        if (!list_link_is_linked(&si->si_hlink)) {
+                KASSERT(!list_link_is_linked(&si->si_dlink));
+                slab_obj_free(s5_incore_allocator, si);
+                return;
+        }
+        list_insert_tail(&ic->sic_unused, &si->si_ulink);
+        ic->sic_nunused++;
+}
+
+/* Copies si into pf, the page of its inode block, which is then dirtied */
+static void
+s5_icache_copy(s5_icache_t *ic, s5_incore_t *si, pframe_t *pf)
+{
+        KASSERT(pf->pf_pagenum == S5_INODE_BLOCK(si->si_inode.s5_number));
+
+        memcpy((s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(si->si_inode.s5_number),
+               &si->si_inode, sizeof(s5_inode_t));
+        if (list_link_is_linked(&si->si_dlink)) {
+                list_remove(&si->si_dlink);
+                ic->sic_ndirty--;
+        }
+}
+
+static void
+s5_icache_dirty_block(s5fs_t *fs, pframe_t *pf)
+{
+        int err;
+
+        err = pframe_dirty(pf);
+        KASSERT(!err && "shouldn\'t fail for a page belonging to a block device");
+        pframe_set_barrier(pf);
+        s5_journal_dirty(fs, pf);
+}
+
+/* Frees unused copies, oldest first, down to S5_ICACHE_MAX_UNUSED */
+static void
+s5_icache_trim(s5_icache_t *ic)
+{
+        s5_incore_t *si;
+        int flushed = 0;
+
+        while (ic->sic_nunused > S5_ICACHE_MAX_UNUSED) {
+                si = list_head(&ic->sic_unused, s5_incore_t, si_ulink);
+                if (list_link_is_linked(&si->si_dlink)) {
+                        /* Copies dirtied again while flushing can wait */
+                        if (flushed++)
+                                break;
+                        s5_icache_flush(ic->sic_fs);
+                        continue;
+                }
+                list_remove(&si->si_ulink);
+                list_remove(&si->si_hlink);
+                ic->sic_nunused--;
+                slab_obj_free(s5_incore_allocator, si);
+        }
+}
+
+/*
+ * Sets up the inode cache of a file system being mounted. Returns 0 on
+ * success or -ENOMEM.
+ */
+int
+s5_icache_init(s5fs_t *fs)
+{
+        s5_icache_t *ic;
+        int i;
+
+        if (NULL == (ic = (s5_icache_t *)kmalloc(sizeof(s5_icache_t))))
+                return -ENOMEM;
+        ic->sic_fs = fs;
+        for (i = 0; i < S5_ICACHE_NBUCKETS; i++)
+                list_init(&ic->sic_hash[i]);
+        list_init(&ic->sic_dirty);
+        list_init(&ic->sic_unused);
+        ic->sic_ndirty = 0;
+        ic->sic_nunused = 0;
+
+        list_insert_tail(&s5_icaches, &ic->sic_link);
+        fs->s5f_icache = ic;
+        return 0;
+}
+
+/*
+ * Writes back and frees the cached inodes of a file system being
+ * unmounted, none of which may be in use any more.
+ */
+void
+s5_icache_destroy(s5fs_t *fs)
+{
+        s5_icache_t *ic = fs->s5f_icache;
+        s5_incore_t *si;
+        int i;
+
+        s5_icache_flush(fs);
+        KASSERT(list_empty(&ic->sic_dirty));
+
+        while (!list_empty(&ic->sic_unused)) {
+                si = list_head(&ic->sic_unused, s5_incore_t, si_ulink);
+                list_remove(&si->si_ulink);
+                list_remove(&si->si_hlink);
+                slab_obj_free(s5_incore_allocator, si);
+        }
+        for (i = 0; i < S5_ICACHE_NBUCKETS; i++)
+                KASSERT(list_empty(&ic->sic_hash[i]) && "inode in use at unmount");
+
+        list_remove(&ic->sic_link);
+        kfree(ic);
+        fs->s5f_icache = NULL;
+}
+
+/*
+ * Returns the in-core copy of inode ino, which must be in use, reading
+ * it from its block if it is not cached, with a reference which is
+ * dropped by s5_icache_put(). Returns NULL if out of memory.
+ *
+ * This function may block.
+ */
+s5_inode_t *
+s5_icache_get(s5fs_t *fs, uint32_t ino)
+{
+        s5_icache_t *ic = fs->s5f_icache;
+        s5_incore_t *si, *other;
+        pframe_t *pf;
+
+        if (NULL != (si = s5_icache_find(ic, ino))) {
+                s5_icache_hold(ic, si);
+                return &si->si_inode;
+        }
+
+        if (NULL == (si = (s5_incore_t *)slab_obj_alloc(s5_incore_allocator)))
+                return NULL;
+        pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(ino), &pf);
+        KASSERT(pf && "because never fails for block_device vm_objects");
+
+        /* It may have been read in while the block was */
+        if (NULL != (other = s5_icache_find(ic, ino))) {
+                slab_obj_free(s5_incore_allocator, si);
+                s5_icache_hold(ic, other);
+                return &other->si_inode;
+        }
+
+        memcpy(&si->si_inode, (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino),
+               sizeof(s5_inode_t));
+        KASSERT(si->si_inode.s5_number == ino);
+        KASSERT(S5_TYPE_FREE != si->si_inode.s5_type);
+
+        si->si_refcount = 1;
+        list_link_init(&si->si_dlink);
+        list_link_init(&si->si_ulink);
+        list_insert_head(&ic->sic_hash[ino % S5_ICACHE_NBUCKETS], &si->si_hlink);
+        return &si->si_inode;
+}
+
+/*
+ * Drops the reference s5_icache_get() returned inode with. If this
+ * leaves too many unused inodes cached, or too many dirty, they are
+ * written back.
+ *
+ * This function may block.
+ */
+void
+s5_icache_put(s5fs_t *fs, s5_inode_t *inode)
+{
+        s5_icache_t *ic = fs->s5f_icache;
+
+        s5_icache_release(ic, S5_INCORE(inode));
+
+        if (ic->sic_ndirty >= S5_ICACHE_BATCH)
+                s5_icache_flush(fs);
+        s5_icache_trim(ic);
+}
+
+/*
+ * Returns the cached copy of inode ino, or NULL if it is not cached,
+ * without blocking or taking a reference.
+ */
+s5_inode_t *
+s5_icache_lookup(s5fs_t *fs, uint32_t ino)
+{
+        s5_incore_t *si;
+
+        if (NULL == fs->s5f_icache
+            || NULL == (si = s5_icache_find(fs->s5f_icache, ino)))
+                return NULL;
+        return &si->si_inode;
+}
+
+/*
+ * Marks inode, returned by s5_icache_get(), as changed, to be written
+ * into its block later. Use s5_dirty_inode().
+ */
+void
+s5_icache_dirty(s5fs_t *fs, s5_inode_t *inode)
+{
+        s5_icache_t *ic = fs->s5f_icache;
+        s5_incore_t *si = S5_INCORE(inode);
+
+        KASSERT(0 < si->si_refcount);
+        KASSERT(list_link_is_linked(&si->si_hlink) && "dirtying an evicted inode");
+
+        if (!list_link_is_linked(&si->si_dlink)) {
+                list_insert_tail(&ic->sic_dirty, &si->si_dlink);
+                ic->sic_ndirty++;
+        }
+}
+
+/*
+ * Writes back inode, which s5_free_inode() has just put on the free
+ * inode list, and drops it from the cache, so that s5_alloc_inode() can
+ * hand it out again from its block. The caller holds the inode lock;
+ * the reference stays until s5_icache_put().
+ *
+ * This function may block.
+ */
+void
+s5_icache_evict(s5fs_t *fs, s5_inode_t *inode)
+{
+        s5_icache_t *ic = fs->s5f_icache;
+        s5_incore_t *si = S5_INCORE(inode);
+        pframe_t *pf;
+
+        KASSERT(0 < si->si_refcount);
+        KASSERT(S5_TYPE_FREE == inode->s5_type);
+
+        pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(inode->s5_number), &pf);
+        KASSERT(pf && "because never fails for block_device vm_objects");
+
+        s5_icache_copy(ic, si, pf);
+        list_remove(&si->si_hlink);
+        s5_icache_dirty_block(fs, pf);
+}
+
+/*
+ * Writes the dirty inodes of fs into their blocks, each block once, as
+ * one journal handle. Does nothing once the cache has been destroyed.
+ *
+ * This function may block.
+ */
+void
+s5_icache_flush(s5fs_t *fs)
+{
+        s5_icache_t *ic = fs->s5f_icache;
+        s5_incore_t *si, *other;
+        pframe_t *pf;
+        uint32_t block, n;
+
+        if (NULL == ic || list_empty(&ic->sic_dirty))
+                return;
+
+        s5_journal_start(fs);
+        while (!list_empty(&ic->sic_dirty)) {
+                si = list_head(&ic->sic_dirty, s5_incore_t, si_dlink);
+                block = S5_INODE_BLOCK(si->si_inode.s5_number);
+
+                /* Keep it cached while the block is read */
+                s5_icache_hold(ic, si);
+                pframe_get(S5FS_TO_VMOBJ(fs), block, &pf);
+                KASSERT(pf && "because never fails for block_device vm_objects");
+
+                n = 0;
+                list_iterate_begin(&ic->sic_dirty, other, s5_incore_t, si_dlink) {
+                        if (S5_INODE_BLOCK(other->si_inode.s5_number) == block) {
+                                s5_icache_copy(ic, other, pf);
+                                n++;
+                        }
+                } list_iterate_end();
+                if (0 < n) {
+                        s5_icache_dirty_block(fs, pf);
+                        dprintf("wrote back %u inodes of block %u\n", n, block);
+                }
+
+                s5_icache_release(ic, si);
+        }
+        s5_journal_stop(fs);
+}
+
+/*
+ * Writes back the dirty inodes of all file systems, for sync(2).
+ */
+void
+s5_icache_flush_all(void)
+{
+        s5_icache_t *ic;
+
+        list_iterate_begin(&s5_icaches, ic, s5_icache_t, sic_link) {
+                s5_icache_flush(ic->sic_fs);
+        } list_iterate_end();
+}
@@ -0,0 +1,977 @@
+/*
+ *   FILE: s5fs_journal.c
+ *  DESCR: S5 metadata journal
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "fs/vnode.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_journal.h"
+
+#define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
+
+/*
+ * Metadata changes are grouped into transactions, which are written to
+ * the journal (see s5fs.h for its format) before any of their blocks
+ * is written in place, so that mounting after a crash only has to copy
+ * the committed transactions from the journal into place to get back to
+ * a consistent file system.
+ *
+ * Everything which changes metadata runs between s5_journal_start() and
+ * s5_journal_stop(), which may nest. Every metadata page is passed to
+ * s5_journal_dirty(), or for the pages of directories
+ * s5_journal_dirty_vnode(), right after pframe_dirty(). The page then
+ * joins the running transaction, which keeps it pinned so that it is
+ * not written back until the transaction is committed. Inodes changed
+ * in memory (see s5fs_icache.c) are written into their blocks when the
+ * transaction is committed, so they join it then.
+ *
+ * A transaction is committed once it has S5_JOURNAL_BATCH blocks and
+ * the last handle on the journal is stopped, on sync(2), and at
+ * unmount. New handles wait while a commit is in progress, and so do
+ * they while the running transaction is half full, so that the handles
+ * already running finish and it can be committed. Every handle counts
+ * as S5_JOURNAL_CREDITS more blocks of the transaction, which is as
+ * many as one operation changes; a handle which would not fit waits
+ * for the others, or commits the transaction if there are none, so
+ * that the transaction is not filled up in the middle of an operation.
+ *
+ * Committed pages are written in place by the normal writeback of dirty
+ * pages. The journal does not track that; once it is full, whatever is
+ * in it is copied into place from the journal (a checkpoint) and the
+ * log starts over.
+ *
+ * A block freed by a transaction is revoked if the journal holds a copy
+ * of it, so that an old copy is not put back over whatever the block is
+ * reused for; until the transaction is committed it is not reused at
+ * all.
+ */
+
+/* Transactions of this many blocks are committed when nothing uses the
+ * journal */
+#define S5_JOURNAL_BATCH        32
+
+/* The blocks a handle may add to the transaction; more than any one
+ * operation other than writing back or freeing a large file changes */
+#define S5_JOURNAL_CREDITS      16
+
+/* The most journal writes submitted at once */
+#define S5_JOURNAL_NREQS        32
+
+/* A block of a transaction */
+typedef struct s5_journal_buf {
+        pframe_t        *sjb_pf;        /* pinned */
+        vnode_t         *sjb_vnode;     /* referenced, for pages of directories */
+        uint32_t         sjb_block;     /* where the block belongs */
+} s5_journal_buf_t;
+
+typedef struct s5_journal_txn {
+        uint32_t          sjt_sequence;
+        s5_journal_buf_t *sjt_bufs;
+        uint32_t          sjt_nbufs;
+        uint32_t         *sjt_revoked;   /* freed blocks with copies in the journal */
+        uint32_t          sjt_nrevoked;
+} s5_journal_txn_t;
+
+typedef struct s5_journal {
+        s5fs_t           *sj_fs;
+        blockdev_t       *sj_bdev;
+        uint32_t          sj_block;      /* the journal superblock */
+        uint32_t          sj_nblocks;
+        uint32_t          sj_head;       /* next free block of the log */
+        uint32_t          sj_max;        /* most blocks of one transaction */
+        uint32_t          sj_credits;    /* blocks set aside for a handle */
+
+        /* For each block of the log holding a copy, where the copy
+         * belongs, or 0 (also once the block is revoked) */
+        uint32_t         *sj_log;
+
+        /* A bit for every block of the disk, set if it has a copy in
+         * the log or is in a transaction */
+        uint32_t         *sj_journaled;
+
+        s5_journal_txn_t  sj_txn[2];
+        s5_journal_txn_t *sj_running;
+        s5_journal_txn_t *sj_committing; /* being written, or NULL */
+        kthread_t        *sj_committer;  /* the thread committing, or NULL */
+
+        int               sj_nhandles;   /* threads with a handle */
+        ktqueue_t         sj_waitq;      /* threads waiting for either */
+
+        char             *sj_buf;        /* descriptor and commit blocks */
+        char             *sj_rbuf;       /* revoke blocks and checkpoints */
+        blockdev_req_t    sj_reqs[S5_JOURNAL_NREQS];
+
+        list_link_t       sj_link;       /* link on s5_journals */
+} s5_journal_t;
+
+/* All the journals of mounted file systems, for sync(2) */
+static list_t s5_journals;
+
+static void
+s5_journal_list_init(void)
+{
+        list_init(&s5_journals);
+}
+init_func(s5_journal_list_init);
+
+static uint32_t
+s5_journal_checksum(uint32_t sum, const void *block)
+{
+        const uint32_t *w = (const uint32_t *)block;
+        uint32_t i;
+
+        for (i = 0; i < S5_BLOCK_SIZE / sizeof(uint32_t); i++)
+                sum = ((sum << 1) | (sum >> 31)) ^ w[i];
+        return sum;
+}
+
+static void
+s5_journal_header(void *block, uint32_t type, uint32_t sequence, uint32_t count)
+{
+        s5_journal_header_t *hdr = (s5_journal_header_t *)block;
+
+        memset(block, 0, S5_BLOCK_SIZE);
+        hdr->s5jh_magic = S5_JOURNAL_MAGIC;
+        hdr->s5jh_type = type;
+        hdr->s5jh_sequence = sequence;
+        hdr->s5jh_count = count;
+}
+
+#define s5_journal_test(j, b)   ((j)->sj_journaled[(b) / 32] & (1U << ((b) % 32)))
+#define s5_journal_mark(j, b)   do { (j)->sj_journaled[(b) / 32] |= 1U << ((b) % 32); } while (0)
+#define s5_journal_unmark(j, b) do { (j)->sj_journaled[(b) / 32] &= ~(1U << ((b) % 32)); } while (0)
+
+
+/*
+ * Recovery, before the file system is mounted. Everything is read and
+ * written directly, as the page cache must not hold any of the blocks
+ * replayed.
+ */
+
+typedef struct s5_journal_scan {
+        blockdev_t      *ss_bdev;
+        uint32_t         ss_block;      /* first block of the journal */
+        uint32_t         ss_nblocks;
+        char            *ss_hdr;        /* page for header blocks */
+        char            *ss_copy;       /* page for copies */
+} s5_journal_scan_t;
+
+typedef struct s5_journal_revoke {
+        uint32_t         sr_block;
+        uint32_t         sr_sequence;   /* the transaction revoking it */
+} s5_journal_revoke_t;
+
+/*
+ * Reads block i of the journal into the header page. Returns 1 if it
+ * is a header block of the given type of transaction sequence, 0 if it
+ * is not, or -errno.
+ */
+static int
+s5_journal_read_header(s5_journal_scan_t *ss, uint32_t i, uint32_t type,
+                       uint32_t sequence)
+{
+        s5_journal_header_t *hdr = (s5_journal_header_t *)ss->ss_hdr;
+        int err;
+
+        if (i >= ss->ss_nblocks)
+                return 0;
+        if (0 > (err = ss->ss_bdev->bd_ops->read_block(ss->ss_bdev, ss->ss_hdr,
+                                                       ss->ss_block + i, 1)))
+                return err;
+        return S5_JOURNAL_MAGIC == hdr->s5jh_magic && type == hdr->s5jh_type
+               && sequence == hdr->s5jh_sequence
+               && hdr->s5jh_count <= S5_JOURNAL_TAGS_PER_BLOCK;
+}
+
+/*
+ * Checks whether a whole committed transaction sequence starts at block
+ * pos of the journal. Returns 1 with the block after it in *next and
+ * the number of blocks it revokes in *nrevoked if so, 0 if not, or
+ * -errno.
+ */
+static int
+s5_journal_scan_txn(s5_journal_scan_t *ss, uint32_t pos, uint32_t sequence,
+                    uint32_t *next, uint32_t *nrevoked)
+{
+        s5_journal_header_t *hdr = (s5_journal_header_t *)ss->ss_hdr;
+        uint32_t count, sum, i;
+        int ret;
+
+        if (0 >= (ret = s5_journal_read_header(ss, pos, S5_JOURNAL_DESCRIPTOR, sequence)))
+                return ret;
+        count = hdr->s5jh_count;
+        sum = s5_journal_checksum(sequence, ss->ss_hdr);
+
+        for (i = pos + 1; i < pos + 1 + count; i++) {
+                if (i >= ss->ss_nblocks)
+                        return 0;
+                if (0 > (ret = ss->ss_bdev->bd_ops->read_block(ss->ss_bdev, ss->ss_copy,
+                                                               ss->ss_block + i, 1)))
+                        return ret;
+                sum = s5_journal_checksum(sum, ss->ss_copy);
+        }
+
+        *nrevoked = 0;
+        if (0 > (ret = s5_journal_read_header(ss, i, S5_JOURNAL_REVOKE, sequence)))
+                return ret;
+        if (ret) {
+                *nrevoked = hdr->s5jh_count;
+                sum = s5_journal_checksum(sum, ss->ss_hdr);
+                if (0 > (ret = s5_journal_read_header(ss, ++i, S5_JOURNAL_COMMIT,
+                                                      sequence)))
+                        return ret;
+        } else {
+                /* The block just read may be the commit block */
+                ret = S5_JOURNAL_MAGIC == hdr->s5jh_magic
+                      && S5_JOURNAL_COMMIT == hdr->s5jh_type
+                      && sequence == hdr->s5jh_sequence;
+        }
+        if (!ret || sum != hdr->s5jh_checksum)
+                return 0;
+
+        *next = i + 1;
+        return 1;
+}
+
+static int
+s5_journal_is_revoked(s5_journal_revoke_t *revoked, uint32_t nrevoked,
+                      uint32_t block, uint32_t sequence)
+{
+        uint32_t i;
+
+        for (i = 0; i < nrevoked; i++) {
+                if (revoked[i].sr_block == block && revoked[i].sr_sequence >= sequence)
+                        return 1;
+        }
+        return 0;
+}
+
+/*
+ * Copies the ntxns transactions starting at sequence from the journal
+ * into place.
+ */
+static int
+s5_journal_replay(s5_journal_scan_t *ss, uint32_t sequence, uint32_t ntxns,
+                  uint32_t nrevoked, uint32_t disk_nblocks)
+{
+        s5_journal_header_t *hdr = (s5_journal_header_t *)ss->ss_hdr;
+        blockdev_t *bd = ss->ss_bdev;
+        s5_journal_revoke_t *revoked = NULL;
+        uint32_t t, pos, i, n = 0, count, block;
+        int err = 0;
+
+        if (0 < nrevoked
+            && NULL == (revoked = (s5_journal_revoke_t *)kmalloc(nrevoked
+                                                                 * sizeof(*revoked))))
+                return -ENOMEM;
+
+        /* Every revocation has to be known before anything is copied, as
+         * it applies to the transactions before it too */
+        for (t = 0, pos = 1; t < ntxns; t++) {
+                if (0 >= (err = s5_journal_read_header(ss, pos, S5_JOURNAL_DESCRIPTOR,
+                                                       sequence + t)))
+                        goto changed;
+                pos += 1 + hdr->s5jh_count;
+                if (0 > (err = s5_journal_read_header(ss, pos, S5_JOURNAL_REVOKE,
+                                                      sequence + t)))
+                        goto out;
+                if (err) {
+                        for (i = 0; i < hdr->s5jh_count && n < nrevoked; i++, n++) {
+                                revoked[n].sr_block = S5_JOURNAL_TAGS(hdr)[i];
+                                revoked[n].sr_sequence = sequence + t;
+                        }
+                        pos++;
+                }
+                pos++;
+        }
+
+        for (t = 0, pos = 1; t < ntxns; t++) {
+                if (0 >= (err = s5_journal_read_header(ss, pos, S5_JOURNAL_DESCRIPTOR,
+                                                       sequence + t)))
+                        goto changed;
+                count = hdr->s5jh_count;
+                for (i = 0; i < count; i++) {
+                        block = S5_JOURNAL_TAGS(hdr)[i];
+                        if (0 == block || block >= disk_nblocks) {
+                                dbg(DBG_PRINT, "s5fs: journal transaction %u has a copy "
+                                    "of bad block %u\n", sequence + t, block);
+                                continue;
+                        }
+                        if (s5_journal_is_revoked(revoked, n, block, sequence + t))
+                                continue;
+                        if (0 > (err = bd->bd_ops->read_block(bd, ss->ss_copy,
+                                                              ss->ss_block + pos + 1 + i, 1))
+                            || 0 > (err = bd->bd_ops->write_block(bd, ss->ss_copy,
+                                                                  block, 1)))
+                                goto out;
+                }
+                pos += 1 + count;
+                if (0 > (err = s5_journal_read_header(ss, pos, S5_JOURNAL_REVOKE,
+                                                      sequence + t)))
+                        goto out;
+                pos += err ? 2 : 1;
+        }
+        err = 0;
+        goto out;
+
+changed:
+        /* The transactions were all there when the journal was scanned */
+        if (0 == err)
+                err = -EIO;
+out:
+        if (NULL != revoked)
+                kfree(revoked);
+        return err;
+}
+
+/*
+ * Called before a file system on bd is mounted: if it has a journal,
+ * copies the transactions committed to it into place and empties it.
+ * Returns 0 on success (also when there is no journal), or -errno if
+ * the journal is damaged or can not be read.
+ */
+int
+s5_journal_recover(blockdev_t *bd)
+{
+        s5_journal_scan_t ss;
+        s5_super_t *super;
+        s5_journal_super_t *js;
+        uint32_t disk_nblocks, sequence, pos, next, nrev, ntxns = 0, nrevoked = 0;
+        int ret;
+
+        if (NULL == (ss.ss_hdr = (char *)page_alloc()))
+                return -ENOMEM;
+        if (NULL == (ss.ss_copy = (char *)page_alloc())) {
+                page_free(ss.ss_hdr);
+                return -ENOMEM;
+        }
+        ss.ss_bdev = bd;
+
+        if (0 > (ret = bd->bd_ops->read_block(bd, ss.ss_hdr, S5_SUPER_BLOCK, 1)))
+                goto out;
+        super = (s5_super_t *)ss.ss_hdr;
+        if (S5_MAGIC != super->s5s_magic || S5_CURRENT_VERSION != super->s5s_version
+            || !(super->s5s_features & S5_FEATURE_JOURNAL))
+                goto out;
+        if (!(super->s5s_bitmap_block + super->s5s_bitmap_nblocks <= super->s5s_journal_block
+              && S5_JOURNAL_MIN_BLOCKS <= super->s5s_journal_nblocks
+              && super->s5s_journal_block + super->s5s_journal_nblocks
+              <= super->s5s_nblocks)) {
+                dbg(DBG_PRINT, "s5fs: the journal is past the end of the disk\n");
+                ret = -EINVAL;
+                goto out;
+        }
+        disk_nblocks = super->s5s_nblocks;
+        ss.ss_block = super->s5s_journal_block;
+        ss.ss_nblocks = super->s5s_journal_nblocks;
+
+        if (0 > (ret = bd->bd_ops->read_block(bd, ss.ss_hdr, ss.ss_block, 1)))
+                goto out;
+        js = (s5_journal_super_t *)ss.ss_hdr;
+        if (S5_JOURNAL_MAGIC != js->s5js_magic || ss.ss_nblocks != js->s5js_nblocks) {
+                dbg(DBG_PRINT, "s5fs: bad journal superblock\n");
+                ret = -EINVAL;
+                goto out;
+        }
+        sequence = js->s5js_sequence;
+
+        for (pos = 1; 0 < (ret = s5_journal_scan_txn(&ss, pos, sequence + ntxns,
+                                                     &next, &nrev)); pos = next) {
+                ntxns++;
+                nrevoked += nrev;
+        }
+        if (0 > ret || 0 == ntxns)
+                goto out;
+
+        if (0 > (ret = s5_journal_replay(&ss, sequence, ntxns, nrevoked, disk_nblocks))
+            || 0 > (ret = blockdev_flush_cache(bd)))
+                goto out;
+
+        /* Only now can the transactions be forgotten */
+        s5_journal_header(ss.ss_hdr, 0, 0, 0);
+        js->s5js_magic = S5_JOURNAL_MAGIC;
+        js->s5js_nblocks = ss.ss_nblocks;
+        js->s5js_sequence = sequence + ntxns;
+        if (0 > (ret = bd->bd_ops->write_block(bd, ss.ss_hdr, ss.ss_block, 1))
+            || 0 > (ret = blockdev_flush_cache(bd)))
+                goto out;
+
+        dbg(DBG_PRINT, "s5fs: replayed journal transactions %u to %u\n",
+            sequence, sequence + ntxns - 1);
+
+out:
+        page_free(ss.ss_copy);
+        page_free(ss.ss_hdr);
+        return (0 > ret) ? ret : 0;
+}
+
+
+/*
+ * Running the journal
+ */
+
+static void
+s5_journal_free(s5_journal_t *j)
+{
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                if (NULL != j->sj_txn[i].sjt_bufs)
+                        kfree(j->sj_txn[i].sjt_bufs);
+                if (NULL != j->sj_txn[i].sjt_revoked)
+                        kfree(j->sj_txn[i].sjt_revoked);
+        }
+        if (NULL != j->sj_log)
+                kfree(j->sj_log);
+        if (NULL != j->sj_journaled)
+                kfree(j->sj_journaled);
+        if (NULL != j->sj_buf)
+                page_free(j->sj_buf);
+        if (NULL != j->sj_rbuf)
+                page_free(j->sj_rbuf);
+        kfree(j);
+}
+
+/*
+ * Sets up the journal of a file system being mounted, after
+ * s5_journal_recover(). s5f_journal is left NULL if it has none.
+ */
+int
+s5_journal_init(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        s5_journal_super_t *js;
+        s5_journal_t *j;
+        size_t mapsize;
+        int i, err;
+
+        fs->s5f_journal = NULL;
+        if (!(s->s5s_features & S5_FEATURE_JOURNAL))
+                return 0;
+
+        if (NULL == (j = (s5_journal_t *)kmalloc(sizeof(s5_journal_t))))
+                return -ENOMEM;
+        memset(j, 0, sizeof(*j));
+        j->sj_fs = fs;
+        j->sj_bdev = fs->s5f_bdev;
+        j->sj_block = s->s5s_journal_block;
+        j->sj_nblocks = s->s5s_journal_nblocks;
+        j->sj_head = 1;
+        /* A transaction has to fit in the log along with its descriptor,
+         * revoke and commit blocks */
+        j->sj_max = MIN(S5_JOURNAL_TAGS_PER_BLOCK, j->sj_nblocks - 4);
+        j->sj_credits = MIN(S5_JOURNAL_CREDITS, j->sj_max);
+        sched_queue_init(&j->sj_waitq);
+
+        mapsize = (s->s5s_nblocks + 31) / 32 * sizeof(uint32_t);
+        if (NULL == (j->sj_log = (uint32_t *)kmalloc(j->sj_nblocks * sizeof(uint32_t)))
+            || NULL == (j->sj_journaled = (uint32_t *)kmalloc(mapsize))
+            || NULL == (j->sj_buf = (char *)page_alloc())
+            || NULL == (j->sj_rbuf = (char *)page_alloc())) {
+                err = -ENOMEM;
+                goto fail;
+        }
+        memset(j->sj_log, 0, j->sj_nblocks * sizeof(uint32_t));
+        memset(j->sj_journaled, 0, mapsize);
+        for (i = 0; i < 2; i++) {
+                if (NULL == (j->sj_txn[i].sjt_bufs = (s5_journal_buf_t *)
+                             kmalloc(j->sj_max * sizeof(s5_journal_buf_t)))
+                    || NULL == (j->sj_txn[i].sjt_revoked = (uint32_t *)
+                                kmalloc(S5_JOURNAL_TAGS_PER_BLOCK * sizeof(uint32_t)))) {
+                        err = -ENOMEM;
+                        goto fail;
+                }
+        }
+
+        if (0 > (err = j->sj_bdev->bd_ops->read_block(j->sj_bdev, j->sj_buf,
+                                                     j->sj_block, 1)))
+                goto fail;
+        js = (s5_journal_super_t *)j->sj_buf;
+        if (S5_JOURNAL_MAGIC != js->s5js_magic || j->sj_nblocks != js->s5js_nblocks) {
+                err = -EINVAL;
+                goto fail;
+        }
+        j->sj_running = &j->sj_txn[0];
+        j->sj_running->sjt_sequence = js->s5js_sequence;
+
+        list_insert_tail(&s5_journals, &j->sj_link);
+        fs->s5f_journal = j;
+        return 0;
+
+fail:
+        s5_journal_free(j);
+        return err;
+}
+
+/*
+ * Waits for the journal writes submitted, the first n of sj_reqs.
+ * Returns 0, or the first error.
+ */
+static int
+s5_journal_wait(s5_journal_t *j, int n)
+{
+        int i, err, ret = 0;
+
+        for (i = 0; i < n; i++) {
+                if (0 > (err = blockdev_wait(&j->sj_reqs[i])) && 0 == ret)
+                        ret = err;
+        }
+        return ret;
+}
+
+/*
+ * Writes block i of the journal from buf, as the nth of the writes
+ * submitted together, first waiting for those if there is no room for
+ * more. Returns the number submitted now, or -errno.
+ */
+static int
+s5_journal_submit(s5_journal_t *j, int n, const char *buf, uint32_t i)
+{
+        int err;
+
+        KASSERT(i < j->sj_nblocks);
+        if (S5_JOURNAL_NREQS == n) {
+                if (0 > (err = s5_journal_wait(j, n)))
+                        return err;
+                n = 0;
+        }
+        blockdev_req_init(&j->sj_reqs[n], j->sj_bdev, 1, (char *)buf, j->sj_block + i, 1,
+                          NULL, NULL);
+        blockdev_submit(&j->sj_reqs[n]);
+        return n + 1;
+}
+
+/*
+ * Writes a transaction to the log at sj_head: the descriptor, the
+ * copies and revoke block, which can go in any order, and the commit
+ * block after everything else is on disk.
+ */
+static int
+s5_journal_write(s5_journal_t *j, s5_journal_txn_t *txn)
+{
+        uint32_t pos = j->sj_head, sum, i;
+        blockdev_req_t req;
+        int n = 0, err;
+
+        s5_journal_header(j->sj_buf, S5_JOURNAL_DESCRIPTOR, txn->sjt_sequence,
+                          txn->sjt_nbufs);
+        for (i = 0; i < txn->sjt_nbufs; i++)
+                S5_JOURNAL_TAGS(j->sj_buf)[i] = txn->sjt_bufs[i].sjb_block;
+        sum = s5_journal_checksum(txn->sjt_sequence, j->sj_buf);
+        if (0 > (n = s5_journal_submit(j, n, j->sj_buf, pos++)))
+                return n;
+
+        for (i = 0; i < txn->sjt_nbufs; i++) {
+                sum = s5_journal_checksum(sum, txn->sjt_bufs[i].sjb_pf->pf_addr);
+                if (0 > (n = s5_journal_submit(j, n, txn->sjt_bufs[i].sjb_pf->pf_addr,
+                                               pos++)))
+                        return n;
+        }
+
+        if (0 < txn->sjt_nrevoked) {
+                s5_journal_header(j->sj_rbuf, S5_JOURNAL_REVOKE, txn->sjt_sequence,
+                                  txn->sjt_nrevoked);
+                memcpy(S5_JOURNAL_TAGS(j->sj_rbuf), txn->sjt_revoked,
+                       txn->sjt_nrevoked * sizeof(uint32_t));
+                sum = s5_journal_checksum(sum, j->sj_rbuf);
+                if (0 > (n = s5_journal_submit(j, n, j->sj_rbuf, pos++)))
+                        return n;
+        }
+        if (0 > (err = s5_journal_wait(j, n)))
+                return err;
+
+        s5_journal_header(j->sj_buf, S5_JOURNAL_COMMIT, txn->sjt_sequence, 0);
+        ((s5_journal_header_t *)j->sj_buf)->s5jh_checksum = sum;
+        blockdev_req_init(&req, j->sj_bdev, 1, j->sj_buf, j->sj_block + pos, 1, NULL, NULL);
+        req.br_flags |= BLOCKDEV_REQ_BARRIER;
+        blockdev_submit(&req);
+        return blockdev_wait(&req);
+}
+
+/*
+ * Copies every block with a copy in the log into place and empties the
+ * log, whose next transaction will be sequence.
+ */
+static int
+s5_journal_checkpoint(s5_journal_t *j, uint32_t sequence)
+{
+        blockdev_t *bd = j->sj_bdev;
+        s5_journal_super_t *js;
+        s5_journal_txn_t *txn;
+        uint32_t i, k, block;
+        int t, err;
+
+        /* Newest copies first; the bits of the blocks tell which ones
+         * are still to be done. A block freed since may have been
+         * written in place already. */
+        for (i = j->sj_head - 1; 0 < i; i--) {
+                if (0 == (block = j->sj_log[i]) || !s5_journal_test(j, block)
+                    || s5_journal_revoked(j->sj_fs, block))
+                        continue;
+                s5_journal_unmark(j, block);
+                if (0 > (err = bd->bd_ops->read_block(bd, j->sj_rbuf, j->sj_block + i, 1))
+                    || 0 > (err = bd->bd_ops->write_block(bd, j->sj_rbuf, block, 1)))
+                        return err;
+        }
+        if (0 > (err = blockdev_flush_cache(bd)))
+                return err;
+
+        js = (s5_journal_super_t *)j->sj_rbuf;
+        memset(j->sj_rbuf, 0, S5_BLOCK_SIZE);
+        js->s5js_magic = S5_JOURNAL_MAGIC;
+        js->s5js_nblocks = j->sj_nblocks;
+        js->s5js_sequence = sequence;
+        if (0 > (err = bd->bd_ops->write_block(bd, j->sj_rbuf, j->sj_block, 1))
+            || 0 > (err = blockdev_flush_cache(bd)))
+                return err;
+
+        dprintf("checkpointed %u journal blocks\n", j->sj_head - 1);
+        j->sj_head = 1;
+        memset(j->sj_log, 0, j->sj_nblocks * sizeof(uint32_t));
+        memset(j->sj_journaled, 0,
+               (j->sj_fs->s5f_super->s5s_nblocks + 31) / 32 * sizeof(uint32_t));
+        for (t = 0; t < 2; t++) {
+                txn = &j->sj_txn[t];
+                if (txn != j->sj_running && txn != j->sj_committing)
+                        continue;
+                for (k = 0; k < txn->sjt_nbufs; k++)
+                        s5_journal_mark(j, txn->sjt_bufs[k].sjb_block);
+                for (k = 0; k < txn->sjt_nrevoked; k++)
+                        s5_journal_mark(j, txn->sjt_revoked[k]);
+        }
+        return 0;
+}
+
+/*
+ * Commits the running transaction of fs and waits for it to be on
+ * disk. Must not be called with a handle on the journal. Returns 0 on
+ * success (also without a journal), or -errno if the transaction could
+ * not be written, in which case its blocks are still written back, but
+ * not atomically.
+ */
+int
+s5_journal_commit(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_journal_txn_t *txn;
+        uint32_t i, k, need;
+        int err = 0;
+
+        if (NULL == j)
+                return 0;
+        KASSERT(curthr->kt_journal != j && "committing with a handle on the journal");
+
+        while (NULL != j->sj_committer)
+                sched_sleep_on(&j->sj_waitq);
+        j->sj_committer = curthr;
+        while (0 < j->sj_nhandles)
+                sched_sleep_on(&j->sj_waitq);
+
+        /* The inodes the transaction changed, with a handle of this
+         * thread */
+        s5_icache_flush(fs);
+
+        txn = j->sj_running;
+        if (0 == txn->sjt_nbufs && 0 == txn->sjt_nrevoked)
+                goto out;
+
+        j->sj_running = (txn == &j->sj_txn[0]) ? &j->sj_txn[1] : &j->sj_txn[0];
+        j->sj_running->sjt_sequence = txn->sjt_sequence + 1;
+        j->sj_running->sjt_nbufs = 0;
+        j->sj_running->sjt_nrevoked = 0;
+        j->sj_committing = txn;
+        for (i = 0; i < txn->sjt_nbufs; i++)
+                pframe_clear_journal(txn->sjt_bufs[i].sjb_pf);
+
+        need = 2 + txn->sjt_nbufs + (0 < txn->sjt_nrevoked ? 1 : 0);
+        if ((j->sj_head + need > j->sj_nblocks
+             && 0 > (err = s5_journal_checkpoint(j, txn->sjt_sequence)))
+            || 0 > (err = s5_journal_write(j, txn))) {
+                dbg(DBG_PRINT, "s5fs: could not commit journal transaction %u: %d\n",
+                    txn->sjt_sequence, err);
+                goto release;
+        }
+
+        for (i = 0; i < txn->sjt_nbufs; i++)
+                j->sj_log[j->sj_head + 1 + i] = txn->sjt_bufs[i].sjb_block;
+        j->sj_head += need;
+        for (k = 0; k < txn->sjt_nrevoked; k++) {
+                for (i = 1; i < j->sj_head; i++) {
+                        if (j->sj_log[i] == txn->sjt_revoked[k])
+                                j->sj_log[i] = 0;
+                }
+        }
+        dprintf("committed journal transaction %u, %u blocks, %u revoked\n",
+                txn->sjt_sequence, txn->sjt_nbufs, txn->sjt_nrevoked);
+
+release:
+        /* Putting a vnode may free its inode, which starts a handle of
+         * this thread; other threads still wait for the commit */
+        j->sj_committing = NULL;
+        for (i = 0; i < txn->sjt_nbufs; i++) {
+                pframe_unpin(txn->sjt_bufs[i].sjb_pf);
+                if (NULL != txn->sjt_bufs[i].sjb_vnode)
+                        vput(txn->sjt_bufs[i].sjb_vnode);
+        }
+        txn->sjt_nbufs = 0;
+        txn->sjt_nrevoked = 0;
+
+out:
+        j->sj_committer = NULL;
+        sched_broadcast_on(&j->sj_waitq);
+        return err;
+}
+
+/*
+ * Commits the running transactions of all file systems, for sync(2).
+ */
+void
+s5_journal_commit_all(void)
+{
+        s5_journal_t *j;
+
+        list_iterate_begin(&s5_journals, j, s5_journal_t, sj_link) {
+                s5_journal_commit(j->sj_fs);
+        } list_iterate_end();
+}
+
+/*
+ * Commits everything and copies it into place, leaving the journal
+ * empty, when fs is unmounted.
+ */
+void
+s5_journal_destroy(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        int err;
+
+        if (NULL == j)
+                return;
+
+        if (0 > (err = s5_journal_commit(fs))
+            || 0 > (err = s5_journal_checkpoint(j, j->sj_running->sjt_sequence)))
+                dbg(DBG_PRINT, "s5fs: could not empty the journal: %d\n", err);
+        KASSERT(0 == j->sj_nhandles && 0 == j->sj_running->sjt_nbufs);
+
+        list_remove(&j->sj_link);
+        s5_journal_free(j);
+        fs->s5f_journal = NULL;
+}
+
+/*
+ * Starts a handle on the journal of fs: the metadata changes made until
+ * the matching s5_journal_stop() go into the same transaction.
+ */
+void
+s5_journal_start(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_journal_txn_t *txn;
+
+        if (NULL == j)
+                return;
+        if (NULL != curthr->kt_journal) {
+                KASSERT(curthr->kt_journal == j
+                        && "handles on two journals at once");
+                curthr->kt_journal_nest++;
+                return;
+        }
+
+        /* The committing thread itself may need a handle to put the
+         * vnodes of the transaction, which it has taken out of the
+         * running one already */
+        for (;;) {
+                txn = j->sj_running;
+                if (NULL != j->sj_committer && curthr != j->sj_committer) {
+                        sched_sleep_on(&j->sj_waitq);
+                } else if (NULL != j->sj_committer
+                           || (txn->sjt_nbufs + (j->sj_nhandles + 1) * j->sj_credits
+                               <= j->sj_max
+                               && (0 == j->sj_nhandles
+                                   || txn->sjt_nbufs + txn->sjt_nrevoked
+                                   < j->sj_max / 2))) {
+                        break;
+                } else if (0 < j->sj_nhandles) {
+                        sched_sleep_on(&j->sj_waitq);
+                } else {
+                        s5_journal_commit(fs);
+                }
+        }
+
+        j->sj_nhandles++;
+        curthr->kt_journal = j;
+        curthr->kt_journal_nest = 1;
+}
+
+/*
+ * Stops a handle started with s5_journal_start(), committing the
+ * running transaction if it is big enough and this was the last
+ * handle.
+ */
+void
+s5_journal_stop(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_journal_txn_t *txn;
+
+        if (NULL == j)
+                return;
+        KASSERT(curthr->kt_journal == j && 0 < curthr->kt_journal_nest);
+        if (0 < --curthr->kt_journal_nest)
+                return;
+
+        curthr->kt_journal = NULL;
+        KASSERT(0 < j->sj_nhandles);
+        if (0 < --j->sj_nhandles)
+                return;
+
+        sched_broadcast_on(&j->sj_waitq);
+        txn = j->sj_running;
+        if (NULL == j->sj_committer
+            && txn->sjt_nbufs + txn->sjt_nrevoked >= MIN(S5_JOURNAL_BATCH, j->sj_max / 2))
+                s5_journal_commit(fs);
+}
+
+/*
+ * Adds a page of the block device or of the directory vn to the running
+ * transaction, as block.
+ */
+static void
+s5_journal_add(s5_journal_t *j, pframe_t *pf, vnode_t *vn, uint32_t block)
+{
+        s5_journal_txn_t *txn = j->sj_running;
+        s5_journal_buf_t *buf;
+
+        KASSERT(curthr->kt_journal == j && "metadata changed without a journal handle");
+        if (pframe_is_journal(pf))
+                return;
+
+        if (txn->sjt_nbufs == j->sj_max) {
+                /* Only a handle going over its S5_JOURNAL_CREDITS gets
+                 * here. Should the page not even be written in place
+                 * before it can be committed, the transaction would be
+                 * stuck; write it back without the journal instead */
+                dbg(DBG_PRINT, "s5fs: journal transaction %u is full, block %u "
+                    "is not journaled\n", txn->sjt_sequence, block);
+                s5_journal_revoke(j->sj_fs, block);
+                return;
+        }
+
+        pframe_pin(pf);
+        pframe_set_journal(pf);
+        if (NULL != vn)
+                vref(vn);
+        buf = &txn->sjt_bufs[txn->sjt_nbufs++];
+        buf->sjb_pf = pf;
+        buf->sjb_vnode = vn;
+        buf->sjb_block = block;
+        s5_journal_mark(j, block);
+}
+
+/*
+ * Adds a page of the block device, which has just been dirtied, to the
+ * running transaction.
+ */
+void
+s5_journal_dirty(s5fs_t *fs, pframe_t *pf)
+{
+        if (NULL == fs->s5f_journal)
+                return;
+        KASSERT(pf->pf_obj == S5FS_TO_VMOBJ(fs));
+        s5_journal_add(fs->s5f_journal, pf, NULL, pf->pf_pagenum);
+}
+
+/*
+ * Like s5_journal_dirty(), for a page of the directory vn, whose block
+ * must be allocated (which dirtying the page does).
+ */
+int
+s5_journal_dirty_vnode(vnode_t *vn, pframe_t *pf)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vn);
+        int block;
+
+        if (NULL == fs->s5f_journal || pframe_is_journal(pf))
+                return 0;
+        KASSERT(pf->pf_obj == &vn->vn_mmobj);
+
+        if (0 >= (block = s5_seek_to_block(vn, pf->pf_pagenum * S5_BLOCK_SIZE, 0)))
+                return block ? block : -EIO;
+        s5_journal_add(fs->s5f_journal, pf, vn, block);
+        return 0;
+}
+
+/*
+ * Called for a block being freed. If the journal may hold a copy of
+ * it, the running transaction revokes the copy, and the block is not
+ * reused until it has been committed.
+ */
+void
+s5_journal_revoke(s5fs_t *fs, uint32_t block)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_journal_txn_t *txn;
+        uint32_t i;
+
+        if (NULL == j || !s5_journal_test(j, block))
+                return;
+
+        txn = j->sj_running;
+        for (i = 0; i < txn->sjt_nrevoked; i++) {
+                if (txn->sjt_revoked[i] == block)
+                        return;
+        }
+        if (S5_JOURNAL_TAGS_PER_BLOCK == txn->sjt_nrevoked) {
+                dbg(DBG_PRINT, "s5fs: journal transaction %u can not revoke block %u\n",
+                    txn->sjt_sequence, block);
+                return;
+        }
+        txn->sjt_revoked[txn->sjt_nrevoked++] = block;
+}
+
+/*
+ * Returns true if block was freed by a transaction which has not been
+ * committed yet, so that it must not be allocated.
+ */
+int
+s5_journal_revoked(s5fs_t *fs, uint32_t block)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_journal_txn_t *txn;
+        uint32_t i;
+        int t;
+
+        if (NULL == j || !s5_journal_test(j, block))
+                return 0;
+
+        for (t = 0; t < 2; t++) {
+                txn = &j->sj_txn[t];
+                if (txn != j->sj_running && txn != j->sj_committing)
+                        continue;
+                for (i = 0; i < txn->sjt_nrevoked; i++) {
+                        if (txn->sjt_revoked[i] == block)
+                                return 1;
+                }
+        }
+        return 0;
+}
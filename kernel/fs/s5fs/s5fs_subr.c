@@ -24,10 +24,14 @@
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
 #include "mm/mm.h"
+#include "mm/mman.h"
 #include "mm/page.h"
+#include "vm/vmmap.h"
 
 #define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
 
+/* The superblock is written back as a barrier like inode blocks, see
+ * s5_dirty_inode_block() */
 #define s5_dirty_super(fs)                                           \
         do {                                                         \
                 pframe_t *p;                                         \
@@ -38,13 +42,66 @@
                 KASSERT(!err                                         \
                         && "shouldn\'t fail for a page belonging "   \
                         "to a block device");                        \
+                pframe_set_barrier(p);                               \
+                s5_journal_dirty(fs, p);                             \
         } while (0)
 
 
 static void s5_free_block(s5fs_t *fs, int block);
-static int s5_alloc_block(s5fs_t *);
+static int s5_alloc_block(s5fs_t *, uint32_t goal);
+static int s5_alloc_blocks(s5fs_t *fs, uint32_t goal, uint32_t *count, vnode_t *vnode);
+static uint32_t s5_nheld(s5fs_t *fs);
+static uint32_t s5_alloc_goal(vnode_t *vnode, uint32_t blocknum);
+static void s5_extent_init(s5_extent_header_t *hdr, uint16_t max, uint16_t depth);
+static int s5_extent_map(vnode_t *vnode, uint32_t fblock, uint32_t *run);
+static int s5_extent_alloc(vnode_t *vnode, uint32_t fblock, uint32_t *run,
+                           uint32_t data);
+static int s5_block_map(vnode_t *vnode, uint32_t blocknum, int alloc, uint32_t data);
+static void s5_extent_free(s5fs_t *fs, s5_extent_header_t *hdr);
 
 
+/*
+ * Finds where the pointer to file block blocknum lives. Returns how
+ * many levels of indirect blocks are above it (0 for a direct block,
+ * up to 3 for the triple indirect block), with the pointer in the inode
+ * which the lookup starts from in *top and the index into the indirect
+ * block of each level on the way down in offsets[].
+ */
+static int
+s5_block_path(s5_inode_t *inode, uint32_t blocknum, uint32_t **top,
+              uint32_t offsets[3])
+{
+        const uint32_t n = S5_NIDIRECT_BLOCKS;
+
+        if (blocknum < S5_NDIRECT_BLOCKS) {
+                *top = &inode->s5_direct_blocks[blocknum];
+                return 0;
+        }
+        blocknum -= S5_NDIRECT_BLOCKS;
+
+        if (blocknum < n) {
+                *top = &inode->s5_indirect_block;
+                offsets[0] = blocknum;
+                return 1;
+        }
+        blocknum -= n;
+
+        if (blocknum < n * n) {
+                *top = &inode->s5_dindirect_block;
+                offsets[0] = blocknum / n;
+                offsets[1] = blocknum % n;
+                return 2;
+        }
+        blocknum -= n * n;
+
+        KASSERT(blocknum < n * n * n);
+        *top = &inode->s5_tindirect_block;
+        offsets[0] = blocknum / (n * n);
+        offsets[1] = (blocknum / n) % n;
+        offsets[2] = blocknum % n;
+        return 3;
+}
+
 /*
  * Return the disk-block number for the given seek pointer (aka file
  * position).
@@ -54,7 +111,11 @@ static int s5_alloc_block(s5fs_t *);
  * alloc is true, then allocate a new disk block (and make the inode
  * point to it) and return it.
  *
- * Be sure to handle indirect blocks!
+ * Be sure to handle indirect blocks! Blocks past the single indirect
+ * block go through the double and then the triple indirect block,
+ * which are allocated (zeroed) on the way down like the single one.
+ * Inodes with S5_INODE_EXTENTS set are mapped by their extent tree
+ * instead.
  *
  * If there is an error, return -errno.
  *
@@ -63,27 +124,510 @@ static int s5_alloc_block(s5fs_t *);
 int
 s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_seek_to_block");
-        return -1;
+        return s5_block_map(vnode, S5_DATA_BLOCK(seekptr), alloc, 0);
 }
 
+/*
+ * Does the work of s5_seek_to_block() for file block blocknum. If data
+ * is not 0, it is the block allocated already for blocknum if it is
+ * sparse (indirect blocks on the way are still allocated here).
+ */
+static int
+s5_block_map(vnode_t *vnode, uint32_t blocknum, int alloc, uint32_t data)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        uint32_t offsets[3], *ptr;
+        pframe_t *pf = NULL, *ibp;
+        int depth, level, block, err;
+
+        /* Inline data has to be moved out into a block first (see
+         * s5_inline_expand()); until then the file has none */
+        if (inode->s5_flags & S5_INODE_INLINE) {
+                KASSERT(!alloc && "allocating a block for inline data");
+                return 0;
+        }
+
+        if (inode->s5_flags & S5_INODE_EXTENTS) {
+                return alloc ? s5_extent_alloc(vnode, blocknum, NULL, data)
+                       : s5_extent_map(vnode, blocknum, NULL);
+        }
+
+        if (blocknum >= S5_MAX_FILE_BLOCKS)
+                return -EFBIG;
+
+        /* ptr points into the inode at first, then into the pinned
+         * indirect block pf of each level */
+        depth = s5_block_path(inode, blocknum, &ptr, offsets);
+        for (level = 0; ; level++) {
+                if (0 == (block = *ptr) && alloc) {
+                        if (level == depth && 0 != data)
+                                block = data;
+                        else if (0 > (block = s5_alloc_block(fs, s5_alloc_goal(vnode,
+                                                                                blocknum))))
+                                break;
+                        if (level < depth) {
+                                if (0 > (err = pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp))) {
+                                        s5_free_block(fs, block);
+                                        block = err;
+                                        break;
+                                }
+                                memset(ibp->pf_addr, 0, S5_BLOCK_SIZE);
+                                pframe_dirty(ibp);
+                                s5_journal_dirty(fs, ibp);
+                        }
+                        *ptr = block;
+                        if (NULL == pf) {
+                                s5_dirty_inode(fs, inode);
+                        } else {
+                                pframe_dirty(pf);
+                                s5_journal_dirty(fs, pf);
+                        }
+                }
+                if (0 == block || level == depth)
+                        break;
+
+                pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp);
+                KASSERT(ibp && "because never fails for block_device vm_objects");
+                pframe_pin(ibp);
+                if (NULL != pf)
+                        pframe_unpin(pf);
+                pf = ibp;
+                ptr = (uint32_t *)pf->pf_addr + offsets[level];
+        }
+
+        if (NULL != pf)
+                pframe_unpin(pf);
+        return block;
+}
 
 /*
- * Locks the mutex for the whole file system
+ * Picks where to look for a free block for block blocknum of a file:
+ * right after the block before it, so that files written sequentially
+ * are laid out contiguously, or where the last allocation left off for
+ * the first block of a file or after a hole.
  */
+static uint32_t
+s5_alloc_goal(vnode_t *vnode, uint32_t blocknum)
+{
+        int prev;
+
+        if (0 < blocknum
+            && 0 < (prev = s5_seek_to_block(vnode, (blocknum - 1) * S5_BLOCK_SIZE, 0)))
+                return prev + 1;
+        return VNODE_TO_S5FS(vnode)->s5f_alloc_hint;
+}
+
+
+/*
+ * Extent trees (see s5fs.h). Mapping a block walks down from the root
+ * in the inode, binary searching every node, so it costs O(log
+ * extents) instead of a pointer per block, and tells how many blocks
+ * after it are contiguous on disk as well.
+ */
+
+/* A node on the path from the root of an extent tree down to a leaf */
+typedef struct s5_extent_path {
+        pframe_t           *sep_pf;     /* the node's block, NULL at the root */
+        s5_extent_header_t *sep_hdr;
+        int                 sep_index;  /* the entry followed, or -1 */
+} s5_extent_path_t;
+
 static void
-lock_s5(s5fs_t *fs)
+s5_extent_init(s5_extent_header_t *hdr, uint16_t max, uint16_t depth)
 {
-        kmutex_lock(&fs->s5f_mutex);
+        hdr->s5eh_magic = S5_EXTENT_MAGIC;
+        hdr->s5eh_nentries = 0;
+        hdr->s5eh_max = max;
+        hdr->s5eh_depth = depth;
 }
 
 /*
- * Unlocks the mutex for the whole file system
+ * Returns the index of the last entry of the node which starts at or
+ * before fblock, or -1 if there is none.
  */
+static int
+s5_extent_search(s5_extent_header_t *hdr, uint32_t fblock)
+{
+        s5_extent_t *e = S5_EXTENT_ENTRIES(hdr);
+        int lo = 0, hi = hdr->s5eh_nentries - 1, mid;
+
+        if (0 == hdr->s5eh_nentries || e[0].s5e_fblock > fblock)
+                return -1;
+        while (lo < hi) {
+                mid = (lo + hi + 1) / 2;
+                if (e[mid].s5e_fblock <= fblock)
+                        lo = mid;
+                else
+                        hi = mid - 1;
+        }
+        return lo;
+}
+
+/* Inserts ent as entry pos of a node which has room for it */
 static void
-unlock_s5(s5fs_t *fs)
+s5_extent_put(s5_extent_header_t *hdr, int pos, const s5_extent_t *ent)
 {
-        kmutex_unlock(&fs->s5f_mutex);
+        s5_extent_t *e = S5_EXTENT_ENTRIES(hdr);
+        int i;
+
+        KASSERT(hdr->s5eh_nentries < hdr->s5eh_max);
+        for (i = hdr->s5eh_nentries; i > pos; i--)
+                e[i] = e[i - 1];
+        e[pos] = *ent;
+        hdr->s5eh_nentries++;
+}
+
+static void
+s5_extent_dirty(vnode_t *vnode, s5_extent_path_t *path, int level)
+{
+        if (0 == level) {
+                s5_dirty_inode(VNODE_TO_S5FS(vnode), VNODE_TO_S5INODE(vnode));
+        } else {
+                pframe_dirty(path[level].sep_pf);
+                s5_journal_dirty(VNODE_TO_S5FS(vnode), path[level].sep_pf);
+        }
+}
+
+static void
+s5_extent_release(s5_extent_path_t *path, int depth)
+{
+        int i;
+
+        for (i = 1; i <= depth; i++)
+                pframe_unpin(path[i].sep_pf);
+}
+
+/*
+ * Fills in the path from the root of the extent tree of vnode down to
+ * the leaf which maps (or would map) fblock, pinning the blocks on it,
+ * and returns the depth of the tree, or -errno. Release the path with
+ * s5_extent_release().
+ */
+static int
+s5_extent_find(vnode_t *vnode, uint32_t fblock, s5_extent_path_t *path)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5_extent_header_t *hdr = &inode->s5_extent_hdr;
+        int depth = hdr->s5eh_depth, i, idx, err;
+        pframe_t *pf;
+
+        path[0].sep_pf = NULL;
+        for (i = 0; ; i++) {
+                if (S5_EXTENT_MAGIC != hdr->s5eh_magic
+                    || depth >= S5_EXTENT_MAX_DEPTH || hdr->s5eh_depth != depth - i
+                    || hdr->s5eh_nentries > hdr->s5eh_max
+                    || (i < depth && 0 == hdr->s5eh_nentries)) {
+                        dbg(DBG_PRINT, "s5fs: inode %u has a bad extent tree node\n",
+                            inode->s5_number);
+                        err = -EIO;
+                        break;
+                }
+                path[i].sep_hdr = hdr;
+                path[i].sep_index = s5_extent_search(hdr, fblock);
+                if (i == depth)
+                        return depth;
+
+                /* Blocks before the first key of a node above the
+                 * leaves can only go into its first child */
+                idx = MAX(0, path[i].sep_index);
+                if (0 > (err = pframe_get(S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode)),
+                                          S5_EXTENT_ENTRIES(hdr)[idx].s5e_block, &pf)))
+                        break;
+                pframe_pin(pf);
+                path[i + 1].sep_pf = pf;
+                hdr = (s5_extent_header_t *)pf->pf_addr;
+        }
+
+        s5_extent_release(path, i);
+        return err;
+}
+
+/*
+ * Returns the disk block file block fblock is mapped to, 0 if it is
+ * sparse, or -errno. If run is not NULL and the block is mapped, the
+ * number of blocks from it to the end of its extent is put in *run.
+ */
+static int
+s5_extent_map(vnode_t *vnode, uint32_t fblock, uint32_t *run)
+{
+        s5_extent_path_t path[S5_EXTENT_MAX_DEPTH];
+        s5_extent_t *e;
+        int depth, ret = 0;
+
+        if (0 > (depth = s5_extent_find(vnode, fblock, path)))
+                return depth;
+
+        if (0 <= path[depth].sep_index) {
+                e = S5_EXTENT_ENTRIES(path[depth].sep_hdr) + path[depth].sep_index;
+                if (fblock - e->s5e_fblock < e->s5e_len) {
+                        ret = e->s5e_block + (fblock - e->s5e_fblock);
+                        if (NULL != run)
+                                *run = e->s5e_len - (fblock - e->s5e_fblock);
+                }
+        }
+
+        s5_extent_release(path, depth);
+        return ret;
+}
+
+/*
+ * Moves the entries of the root of the extent tree into a new block
+ * below it, making the tree one level deeper and leaving room at the
+ * root.
+ */
+static int
+s5_extent_grow(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5_extent_header_t *root = &inode->s5_extent_hdr, *hdr;
+        pframe_t *pf;
+        int block, err;
+
+        if (root->s5eh_depth + 1 >= S5_EXTENT_MAX_DEPTH)
+                return -EFBIG;
+
+        if (0 > (block = s5_alloc_block(fs, fs->s5f_alloc_hint)))
+                return block;
+        if (0 > (err = pframe_get(S5FS_TO_VMOBJ(fs), block, &pf))) {
+                s5_free_block(fs, block);
+                return err;
+        }
+        hdr = (s5_extent_header_t *)pf->pf_addr;
+        s5_extent_init(hdr, S5_EXTENTS_PER_BLOCK, root->s5eh_depth);
+        memcpy(S5_EXTENT_ENTRIES(hdr), S5_EXTENT_ENTRIES(root),
+               root->s5eh_nentries * sizeof(s5_extent_t));
+        hdr->s5eh_nentries = root->s5eh_nentries;
+        pframe_dirty(pf);
+        s5_journal_dirty(fs, pf);
+
+        /* The first key stays what it was */
+        root->s5eh_depth++;
+        root->s5eh_nentries = 1;
+        S5_EXTENT_ENTRIES(root)[0].s5e_block = block;
+        S5_EXTENT_ENTRIES(root)[0].s5e_len = 0;
+        s5_dirty_inode(fs, inode);
+        return 0;
+}
+
+/*
+ * Inserts ext into the leaf at the end of path, after the entry the
+ * path points at. Full nodes are split, adding an entry for the new
+ * node to their parent, up to the root, which must have room.
+ */
+static int
+s5_extent_insert(vnode_t *vnode, s5_extent_path_t *path, int depth,
+                 const s5_extent_t *ext)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_extent_header_t *hdr, *nhdr;
+        s5_extent_t ent = *ext;
+        pframe_t *pf;
+        int level, pos, split, block, err;
+
+        for (level = depth; ; level--) {
+                hdr = path[level].sep_hdr;
+                pos = path[level].sep_index + 1;
+                if (hdr->s5eh_nentries < hdr->s5eh_max) {
+                        s5_extent_put(hdr, pos, &ent);
+                        s5_extent_dirty(vnode, path, level);
+                        return 0;
+                }
+                KASSERT(0 < level && "the root must have room");
+
+                /* Move the upper half to a new node. When appending,
+                 * which is what a file written sequentially does, start
+                 * the new node with just the new entry instead, so that
+                 * the nodes end up full. */
+                split = (pos == hdr->s5eh_nentries) ? pos : hdr->s5eh_nentries / 2;
+                if (0 > (block = s5_alloc_block(fs, path[level].sep_pf->pf_pagenum + 1)))
+                        return block;
+                if (0 > (err = pframe_get(S5FS_TO_VMOBJ(fs), block, &pf))) {
+                        s5_free_block(fs, block);
+                        return err;
+                }
+                nhdr = (s5_extent_header_t *)pf->pf_addr;
+                s5_extent_init(nhdr, S5_EXTENTS_PER_BLOCK, hdr->s5eh_depth);
+                nhdr->s5eh_nentries = hdr->s5eh_nentries - split;
+                memcpy(S5_EXTENT_ENTRIES(nhdr), S5_EXTENT_ENTRIES(hdr) + split,
+                       nhdr->s5eh_nentries * sizeof(s5_extent_t));
+                hdr->s5eh_nentries = split;
+                if (pos < split)
+                        s5_extent_put(hdr, pos, &ent);
+                else
+                        s5_extent_put(nhdr, pos - split, &ent);
+
+                ent.s5e_fblock = S5_EXTENT_ENTRIES(nhdr)[0].s5e_fblock;
+                ent.s5e_block = block;
+                ent.s5e_len = 0;
+                pframe_dirty(pf);
+                pframe_dirty(path[level].sep_pf);
+                s5_journal_dirty(fs, pf);
+                s5_journal_dirty(fs, path[level].sep_pf);
+        }
+}
+
+/*
+ * Like s5_extent_map(), but allocates a block for fblock if it is
+ * sparse. The new block is looked for right after the extent before
+ * it, which is extended when that works out, and gets an extent of its
+ * own otherwise. If data is not 0, it is the block allocated already.
+ */
+static int
+s5_extent_alloc(vnode_t *vnode, uint32_t fblock, uint32_t *run, uint32_t data)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_extent_path_t path[S5_EXTENT_MAX_DEPTH];
+        s5_extent_t *e = NULL, ext;
+        uint32_t goal = fs->s5f_alloc_hint;
+        int depth, level, block, err;
+
+        if (0 != (block = s5_extent_map(vnode, fblock, run)))
+                return block;
+
+        if (0 > (depth = s5_extent_find(vnode, fblock, path)))
+                return depth;
+        if (0 <= path[depth].sep_index) {
+                e = S5_EXTENT_ENTRIES(path[depth].sep_hdr) + path[depth].sep_index;
+                goal = e->s5e_block + (fblock - e->s5e_fblock);
+        }
+        if (0 != data) {
+                block = data;
+        } else if (0 > (block = s5_alloc_block(fs, goal))) {
+                s5_extent_release(path, depth);
+                return block;
+        }
+        if (NULL != run)
+                *run = 1;
+
+        if (NULL != e && e->s5e_fblock + e->s5e_len == fblock
+            && e->s5e_block + e->s5e_len == (uint32_t) block) {
+                e->s5e_len++;
+                s5_extent_dirty(vnode, path, depth);
+                s5_extent_release(path, depth);
+                return block;
+        }
+
+        /* If every node down to the leaf is full the root has to make
+         * room for the splits */
+        for (level = depth; 0 < level; level--) {
+                if (path[level].sep_hdr->s5eh_nentries < path[level].sep_hdr->s5eh_max)
+                        break;
+        }
+        if (path[level].sep_hdr->s5eh_nentries == path[level].sep_hdr->s5eh_max) {
+                s5_extent_release(path, depth);
+                if (0 > (err = s5_extent_grow(vnode))
+                    || 0 > (err = depth = s5_extent_find(vnode, fblock, path))) {
+                        if (0 == data)
+                                s5_free_block(fs, block);
+                        return err;
+                }
+        }
+
+        /* A block before the first key of the tree goes into the
+         * leftmost leaf, whose keys on the way down must cover it. The
+         * path then points at those first entries, so that a node split
+         * off below goes in after them. */
+        for (level = 0; level < depth; level++) {
+                if (0 > path[level].sep_index) {
+                        S5_EXTENT_ENTRIES(path[level].sep_hdr)[0].s5e_fblock = fblock;
+                        path[level].sep_index = 0;
+                        s5_extent_dirty(vnode, path, level);
+                }
+        }
+
+        ext.s5e_fblock = fblock;
+        ext.s5e_block = block;
+        ext.s5e_len = 1;
+        if (0 > (err = s5_extent_insert(vnode, path, depth, &ext))) {
+                if (0 == data)
+                        s5_free_block(fs, block);
+                block = err;
+        }
+        s5_extent_release(path, depth);
+        return block;
+}
+
+/*
+ * Frees the blocks mapped by an extent tree node and the nodes below
+ * it, and empties the node.
+ */
+static void
+s5_extent_free(s5fs_t *fs, s5_extent_header_t *hdr)
+{
+        s5_extent_t *e = S5_EXTENT_ENTRIES(hdr);
+        s5_extent_header_t *child;
+        pframe_t *pf;
+        uint32_t i, b;
+
+        for (i = 0; i < hdr->s5eh_nentries; i++) {
+                if (0 == hdr->s5eh_depth) {
+                        for (b = 0; b < e[i].s5e_len; b++)
+                                s5_free_block(fs, e[i].s5e_block + b);
+                        continue;
+                }
+
+                pframe_get(S5FS_TO_VMOBJ(fs), e[i].s5e_block, &pf);
+                KASSERT(pf && "because never fails for block_device vm_objects");
+                pframe_pin(pf);
+                child = (s5_extent_header_t *)pf->pf_addr;
+                if (S5_EXTENT_MAGIC == child->s5eh_magic
+                    && child->s5eh_depth == hdr->s5eh_depth - 1)
+                        s5_extent_free(fs, child);
+                else
+                        dbg(DBG_PRINT, "s5fs: leaking the blocks below bad extent "
+                            "tree node %u\n", e[i].s5e_block);
+                pframe_unpin(pf);
+                s5_free_block(fs, e[i].s5e_block);
+        }
+        hdr->s5eh_nentries = 0;
+}
+
+
+/*
+ * s5f_block_mutex protects the free block bitmap, s5s_nfree and
+ * s5f_alloc_hint (which s5_alloc_goal() reads without it, as it is only
+ * a hint), and s5f_inode_mutex the free inode list. Everything
+ * else about an inode is protected by the vn_lock of its vnode, which
+ * the vnode operations take (see s5fs.c) before any of these. Neither
+ * of these is held while taking the other.
+ */
+
+/*
+ * Locks the mutex for the free blocks
+ */
+static void
+lock_s5_blocks(s5fs_t *fs)
+{
+        kmutex_lock(&fs->s5f_block_mutex);
+}
+
+/*
+ * Unlocks the mutex for the free blocks
+ */
+static void
+unlock_s5_blocks(s5fs_t *fs)
+{
+        kmutex_unlock(&fs->s5f_block_mutex);
+}
+
+/*
+ * Locks the mutex for the free inodes
+ */
+static void
+lock_s5_inodes(s5fs_t *fs)
+{
+        kmutex_lock(&fs->s5f_inode_mutex);
+}
+
+/*
+ * Unlocks the mutex for the free inodes
+ */
+static void
+unlock_s5_inodes(s5fs_t *fs)
+{
+        kmutex_unlock(&fs->s5f_inode_mutex);
 }
 
 
@@ -105,13 +649,68 @@ unlock_s5(s5fs_t *fs)
  * use the vnode's pframe functions, which will eventually result in a
  * call to s5_seek_to_block().
  *
+ * The pages of directories are metadata: with a journal, pass each one
+ * to s5_journal_dirty_vnode() after dirtying it.
+ *
+ * A file with inline data (S5_INODE_INLINE) has no blocks to write to:
+ * before a write which would take it past S5_INLINE_SIZE bytes, move
+ * its data out with s5_inline_expand(); after one which does not, copy
+ * the page into the inode with s5_inline_update() right away, so that
+ * the change is journaled with the rest of the operation.
+ *
  * You will need pframe_dirty(), pframe_get(), memcpy().
  */
 int
 s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_write_file");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *pf;
+        size_t done, n;
+        int err = 0;
+
+        if ((inode->s5_flags & S5_INODE_INLINE) && 0 < len
+            && (size_t)seek + len > S5_INLINE_SIZE) {
+                if (0 > (err = s5_inline_expand(vnode)))
+                        return err;
+        }
+
+        for (done = 0; done < len; done += n) {
+                n = MIN(len - done, S5_BLOCK_SIZE - S5_DATA_OFFSET(seek + done));
+                if (0 > (err = pframe_get(&vnode->vn_mmobj,
+                                          S5_DATA_BLOCK(seek + done), &pf)))
+                        break;
+
+                /* Dirtying gets the page a block, or fails without
+                 * anything having been written to it */
+                pframe_pin(pf);
+                if (0 > (err = pframe_dirty(pf))
+                    || (S5_TYPE_DIR == inode->s5_type
+                        && !(inode->s5_flags & S5_INODE_INLINE)
+                        && 0 > (err = s5_journal_dirty_vnode(vnode, pf)))) {
+                        pframe_unpin(pf);
+                        break;
+                }
+                memcpy((char *)pf->pf_addr + S5_DATA_OFFSET(seek + done), bytes + done, n);
+                pframe_unpin(pf);
+        }
+
+        if (0 < done && (off_t)(seek + done) > vnode->vn_len) {
+                vnode->vn_len = seek + done;
+                inode->s5_size = vnode->vn_len;
+                s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+        }
+
+        /* The inode is journaled with the rest of the operation, not
+         * when the page is cleaned */
+        if (0 < done && (inode->s5_flags & S5_INODE_INLINE)) {
+                pframe_get(&vnode->vn_mmobj, 0, &pf);
+                KASSERT(pf && "because it has just been written");
+                s5_inline_update(vnode, pf->pf_addr);
+        }
+
+        if (0 == done && 0 > err)
+                return err;
+        return done;
 }
 
 /*
@@ -137,76 +736,606 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
 int
 s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_read_file");
+        pframe_t *pf;
+        size_t done, n;
+        int err;
+
+        if (seek >= vnode->vn_len)
+                return 0;
+        if (len > (size_t)(vnode->vn_len - seek))
+                len = vnode->vn_len - seek;
+
+        for (done = 0; done < len; done += n) {
+                if (0 > (err = pframe_get(&vnode->vn_mmobj,
+                                          S5_DATA_BLOCK(seek + done), &pf)))
+                        return done ? (int)done : err;
+                n = MIN(len - done, S5_BLOCK_SIZE - S5_DATA_OFFSET(seek + done));
+                memcpy(dest + done, (char *)pf->pf_addr + S5_DATA_OFFSET(seek + done), n);
+        }
+        return done;
+}
+
+/*
+ * Direct I/O (O_DIRECT) moves whole blocks straight between the disk
+ * and the caller's buffer, without copying them through the file's
+ * pages. The blocks of a batch are submitted together so that the disk
+ * scheduler can merge them into a few large transfers.
+ */
+
+/* The most blocks one batch transfers */
+#define S5_DIRECT_BATCH         32
+
+/*
+ * Like s5_seek_to_block(), also returning in *run how many blocks from
+ * the one returned on are known to follow it on disk: the rest of its
+ * extent, or just the one block for inodes without extents.
+ */
+static int
+s5_seek_to_run(vnode_t *vnode, off_t seekptr, int alloc, uint32_t *run)
+{
+        *run = 1;
+        if (!(VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_EXTENTS))
+                return s5_seek_to_block(vnode, seekptr, alloc);
+        if (alloc)
+                return s5_extent_alloc(vnode, S5_DATA_BLOCK(seekptr), run, 0);
+        return s5_extent_map(vnode, S5_DATA_BLOCK(seekptr), run);
+}
+
+typedef struct s5_direct_req {
+        blockdev_req_t   sdr_req;
+        pframe_t        *sdr_pf;       /* pinned user page, or NULL */
+} s5_direct_req_t;
+
+/*
+ * Finds a kernel address for the page of the buffer at addr, which
+ * disk DMA can use no matter which address space is current when the
+ * transfer starts. Kernel buffers are used as they are; for a user
+ * buffer the page behind it is looked up (and faulted in) through
+ * curproc's address space and pinned until s5_direct_put().
+ */
+static int
+s5_direct_get(char *addr, int forwrite, s5_direct_req_t *sdr, char **kaddr)
+{
+        vmarea_t *vma;
+        uint32_t vfn;
+        int err;
+
+        sdr->sdr_pf = NULL;
+        if ((uintptr_t) addr >= USER_MEM_HIGH) {
+                *kaddr = addr;
+                return 0;
+        }
+
+        vfn = ADDR_TO_PN(addr);
+        if (NULL == (vma = vmmap_lookup(curproc->p_vmmap, vfn))
+            || (forwrite && !(vma->vma_prot & PROT_WRITE)))
+                return -EFAULT;
+        if (0 > (err = pframe_lookup(vma->vma_obj, vfn - vma->vma_start + vma->vma_off,
+                                     forwrite, &sdr->sdr_pf)))
+                return err;
+        pframe_pin(sdr->sdr_pf);
+        *kaddr = sdr->sdr_pf->pf_addr;
+        return 0;
+}
+
+static void
+s5_direct_put(s5_direct_req_t *sdr, int dirty)
+{
+        if (NULL == sdr->sdr_pf)
+                return;
+        if (dirty)
+                pframe_dirty(sdr->sdr_pf);
+        pframe_unpin(sdr->sdr_pf);
+}
+
+/*
+ * Transfers up to nblocks whole blocks starting at the block-aligned
+ * seek directly, stopping early at blocks which have to go through the
+ * page cache: blocks whose page is resident (the cached copy may be
+ * newer than the disk, or would go stale) and sparse blocks being read.
+ * buf must be page aligned. Returns the number of bytes transferred,
+ * 0 if the first block has to go through the page cache, or -errno.
+ */
+static int
+s5_direct_batch(vnode_t *vnode, off_t seek, char *buf, size_t nblocks, int write)
+{
+        blockdev_t *bdev = VNODE_TO_S5FS(vnode)->s5f_bdev;
+        s5_direct_req_t *sdr;
+        char *kaddr;
+        size_t n, ndone, i;
+        uint32_t run = 0;
+        int block = 0, ret = 0, err;
+
+        KASSERT(0 == S5_DATA_OFFSET(seek) && PAGE_ALIGNED(buf));
+
+        /* Inline data only lives in the inode and its page */
+        if (VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_INLINE)
+                return 0;
+        if (nblocks > S5_DIRECT_BATCH)
+                nblocks = S5_DIRECT_BATCH;
+        if (NULL == (sdr = (s5_direct_req_t *)kmalloc(nblocks * sizeof(*sdr))))
+                return -ENOMEM;
+
+        for (n = 0; n < nblocks; n++, seek += S5_BLOCK_SIZE, buf += S5_BLOCK_SIZE) {
+                if (NULL != pframe_get_resident(&vnode->vn_mmobj, S5_DATA_BLOCK(seek)))
+                        break;
+                /* Writes allocate sparse blocks. The rest of an extent
+                 * needs no more lookups. */
+                if (0 < run) {
+                        block++;
+                } else if (0 >= (block = s5_seek_to_run(vnode, seek, write, &run))) {
+                        ret = block;
+                        break;
+                }
+                run--;
+                if (0 > (ret = s5_direct_get(buf, !write, &sdr[n], &kaddr)))
+                        break;
+                blockdev_req_init(&sdr[n].sdr_req, bdev, write, kaddr, block, 1,
+                                  NULL, NULL);
+                blockdev_submit(&sdr[n].sdr_req);
+        }
+
+        /* Everything submitted has to be waited for, even after an
+         * error, before the pages can be let go. Only the blocks before
+         * the first failed one count as transferred. */
+        ndone = n;
+        for (i = 0; i < n; i++) {
+                err = blockdev_wait(&sdr[i].sdr_req);
+                s5_direct_put(&sdr[i], !write && 0 == err);
+                if (0 > err && i < ndone) {
+                        ndone = i;
+                        ret = err;
+                }
+        }
+        kfree(sdr);
+
+        if (0 == ndone)
+                return ret;
+        if (0 > ret) {
+                dprintf("direct %s stopped after %u blocks: %d\n",
+                        (write ? "write" : "read"), ndone, ret);
+        }
+        return ndone * S5_BLOCK_SIZE;
+}
+
+/*
+ * Reads (write is false) or writes (write is true) len bytes of the
+ * given file starting at seek, like s5_read_file() and
+ * s5_write_file(), moving whole blocks directly between the disk and
+ * buf where possible (see s5_direct_batch()). Partial blocks at the
+ * head and tail, buffers which are not page aligned and blocks which
+ * must not bypass the page cache fall back to s5_read_file() and
+ * s5_write_file() a block at a time. buf may be a user address.
+ *
+ * Returns the number of bytes transferred, or -errno if nothing was.
+ */
+int
+s5_direct_io(vnode_t *vnode, off_t seek, char *buf, size_t len, int write)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        size_t done = 0, n;
+        int ret = 0;
+
+        if (!write) {
+                if (seek >= vnode->vn_len)
+                        return 0;
+                if (len > (size_t)(vnode->vn_len - seek))
+                        len = vnode->vn_len - seek;
+        }
+
+        while (done < len) {
+                n = len - done;
+                ret = 0;
+                if (0 == S5_DATA_OFFSET(seek + done) && S5_BLOCK_SIZE <= n
+                    && PAGE_ALIGNED(buf + done)) {
+                        ret = s5_direct_batch(vnode, seek + done, buf + done,
+                                               n / S5_BLOCK_SIZE, write);
+                }
+                if (0 == ret) {
+                        if (n > S5_BLOCK_SIZE - S5_DATA_OFFSET(seek + done))
+                                n = S5_BLOCK_SIZE - S5_DATA_OFFSET(seek + done);
+                        if (write)
+                                ret = s5_write_file(vnode, seek + done, buf + done, n);
+                        else
+                                ret = s5_read_file(vnode, seek + done, buf + done, n);
+                } else if (0 < ret && write && (off_t)(seek + done + ret) > vnode->vn_len) {
+                        /* The page cache path grows the file itself */
+                        vnode->vn_len = seek + done + ret;
+                        inode->s5_size = vnode->vn_len;
+                        s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+                }
+                if (0 >= ret)
+                        break;
+                done += ret;
+        }
+
+        if (0 == done && 0 > ret)
+                return ret;
+        return done;
+}
+
+/*
+ * Returns the first clear bit of a free bitmap block at or after start
+ * and before end, or -1 if there is none. Whole words of allocated
+ * blocks are skipped at once.
+ */
+static int
+s5_bitmap_find(const uint32_t *map, uint32_t start, uint32_t end)
+{
+        uint32_t i = start;
+
+        while (i < end) {
+                if (0 == i % 32 && 0xffffffff == map[i / 32]) {
+                        i += 32;
+                        continue;
+                }
+                if (!(map[i / 32] & (1U << (i % 32))))
+                        return i;
+                i++;
+        }
         return -1;
 }
 
 /*
- * Allocate a new disk-block off the block free list and return it. If
- * there are no free blocks, return -ENOSPC.
- *
- * This will not initialize the contents of an allocated block; these
- * contents are undefined.
- *
- * If the super block's s5s_nfree is 0, you need to refill 
- * s5s_free_blocks and reset s5s_nfree.  You need to read the contents 
- * of this page using the pframe system in order to obtain the next set of
- * free block numbers.
- *
- * Don't forget to dirty the appropriate blocks!
- *
- * You'll probably want to use lock_s5(), unlock_s5(), pframe_get(),
- * and s5_dirty_super()
+ * Allocate a new disk-block from the free block bitmap and return it.
+ * If there are no free blocks, return -ENOSPC.
+ *
+ * The first free block at or after goal is taken, wrapping around to
+ * the start of the disk, so that a block asked for right after another
+ * one usually ends up next to it. Blocks revoked by a journal transaction
+ * which is not committed yet (see s5_journal_revoke()) are passed over.
+ * The blocks reserved for dirty pages (see s5_reserve_block()) are not
+ * free for this.
+ *
+ * This will not initialize the contents of an allocated block; these
+ * contents are undefined.
+ */
+static int
+s5_alloc_block(s5fs_t *fs, uint32_t goal)
+{
+        uint32_t count = 1;
+
+        return s5_alloc_blocks(fs, goal, &count, NULL);
+}
+
+/*
+ * Like s5_alloc_block(), but allocates up to *count blocks following
+ * the one returned, stopping at the first one in use (or at the end of
+ * its bitmap block), and puts the number allocated in *count. With
+ * vnode not NULL, the blocks are taken from the ones reserved for its
+ * dirty pages.
+ */
+static int
+s5_alloc_blocks(s5fs_t *fs, uint32_t goal, uint32_t *count, vnode_t *vnode)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t i, n, start, end, got;
+        pframe_t *pf;
+        uint32_t *map;
+        int bit, ret;
+
+        lock_s5_blocks(fs);
+
+        if (NULL != vnode) {
+                KASSERT(*count <= fs->s5f_ireserved[vnode->vn_vno]);
+        } else if (s->s5s_nfree <= s5_nheld(fs)) {
+                unlock_s5_blocks(fs);
+                return -ENOSPC;
+        }
+        if (goal >= s->s5s_nblocks)
+                goal = 0;
+
+        /* From the goal to the end of its bitmap block, every other
+         * bitmap block, and back in the goal's block up to the goal */
+        for (n = 0; n <= s->s5s_bitmap_nblocks; n++) {
+                i = (goal / S5_BITS_PER_BLOCK + n) % s->s5s_bitmap_nblocks;
+                start = (0 == n) ? goal % S5_BITS_PER_BLOCK : 0;
+                end = MIN(S5_BITS_PER_BLOCK, s->s5s_nblocks - i * S5_BITS_PER_BLOCK);
+                if (n == s->s5s_bitmap_nblocks)
+                        end = goal % S5_BITS_PER_BLOCK;
+                if (start >= end)
+                        continue;
+
+                if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(fs), s->s5s_bitmap_block + i, &pf))) {
+                        unlock_s5_blocks(fs);
+                        return ret;
+                }
+                map = (uint32_t *)pf->pf_addr;
+                /* Blocks freed by a transaction which is not committed
+                 * yet can not be reused */
+                while (0 <= (bit = s5_bitmap_find(map, start, end))
+                       && s5_journal_revoked(fs, i * S5_BITS_PER_BLOCK + bit))
+                        start = bit + 1;
+                if (0 > bit)
+                        continue;
+
+                ret = i * S5_BITS_PER_BLOCK + bit;
+                for (got = 0; got < *count && (uint32_t) bit + got < end; got++) {
+                        if ((map[(bit + got) / 32] & (1U << ((bit + got) % 32)))
+                            || (0 < got && s5_journal_revoked(fs, ret + got)))
+                                break;
+                        map[(bit + got) / 32] |= 1U << ((bit + got) % 32);
+                }
+                pframe_dirty(pf);
+                s5_journal_dirty(fs, pf);
+                s->s5s_nfree -= got;
+                s5_dirty_super(fs);
+                if (NULL != vnode) {
+                        fs->s5f_nreserved -= got;
+                        fs->s5f_ireserved[vnode->vn_vno] -= got;
+                }
+
+                *count = got;
+                fs->s5f_alloc_hint = ret + got;
+                unlock_s5_blocks(fs);
+                return ret;
+        }
+
+        dbg(DBG_PRINT, "s5fs: %u blocks should be free, but the bitmap is full\n",
+            s->s5s_nfree);
+        unlock_s5_blocks(fs);
+        return -ENOSPC;
+}
+
+
+/*
+ * Given a filesystem and a block number, frees the given block in the
+ * filesystem.
+ *
+ * This function may potentially block.
+ *
+ * The caller is responsible for ensuring that the block being placed on
+ * the free list is actually free and is not resident.
+ *
+ * With a journal, a copy of the block it may hold is revoked.
+ */
+static void
+s5_free_block(s5fs_t *fs, int blockno)
+{
+        s5_super_t *s = fs->s5f_super;
+        pframe_t *pf = NULL;
+        uint32_t *word;
+
+        lock_s5_blocks(fs);
+
+        KASSERT(0 < blockno && (uint32_t) blockno < s->s5s_nblocks);
+
+        pframe_get(S5FS_TO_VMOBJ(fs), s->s5s_bitmap_block + blockno / S5_BITS_PER_BLOCK,
+                   &pf);
+        KASSERT(pf && "because never fails for block_device vm_objects");
+
+        word = (uint32_t *)pf->pf_addr + (blockno % S5_BITS_PER_BLOCK) / 32;
+        KASSERT(*word & (1U << (blockno % 32)) && "freeing a free block");
+        *word &= ~(1U << (blockno % 32));
+        pframe_dirty(pf);
+        s5_journal_dirty(fs, pf);
+        s5_journal_revoke(fs, blockno);
+
+        s->s5s_nfree++;
+        s5_dirty_super(fs);
+
+        unlock_s5_blocks(fs);
+}
+
+/*
+ * Delayed allocation. Dirtying a page of a data file which has no block
+ * yet only reserves a free block for it; the block is allocated when
+ * the page is written back, along with the blocks of the dirty pages
+ * after it which have none either, which can then all be allocated as
+ * one run under the block lock instead of one at a time as the file
+ * grows, and be mapped by one extent.
+ *
+ * Every dirty page of a data file without a block holds a reservation,
+ * counted per inode in s5f_ireserved and in all in s5f_nreserved.
+ * Reservations also hold back some free blocks for the indirect and
+ * extent tree blocks mapping the data blocks may take; only allocations
+ * at writeback, made with s5f_delalloc_mutex held, use those.
+ */
+
+/* The most blocks allocated together at writeback */
+#define S5_DELALLOC_MAX_RUN     S5_EXTENTS_PER_BLOCK
+
+/* The blocks held back for mapping n reserved blocks: an estimate, as
+ * the tree blocks needed depend on how fragmented the free space is */
+#define S5_DELALLOC_META(n)     ((n) ? (n) / S5_EXTENTS_PER_BLOCK + S5_EXTENT_MAX_DEPTH : 0)
+
+/* The free blocks not available to s5_alloc_block(), with the block
+ * lock held */
+static uint32_t
+s5_nheld(s5fs_t *fs)
+{
+        if (curthr == fs->s5f_delalloc_mutex.km_holder)
+                return fs->s5f_nreserved;
+        return fs->s5f_nreserved + S5_DELALLOC_META(fs->s5f_nreserved);
+}
+
+/*
+ * Reserves a free block for a page of the data file vnode, which is
+ * about to be dirtied and has no block. Returns 0 on success, or
+ * -ENOSPC.
+ */
+int
+s5_reserve_block(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        uint32_t n;
+
+        lock_s5_blocks(fs);
+        n = fs->s5f_nreserved + 1;
+        if (fs->s5f_super->s5s_nfree < n + S5_DELALLOC_META(n)) {
+                unlock_s5_blocks(fs);
+                return -ENOSPC;
+        }
+        fs->s5f_nreserved = n;
+        fs->s5f_ireserved[vnode->vn_vno]++;
+        unlock_s5_blocks(fs);
+        return 0;
+}
+
+/* Gives back n blocks reserved for the pages of inode ino */
+static void
+s5_unreserve(s5fs_t *fs, uint32_t ino, uint32_t n)
+{
+        lock_s5_blocks(fs);
+        KASSERT(n <= fs->s5f_ireserved[ino] && n <= fs->s5f_nreserved);
+        fs->s5f_ireserved[ino] -= n;
+        fs->s5f_nreserved -= n;
+        unlock_s5_blocks(fs);
+}
+
+/*
+ * Allocates the block reserved for the page at seekptr of the data file
+ * vnode, which is being written back, and returns it; or returns
+ * -errno, in which case the page keeps its reservation. Called instead
+ * of s5_seek_to_block() when that finds no block.
+ */
+int
+s5_alloc_delayed(vnode_t *vnode, off_t seekptr)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        uint32_t blocknum = S5_DATA_BLOCK(seekptr), n, i, got;
+        pframe_t *pf;
+        int block, err;
+
+        s5_journal_start(fs);
+        kmutex_lock(&fs->s5f_delalloc_mutex);
+
+        /* Another thread may have mapped it along with its own page */
+        if (0 != (block = s5_block_map(vnode, blocknum, 0, 0)))
+                goto out;
+        KASSERT(0 < fs->s5f_ireserved[vnode->vn_vno]);
+
+        for (n = 1; n < S5_DELALLOC_MAX_RUN && n < fs->s5f_ireserved[vnode->vn_vno]; n++) {
+                if (NULL == (pf = pframe_get_resident(&vnode->vn_mmobj, blocknum + n))
+                    || !pframe_is_dirty(pf) || 0 != s5_block_map(vnode, blocknum + n, 0, 0))
+                        break;
+        }
+
+        got = n;
+        if (0 > (block = s5_alloc_blocks(fs, s5_alloc_goal(vnode, blocknum), &got,
+                                         vnode)))
+                goto out;
+        for (i = 0; i < got; i++) {
+                if (0 > (err = s5_block_map(vnode, blocknum + i, 1, block + i))) {
+                        /* The pages left keep their reservations */
+                        dprintf("mapping delayed block %u of inode %u: %d\n",
+                                blocknum + i, vnode->vn_vno, err);
+                        lock_s5_blocks(fs);
+                        fs->s5f_nreserved += got - i;
+                        fs->s5f_ireserved[vnode->vn_vno] += got - i;
+                        unlock_s5_blocks(fs);
+                        for (n = i; n < got; n++)
+                                s5_free_block(fs, block + n);
+                        if (0 == i)
+                                block = err;
+                        break;
+                }
+        }
+        dprintf("allocated %u delayed blocks at block %d for inode %u\n",
+                i, block, vnode->vn_vno);
+
+out:
+        kmutex_unlock(&fs->s5f_delalloc_mutex);
+        s5_journal_stop(fs);
+        return block;
+}
+
+/*
+ * Inline data (see s5fs.h). The data of such a file lives in its page 0
+ * like any other, filled from and written back to the inode instead of
+ * a block.
  */
-static int
-s5_alloc_block(s5fs_t *fs)
+
+/*
+ * Fills the page at offset of vnode, which has S5_INODE_INLINE set,
+ * from the inode, which is all there is for page 0; the others are
+ * past the end of the file.
+ */
+void
+s5_inline_fill(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_alloc_block");
-        return -1;
-}
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+
+        KASSERT(inode->s5_flags & S5_INODE_INLINE);
+        KASSERT(inode->s5_size <= S5_INLINE_SIZE);
 
+        memset(pagebuf, 0, S5_BLOCK_SIZE);
+        if (0 == S5_DATA_BLOCK(offset))
+                memcpy(pagebuf, inode->s5_inline_data, inode->s5_size);
+}
 
 /*
- * Given a filesystem and a block number, frees the given block in the
- * filesystem.
- *
- * This function may potentially block.
- *
- * The caller is responsible for ensuring that the block being placed on
- * the free list is actually free and is not resident.
+ * Copies the first s5_size bytes of page 0 of vnode, which has
+ * S5_INODE_INLINE set, into the inode, and dirties the inode.
  */
-static void
-s5_free_block(s5fs_t *fs, int blockno)
+void
+s5_inline_update(vnode_t *vnode, const void *pagebuf)
 {
-        s5_super_t *s = fs->s5f_super;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
 
+        KASSERT(inode->s5_flags & S5_INODE_INLINE);
+        KASSERT(inode->s5_size <= S5_INLINE_SIZE);
 
-        lock_s5(fs);
+        s5_journal_start(fs);
+        memcpy(inode->s5_inline_data, pagebuf, inode->s5_size);
+        memset(inode->s5_inline_data + inode->s5_size, 0, S5_INLINE_SIZE - inode->s5_size);
+        s5_dirty_inode(fs, inode);
+        s5_journal_stop(fs);
+}
 
-        KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
+/*
+ * Moves the inline data of vnode into a block of its own, mapped like
+ * the blocks of files made without S5_FEATURE_INLINE_DATA. The data
+ * stays in page 0, which gets a block (directories) or a reservation
+ * for one (data files) and is written back to it. Returns 0 on
+ * success, or -errno, leaving the data inline.
+ */
+int
+s5_inline_expand(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        char saved[S5_INLINE_SIZE];
+        pframe_t *pf;
+        int err;
 
-        if ((S5_NBLKS_PER_FNODE - 1) == s->s5s_nfree) {
-                /* get the pframe where we will store the free block nums */
-                pframe_t *prev_free_blocks = NULL;
-                KASSERT(fs->s5f_bdev);
-                pframe_get(&fs->s5f_bdev->bd_mmobj, blockno, &prev_free_blocks);
-                KASSERT(prev_free_blocks->pf_addr);
+        KASSERT(inode->s5_flags & S5_INODE_INLINE);
 
-                /* copy from the superblock to the new block on disk */
-                memcpy(prev_free_blocks->pf_addr, (void *)(s->s5s_free_blocks),
-                       S5_NBLKS_PER_FNODE * sizeof(int));
-                pframe_dirty(prev_free_blocks);
+        if (0 > (err = pframe_get(&vnode->vn_mmobj, 0, &pf)))
+                return err;
+        pframe_pin(pf);
+        memcpy(saved, inode->s5_inline_data, S5_INLINE_SIZE);
 
-                /* reset s->s5s_nfree and s->s5s_free_blocks */
-                s->s5s_nfree = 0;
-                s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = blockno;
-        } else {
-                s->s5s_free_blocks[s->s5s_nfree++] = blockno;
+        s5_journal_start(fs);
+        memset(&inode->s5_map, 0, sizeof(inode->s5_map));
+        inode->s5_flags &= ~S5_INODE_INLINE;
+        if (fs->s5f_super->s5s_features & S5_FEATURE_EXTENTS) {
+                inode->s5_flags |= S5_INODE_EXTENTS;
+                s5_extent_init(&inode->s5_extent_hdr, S5_EXTENTS_PER_INODE, 0);
         }
 
-        s5_dirty_super(fs);
+        /* A dirty page would not go through dirtypage again */
+        if (!pframe_is_dirty(pf))
+                err = pframe_dirty(pf);
+        else if (S5_TYPE_DIR == inode->s5_type)
+                err = s5_seek_to_block(vnode, 0, 1);
+        else
+                err = s5_reserve_block(vnode);
+        if (0 <= err && S5_TYPE_DIR == inode->s5_type)
+                err = s5_journal_dirty_vnode(vnode, pf);
+
+        if (0 > err) {
+                inode->s5_flags &= ~S5_INODE_EXTENTS;
+                inode->s5_flags |= S5_INODE_INLINE;
+                memcpy(inode->s5_inline_data, saved, S5_INLINE_SIZE);
+        }
+        s5_dirty_inode(fs, inode);
+        s5_journal_stop(fs);
+        pframe_unpin(pf);
 
-        unlock_s5(fs);
+        dprintf("moved the inline data of inode %u out: %d\n", inode->s5_number, err);
+        return (0 > err) ? err : 0;
 }
 
 /*
@@ -229,10 +1358,10 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
                 || (S5_TYPE_BLK == type));
 
 
-        lock_s5(s5fs);
+        lock_s5_inodes(s5fs);
 
         if (s5fs->s5f_super->s5s_free_inode == (uint32_t) -1) {
-                unlock_s5(s5fs);
+                unlock_s5_inodes(s5fs);
                 return -ENOSPC;
         }
 
@@ -258,21 +1387,59 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
         /* init the newly-allocated inode: */
         inode->s5_size = 0;
         inode->s5_type = type;
+        inode->s5_flags = 0;
         inode->s5_linkcount = 0;
-        memset(inode->s5_direct_blocks, 0, S5_NDIRECT_BLOCKS * sizeof(int));
-        if ((S5_TYPE_CHR == type) || (S5_TYPE_BLK == type))
+        memset(&inode->s5_map, 0, sizeof(inode->s5_map));
+        if ((S5_TYPE_CHR == type) || (S5_TYPE_BLK == type)) {
                 inode->s5_indirect_block = devid;
-        else
-                inode->s5_indirect_block = 0;
+        } else if (s5fs->s5f_super->s5s_features & S5_FEATURE_INLINE_DATA) {
+                inode->s5_flags |= S5_INODE_INLINE;
+        } else if (s5fs->s5f_super->s5s_features & S5_FEATURE_EXTENTS) {
+                inode->s5_flags |= S5_INODE_EXTENTS;
+                s5_extent_init(&inode->s5_extent_hdr, S5_EXTENTS_PER_INODE, 0);
+        }
 
-        s5_dirty_inode(s5fs, inode);
+        /* Free inodes are not cached (see s5fs_icache.c), so this one
+         * is read in from its block when its vnode is */
+        s5_dirty_inode_block(s5fs, ret);
 
-        unlock_s5(s5fs);
+        unlock_s5_inodes(s5fs);
 
         return ret;
 }
 
 
+/*
+ * Frees an indirect block and the blocks below it. depth is 1 for a
+ * single indirect block, whose entries are data blocks, 2 for a double
+ * and 3 for a triple indirect block.
+ */
+static void
+s5_free_indirect(s5fs_t *fs, uint32_t block, int depth)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp);
+        KASSERT(ibp && "because never fails for block_device vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                KASSERT(b[i] != block);
+                if (0 == b[i])
+                        continue;
+                if (1 < depth)
+                        s5_free_indirect(fs, b[i], depth - 1);
+                else
+                        s5_free_block(fs, b[i]);
+        }
+
+        pframe_unpin(ibp);
+        s5_free_block(fs, block);
+}
+
 /*
  * Free an inode by freeing its disk blocks and putting it back on the
  * inode free list.
@@ -280,7 +1447,8 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
  * You should also reset the inode to an unused state (eg. zero-ing its
  * list of blocks and setting its type to S5_FREE_TYPE).
  *
- * Don't forget to free the indirect block if it exists.
+ * Don't forget to free the indirect blocks if they exist, or the extent
+ * tree.
  *
  * You probably want to use s5_free_block().
  */
@@ -296,6 +1464,19 @@ s5_free_inode(vnode_t *vnode)
                 || (S5_TYPE_CHR == inode->s5_type)
                 || (S5_TYPE_BLK == inode->s5_type));
 
+        /* Its dirty pages went away without being written back */
+        s5_unreserve(fs, inode->s5_number, fs->s5f_ireserved[inode->s5_number]);
+
+        if (inode->s5_flags & S5_INODE_INLINE) {
+                memset(&inode->s5_map, 0, sizeof(inode->s5_map));
+                goto freed;
+        }
+        if (inode->s5_flags & S5_INODE_EXTENTS) {
+                s5_extent_free(fs, &inode->s5_extent_hdr);
+                memset(&inode->s5_map, 0, sizeof(inode->s5_map));
+                goto freed;
+        }
+
         /* free any direct blocks */
         for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
                 if (inode->s5_direct_blocks[i]) {
@@ -307,45 +1488,488 @@ s5_free_inode(vnode_t *vnode)
                 }
         }
 
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))
-            && inode->s5_indirect_block) {
-                pframe_t *ibp;
-                uint32_t *b;
-
-                pframe_get(S5FS_TO_VMOBJ(fs),
-                           (unsigned)inode->s5_indirect_block,
-                           &ibp);
-                KASSERT(ibp
-                        && "because never fails for block_device "
-                        "vm_objects");
-                pframe_pin(ibp);
-
-                b = (uint32_t *)(ibp->pf_addr);
-                for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-                        KASSERT(b[i] != inode->s5_indirect_block);
-                        if (b[i])
-                                s5_free_block(fs, b[i]);
-                }
-
-                pframe_unpin(ibp);
-
-                s5_free_block(fs, inode->s5_indirect_block);
+        if ((S5_TYPE_DATA == inode->s5_type)
+            || (S5_TYPE_DIR == inode->s5_type)) {
+                if (inode->s5_indirect_block)
+                        s5_free_indirect(fs, inode->s5_indirect_block, 1);
+                if (inode->s5_dindirect_block)
+                        s5_free_indirect(fs, inode->s5_dindirect_block, 2);
+                if (inode->s5_tindirect_block)
+                        s5_free_indirect(fs, inode->s5_tindirect_block, 3);
+                inode->s5_dindirect_block = 0;
+                inode->s5_tindirect_block = 0;
         }
 
         inode->s5_indirect_block = 0;
+freed:
         inode->s5_type = S5_TYPE_FREE;
-        s5_dirty_inode(fs, inode);
+        inode->s5_flags = 0;
 
-        lock_s5(fs);
+        /* s5_alloc_inode() takes inodes from their blocks, so this one
+         * is written back and leaves the cache before it can */
+        lock_s5_inodes(fs);
         inode->s5_next_free = fs->s5f_super->s5s_free_inode;
         fs->s5f_super->s5s_free_inode = inode->s5_number;
-        unlock_s5(fs);
+        s5_icache_evict(fs, inode);
+        unlock_s5_inodes(fs);
 
-        s5_dirty_inode(fs, inode);
         s5_dirty_super(fs);
 }
 
+/*
+ * The hash index of large directories (see s5fs.h). It only speeds up
+ * finding entries, which stay where linear readers expect them, so an
+ * index which can not be updated (its root is full, or a block can not
+ * be allocated) is dropped, and the directory is searched linearly
+ * until it is indexed again. The blocks of a dropped index stay with
+ * the directory to be reused.
+ */
+
+/* FNV-1a */
+static uint32_t
+s5_dindex_hash(const char *name, size_t namelen)
+{
+        uint32_t hash = 2166136261U;
+        size_t i;
+
+        for (i = 0; i < namelen; i++) {
+                hash ^= (uint8_t)name[i];
+                hash *= 16777619;
+        }
+        return hash;
+}
+
+/*
+ * Gets index block i of dir, which should be a node of the given
+ * depth, and pins it. Unpin it with pframe_unpin().
+ */
+static int
+s5_dindex_get(vnode_t *dir, uint32_t i, int depth, s5_dindex_header_t **hdr,
+              pframe_t **pf)
+{
+        int err;
+
+        if (0 > (err = pframe_get(&dir->vn_mmobj, S5_DINDEX_BLOCK + i, pf)))
+                return err;
+        *hdr = (s5_dindex_header_t *)(*pf)->pf_addr;
+        if (S5_DINDEX_MAGIC != (*hdr)->s5dh_magic || depth != (*hdr)->s5dh_depth
+            || (*hdr)->s5dh_nentries > S5_DINDEX_ENTRIES_PER_BLOCK
+            || (depth && (0 == (*hdr)->s5dh_nentries
+                          || (*hdr)->s5dh_nblocks > S5_DINDEX_ENTRIES_PER_BLOCK + 1))) {
+                dbg(DBG_PRINT, "s5fs: directory %u has a bad index block %u\n",
+                    VNODE_TO_S5INODE(dir)->s5_number, i);
+                return -EIO;
+        }
+        pframe_pin(*pf);
+        return 0;
+}
+
+/* Like s5_dindex_get(), for a new, empty index block */
+static int
+s5_dindex_new(vnode_t *dir, uint32_t i, int depth, s5_dindex_header_t **hdr,
+              pframe_t **pf)
+{
+        int err;
+
+        if (0 > (err = pframe_get(&dir->vn_mmobj, S5_DINDEX_BLOCK + i, pf)))
+                return err;
+        pframe_pin(*pf);
+        if (0 > (err = pframe_dirty(*pf))
+            || 0 > (err = s5_journal_dirty_vnode(dir, *pf))) {
+                pframe_unpin(*pf);
+                return err;
+        }
+        *hdr = (s5_dindex_header_t *)(*pf)->pf_addr;
+        (*hdr)->s5dh_magic = S5_DINDEX_MAGIC;
+        (*hdr)->s5dh_nentries = 0;
+        (*hdr)->s5dh_depth = depth;
+        (*hdr)->s5dh_nblocks = 0;
+        return 0;
+}
+
+/*
+ * Returns the position of the first entry of an index block with a
+ * hash above the given one if after is set, or not below it if it is
+ * not.
+ */
+static int
+s5_dindex_search(s5_dindex_header_t *hdr, uint32_t hash, int after)
+{
+        s5_dindex_entry_t *ent = S5_DINDEX_ENTRIES(hdr);
+        int lo = 0, hi = hdr->s5dh_nentries, mid;
+
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (ent[mid].s5de_hash < hash
+                    || (after && ent[mid].s5de_hash == hash))
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+/* Copies the entry in slot of dir into *dirent */
+static int
+s5_dindex_dirent(vnode_t *dir, uint32_t slot, s5_dirent_t *dirent)
+{
+        pframe_t *pf;
+        int err;
+
+        if (slot >= VNODE_TO_S5INODE(dir)->s5_size / sizeof(s5_dirent_t)) {
+                dbg(DBG_PRINT, "s5fs: index of directory %u points past its end\n",
+                    VNODE_TO_S5INODE(dir)->s5_number);
+                return -EIO;
+        }
+        if (0 > (err = pframe_get(&dir->vn_mmobj, slot / S5_DIRENTS_PER_BLOCK, &pf)))
+                return err;
+        memcpy(dirent, (s5_dirent_t *)pf->pf_addr + slot % S5_DIRENTS_PER_BLOCK,
+               sizeof(*dirent));
+        dirent->s5d_name[S5_NAME_LEN - 1] = '\0';
+        return 0;
+}
+
+/*
+ * Finds the leaf entry with the given hash for the directory entry
+ * named name, or if name is NULL, for the one in slot. Returns 0 with
+ * the leaf pinned in *leafpf and the position of the entry in *pos,
+ * -ENOENT if there is no such entry, or -errno.
+ */
+static int
+s5_dindex_find(vnode_t *dir, uint32_t hash, const char *name, size_t namelen,
+               uint32_t slot, pframe_t **leafpf, int *pos)
+{
+        s5_dindex_header_t *root, *leaf;
+        s5_dindex_entry_t *rent, *lent;
+        pframe_t *rootpf;
+        s5_dirent_t d;
+        int i, j, last, err;
+
+        if (0 > (err = s5_dindex_get(dir, 0, 1, &root, &rootpf)))
+                return err;
+        rent = S5_DINDEX_ENTRIES(root);
+
+        /* The leaf before the first one keyed with the hash can end with
+         * entries with the hash */
+        err = -ENOENT;
+        for (i = MAX(0, s5_dindex_search(root, hash, 0) - 1);
+             i < root->s5dh_nentries && rent[i].s5de_hash <= hash; i++) {
+                if (0 == rent[i].s5de_value
+                    || rent[i].s5de_value >= root->s5dh_nblocks) {
+                        err = -EIO;
+                        break;
+                }
+                if (0 > (err = s5_dindex_get(dir, rent[i].s5de_value, 0,
+                                             &leaf, leafpf)))
+                        break;
+
+                lent = S5_DINDEX_ENTRIES(leaf);
+                for (j = s5_dindex_search(leaf, hash, 0);
+                     j < leaf->s5dh_nentries && lent[j].s5de_hash == hash; j++) {
+                        if (NULL == name) {
+                                if (lent[j].s5de_value == slot)
+                                        goto found;
+                        } else if (0 > (err = s5_dindex_dirent(dir, lent[j].s5de_value,
+                                                               &d))) {
+                                pframe_unpin(*leafpf);
+                                goto out;
+                        } else if (name_match(d.s5d_name, name, namelen)) {
+                                goto found;
+                        }
+                }
+                last = (j < leaf->s5dh_nentries);
+                pframe_unpin(*leafpf);
+                err = -ENOENT;
+                if (last)
+                        break;
+        }
+out:
+        pframe_unpin(rootpf);
+        return err;
+
+found:
+        *pos = j;
+        pframe_unpin(rootpf);
+        return 0;
+}
+
+/* Adds hash -> slot to the index of dir, splitting the leaf if it is full */
+static int
+s5_dindex_insert(vnode_t *dir, uint32_t hash, uint32_t slot)
+{
+        s5_dindex_header_t *root, *leaf, *new;
+        s5_dindex_entry_t *rent, *lent;
+        pframe_t *rootpf, *leafpf, *newpf;
+        int i, j, mid, err;
+
+        if (0 > (err = s5_dindex_get(dir, 0, 1, &root, &rootpf)))
+                return err;
+        rent = S5_DINDEX_ENTRIES(root);
+
+        /* The first key is 0, so some leaf is keyed at or below the hash */
+        i = MAX(0, s5_dindex_search(root, hash, 1) - 1);
+        if (0 == rent[i].s5de_value || rent[i].s5de_value >= root->s5dh_nblocks) {
+                err = -EIO;
+                goto out_root;
+        }
+        if (0 > (err = s5_dindex_get(dir, rent[i].s5de_value, 0, &leaf, &leafpf)))
+                goto out_root;
+        if (0 > (err = pframe_dirty(leafpf))
+            || 0 > (err = s5_journal_dirty_vnode(dir, leafpf)))
+                goto out_leaf;
+
+        if (S5_DINDEX_ENTRIES_PER_BLOCK == leaf->s5dh_nentries) {
+                /* Move the upper half of the leaf into a new one after it */
+                if (S5_DINDEX_ENTRIES_PER_BLOCK == root->s5dh_nentries) {
+                        err = -ENOSPC;
+                        goto out_leaf;
+                }
+                if (0 > (err = pframe_dirty(rootpf))
+                    || 0 > (err = s5_journal_dirty_vnode(dir, rootpf))
+                    || 0 > (err = s5_dindex_new(dir, root->s5dh_nblocks, 0,
+                                                &new, &newpf)))
+                        goto out_leaf;
+
+                mid = leaf->s5dh_nentries / 2;
+                memcpy(S5_DINDEX_ENTRIES(new), S5_DINDEX_ENTRIES(leaf) + mid,
+                       (leaf->s5dh_nentries - mid) * sizeof(s5_dindex_entry_t));
+                new->s5dh_nentries = leaf->s5dh_nentries - mid;
+                leaf->s5dh_nentries = mid;
+
+                for (j = root->s5dh_nentries; j > i + 1; j--)
+                        rent[j] = rent[j - 1];
+                rent[i + 1].s5de_hash = S5_DINDEX_ENTRIES(new)[0].s5de_hash;
+                rent[i + 1].s5de_value = root->s5dh_nblocks;
+                root->s5dh_nentries++;
+                root->s5dh_nblocks++;
+
+                if (hash >= rent[i + 1].s5de_hash) {
+                        pframe_unpin(leafpf);
+                        leaf = new;
+                        leafpf = newpf;
+                } else {
+                        pframe_unpin(newpf);
+                }
+        }
+
+        lent = S5_DINDEX_ENTRIES(leaf);
+        for (j = leaf->s5dh_nentries, mid = s5_dindex_search(leaf, hash, 1);
+             j > mid; j--)
+                lent[j] = lent[j - 1];
+        lent[mid].s5de_hash = hash;
+        lent[mid].s5de_value = slot;
+        leaf->s5dh_nentries++;
+
+out_leaf:
+        pframe_unpin(leafpf);
+out_root:
+        pframe_unpin(rootpf);
+        return err;
+}
+
+/* Indexes all the entries of dir, which has no index */
+static int
+s5_dindex_build(vnode_t *dir)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(dir);
+        s5_dindex_header_t *root, *leaf;
+        pframe_t *rootpf, *leafpf;
+        s5_dirent_t d;
+        uint32_t slot;
+        int err;
+
+        if (0 > (err = s5_dindex_new(dir, 0, 1, &root, &rootpf)))
+                return err;
+        if (0 > (err = s5_dindex_new(dir, 1, 0, &leaf, &leafpf))) {
+                pframe_unpin(rootpf);
+                return err;
+        }
+        S5_DINDEX_ENTRIES(root)[0].s5de_hash = 0;
+        S5_DINDEX_ENTRIES(root)[0].s5de_value = 1;
+        root->s5dh_nentries = 1;
+        root->s5dh_nblocks = 2;
+        pframe_unpin(leafpf);
+        pframe_unpin(rootpf);
+
+        for (slot = 0; slot < inode->s5_size / sizeof(s5_dirent_t); slot++) {
+                if (0 > (err = s5_dindex_dirent(dir, slot, &d)))
+                        return err;
+                if ('\0' == d.s5d_name[0])
+                        continue;
+                if (0 > (err = s5_dindex_insert(dir, s5_dindex_hash(d.s5d_name,
+                                                                    strlen(d.s5d_name)),
+                                                slot)))
+                        return err;
+        }
+
+        inode->s5_flags |= S5_INODE_INDEXED;
+        s5_dirty_inode(VNODE_TO_S5FS(dir), inode);
+        return 0;
+}
+
+/*
+ * Stops using the index of dir, which could not be built or updated.
+ * Building it again would most likely fail the same way after going
+ * through every entry, so it is not tried again until the directory
+ * is small enough to do without one.
+ */
+static void
+s5_dindex_drop(vnode_t *dir, int err)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(dir);
+
+        dprintf("dropping the index of directory %u: %d\n", inode->s5_number, err);
+        inode->s5_flags &= ~S5_INODE_INDEXED;
+        inode->s5_flags |= S5_INODE_NOINDEX;
+        s5_dirty_inode(VNODE_TO_S5FS(dir), inode);
+}
+
+/*
+ * Looks name up in the index of dir, which must have S5_INODE_INDEXED
+ * set. Returns the inode number of the entry, and puts its slot in
+ * *slot if slot is not NULL; or returns -ENOENT if there is no such
+ * entry, or -errno.
+ */
+int
+s5_dindex_lookup(vnode_t *dir, const char *name, size_t namelen, uint32_t *slot)
+{
+        s5_dindex_entry_t *ent;
+        s5_dirent_t d;
+        pframe_t *pf;
+        int pos, err;
+
+        KASSERT(VNODE_TO_S5INODE(dir)->s5_flags & S5_INODE_INDEXED);
+
+        if (0 > (err = s5_dindex_find(dir, s5_dindex_hash(name, namelen),
+                                      name, namelen, 0, &pf, &pos)))
+                return err;
+        ent = S5_DINDEX_ENTRIES(pf->pf_addr) + pos;
+        if (NULL != slot)
+                *slot = ent->s5de_value;
+        err = s5_dindex_dirent(dir, ent->s5de_value, &d);
+        pframe_unpin(pf);
+
+        return err ? err : (int)d.s5d_inode;
+}
+
+/*
+ * Adds the entry named name, just written to slot, to the index of
+ * dir. If dir has no index, it is indexed (new entry included) once it
+ * has more than S5_DINDEX_MIN_DIRENTS entries, if the file system has
+ * S5_FEATURE_DIR_INDEX and dir does not have S5_INODE_NOINDEX set.
+ */
+void
+s5_dindex_add(vnode_t *dir, const char *name, size_t namelen, uint32_t slot)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(dir);
+        int err;
+
+        /* The entries must never reach the index */
+        KASSERT(slot < S5_DINDEX_BLOCK * S5_DIRENTS_PER_BLOCK);
+
+        if (!(inode->s5_flags & S5_INODE_INDEXED)) {
+                if (!(VNODE_TO_S5FS(dir)->s5f_super->s5s_features & S5_FEATURE_DIR_INDEX)
+                    || (inode->s5_flags & S5_INODE_NOINDEX)
+                    || inode->s5_size / sizeof(s5_dirent_t) <= S5_DINDEX_MIN_DIRENTS)
+                        return;
+                if (0 > (err = s5_dindex_build(dir)))
+                        s5_dindex_drop(dir, err);
+                return;
+        }
+
+        if (0 > (err = s5_dindex_insert(dir, s5_dindex_hash(name, namelen), slot)))
+                s5_dindex_drop(dir, err);
+}
+
+/*
+ * Removes the entry named name in slot from the index of dir, if it
+ * has one.
+ */
+void
+s5_dindex_remove(vnode_t *dir, const char *name, size_t namelen, uint32_t slot)
+{
+        s5_dindex_header_t *leaf;
+        s5_dindex_entry_t *ent;
+        pframe_t *pf;
+        int pos, err;
+
+        if (!(VNODE_TO_S5INODE(dir)->s5_flags & S5_INODE_INDEXED))
+                return;
+
+        if (0 > (err = s5_dindex_find(dir, s5_dindex_hash(name, namelen),
+                                      NULL, 0, slot, &pf, &pos))) {
+                s5_dindex_drop(dir, err);
+                return;
+        }
+        if (0 > (err = pframe_dirty(pf))
+            || 0 > (err = s5_journal_dirty_vnode(dir, pf))) {
+                pframe_unpin(pf);
+                s5_dindex_drop(dir, err);
+                return;
+        }
+
+        leaf = (s5_dindex_header_t *)pf->pf_addr;
+        ent = S5_DINDEX_ENTRIES(leaf);
+        for (; pos + 1 < leaf->s5dh_nentries; pos++)
+                ent[pos] = ent[pos + 1];
+        leaf->s5dh_nentries--;
+        pframe_unpin(pf);
+}
+
+/*
+ * Updates the index of dir, if it has one, after the entry named name
+ * was moved from slot from to slot to.
+ */
+void
+s5_dindex_move(vnode_t *dir, const char *name, size_t namelen,
+               uint32_t from, uint32_t to)
+{
+        pframe_t *pf;
+        int pos, err;
+
+        if (!(VNODE_TO_S5INODE(dir)->s5_flags & S5_INODE_INDEXED))
+                return;
+
+        if (0 > (err = s5_dindex_find(dir, s5_dindex_hash(name, namelen),
+                                      NULL, 0, from, &pf, &pos))) {
+                s5_dindex_drop(dir, err);
+                return;
+        }
+        if (0 > (err = pframe_dirty(pf))
+            || 0 > (err = s5_journal_dirty_vnode(dir, pf))) {
+                pframe_unpin(pf);
+                s5_dindex_drop(dir, err);
+                return;
+        }
+        S5_DINDEX_ENTRIES(pf->pf_addr)[pos].s5de_value = to;
+        pframe_unpin(pf);
+}
+
+/*
+ * Does the work of s5_find_dirent(), also putting the slot of the entry
+ * in *slot.
+ */
+static int
+s5_dirent_slot(vnode_t *vnode, const char *name, size_t namelen, uint32_t *slot)
+{
+        s5_dirent_t d;
+        uint32_t i;
+        int ret;
+
+        if (VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_INDEXED)
+                return s5_dindex_lookup(vnode, name, namelen, slot);
+
+        for (i = 0; sizeof(d) == (ret = s5_read_file(vnode, i * sizeof(d), (char *)&d,
+                                                      sizeof(d))); i++) {
+                d.s5d_name[S5_NAME_LEN - 1] = '\0';
+                if ('\0' != d.s5d_name[0] && name_match(d.s5d_name, name, namelen)) {
+                        *slot = i;
+                        return d.s5d_inode;
+                }
+        }
+        return (0 > ret) ? ret : -ENOENT;
+}
+
 /*
  * Locate the directory entry in the given inode with the given name,
  * and return its inode number. If there is no entry with the given
@@ -355,12 +1979,16 @@ s5_free_inode(vnode_t *vnode)
  *
  * You can either read one dirent at a time or optimize and read more.
  * Either is fine.
+ *
+ * Indexed directories are searched with their index instead. Entries
+ * with an empty name (which fsmaker leaves behind) are unused.
  */
 int
 s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_find_dirent");
-        return -1;
+        uint32_t slot;
+
+        return s5_dirent_slot(vnode, name, namelen, &slot);
 }
 
 /*
@@ -382,12 +2010,57 @@ s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
  *
  * You probably want to use vget(), vput(), s5_read_file(),
  * s5_write_file(), and s5_dirty_inode().
+ *
+ * Keep the index up to date with s5_dindex_remove() for the removed
+ * entry and s5_dindex_move() for the one moved into its place;
+ * s5_dindex_lookup() finds the slot of the entry in indexed
+ * directories.
  */
 int
 s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_remove_dirent");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5_dirent_t d;
+        uint32_t slot, last;
+        vnode_t *child;
+        pframe_t *pf;
+        int ino, ret;
+
+        if (0 > (ino = s5_dirent_slot(vnode, name, namelen, &slot)))
+                return ino;
+        last = inode->s5_size / sizeof(s5_dirent_t) - 1;
+
+        /* Out of the index before another entry takes the slot */
+        s5_dindex_remove(vnode, name, namelen, slot);
+
+        if (slot != last) {
+                if (sizeof(d) != (ret = s5_read_file(vnode, last * sizeof(d), (char *)&d,
+                                                      sizeof(d)))
+                    || sizeof(d) != (ret = s5_write_file(vnode, slot * sizeof(d),
+                                                         (char *)&d, sizeof(d))))
+                        return (0 > ret) ? ret : -EIO;
+                d.s5d_name[S5_NAME_LEN - 1] = '\0';
+                s5_dindex_move(vnode, d.s5d_name, strlen(d.s5d_name), last, slot);
+        }
+
+        vnode->vn_len -= sizeof(s5_dirent_t);
+        inode->s5_size = vnode->vn_len;
+        if (inode->s5_size / sizeof(s5_dirent_t) <= S5_DINDEX_MIN_DIRENTS)
+                inode->s5_flags &= ~S5_INODE_NOINDEX;
+        s5_dirty_inode(fs, inode);
+        if (inode->s5_flags & S5_INODE_INLINE) {
+                pframe_get(&vnode->vn_mmobj, 0, &pf);
+                KASSERT(pf && "because the directory has just been read");
+                s5_inline_update(vnode, pf->pf_addr);
+        }
+
+        child = vget(vnode->vn_fs, ino);
+        VNODE_TO_S5INODE(child)->s5_linkcount--;
+        s5_dirty_inode(fs, VNODE_TO_S5INODE(child));
+        vput(child);
+
+        return 0;
 }
 
 /*
@@ -400,18 +2073,114 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
  * Remember to incrament the ref counts appropriately
  *
  * You probably want to use s5_find_dirent(), s5_write_file(), and s5_dirty_inode().
+ *
+ * Add the new entry to the index with s5_dindex_add() once it is
+ * written.
  */
 int
 s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_link");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(child);
+        s5_dirent_t d;
+        uint32_t slot;
+        int ret;
+
+        KASSERT(S5_TYPE_DIR == VNODE_TO_S5INODE(parent)->s5_type);
+
+        if (namelen >= S5_NAME_LEN)
+                return -ENAMETOOLONG;
+        if (0 <= (ret = s5_find_dirent(parent, name, namelen)))
+                return -EEXIST;
+        if (-ENOENT != ret)
+                return ret;
+
+        /* The entries are kept contiguous, so the new one goes at the end */
+        slot = VNODE_TO_S5INODE(parent)->s5_size / sizeof(s5_dirent_t);
+        if (slot >= S5_DINDEX_BLOCK * S5_DIRENTS_PER_BLOCK)
+                return -ENOSPC;
+
+        memset(&d, 0, sizeof(d));
+        d.s5d_inode = child->vn_vno;
+        memcpy(d.s5d_name, name, namelen);
+        if (sizeof(d) != (ret = s5_write_file(parent, slot * sizeof(d), (char *)&d,
+                                              sizeof(d))))
+                return (0 > ret) ? ret : -EIO;
+        s5_dindex_add(parent, name, namelen, slot);
+
+        /* "." does not count as a link */
+        if (parent != child) {
+                inode->s5_linkcount++;
+                s5_dirty_inode(VNODE_TO_S5FS(child), inode);
+        }
+        return 0;
+}
+
+/*
+ * Counts an indirect block and the blocks below it, like
+ * s5_free_indirect() frees them.
+ */
+static int
+s5_indirect_blocks(s5fs_t *fs, uint32_t block, int depth)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+        int n = 1;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp);
+        KASSERT(ibp && "because never fails for block_device vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                if (0 == b[i])
+                        continue;
+                if (1 < depth)
+                        n += s5_indirect_blocks(fs, b[i], depth - 1);
+                else
+                        n++;
+        }
+
+        pframe_unpin(ibp);
+        return n;
+}
+
+/*
+ * Counts the blocks mapped by an extent tree node and the nodes below
+ * it, like s5_extent_free() frees them.
+ */
+static int
+s5_extent_blocks(s5fs_t *fs, s5_extent_header_t *hdr)
+{
+        s5_extent_t *e = S5_EXTENT_ENTRIES(hdr);
+        s5_extent_header_t *child;
+        pframe_t *pf;
+        uint32_t i;
+        int n = 0;
+
+        for (i = 0; i < hdr->s5eh_nentries; i++) {
+                if (0 == hdr->s5eh_depth) {
+                        n += e[i].s5e_len;
+                        continue;
+                }
+
+                pframe_get(S5FS_TO_VMOBJ(fs), e[i].s5e_block, &pf);
+                KASSERT(pf && "because never fails for block_device vm_objects");
+                pframe_pin(pf);
+                child = (s5_extent_header_t *)pf->pf_addr;
+                if (S5_EXTENT_MAGIC == child->s5eh_magic
+                    && child->s5eh_depth == hdr->s5eh_depth - 1)
+                        n += s5_extent_blocks(fs, child);
+                pframe_unpin(pf);
+                n++;
+        }
+        return n;
 }
 
 /*
  * Return the number of blocks that this inode has allocated on disk.
  * This should include the indirect block, but not include sparse
- * blocks.
+ * blocks. A file with inline data (S5_INODE_INLINE) has none.
  *
  * This is only used by s5fs_stat().
  *
@@ -420,7 +2189,26 @@ s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 int
 s5_inode_blocks(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_inode_blocks");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        int i, n = 0;
+
+        if ((S5_TYPE_DATA != inode->s5_type && S5_TYPE_DIR != inode->s5_type)
+            || (inode->s5_flags & S5_INODE_INLINE))
+                return 0;
+        if (inode->s5_flags & S5_INODE_EXTENTS)
+                return s5_extent_blocks(fs, &inode->s5_extent_hdr);
+
+        for (i = 0; i < S5_NDIRECT_BLOCKS; i++) {
+                if (inode->s5_direct_blocks[i])
+                        n++;
+        }
+        if (inode->s5_indirect_block)
+                n += s5_indirect_blocks(fs, inode->s5_indirect_block, 1);
+        if (inode->s5_dindirect_block)
+                n += s5_indirect_blocks(fs, inode->s5_dindirect_block, 2);
+        if (inode->s5_tindirect_block)
+                n += s5_indirect_blocks(fs, inode->s5_tindirect_block, 3);
+        return n;
 }
 
@@ -54,7 +54,15 @@ do_read(int fd, void *buf, size_t nbytes)
                 fput(file_handler);
                 return -EISDIR;
         }
-        int ret_val=file_handler->f_vnode->vn_ops->read(file_handler->f_vnode,file_handler->f_pos,buf,nbytes);
+        int ret_val;
+        if((file_handler->f_mode & FMODE_DIRECT) && file_handler->f_vnode->vn_ops->direct_io)
+        {
+                ret_val=file_handler->f_vnode->vn_ops->direct_io(file_handler->f_vnode,file_handler->f_pos,buf,nbytes,0);
+        }
+        else
+        {
+                ret_val=file_handler->f_vnode->vn_ops->read(file_handler->f_vnode,file_handler->f_pos,buf,nbytes);
+        }
         if(ret_val>=0)
         {
           file_handler->f_pos+=ret_val;
@@ -98,7 +106,15 @@ do_write(int fd, const void *buf, size_t nbytes)
                 return ret_val;    
               }
       }
-      int ret_val=file_handler->f_vnode->vn_ops->write(file_handler->f_vnode, file_handler->f_pos, buf, nbytes);
+      int ret_val;
+      if((file_handler->f_mode & FMODE_DIRECT) && file_handler->f_vnode->vn_ops->direct_io)
+      {
+              ret_val=file_handler->f_vnode->vn_ops->direct_io(file_handler->f_vnode, file_handler->f_pos, (void *)buf, nbytes, 1);
+      }
+      else
+      {
+              ret_val=file_handler->f_vnode->vn_ops->write(file_handler->f_vnode, file_handler->f_pos, buf, nbytes);
+      }
       fput(file_handler);
       return ret_val;
 }
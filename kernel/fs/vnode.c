@@ -41,6 +41,16 @@ static int  vreadpage(mmobj_t *o, pframe_t *pf);
 static int  vdirtypage(mmobj_t *o, pframe_t *pf);
 static int  vcleanpage(mmobj_t *o, pframe_t *pf);
 
+/* Memory pressure: */
+static int vnode_shrinker_count(void);
+static int vnode_shrinker_scan(int nscan, int *npages);
+
+static slab_shrinker_t vnode_shrinker = {
+        .ss_name = "vnode",
+        .ss_count = vnode_shrinker_count,
+        .ss_scan = vnode_shrinker_scan
+};
+
 static mmobj_ops_t vnode_mmobj_ops = {
         .ref = vo_vref,
         .put = vo_vput,
@@ -54,6 +64,7 @@ static mmobj_ops_t vnode_mmobj_ops = {
 static vnode_ops_t bytedev_spec_vops = {
         .read = special_file_read,
         .write = special_file_write,
+        .direct_io = NULL,
         .mmap = special_file_mmap,
         .create = NULL,
         .mknod = NULL,
@@ -72,6 +83,7 @@ static vnode_ops_t bytedev_spec_vops = {
 static vnode_ops_t blockdev_spec_vops = {
         .read = NULL,
         .write = NULL,
+        .direct_io = NULL,
         .mmap = NULL,
         .create = NULL,
         .mknod = NULL,
@@ -90,11 +102,29 @@ static vnode_ops_t blockdev_spec_vops = {
 /*
  * Initialization:
  */
+/*
+ * Slab constructor for vnodes. vput() hands vnodes back to the allocator
+ * with no references or resident pages, an unlocked lock, nobody on
+ * the wait queue, and off of vnode_inuse_list.
+ */
+static void
+vnode_ctor(void *obj)
+{
+        vnode_t *vn = (vnode_t *)obj;
+
+        krwlock_init(&vn->vn_lock);
+        mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
+        sched_queue_init(&vn->vn_waitq);
+        list_link_init(&vn->vn_link);
+}
+
 static __attribute__((unused)) void
 vnode_init(void)
 {
         list_init(&vnode_inuse_list);
-        vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
+        vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t),
+                                                vnode_ctor, NULL);
+        slab_shrinker_register(&vnode_shrinker);
 }
 init_func(vnode_init);
 
@@ -160,14 +190,20 @@ find:
                 sched_switch();
                 goto find;
         }
-        memset(vn, 0, sizeof(vnode_t));
-        /*   initialize its contents: */
+        /*   initialize its contents (the mutex, mmobj and wait queue were
+         *   set up by vnode_ctor()): */
+        KASSERT(0 == vn->vn_refcount && 0 == vn->vn_nrespages);
         /*     members that can be initialized here: */
+        vn->vn_ops = NULL;
         vn->vn_fs = fs;
         vn->vn_vno = vno;
-        kmutex_init(&vn->vn_mutex);
-        mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
-        sched_queue_init(&vn->vn_waitq);
+        vn->vn_mode = 0;
+        vn->vn_len = 0;
+        vn->vn_i = NULL;
+        vn->vn_devid = NULL_DEVID;
+        vn->vn_cdev = NULL;
+        vn->vn_bdev = NULL;
+        vn->vn_flags = 0;
 
 #ifdef __MOUNTING__
         vn->vn_mount = vn;
@@ -302,6 +338,74 @@ vput(struct vnode *vn)
         slab_obj_free(vnode_allocator, vn);
 }
 
+/*
+ * A vnode whose only references come from its own resident pages is
+ * passively-referenced: nobody is using it, it is only being kept
+ * around by the page cache. Under memory pressure we can drop its clean
+ * pages, which in turn drops the last references to the vnode and lets
+ * vput() hand it back to the filesystem and the vnode allocator.
+ */
+#define vnode_is_passive(vn)                                            \
+        (!(VN_BUSY & (vn)->vn_flags)                                    \
+         && (0 < (vn)->vn_nrespages)                                    \
+         && ((vn)->vn_refcount == (vn)->vn_nrespages))
+
+static int
+vnode_shrinker_count(void)
+{
+        vnode_t *vn;
+        int count = 0;
+
+        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+                if (vnode_is_passive(vn))
+                        count++;
+        } list_iterate_end();
+
+        return count;
+}
+
+static int
+vnode_shrinker_scan(int nscan, int *npages)
+{
+        vnode_t *vn;
+        pframe_t *pf;
+        int nfreed = 0;
+
+restart:
+        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+                if (0 >= nscan)
+                        return nfreed;
+                if (!vnode_is_passive(vn))
+                        continue;
+                nscan--;
+
+                /* Hold our own reference so freeing the pages below does not
+                 * free the vnode out from under us. Pages which are busy,
+                 * pinned or dirty are left alone; pageoutd deals with those. */
+                vref(vn);
+                list_iterate_begin(&vn->vn_mmobj.mmo_respages, pf, pframe_t,
+                                   pf_olink) {
+                        if (!pframe_is_busy(pf) && !pframe_is_pinned(pf)
+                            && !pframe_is_dirty(pf)) {
+                                pframe_free(pf);
+                                (*npages)++;
+                        }
+                } list_iterate_end();
+
+                if (1 == vn->vn_refcount) {
+                        /* vput() is going to free the vnode, which may block
+                         * in the filesystem, so the list may have changed
+                         * by the time we get back. */
+                        vput(vn);
+                        nfreed++;
+                        goto restart;
+                }
+                vput(vn);
+        } list_iterate_end();
+
+        return nfreed;
+}
+
 int
 vfs_is_in_use(fs_t *fs)
 {
@@ -411,6 +515,21 @@ vnode_inuse(struct fs *fs)
         return n;
 }
 
+/*
+ * Return whether the vnode of the given inode is in memory.
+ */
+int
+vnode_incore(struct fs *fs, ino_t vno)
+{
+        vnode_t *vn;
+
+        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+                if (vn->vn_fs == fs && vn->vn_vno == vno)
+                        return 1;
+        } list_iterate_end();
+        return 0;
+}
+
 static void
 init_special_vnode(vnode_t *vn)
 {
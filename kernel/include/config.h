@@ -45,6 +45,24 @@
 /* Note: if rootfs is ramfs, this is completely ignored */
 #define VFS_ROOTFS_DEV  "disk0" /* device containing root filesystem */
 
+/*
+ * RAM disks: RAMDISK_NDEVS of them, RAMDISK_NBLOCKS blocks each. Pages
+ * are only allocated for blocks which have been written. See
+ * RAMDISK_IMAGE in Config.mk for preloading ram0.
+ */
+#define RAMDISK_NDEVS           1
+#define RAMDISK_NBLOCKS         1024
+
+/*
+ * Software RAID: define MD_LEVEL to build md0 at boot from the first
+ * MD_NDISKS disks, either striped (0) in chunks of MD_CHUNK_BLOCKS
+ * blocks or mirrored (1). Set VFS_ROOTFS_DEV to "md0" to put the root
+ * filesystem on it.
+ */
+/* #define MD_LEVEL             0 */
+#define MD_NDISKS               2
+#define MD_CHUNK_BLOCKS         16
+
 #ifdef __S5FS__
 /* root filesystem type - either "ramfs" or "s5fs" */
 #    define VFS_ROOTFS_TYPE "s5fs"
@@ -13,9 +13,57 @@
 #include "mm/page.h"
 #include "mm/mmobj.h"
 
+#include "main/interrupt.h"
+
+#include "proc/sched.h"
+
 #define BLOCK_SIZE PAGE_SIZE
 
+/* Block device interrupts are masked at (and below) this IPL */
+#define BLOCKDEV_IPL INTR_DISK_SECONDARY
+
 struct blockdev_ops;
+struct blockdev_req;
+struct iosched_queue;
+
+/*
+ * Called when a request completes, with br_status set. This is usually
+ * called from an interrupt handler, so it must not block. The request
+ * is not touched after this returns, so it may free or resubmit it.
+ */
+typedef void (*blockdev_done_func_t)(struct blockdev_req *req);
+
+/* Latency histograms have a bucket for each power of two cycles */
+#define BLOCKDEV_HIST_NBUCKETS 40
+
+/*
+ * Activity counters of a block device, kept by the block device layer
+ * (and, for the service times, by drivers which know when the hardware
+ * is busy with a command). Only touched with disk interrupts blocked.
+ */
+typedef struct blockdev_stats {
+        uint32_t bs_nreads;
+        uint32_t bs_nwrites;
+        uint32_t bs_nblocks_read;
+        uint32_t bs_nblocks_written;
+        uint32_t bs_nflushes;
+        uint32_t bs_nerrors;
+
+        /* Requests submitted but not completed, and the total time
+         * there were any */
+        uint32_t bs_inflight;
+        uint64_t bs_busy_cycles;
+        uint64_t bs_busy_since;
+
+        /* Cycles from blockdev_submit() to blockdev_req_done(): bucket
+         * i counts requests which took [2^i, 2^(i+1)) cycles */
+        uint32_t bs_latency[BLOCKDEV_HIST_NBUCKETS];
+
+        /* Cycles the hardware spent on each command (which may cover
+         * several requests, or part of one) */
+        uint32_t bs_ncommands;
+        uint32_t bs_service[BLOCKDEV_HIST_NBUCKETS];
+} blockdev_stats_t;
 
 /*
  * Represents a Weenix block device.
@@ -26,13 +74,68 @@ typedef struct blockdev {
 
         struct blockdev_ops  *bd_ops;
 
+        /* Size of the device in blocks */
+        blocknum_t bd_nblocks;
+
+        /* The driver's request queue, or NULL if it has none */
+        struct iosched_queue *bd_iosched;
+
         /* Fields that should be ignored by drivers: */
         struct mmobj bd_mmobj;
 
+        blockdev_stats_t bd_stats;
+
         /* Link on the list of block-oriented devices */
         list_link_t bd_link;
 } blockdev_t;
 
+/*
+ * Request flags:
+ *
+ * A barrier request is ordered with respect to every other request to
+ * the device: everything submitted before it has completed and reached
+ * stable storage before it starts, and it has reached stable storage
+ * before anything submitted after it starts. A barrier request with no
+ * blocks (see blockdev_req_init_flush()) just flushes the device's
+ * write cache at that point.
+ */
+#define BLOCKDEV_REQ_BARRIER    0x01
+
+/*
+ * An asynchronous block device request. The submitter owns the request
+ * (it may live on the submitter's stack if the submitter waits for it)
+ * and must not touch it between blockdev_submit() and its completion.
+ */
+typedef struct blockdev_req {
+        /* Filled in by blockdev_req_init(): */
+        blockdev_t          *br_bdev;
+        int                  br_write;     /* true for writes */
+        char                *br_buf;       /* page-aligned buffer */
+        blocknum_t           br_blocknum;  /* first block */
+        size_t               br_count;     /* number of blocks */
+        blockdev_done_func_t br_done_func; /* or NULL */
+        void                *br_private;   /* for the submitter's use */
+        int                  br_flags;     /* BLOCKDEV_REQ_*, 0 by default */
+
+        /* Completion: */
+        int                  br_done;      /* true once completed */
+        int                  br_status;    /* 0 or -errno once completed */
+        ktqueue_t            br_waitq;     /* woken up on completion */
+        uint64_t             br_submit_time; /* rdtsc() at blockdev_submit() */
+
+        /* For the driver's use while the request is queued: */
+        list_link_t          br_link;
+        size_t               br_nblocks_done;
+        int                  br_npending;  /* e.g. requests to lower devices */
+        int                  br_error;
+
+        /* For the I/O scheduler's use (see drivers/iosched.h): */
+        list_link_t          br_fifo_link;  /* link on the deadline FIFO */
+        struct blockdev_req *br_merge_next; /* next request merged into this one */
+        struct blockdev_req *br_merge_last; /* last request in the merge chain */
+        size_t               br_merge_nblocks; /* blocks in the whole chain */
+} blockdev_req_t;
+
 typedef struct blockdev_ops {
         /**
          * Reads a block from the block device. This call will block.
@@ -59,6 +162,27 @@ typedef struct blockdev_ops {
          */
         int (*write_block)(blockdev_t *bdev, const char *buf,
                            blocknum_t loc, size_t count);
+
+        /**
+         * Queues a request and returns without waiting for it. The
+         * driver calls blockdev_req_done() once the request has
+         * completed. May be NULL, in which case blockdev_submit() does
+         * the request synchronously with read_block or write_block.
+         *
+         * @param bdev the block device
+         * @param req the request to queue
+         */
+        void (*submit)(blockdev_t *bdev, blockdev_req_t *req);
+
+        /**
+         * Writes everything in the device's volatile write cache to
+         * stable storage. This call will block. May be NULL if the
+         * device has no such cache.
+         *
+         * @param bdev the block device
+         * @return 0 on success, -errno on failure
+         */
+        int (*flush)(blockdev_t *bdev);
 } blockdev_ops_t;
 
 /**
@@ -82,6 +206,101 @@ int blockdev_register(blockdev_t *dev);
  */
 blockdev_t *blockdev_lookup(devid_t id);
 
+/**
+ * Finds a block device by name, such as "disk0" or "md1".
+ *
+ * @param name the name of the block device
+ * @return the block device if it exists, or NULL
+ */
+blockdev_t *blockdev_lookup_name(const char *name);
+
+/**
+ * Initializes a request to read (or write) count blocks starting at
+ * blocknum into (or from) buf.
+ *
+ * @param req the request to initialize
+ * @param bdev the block device
+ * @param write true to write, false to read
+ * @param buf the page-aligned buffer
+ * @param blocknum the first block
+ * @param count the number of blocks
+ * @param done_func called on completion, or NULL
+ * @param private stored in br_private
+ */
+void blockdev_req_init(blockdev_req_t *req, blockdev_t *bdev, int write,
+                       char *buf, blocknum_t blocknum, size_t count,
+                       blockdev_done_func_t done_func, void *private);
+
+/**
+ * Initializes a request which flushes the device's write cache: a
+ * barrier request with no blocks.
+ *
+ * @param req the request to initialize
+ * @param bdev the block device
+ * @param done_func called on completion, or NULL
+ * @param private stored in br_private
+ */
+void blockdev_req_init_flush(blockdev_req_t *req, blockdev_t *bdev,
+                             blockdev_done_func_t done_func, void *private);
+
+/**
+ * Starts a request. This does not block unless the device has no
+ * submit operation.
+ *
+ * @param req an initialized request
+ */
+void blockdev_submit(blockdev_req_t *req);
+
+/**
+ * Waits for a submitted request to complete.
+ *
+ * @param req the request
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_wait(blockdev_req_t *req);
+
+/**
+ * Called by drivers to complete a request: sets its status, wakes up
+ * anyone waiting for it and then calls its completion function.
+ *
+ * @param req the request
+ * @param status 0 on success, -errno on failure
+ */
+void blockdev_req_done(blockdev_req_t *req, int status);
+
+/**
+ * Writes a block device's volatile write cache to stable storage.
+ *
+ * @param bd the block device
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_flush_cache(blockdev_t *bd);
+
+/**
+ * Flushes the write caches of all block devices, e.g. for sync(2).
+ */
+void blockdev_flush_caches(void);
+
+/**
+ * Called by drivers to account for the time the hardware spent on a
+ * command. Called with disk interrupts blocked.
+ *
+ * @param bd the block device
+ * @param cycles the time from starting the command to its completion
+ */
+void blockdev_stats_service(blockdev_t *bd, uint64_t cycles);
+
+/**
+ * Provides activity statistics of block devices.
+ *
+ * @param arg a block device to show in detail, with latency histograms,
+ * or NULL for a summary of all block devices
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t blockdev_info(const void *arg, char *buf, size_t osize);
+
 /**
  * Cleans and frees all resident pages belonging to a given block
  * device.
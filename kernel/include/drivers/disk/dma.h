@@ -1,5 +1,24 @@
 #pragma once
 
+#include "types.h"
+
+/* The most entries a channel's PRD table holds (a page worth, enough
+ * for the largest LBA48 transfer if it is physically contiguous) */
+#define DMA_MAX_PRDS 512
+
+/* The most bytes a single PRD entry can describe */
+#define DMA_PRD_MAX_BYTES 0x10000
+
+/*
+ * One piece of a scatter-gather list: a virtually contiguous, page
+ * aligned buffer. Pieces which turn out to be physically contiguous
+ * are coalesced into a single PRD entry.
+ */
+typedef struct dma_sg {
+        void     *ds_addr;
+        uint32_t  ds_len;  /* a multiple of PAGE_SIZE */
+} dma_sg_t;
+
 /**
  * Initializes the DMA subsystem.
  */
@@ -30,6 +49,19 @@ void dma_reset(uint8_t channel);
  */
 void dma_load(uint8_t channel, void *start, int count, int write);
 
+/**
+ * Initialize DMA for an operation on a scatter-gather list. The buffers
+ * are transferred in order, as if they were one.
+ *
+ * @param channel the channel on which to perform the operation
+ * @param sg the buffers
+ * @param nsg the number of buffers
+ * @param write true if writing, false if reading
+ * @return the number of bytes loaded, which is less than the total
+ * length of the buffers if they need more than DMA_MAX_PRDS entries
+ */
+uint32_t dma_load_sg(uint8_t channel, const dma_sg_t *sg, int nsg, int write);
+
 /**
  * Cancel the current DMA operation.
  *
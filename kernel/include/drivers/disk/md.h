@@ -0,0 +1,42 @@
+#pragma once
+
+#include "types.h"
+
+#include "drivers/blockdev.h"
+
+/*
+ * Software RAID ("multiple device") block devices, md0, md1, ...,
+ * layered on other block devices:
+ *   - RAID-0 stripes the array over its members in chunks of
+ *     md_chunk blocks: chunk i lives on member i % n
+ *   - RAID-1 mirrors the array onto every member. Writes go to all of
+ *     them; each read goes to the least busy member, and is retried on
+ *     the next one if it fails
+ */
+
+#define MD_RAID0 0
+#define MD_RAID1 1
+
+/* The most members an array can have */
+#define MD_MAX_DISKS 4
+
+/* Requests to members each array can have in flight */
+#define MD_NCHILDREN 32
+
+/**
+ * Initializes the md subsystem and, if MD_LEVEL is configured, builds
+ * md0 from the first MD_NDISKS disks. Called after the disks have been
+ * registered.
+ */
+void md_init(void);
+
+/**
+ * Builds and registers an array.
+ *
+ * @param level MD_RAID0 or MD_RAID1
+ * @param chunk the RAID-0 chunk size in blocks (ignored for RAID-1)
+ * @param disks the members
+ * @param ndisks the number of members
+ * @return the new array, or NULL on failure
+ */
+blockdev_t *md_create(int level, blocknum_t chunk, blockdev_t **disks, int ndisks);
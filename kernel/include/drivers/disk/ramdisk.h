@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * RAM-backed block devices, ram0, ram1, ... Blocks are pages from the
+ * page allocator, allocated the first time they are written; blocks
+ * which were never written read as zeros.
+ *
+ * If the kernel was built with RAMDISK_IMAGE set (see Config.mk), ram0
+ * starts out with the contents of that image, which is linked into the
+ * kernel and so loaded from the boot floppy/ISO along with it.
+ */
+
+/**
+ * Registers RAMDISK_NDEVS ramdisks of RAMDISK_NBLOCKS blocks each
+ * (ram0 is made larger if the preloaded image needs it).
+ */
+void ramdisk_init(void);
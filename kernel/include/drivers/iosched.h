@@ -0,0 +1,131 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+#include "drivers/blockdev.h"
+
+/*
+ * I/O schedulers sit between a block device driver's submit operation
+ * and the code which programs the hardware. The driver hands every
+ * request it is given to iosched_add() and asks iosched_next() for the
+ * next one whenever the device goes idle.
+ *
+ * When a request continues where a queued request (of the same
+ * direction) ends, it is merged into that request instead of being
+ * queued on its own: it is chained behind it with br_merge_next and
+ * dispatched together with it. The driver must work through the whole
+ * chain and call iosched_complete() and then blockdev_req_done() for
+ * every request in it.
+ *
+ * Barrier requests (BLOCKDEV_REQ_BARRIER) are never merged or
+ * reordered. A barrier and everything submitted after it are held back
+ * until everything before it has been dispatched and completed; the
+ * barrier is then dispatched on its own, and once it has completed the
+ * requests behind it (up to the next barrier) go to the scheduler.
+ *
+ * Two schedulers are available:
+ *   - "noop" dispatches requests in the order they arrive, and only
+ *     merges into the most recent request
+ *   - "deadline" dispatches requests in ascending block order, sweeping
+ *     across the disk, unless the oldest read or write has been waiting
+ *     longer than its expiry time, in which case that one goes first
+ */
+
+/* The scheduler new queues start out with */
+#define IOSCHED_DEFAULT         "deadline"
+
+/* The most blocks a merge chain may cover */
+#define IOSCHED_MAX_MERGE       32
+
+/* Deadline expiry times, in cycles (rdtsc()) */
+#define IOSCHED_READ_EXPIRE     (1ULL << 28)
+#define IOSCHED_WRITE_EXPIRE    (1ULL << 31)
+
+struct iosched_queue;
+
+typedef struct iosched_ops {
+        const char     *is_name;
+
+        /* Queues req, which could not be merged. */
+        void            (*is_add)(struct iosched_queue *q, blockdev_req_t *req);
+
+        /* Returns a queued request req can be appended to (see
+         * iosched_can_merge()), or NULL. */
+        blockdev_req_t *(*is_merge)(struct iosched_queue *q, blockdev_req_t *req);
+
+        /* Removes and returns the next request to dispatch, or NULL if
+         * nothing is queued. */
+        blockdev_req_t *(*is_next)(struct iosched_queue *q);
+} iosched_ops_t;
+
+typedef struct iosched_queue {
+        iosched_ops_t  *iq_ops;
+
+        /* Scheduler state */
+        list_t          iq_sorted;      /* queued requests by block number (br_link) */
+        list_t          iq_fifo[2];     /* reads and writes by age (br_fifo_link) */
+        blocknum_t      iq_next_block;  /* where the last dispatch left off */
+        list_t          iq_held;        /* behind a barrier, in order (br_link) */
+        uint32_t        iq_ndispatched; /* requests dispatched, not completed */
+
+        /* Statistics */
+        uint32_t        iq_depth;       /* requests queued or in flight */
+        uint32_t        iq_max_depth;
+        uint32_t        iq_nsubmitted;
+        uint32_t        iq_nmerged;     /* requests merged into another one */
+        uint32_t        iq_ncompleted;
+        uint32_t        iq_nexpired;    /* deadline dispatches out of order */
+        uint32_t        iq_nbarriers;
+        uint64_t        iq_total_latency; /* cycles from submit to completion */
+        uint64_t        iq_max_latency;
+} iosched_queue_t;
+
+/**
+ * Initializes a queue with the IOSCHED_DEFAULT scheduler.
+ */
+void iosched_init(iosched_queue_t *q);
+
+/**
+ * Switches the scheduler of a queue.
+ *
+ * @param q the queue
+ * @param name "noop" or "deadline"
+ * @return 0 on success, -EINVAL for an unknown scheduler, -EBUSY if the
+ * queue is not empty
+ */
+int iosched_set(iosched_queue_t *q, const char *name);
+
+/**
+ * Queues (or merges) a request. Called with the device's interrupts
+ * blocked.
+ */
+void iosched_add(iosched_queue_t *q, blockdev_req_t *req);
+
+/**
+ * Returns the next request (chain) to dispatch, or NULL. Called with
+ * the device's interrupts blocked.
+ */
+blockdev_req_t *iosched_next(iosched_queue_t *q);
+
+/**
+ * Accounts for a completed request. Called by the driver right before
+ * blockdev_req_done() for every request of a dispatched chain.
+ */
+void iosched_complete(iosched_queue_t *q, blockdev_req_t *req);
+
+/**
+ * True if req can be appended to the merge chain starting at head.
+ */
+int iosched_can_merge(blockdev_req_t *head, blockdev_req_t *req);
+
+/**
+ * Provides the scheduler and statistics of a queue.
+ *
+ * @param arg the queue
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t iosched_info(const void *arg, char *buf, size_t osize);
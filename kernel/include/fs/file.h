@@ -5,6 +5,7 @@
 #define FMODE_READ    1
 #define FMODE_WRITE   2
 #define FMODE_APPEND  4
+#define FMODE_DIRECT  8
 
 struct vnode;
 
@@ -18,7 +19,9 @@ typedef struct file {
 
         /*
          * The mode in which this file was opened. This is a mask of the flags
-         * FMODE_READ, FMODE_WRITE, and FMODE_APPEND. It is set when the file
+         * FMODE_READ, FMODE_WRITE, FMODE_APPEND and FMODE_DIRECT (reads and
+         * writes go through the direct_io vnode operation, if the file has
+         * one). It is set when the file
          * is first opened, and use to restrict the operations that can be
          * performed on the underlying vnode.
          */
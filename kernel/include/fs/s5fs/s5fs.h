@@ -21,10 +21,13 @@
 #define S5_IS_SUPER(blkno)      ( (blkno) == S5_SUPER_BLOCK )
 #define S5_NBLKS_PER_FNODE      30
 #define S5_BLOCK_SIZE           4096
-#define S5_NDIRECT_BLOCKS       28
+#define S5_NDIRECT_BLOCKS       26
 #define S5_INODES_PER_BLOCK     (S5_BLOCK_SIZE /  sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK    (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
-#define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + (S5_BLOCK_SIZE / sizeof(uint32_t)))
+#define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS          \
+                                 + S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS       \
+                                 + S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS       \
+                                 * S5_NIDIRECT_BLOCKS)
 #define S5_NAME_LEN             28
 
 #define S5_TYPE_FREE            0x0
@@ -33,10 +36,24 @@
 #define S5_TYPE_CHR             0x4
 #define S5_TYPE_BLK             0x8
 
+/* s5_flags */
+#define S5_INODE_EXTENTS        0x01    /* blocks are mapped by extents */
+#define S5_INODE_INDEXED        0x02    /* the directory has a hash index */
+#define S5_INODE_INLINE         0x04    /* the data is in the inode */
+#define S5_INODE_NOINDEX        0x08    /* indexing the directory failed */
+
+/* s5s_features */
+#define S5_FEATURE_EXTENTS      0x01    /* new files are mapped by extents */
+#define S5_FEATURE_DIR_INDEX    0x02    /* large directories are indexed */
+#define S5_FEATURE_JOURNAL      0x04    /* metadata updates are journaled */
+#define S5_FEATURE_INLINE_DATA  0x08    /* new files start with inline data */
+#define S5_FEATURES_SUPPORTED   (S5_FEATURE_EXTENTS | S5_FEATURE_DIR_INDEX \
+                                 | S5_FEATURE_JOURNAL | S5_FEATURE_INLINE_DATA)
+
 #define S5_MAGIC                071177
-#define S5_CURRENT_VERSION      3
+#define S5_CURRENT_VERSION      6
 
-/* Number of blocks stored in the indirect block */
+/* Number of blocks stored in an indirect block */
 #define S5_NIDIRECT_BLOCKS      (S5_BLOCK_SIZE / sizeof(uint32_t))
 
 /* Given a file offset, returns the block number that it is in */
@@ -54,16 +71,118 @@
  */
 #define S5_INODE_OFFSET(inum)  ((inum) % S5_INODES_PER_BLOCK)
 
+/* Number of blocks one block of the free block bitmap covers */
+#define S5_BITS_PER_BLOCK       (S5_BLOCK_SIZE * 8)
+
+#define S5_EXTENT_MAGIC         0xe5e5
+
+/* Number of entries of the extent tree node in an inode (which takes
+ * the same space as the block pointers), and in a block */
+#define S5_EXTENTS_PER_INODE    9
+#define S5_EXTENTS_PER_BLOCK    ((S5_BLOCK_SIZE - sizeof(s5_extent_header_t)) \
+                                 / sizeof(s5_extent_t))
+
+/* Deeper than any tree of extents of a file which fits in an off_t */
+#define S5_EXTENT_MAX_DEPTH     4
+
+/* Bytes of data an inode with S5_INODE_INLINE holds, in the space of
+ * the block pointers */
+#define S5_INLINE_SIZE          ((S5_NDIRECT_BLOCKS + 3) * sizeof(uint32_t))
+
+/* The entries following an extent tree node header */
+#define S5_EXTENT_ENTRIES(hdr)  ((s5_extent_t *)((s5_extent_header_t *)(hdr) + 1))
+
+#define S5_DINDEX_MAGIC         0xd1d1
+
+/* The file block of a directory its index starts at */
+#define S5_DINDEX_BLOCK         0x40000
+
+/* Number of entries of a directory index block */
+#define S5_DINDEX_ENTRIES_PER_BLOCK ((S5_BLOCK_SIZE - sizeof(s5_dindex_header_t)) \
+                                     / sizeof(s5_dindex_entry_t))
+
+/* The entries following a directory index block header */
+#define S5_DINDEX_ENTRIES(hdr)  ((s5_dindex_entry_t *)((s5_dindex_header_t *)(hdr) + 1))
+
+/* Directories are indexed once they outgrow their first block */
+#define S5_DINDEX_MIN_DIRENTS   S5_DIRENTS_PER_BLOCK
+
+#define S5_JOURNAL_MAGIC        0x4a524e4c
+
+/* s5jh_type */
+#define S5_JOURNAL_DESCRIPTOR   1
+#define S5_JOURNAL_REVOKE       2
+#define S5_JOURNAL_COMMIT       3
+
+/* Number of block numbers following a journal block header */
+#define S5_JOURNAL_TAGS_PER_BLOCK ((S5_BLOCK_SIZE - sizeof(s5_journal_header_t)) \
+                                   / sizeof(uint32_t))
+
+/* The block numbers following a journal block header */
+#define S5_JOURNAL_TAGS(hdr)    ((uint32_t *)((s5_journal_header_t *)(hdr) + 1))
+
+/* The smallest journal fsmaker makes and the kernel accepts */
+#define S5_JOURNAL_MIN_BLOCKS   16
+
 /* Given an FS struct, get the S5FS (private data) struct. */
 #define FS_TO_S5FS(fs)  ( (s5fs_t *)((fs)->fs_i))
 
-/* each node of the free block list looks like this: */
 /*
-typedef struct s5_fbl_node {
-        int free_blocks[S5_NBLKS_PER_FNODE-1];
-        int more;
-} s5_fbl_node_t;
-*/
+ * Free blocks are tracked in a bitmap of s5s_bitmap_nblocks blocks
+ * starting at s5s_bitmap_block, one bit per block of the disk, set if
+ * the block is in use. The superblock, the inode blocks and the bitmap
+ * itself are marked in use when the disk is made.
+ */
+
+/*
+ * An inode with S5_INODE_EXTENTS set maps its blocks with a tree of
+ * extents, runs of contiguous disk blocks, instead of direct and
+ * indirect blocks. The root node of the tree takes the place of the
+ * block pointers in the inode; the other nodes are a block each. Nodes
+ * of depth 0 hold extents sorted by file block. Higher nodes hold one
+ * entry per child, with the child's block in s5e_block and no file
+ * block below the child smaller than s5e_fblock.
+ */
+
+/*
+ * An inode with S5_INODE_INLINE set has no blocks: the first s5_size
+ * bytes of s5_inline_data, which takes the place of the block pointers,
+ * are the contents of the file. Data files and directories start out
+ * like that with S5_FEATURE_INLINE_DATA, until they grow past
+ * S5_INLINE_SIZE bytes (a directory holding ".", ".." and one more
+ * entry still fits).
+ */
+
+/*
+ * A directory with S5_INODE_INDEXED set also has a hash index of its
+ * entries, in blocks of the directory file starting at S5_DINDEX_BLOCK,
+ * far past the end of its entries, so that anything reading the
+ * entries from the start of the file never sees it. The first index
+ * block is the root, holding one entry per leaf with the hash of the
+ * first entry the leaf had when it was made and the leaf's number
+ * (relative to S5_DINDEX_BLOCK). Leaves hold one entry per directory
+ * entry, with the hash of its name and its slot in the directory. The
+ * entries of both are sorted by hash; entries with the same hash can
+ * run from the end of one leaf into the next. A directory whose index
+ * could not be built or updated has S5_INODE_NOINDEX set instead, until
+ * it is back down to S5_DINDEX_MIN_DIRENTS entries.
+ */
+
+/*
+ * With S5_FEATURE_JOURNAL, changes to metadata (the superblock, inodes,
+ * the bitmap, indirect and extent tree blocks, and directory blocks)
+ * are first written to a journal of s5s_journal_nblocks blocks starting
+ * at s5s_journal_block, which is marked in use in the bitmap. Its first
+ * block holds an s5_journal_super_t; the rest is a log of transactions,
+ * written from its second block on and started over once everything in
+ * it has been written in place. A transaction is a descriptor block
+ * listing where the blocks which follow it belong, an optional revoke
+ * block listing blocks freed by the transaction, and a commit block
+ * with a checksum of all of them. Only transactions with a commit
+ * block, numbered consecutively from s5js_sequence, count: mounting
+ * copies their blocks into place, except blocks revoked by the same or
+ * a later transaction, which may since have been reused for data.
+ */
 
 /* Note that all on-disk types need to have hard-coded sizes (to ensure
  * inter-machine compatibility of s5 disks) */
@@ -72,16 +191,67 @@ typedef struct s5_fbl_node {
 typedef struct s5_super {
         uint32_t s5s_magic;              /* the magic number */
         uint32_t s5s_free_inode;         /* the free inode pointer */
-        uint32_t s5s_nfree;              /* number of blocks currently in
-                                          * s5s_free_blocks */
-        /** First "node" of free block list */
-        uint32_t s5s_free_blocks[S5_NBLKS_PER_FNODE];
+        uint32_t s5s_nfree;              /* number of free blocks */
+        /* Where version 3 kept the first node of its free block list */
+        uint32_t s5s_reserved[S5_NBLKS_PER_FNODE];
 
         uint32_t s5s_root_inode;         /* root inode */
         uint32_t s5s_num_inodes;         /* number of inodes */
         uint32_t s5s_version;            /* version of this disk format */
+
+        uint32_t s5s_nblocks;            /* number of blocks on the disk */
+        uint32_t s5s_bitmap_block;       /* first block of the free bitmap */
+        uint32_t s5s_bitmap_nblocks;     /* number of blocks of the bitmap */
+        uint32_t s5s_features;           /* S5_FEATURE_* */
+        uint32_t s5s_journal_block;      /* first block of the journal */
+        uint32_t s5s_journal_nblocks;    /* number of blocks of the journal */
 } s5_super_t;
 
+/* The first block of the journal */
+typedef struct s5_journal_super {
+        uint32_t s5js_magic;    /* S5_JOURNAL_MAGIC */
+        uint32_t s5js_nblocks;  /* s5s_journal_nblocks */
+        uint32_t s5js_sequence; /* number of the first transaction in the log */
+} s5_journal_super_t;
+
+/* The header of the blocks of a transaction other than the copies */
+typedef struct s5_journal_header {
+        uint32_t s5jh_magic;    /* S5_JOURNAL_MAGIC */
+        uint32_t s5jh_type;     /* S5_JOURNAL_* */
+        uint32_t s5jh_sequence; /* number of the transaction */
+        uint32_t s5jh_count;    /* number of block numbers following */
+        uint32_t s5jh_checksum; /* commit only: of the blocks before it */
+} s5_journal_header_t;
+
+/* An extent, or an entry of an extent tree node above depth 0 */
+typedef struct s5_extent {
+        uint32_t s5e_fblock;    /* first file block */
+        uint32_t s5e_block;     /* first disk block, or the child node */
+        uint32_t s5e_len;       /* number of blocks, 0 above depth 0 */
+} s5_extent_t;
+
+/* The header of an extent tree node, followed by its entries */
+typedef struct s5_extent_header {
+        uint16_t s5eh_magic;    /* S5_EXTENT_MAGIC */
+        uint16_t s5eh_nentries; /* number of entries in use */
+        uint16_t s5eh_max;      /* number of entries which fit */
+        uint16_t s5eh_depth;    /* 0 if the entries are extents */
+} s5_extent_header_t;
+
+/* The header of a directory index block, followed by its entries */
+typedef struct s5_dindex_header {
+        uint16_t s5dh_magic;    /* S5_DINDEX_MAGIC */
+        uint16_t s5dh_nentries; /* number of entries in use */
+        uint16_t s5dh_depth;    /* 1 for the root, 0 for leaves */
+        uint16_t s5dh_nblocks;  /* root only: index blocks in use */
+} s5_dindex_header_t;
+
+/* An entry of a directory index block */
+typedef struct s5_dindex_entry {
+        uint32_t s5de_hash;     /* hash of the name */
+        uint32_t s5de_value;    /* slot of the dirent, or leaf in the root */
+} s5_dindex_entry_t;
+
 /* The contents of an inode, as stored on disk. */
 typedef struct s5_inode {
         union {
@@ -91,10 +261,28 @@ typedef struct s5_inode {
 #define        s5_next_free s5_un.s5_next_free
 #define        s5_size      s5_un.s5_size
         uint32_t   s5_number;              /* this inode's number */
-        uint16_t   s5_type;         /* one of S5_TYPE_{FREE,DATA,DIR} */
+        uint8_t    s5_type;         /* one of S5_TYPE_{FREE,DATA,DIR} */
+        uint8_t    s5_flags;        /* S5_INODE_* */
         int16_t    s5_linkcount;    /* link count of this inode */
-        uint32_t   s5_direct_blocks[S5_NDIRECT_BLOCKS];
-        uint32_t   s5_indirect_block;
+        union {
+                struct {
+                        uint32_t s5_direct_blocks[S5_NDIRECT_BLOCKS];
+                        uint32_t s5_indirect_block;
+                        uint32_t s5_dindirect_block;   /* double indirect */
+                        uint32_t s5_tindirect_block;   /* triple indirect */
+                } s5_blocks;
+                struct {
+                        s5_extent_header_t s5_ehdr;
+                        s5_extent_t        s5_eroot[S5_EXTENTS_PER_INODE];
+                } s5_extents;
+                char s5_inline[S5_INLINE_SIZE];
+        } s5_map;
+#define        s5_direct_blocks   s5_map.s5_blocks.s5_direct_blocks
+#define        s5_indirect_block  s5_map.s5_blocks.s5_indirect_block
+#define        s5_dindirect_block s5_map.s5_blocks.s5_dindirect_block
+#define        s5_tindirect_block s5_map.s5_blocks.s5_tindirect_block
+#define        s5_extent_hdr      s5_map.s5_extents.s5_ehdr
+#define        s5_inline_data     s5_map.s5_inline
 } s5_inode_t;
 
 /* The contents of a directory entry, as stored on disk. */
@@ -108,9 +296,18 @@ typedef struct s5_dirent {
 typedef struct s5fs {
         blockdev_t              *s5f_bdev;
         s5_super_t              *s5f_super;
-        kmutex_t                s5f_mutex;
+        kmutex_t                s5f_block_mutex; /* free blocks, s5f_alloc_hint,
+                                                  * the reservations */
+        kmutex_t                s5f_inode_mutex; /* the free inode list */
+        kmutex_t                s5f_delalloc_mutex; /* allocation at writeback */
         fs_t                    *s5f_fs;
+        uint32_t                s5f_alloc_hint; /* after the last allocated block */
+        struct s5_journal       *s5f_journal;   /* NULL without S5_FEATURE_JOURNAL */
+        struct s5_icache        *s5f_icache;    /* the inodes in memory */
+        uint32_t                s5f_nreserved;  /* free blocks held for dirty pages */
+        uint32_t                *s5f_ireserved; /* the same, per inode */
 } s5fs_t;
 
 int s5fs_mount(struct fs *fs);
+int s5fs_fsck(struct fs *fs, char *buf, size_t size);
 #endif
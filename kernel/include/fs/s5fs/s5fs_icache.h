@@ -0,0 +1,23 @@
+/*
+ *   FILE: s5fs_icache.h
+ *  DESCR: S5 in-core inode cache
+ */
+
+#pragma once
+
+#include "types.h"
+
+struct s5fs;
+struct s5_inode;
+
+int s5_icache_init(struct s5fs *fs);
+void s5_icache_destroy(struct s5fs *fs);
+
+struct s5_inode *s5_icache_get(struct s5fs *fs, uint32_t ino);
+void s5_icache_put(struct s5fs *fs, struct s5_inode *inode);
+struct s5_inode *s5_icache_lookup(struct s5fs *fs, uint32_t ino);
+
+void s5_icache_dirty(struct s5fs *fs, struct s5_inode *inode);
+void s5_icache_evict(struct s5fs *fs, struct s5_inode *inode);
+void s5_icache_flush(struct s5fs *fs);
+void s5_icache_flush_all(void);
@@ -0,0 +1,27 @@
+/*
+ *   FILE: s5fs_journal.h
+ *  DESCR: S5 metadata journal (see s5fs.h for the disk format)
+ */
+
+#pragma once
+
+#include "types.h"
+
+struct blockdev;
+struct pframe;
+struct s5fs;
+struct vnode;
+
+int s5_journal_recover(struct blockdev *bd);
+int s5_journal_init(struct s5fs *fs);
+void s5_journal_destroy(struct s5fs *fs);
+
+void s5_journal_start(struct s5fs *fs);
+void s5_journal_stop(struct s5fs *fs);
+void s5_journal_dirty(struct s5fs *fs, struct pframe *pf);
+int s5_journal_dirty_vnode(struct vnode *vn, struct pframe *pf);
+void s5_journal_revoke(struct s5fs *fs, uint32_t block);
+int s5_journal_revoked(struct s5fs *fs, uint32_t block);
+
+int s5_journal_commit(struct s5fs *fs);
+void s5_journal_commit_all(void);
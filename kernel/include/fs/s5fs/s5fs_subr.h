@@ -8,6 +8,9 @@
 
 #include "types.h"
 
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_icache.h"
+
 struct fs;
 struct vnode;
 
@@ -18,6 +21,8 @@ void s5_free_inode(struct vnode *vnode);
 int s5_read_file(struct vnode *vn, off_t seek, char *dest, size_t len);
 int s5_write_file(struct vnode *vn, off_t seek, const char *bytes,
                   size_t len);
+int s5_direct_io(struct vnode *vn, off_t seek, char *buf, size_t len,
+                 int write);
 
 /* TA BLANK {{{ */
 /* TODO: perhaps change the order of the arguments 'parent' and 'child' to
@@ -28,6 +33,21 @@ int s5_link(struct vnode *parent, struct vnode *child,
 int s5_find_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_remove_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_seek_to_block(struct vnode *vnode, off_t seekptr, int alloc);
+int s5_reserve_block(struct vnode *vnode);
+int s5_alloc_delayed(struct vnode *vnode, off_t seekptr);
+
+void s5_inline_fill(struct vnode *vnode, off_t offset, void *pagebuf);
+void s5_inline_update(struct vnode *vnode, const void *pagebuf);
+int s5_inline_expand(struct vnode *vnode);
+
+int s5_dindex_lookup(struct vnode *dir, const char *name, size_t namelen,
+                     uint32_t *slot);
+void s5_dindex_add(struct vnode *dir, const char *name, size_t namelen,
+                   uint32_t slot);
+void s5_dindex_remove(struct vnode *dir, const char *name, size_t namelen,
+                      uint32_t slot);
+void s5_dindex_move(struct vnode *dir, const char *name, size_t namelen,
+                    uint32_t from, uint32_t to);
 int s5_inode_blocks(struct vnode *vnode);
 
 #define VNODE_TO_S5FS(vn)       ( (s5fs_t *)((vn)->vn_fs->fs_i))
@@ -38,17 +58,33 @@ int s5_inode_blocks(struct vnode *vnode);
 /* TODO: change args to be more natural for how things are arranged in this
  * experimental version of things */
 /* TA BLANK }}} */
+/* Inodes in memory are copies kept by the inode cache (see
+ * s5fs_icache.c); s5_dirty_inode() marks one to be written into its
+ * block later. */
 #define s5_dirty_inode(fs, inode)                                       \
+        s5_icache_dirty((fs), (inode))
+
+/* Inode blocks are written back as barriers (see blockdev.h), so that
+ * they are on disk once written back. That only orders them after the
+ * writes already submitted: pages are written back in whatever order
+ * they are cleaned, so the data blocks an inode points to may still be
+ * written after it. With a journal, they also join the running
+ * transaction (see s5fs_journal.c). This is for changes made to an
+ * inode in its block, which only s5_alloc_inode() makes; the inode
+ * cache writes its blocks back the same way. */
+#define s5_dirty_inode_block(fs, ino)                                   \
         do {                                                            \
                 pframe_t *p;                                            \
                 int err;                                                \
                 pframe_get(S5FS_TO_VMOBJ((fs)),                         \
-                           S5_INODE_BLOCK((inode)->s5_number), &p);     \
+                           S5_INODE_BLOCK(ino), &p);                    \
                 KASSERT(p);                                             \
                 err = pframe_dirty(p);                                  \
                 KASSERT(!err                                            \
                         && "shouldn\'t fail for a page belonging "      \
                         "to a block device");                           \
+                pframe_set_barrier(p);                                  \
+                s5_journal_dirty((fs), p);                              \
         } while (0)
 
 /*
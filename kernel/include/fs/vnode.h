@@ -13,6 +13,7 @@
 #include "drivers/bytedev.h"
 #include "util/list.h"
 #include "proc/kmutex.h"
+#include "proc/krwlock.h"
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
@@ -45,6 +46,15 @@ typedef struct vnode_ops {
          * transferred.
          */
         int (*write)(struct vnode *file, off_t offset, const void *buf, size_t count);
+        /*
+         * direct_io does what read (write is false) or write (write is
+         * true) do, but moves whole blocks straight between the disk and
+         * buf instead of copying them through the page cache. buf may be
+         * a user address in curproc. Used for files opened with O_DIRECT;
+         * may be NULL, in which case read and write are used instead.
+         */
+        int (*direct_io)(struct vnode *file, off_t offset, void *buf,
+                         size_t count, int write);
         /*
          * Everything within 'vma' other than vma->vm_obj (and
          * vm_link--meaning that 'vma' has not yet been entered into
@@ -215,10 +225,11 @@ typedef struct vnode {
         off_t              vn_len;
 
         /*
-         * A mutex used to synchronize reads and writes. This is only used by
-         * the underlying filesystem implementation.
+         * A lock used to synchronize reads and writes, which readers can
+         * share. This is only used by the underlying filesystem
+         * implementation.
          */
-        kmutex_t           vn_mutex;
+        krwlock_t          vn_lock;
 
         /*
          * A generic pointer which the file system can use to store any extra
@@ -354,6 +365,13 @@ void vnode_flush_all(struct fs *fs);
  */
 int vnode_inuse(struct fs *fs);
 
+/*
+ *         Returns whether the vnode of the given inode is in memory
+ *         (and so holds the reference read_vnode took on the inode).
+ *         Does not block.
+ */
+int vnode_incore(struct fs *fs, ino_t vno);
+
 
 /* Diagnostic: */
 /*
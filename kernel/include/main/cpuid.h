@@ -89,3 +89,11 @@ static inline void cpuid(int request, uint32_t *a, uint32_t *d)
 {
         __asm__ volatile("cpuid":"=a"(*a), "=d"(*d):"0"(request));
 }
+
+/* Reads the time-stamp counter (the number of cycles since reset). */
+static inline uint64_t rdtsc(void)
+{
+        uint64_t tsc;
+        __asm__ volatile("rdtsc":"=A"(tsc));
+        return tsc;
+}
@@ -11,6 +11,8 @@ struct mmobj;
 
 #define PF_BUSY                 0x01
 #define PF_DIRTY                0x02
+#define PF_BARRIER              0x04 /* write back as a barrier (see blockdev.h) */
+#define PF_JOURNAL              0x08 /* in a journal transaction (see s5fs_journal.c) */
 
 #define pframe_is_busy(pf)          ((pf)->pf_flags & PF_BUSY)
 #define pframe_set_busy(pf)         do { (pf)->pf_flags |= PF_BUSY; } while (0)
@@ -20,6 +22,14 @@ struct mmobj;
 #define pframe_set_dirty(pf)        do { (pf)->pf_flags |= PF_DIRTY; } while (0)
 #define pframe_clear_dirty(pf)      do { (pf)->pf_flags &= ~PF_DIRTY; } while (0)
 
+#define pframe_is_barrier(pf)       ((pf)->pf_flags & PF_BARRIER)
+#define pframe_set_barrier(pf)      do { (pf)->pf_flags |= PF_BARRIER; } while (0)
+#define pframe_clear_barrier(pf)    do { (pf)->pf_flags &= ~PF_BARRIER; } while (0)
+
+#define pframe_is_journal(pf)       ((pf)->pf_flags & PF_JOURNAL)
+#define pframe_set_journal(pf)      do { (pf)->pf_flags |= PF_JOURNAL; } while (0)
+#define pframe_clear_journal(pf)    do { (pf)->pf_flags &= ~PF_JOURNAL; } while (0)
+
 #define pframe_is_pinned(pf)        ((pf)->pf_pincount)
 #define pframe_is_free(pf)          (!(pf)->pf_obj)
 
@@ -38,7 +48,7 @@ typedef struct pframe {
         void               *pf_addr;
 
         /* Private: */
-        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY */
+        uint8_t             pf_flags;    /* PF_* */
         ktqueue_t           pf_waitq;    /* wait on this if page is busy */
         int                 pf_pincount;
         list_link_t         pf_link;     /* link on {free,allocated,pinned}_list */
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "types.h"
+
+#include "util/list.h"
+
 /* Define SLAB_REDZONE to add top and bottom redzones to every object.
  * Use kmem_check_redzones() liberally throughout your code to test
  * for memory pissing. */
@@ -9,6 +13,13 @@
  * are no double frees. */
 #define SLAB_CHECK_FREE
 
+/* Define SLAB_TRACE to record the caller and time of every allocation.
+ * This costs an extra 8 bytes per object, and lets you see which
+ * call sites hold on to how much memory (slab_trace_info()) and look for
+ * objects nothing points to anymore (slab_leak_info()). Both are
+ * available from the kshell "kmemtrace" command. */
+/* #define SLAB_TRACE */
+
 /*
  * The slab allocator. A "cache" is a store of objects; you create one by
  * specifying a constructor, destructor, and the size of an object. The
@@ -16,11 +27,115 @@
  * it to the free list *without calling the destructor*. This lets you save
  * on destruction/construction calls; the idea is that every free object in
  * the cache is in a known state.
+ *
+ * The constructor is called on every object in a slab when the slab is
+ * added to the cache, and the destructor on every object in a slab when
+ * the slab is reclaimed. Either may be NULL. Objects passed to
+ * slab_obj_free() must be back in their constructed state.
  */
 typedef struct slab_allocator slab_allocator_t;
+typedef void (*slab_obj_func_t)(void *obj);
 
-slab_allocator_t *slab_allocator_create(const char *name, size_t size);
+slab_allocator_t *slab_allocator_create(const char *name, size_t size,
+                                        slab_obj_func_t ctor, slab_obj_func_t dtor);
 int slab_allocators_reclaim(int target);
 
 void *slab_obj_alloc(slab_allocator_t *allocator);
 void slab_obj_free(slab_allocator_t *allocator, void *obj);
+
+/*
+ * Frees an object the way slab_obj_free() does when called on a CPU
+ * other than the one which owns the object's slab: the object is put on
+ * the slab's remote free list and only becomes available again once the
+ * owner drains that list. Since Weenix runs on one CPU this is only
+ * useful for exercising that path (see test/slabtest.c).
+ */
+void slab_obj_free_remote(slab_allocator_t *allocator, void *obj);
+
+/**
+ * Provides usage statistics for every slab allocator (and shrinker):
+ * objects in use, objects the allocator has room for, the high-water
+ * mark of objects in use, object size, slabs, pages per slab, and the
+ * number of allocations, frees, slab grows and failed allocations
+ * since boot.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t slab_allocators_info(const void *arg, char *buf, size_t osize);
+
+/* Pages of the buffer /dev/slabinfo and the kshell slabinfo command
+ * format slab_allocators_info() into */
+#define SLABINFO_NPAGES         2
+
+#ifdef SLAB_TRACE
+/**
+ * Provides the live objects of every slab allocator grouped by the
+ * address they were allocated from (for kmalloc()ed objects, the caller
+ * of kmalloc()), with the age of the oldest object from each call site.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t slab_trace_info(const void *arg, char *buf, size_t osize);
+
+/**
+ * Looks for leaked objects by conservatively marking every live object
+ * which can be reached from the kernel's data and bss sections or from a
+ * thread's stack, and provides the objects which could not be reached,
+ * grouped by call site. Objects only pointed to from page_alloc()ed
+ * memory other than stacks show up here too, so these are candidates
+ * rather than certain leaks.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t slab_leak_info(const void *arg, char *buf, size_t osize);
+#endif
+
+/*
+ * A shrinker is registered by a subsystem which holds on to objects it
+ * could give back under memory pressure (for example vnodes which are
+ * only being kept alive by their resident pages). When the page
+ * allocator runs out of memory, or pageoutd cannot meet its target,
+ * every registered shrinker is asked how many objects it could free
+ * (ss_count) and then asked to free some of them (ss_scan), after
+ * which any slabs that have become empty are returned to the page
+ * allocator.
+ *
+ * ss_scan is given the number of objects to look at and returns the
+ * number of objects it actually freed. Pages it hands back to the page
+ * allocator itself along the way (e.g. the pages of the vnodes it
+ * frees) are not in any slab, so it adds those to *npages, which count
+ * towards what slab_shrink() has recovered. It is called from within
+ * page_alloc(), so while it may block and allocate memory, it should
+ * expect those allocations to fail; shrinkers are never reentered.
+ */
+typedef struct slab_shrinker {
+        const char   *ss_name;
+        int         (*ss_count)(void);
+        int         (*ss_scan)(int nscan, int *npages);
+
+        /* Fields maintained by the slab allocator: */
+        uint32_t      ss_nscanned;      /* objects handed to ss_scan */
+        uint32_t      ss_nfreed;        /* objects ss_scan reported freed */
+        uint32_t      ss_npages;        /* pages ss_scan reported freed */
+        list_link_t   ss_link;          /* link on list of shrinkers */
+} slab_shrinker_t;
+
+void slab_shrinker_register(slab_shrinker_t *shrinker);
+void slab_shrinker_unregister(slab_shrinker_t *shrinker);
+
+/*
+ * Runs the registered shrinkers and then slab_allocators_reclaim()
+ * until at least target pages have been returned to the page
+ * allocator (or everything reclaimable has been, if target is not
+ * positive). Returns the number of pages freed.
+ */
+int slab_shrink(int target);
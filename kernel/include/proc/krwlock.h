@@ -0,0 +1,52 @@
+#pragma once
+
+#include "proc/sched.h"
+
+/*
+ * A lock which any number of readers, or a single writer, can hold.
+ * Waiting writers keep new readers out, and a writer releasing the
+ * lock lets in all the readers which waited for it, so neither side
+ * starves the other.
+ */
+typedef struct krwlock {
+        ktqueue_t       krw_rdq;        /* readers waiting */
+        ktqueue_t       krw_wrq;        /* writers waiting */
+        int             krw_readers;    /* number of readers holding it */
+        struct kthread *krw_writer;     /* the writer holding it */
+} krwlock_t;
+
+/**
+ * Initializes the fields of the specified krwlock_t.
+ *
+ * @param lock the lock to initialize
+ */
+void krwlock_init(krwlock_t *lock);
+
+/**
+ * Locks the specified lock for reading, sharing it with other readers.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant
+ *
+ * @param lock the lock to lock
+ */
+void krwlock_rdlock(krwlock_t *lock);
+
+/**
+ * Locks the specified lock for writing.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant
+ *
+ * @param lock the lock to lock
+ */
+void krwlock_wrlock(krwlock_t *lock);
+
+/**
+ * Unlocks the specified lock, held for reading or for writing.
+ *
+ * @param lock the lock to unlock
+ */
+void krwlock_unlock(krwlock_t *lock);
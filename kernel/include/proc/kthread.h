@@ -25,6 +25,8 @@ typedef struct kthread {
         int             kt_state;       /* this thread's state */
         list_link_t     kt_qlink;       /* link on ktqueue */
         list_link_t     kt_plink;       /* link on proc thread list */
+        void           *kt_journal;     /* the s5fs journal this thread has a handle on */
+        int             kt_journal_nest; /* number of nested handles it started */
 #ifdef __MTP__
         int             kt_detached;    /* if the thread has been detached */
         ktqueue_t       kt_joinq;       /* thread waiting to join with this thread */
@@ -0,0 +1,12 @@
+#pragma once
+
+/*
+ * Streams large sequential transfers to each disk on its own and then
+ * to all of them at once, and reports the throughput of each run. With
+ * independent channels, the aggregate throughput of the last run should
+ * approach the sum of the single-disk ones.
+ *
+ * Reads by default; "-w" writes instead, which destroys the contents of
+ * the disks.
+ */
+int diskbench_main(int argc, char **argv);
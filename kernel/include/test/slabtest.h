@@ -0,0 +1,9 @@
+#pragma once
+
+/*
+ * Randomized alloc/free stress test for the slab allocator, run by
+ * several threads at once. Part of the objects are freed through
+ * slab_obj_free_remote() by a thread other than the one which allocated
+ * them, which exercises the remote free lists.
+ */
+int slabtest_main(int argc, char **argv);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Atomic pointer operations for i386. Weenix is uniprocessor and not
+ * preemptible, so almost nothing needs these; they exist for the few
+ * data structures (such as the slab allocator's remote free lists) which
+ * are designed to be shared between CPUs without a lock.
+ */
+
+/*
+ * If *ptr is old, sets it to new. Returns the value *ptr had before, so
+ * the exchange happened if and only if the return value is old.
+ */
+static inline void *atomic_cmpxchg_ptr(void *volatile *ptr, void *old, void *new)
+{
+        void *prev;
+        __asm__ volatile("lock; cmpxchgl %2, %1"
+                         : "=a"(prev), "+m"(*ptr)
+                         : "r"(new), "0"(old)
+                         : "memory");
+        return prev;
+}
+
+/*
+ * Sets *ptr to new and returns the value it had before.
+ */
+static inline void *atomic_xchg_ptr(void *volatile *ptr, void *new)
+{
+        /* xchg with a memory operand is always locked */
+        __asm__ volatile("xchgl %0, %1"
+                         : "+r"(new), "+m"(*ptr)
+                         :
+                         : "memory");
+        return new;
+}
@@ -167,7 +167,8 @@ idleproc_run(int arg1, void *arg2)
         /* Once you have VFS remember to set the current working directory
          * of the idle and init processes */
 
-        /* Here you need to make the null, zero, and tty devices using mknod */
+        /* Here you need to make the null, zero, and tty devices using mknod
+         * (fsmaker puts /dev/slabinfo on the disk image) */
         /* You can't do this until you have VFS, check the include/drivers/dev.h
          * file for macros with the device ID's you will need to pass to mknod */
     
@@ -189,7 +189,7 @@ _page_split(int order)
 #ifdef __SHADOWD__
         uint32_t num_retrys = 2;
 #else
-        uint32_t num_retrys = 0;
+        uint32_t num_retrys = 1;
 #endif
         int norder;
 
@@ -217,7 +217,7 @@ _page_split(int order)
                 shadowd_wakeup();
                 shadowd_alloc_sleep();
 #endif
-                int num_freed = slab_allocators_reclaim(0);
+                int num_freed = slab_shrink(1 << order);
                 dbg(DBG_MM, "reclaimed %d pages from slab allocator.\n", num_freed);
         } while (num_retrys-- > 0);
 
@@ -113,6 +113,25 @@ static void pageoutd_exit(void);
 #define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
 
 
+/*
+ * Slab constructor for pframes. Puts a pframe into the state pframe_free()
+ * leaves it in: not busy, not pinned, with an empty wait queue and on
+ * no lists.
+ */
+static void
+pframe_ctor(void *obj)
+{
+        pframe_t *pf = (pframe_t *)obj;
+
+        pf->pf_obj = NULL;
+        pf->pf_flags = 0;
+        sched_queue_init(&pf->pf_waitq);
+        pf->pf_pincount = 0;
+        list_link_init(&pf->pf_link);
+        list_link_init(&pf->pf_hlink);
+        list_link_init(&pf->pf_olink);
+}
+
 /*
  * Initialize the pinned and allocated counts and lists. Then, make a pframe
  * slab allocator. You should also list_init all the lists that make
@@ -128,7 +147,8 @@ pframe_init(void)
         nallocated = 0;
         list_init(&alloc_list);
 
-        pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
+        pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t),
+                                                 pframe_ctor, NULL);
         KASSERT(NULL != pframe_allocator);
 
         /* initialize pframe_hash: */
@@ -240,11 +260,11 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
         nallocated++;
         list_insert_tail(&alloc_list, &pf->pf_link);
 
+        /* the rest of the pframe was set up by pframe_ctor() */
+        KASSERT(!pframe_is_pinned(pf) && sched_queue_empty(&pf->pf_waitq));
         pf->pf_obj = o;
         pf->pf_pagenum = pagenum;
         pf->pf_flags = 0;
-        sched_queue_init(&pf->pf_waitq);
-        pf->pf_pincount = 0;
 
         list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
 
@@ -297,7 +317,39 @@ pframe_fill(pframe_t *pf)
 int
 pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_get");
+        pframe_t *pf;
+        int ret;
+
+        KASSERT(NULL != o);
+        KASSERT(NULL != result);
+
+        *result = NULL;
+        while (1) {
+                if (NULL != (pf = pframe_get_resident(o, pagenum))) {
+                        if (!pframe_is_busy(pf)) {
+                                *result = pf;
+                                return 0;
+                        }
+                        /* it may have been freed by the time it is not
+                         * busy, so look it up again */
+                        sched_sleep_on(&pf->pf_waitq);
+                        continue;
+                }
+                if (!pageoutd_needed())
+                        break;
+                pageoutd_wakeup();
+                sched_sleep_on(&alloc_waitq);
+        }
+
+        if (NULL == (pf = pframe_alloc(o, pagenum)))
+                return -ENOMEM;
+
+        if (0 > (ret = pframe_fill(pf))) {
+                pframe_free(pf);
+                return ret;
+        }
+
+        *result = pf;
         return 0;
 }
 
@@ -357,7 +409,16 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
 void
 pframe_pin(pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_pin");
+        KASSERT(!pframe_is_free(pf));
+        KASSERT(0 <= pf->pf_pincount);
+
+        if (0 == pf->pf_pincount) {
+                nallocated--;
+                list_remove(&pf->pf_link);
+                npinned++;
+                list_insert_tail(&pinned_list, &pf->pf_link);
+        }
+        pf->pf_pincount++;
 }
 
 /*
@@ -373,7 +434,15 @@ pframe_pin(pframe_t *pf)
 void
 pframe_unpin(pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_unpin");
+        KASSERT(!pframe_is_free(pf));
+        KASSERT(0 < pf->pf_pincount);
+
+        if (0 == --pf->pf_pincount) {
+                npinned--;
+                list_remove(&pf->pf_link);
+                nallocated++;
+                list_insert_tail(&alloc_list, &pf->pf_link);
+        }
 }
 
 /*
@@ -618,6 +687,12 @@ pageoutd_run(int arg1, void *arg2)
                         }
                 }
 
+                /* Paging out everything was not enough; give back whatever
+                 * the other caches can spare, along with the slabs emptied
+                 * by freeing the pframes above. */
+                if (!pageoutd_target_met())
+                        slab_shrink(nfreepages_target - page_free_count());
+
                 /*   release the thundering herd... */
                 sched_broadcast_on(&alloc_waitq);
 
@@ -9,15 +9,32 @@
  * Note that there is no need for locking in allocation and deallocation because
  * it never blocks nor is used by an interrupt handler. Hurray for non preemptible
  * kernels!
+ *
+ * That only holds as long as there is one CPU. To keep it holding for the
+ * common case once there are more, every slab belongs to the CPU which
+ * grew it, and only that CPU touches the slab's free list and counts.
+ * Objects freed on any other CPU are pushed onto the slab's remote free
+ * list with a compare-and-swap, and the owner moves them back to the
+ * free list when it runs out of free objects or reclaims slabs.
  */
 
 #include "types.h"
+#include "kernel.h"
+#include "config.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
 
 #include "mm/mm.h"
 #include "mm/slab.h"
 #include "mm/page.h"
 
+#include "proc/proc.h"
+#include "proc/kthread.h"
+
+#include "util/atomic.h"
 #include "util/gdb.h"
+#include "util/printf.h"
 #include "util/string.h"
 #include "util/debug.h"
 
@@ -42,8 +59,13 @@ struct slab {
         int                      s_inuse;      /* number of allocated objs */
         void                    *s_free;       /* head of obj free list */
         void                    *s_addr;       /* start address */
+        int                      s_owner;      /* CPU which owns s_free and s_inuse */
+        void * volatile          s_remote_free; /* objs freed by other CPUs */
 };
 
+/* The CPU we are running on. Weenix only runs on one. */
+#define slab_cpuid()            0
+
 struct slab_allocator {
         struct slab_allocator   *sa_next;       /* link on list of slab allocators */
         const char              *sa_name;       /* user-provided name */
@@ -51,6 +73,17 @@ struct slab_allocator {
         struct slab             *sa_slabs;      /* head of slab list */
         int                      sa_order;      /* npages = (1 << order) */
         int                      sa_slab_nobjs; /* number of objs per slab */
+        slab_obj_func_t          sa_ctor;       /* object constructor, or NULL */
+        slab_obj_func_t          sa_dtor;       /* object destructor, or NULL */
+
+        /* Statistics, see slab_allocators_info(): */
+        uint32_t                 sa_nslabs;     /* slabs currently held */
+        uint32_t                 sa_nactive;    /* objects currently allocated */
+        uint32_t                 sa_peak;       /* high-water mark of sa_nactive */
+        uint32_t                 sa_nallocs;    /* successful allocations */
+        uint32_t                 sa_nfrees;     /* frees */
+        uint32_t                 sa_ngrows;     /* slabs added to the allocator */
+        uint32_t                 sa_nfails;     /* allocations which failed */
 };
 
 struct slab_bufctl {
@@ -61,6 +94,11 @@ struct slab_bufctl {
 #ifdef SLAB_CHECK_FREE
         uint8_t                  sb_free;       /* true if is object is free */
 #endif
+#ifdef SLAB_TRACE
+        void                    *sb_caller;     /* where it was allocated, NULL if free */
+        uint32_t                 sb_time;       /* slab_trace_now() when allocated */
+        uint8_t                  sb_mark;       /* SLAB_MARK_*, see slab_leak_info() */
+#endif
 };
 #define sb_next                 u.sb_next
 #define sb_slab                 u.sb_slab
@@ -73,12 +111,44 @@ struct slab_bufctl {
         ( (void*) (((uintptr_t)(obj)) + (allocator)->sa_objsize \
                    + sizeof(struct slab_bufctl)) )
 
+/* The address handed out to the user for an object */
+#ifdef SLAB_REDZONE
+#define user_obj(obj)   ( (void*)(((uintptr_t)(obj)) + sizeof(SLAB_REDZONE)) )
+#else
+#define user_obj(obj)   (obj)
+#endif
+
+#ifdef SLAB_TRACE
+/* Allocation times are kept in units of 2^SLAB_TRACE_TSC_SHIFT cycles
+ * (about a millisecond) so they fit in 32 bits. */
+#define SLAB_TRACE_TSC_SHIFT    20
+#define slab_trace_now()        ((uint32_t)(rdtsc() >> SLAB_TRACE_TSC_SHIFT))
+
+#define SLAB_MARK_NONE          0       /* not (yet) found to be reachable */
+#define SLAB_MARK_REACHED       1       /* reachable, contents not scanned yet */
+#define SLAB_MARK_SCANNED       2       /* reachable and scanned */
+
+/* The number of distinct call sites slab_trace_info() can report */
+#define SLAB_TRACE_NSITES       128
+#endif
+
 GDB_DEFINE_HOOK(slab_obj_alloc, void *addr, struct slab_allocator *allocator)
 GDB_DEFINE_HOOK(slab_obj_free, void *addr, struct slab_allocator *allocator)
 
 /* Head of global list of slab allocators. */
 static struct slab_allocator *slab_allocators = NULL;
 
+/* List of registered shrinkers, see slab_shrink(). This is statically
+ * initialized because page_alloc() may fall back on slab_shrink() before
+ * slab_init() has run. */
+static list_t slab_shrinkers = { &slab_shrinkers, &slab_shrinkers };
+
+/* slab_shrink() starts by asking each shrinker to scan only
+ * 1/(2^(SLAB_SHRINK_PRIORITIES-1)) of its objects and doubles that
+ * fraction each pass until the target is met or everything has been
+ * scanned. */
+#define SLAB_SHRINK_PRIORITIES  4
+
 /* Special case - allocator for allocation of slab_allocator objects. */
 static struct slab_allocator slab_allocator_allocator;
 
@@ -158,7 +228,8 @@ _calc_slab_size(struct slab_allocator *allocator)
 }
 
 static void
-_allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
+_allocator_init(struct slab_allocator *allocator, const char *name, size_t size,
+                slab_obj_func_t ctor, slab_obj_func_t dtor)
 {
 #ifdef SLAB_REDZONE
         /*
@@ -173,6 +244,15 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
         allocator->sa_name = name;
         allocator->sa_objsize = size;
         allocator->sa_slabs = NULL;
+        allocator->sa_ctor = ctor;
+        allocator->sa_dtor = dtor;
+        allocator->sa_nslabs = 0;
+        allocator->sa_nactive = 0;
+        allocator->sa_peak = 0;
+        allocator->sa_nallocs = 0;
+        allocator->sa_nfrees = 0;
+        allocator->sa_ngrows = 0;
+        allocator->sa_nfails = 0;
         _calc_slab_size(allocator);
 
         /* Add cache to global cache list. */
@@ -187,14 +267,15 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
 }
 
 struct slab_allocator *
-slab_allocator_create(const char *name, size_t size) {
+slab_allocator_create(const char *name, size_t size,
+                      slab_obj_func_t ctor, slab_obj_func_t dtor) {
         struct slab_allocator *allocator;
 
         allocator = (struct slab_allocator *) slab_obj_alloc(&slab_allocator_allocator);
         if (!allocator)
                 return NULL;
 
-        _allocator_init(allocator, name, size);
+        _allocator_init(allocator, name, size, ctor, dtor);
         return allocator;
 }
 
@@ -237,6 +318,8 @@ _slab_allocator_grow(struct slab_allocator *allocator)
         slab->s_free = addr;
         slab->s_addr = addr;
         slab->s_inuse = 0;
+        slab->s_owner = slab_cpuid();
+        slab->s_remote_free = NULL;
 
         /* Initialize objects. */
         obj = addr;
@@ -245,6 +328,11 @@ _slab_allocator_grow(struct slab_allocator *allocator)
                 front_rz(obj) = SLAB_REDZONE;
                 rear_rz(allocator, obj) = SLAB_REDZONE;
 #endif
+#ifdef SLAB_TRACE
+                obj_bufctl(allocator, obj)->sb_caller = NULL;
+#endif
+                if (NULL != allocator->sa_ctor)
+                        allocator->sa_ctor(user_obj(obj));
                 obj = next_obj(allocator, obj);
         }
 
@@ -255,12 +343,54 @@ _slab_allocator_grow(struct slab_allocator *allocator)
         /* Place this slab into the cache. */
         slab->s_next = allocator->sa_slabs;
         allocator->sa_slabs = slab;
+        allocator->sa_nslabs++;
+        allocator->sa_ngrows++;
 
         return 1;
 }
 
-void *
-slab_obj_alloc(struct slab_allocator *allocator)
+/*
+ * Moves the objects other CPUs have freed back onto the free lists of the
+ * slabs this CPU owns. Returns the number of objects moved.
+ */
+static int
+_slab_allocator_drain_remote(struct slab_allocator *allocator)
+{
+        struct slab *slab;
+        int ndrained = 0;
+
+        for (slab = allocator->sa_slabs; NULL != slab; slab = slab->s_next) {
+                void *obj, *last;
+                int n;
+
+                if (slab->s_owner != slab_cpuid() || NULL == slab->s_remote_free)
+                        continue;
+
+                /* Take the whole list at once; frees which race with us
+                 * start a new one. */
+                obj = atomic_xchg_ptr(&slab->s_remote_free, NULL);
+                for (n = 1, last = obj; NULL != obj_bufctl(allocator, last)->sb_next;
+                     n++, last = obj_bufctl(allocator, last)->sb_next)
+                        ;
+
+                obj_bufctl(allocator, last)->sb_next = slab->s_free;
+                slab->s_free = obj;
+                slab->s_inuse -= n;
+                KASSERT(0 <= slab->s_inuse);
+
+                allocator->sa_nfrees += n;
+                allocator->sa_nactive -= n;
+                ndrained += n;
+        }
+
+        if (0 < ndrained)
+                dbg(DBG_MM, "Drained %d remotely freed objects into \"%s\" (0x%p)\n",
+                    ndrained, allocator->sa_name, allocator);
+        return ndrained;
+}
+
+static void *
+_slab_obj_alloc(struct slab_allocator *allocator, void *caller)
 {
         struct slab *slab;
         void *obj;
@@ -268,12 +398,17 @@ slab_obj_alloc(struct slab_allocator *allocator)
         /* Find a slab with a free object. */
         for (;;) {
                 slab = allocator->sa_slabs;
-                while (slab && (slab->s_inuse == allocator->sa_slab_nobjs))
+                while (slab && ((slab->s_owner != slab_cpuid())
+                                || (slab->s_inuse == allocator->sa_slab_nobjs)))
                         slab = slab->s_next;
                 if (slab && (slab->s_inuse < allocator->sa_slab_nobjs))
                         break;
-                if (!_slab_allocator_grow(allocator))
+                if (0 < _slab_allocator_drain_remote(allocator))
+                        continue;
+                if (!_slab_allocator_grow(allocator)) {
+                        allocator->sa_nfails++;
                         return NULL;
+                }
         }
 
         /*
@@ -287,28 +422,61 @@ slab_obj_alloc(struct slab_allocator *allocator)
 #ifdef SLAB_CHECK_FREE
         obj_bufctl(allocator, obj)->sb_free = 0;
 #endif
+#ifdef SLAB_TRACE
+        obj_bufctl(allocator, obj)->sb_caller = caller;
+        obj_bufctl(allocator, obj)->sb_time = slab_trace_now();
+#endif
 
         slab->s_inuse++;
 
+        allocator->sa_nallocs++;
+        if (++allocator->sa_nactive > allocator->sa_peak)
+                allocator->sa_peak = allocator->sa_nactive;
+
         dbg(DBG_MM, "Allocated object 0x%p from \"%s\" (0x%p), "
             "slab 0x%p, inuse %d\n", obj, allocator->sa_name,
             allocator, allocator, slab->s_inuse);
 
 #ifdef SLAB_REDZONE
         VERIFY_REDZONES(allocator, obj);
+#endif
 
         /*
          * Make object pointer point past the first red-zone.
          */
-        obj = (void *)((uintptr_t)obj + sizeof(SLAB_REDZONE));
-#endif
+        obj = user_obj(obj);
 
         GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
         return obj;
 }
 
-void
-slab_obj_free(struct slab_allocator *allocator, void *obj)
+void *
+slab_obj_alloc(struct slab_allocator *allocator)
+{
+        return _slab_obj_alloc(allocator, __builtin_return_address(0));
+}
+
+/*
+ * Frees an object into a slab owned by another CPU; see the comment at
+ * the top of this file.
+ */
+static void
+_slab_obj_free_remote(struct slab_allocator *allocator, struct slab *slab, void *obj)
+{
+        void *head;
+
+        do {
+                head = slab->s_remote_free;
+                obj_bufctl(allocator, obj)->sb_next = head;
+        } while (head != atomic_cmpxchg_ptr(&slab->s_remote_free, head, obj));
+
+        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, "
+            "remotely (owner %d)\n", obj, allocator->sa_name, allocator, slab,
+            slab->s_owner);
+}
+
+static void
+_slab_obj_free(struct slab_allocator *allocator, void *obj, int remote)
 {
         struct slab *slab;
         GDB_CALL_HOOK(slab_obj_free, obj, allocator);
@@ -324,19 +492,42 @@ slab_obj_free(struct slab_allocator *allocator, void *obj)
         KASSERT(!obj_bufctl(allocator, obj)->sb_free && "INVALID FREE!");
         obj_bufctl(allocator, obj)->sb_free = 1;
 #endif
+#ifdef SLAB_TRACE
+        obj_bufctl(allocator, obj)->sb_caller = NULL;
+#endif
 
         slab = obj_bufctl(allocator, obj)->sb_slab;
 
+        if (remote || slab->s_owner != slab_cpuid()) {
+                _slab_obj_free_remote(allocator, slab, obj);
+                return;
+        }
+
         /* Place this object back on the slab's free list. */
         obj_bufctl(allocator, obj)->sb_next = slab->s_free;
         slab->s_free = obj;
 
         slab->s_inuse--;
 
+        allocator->sa_nfrees++;
+        allocator->sa_nactive--;
+
         dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
             obj, allocator->sa_name, allocator, slab, slab->s_inuse);
 }
 
+void
+slab_obj_free(struct slab_allocator *allocator, void *obj)
+{
+        _slab_obj_free(allocator, obj, 0);
+}
+
+void
+slab_obj_free_remote(struct slab_allocator *allocator, void *obj)
+{
+        _slab_obj_free(allocator, obj, 1);
+}
+
 /*
  * Reclaims as much memory (up to a target) from
  * unused slabs as possible
@@ -354,17 +545,28 @@ slab_allocators_reclaim(int target)
 
         /* Go through all caches */
         for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                _slab_allocator_drain_remote(a);
                 prev = &(a->sa_slabs);
                 s = a->sa_slabs;
                 while (NULL != s) {
                         struct slab *next = s->s_next;
-                        if (0 == s->s_inuse) {
+                        if (0 == s->s_inuse && s->s_owner == slab_cpuid()) {
                                 /* Free Slab */
                                 (*prev) = next;
                                 npages = 1 << a->sa_order;
 
+                                if (NULL != a->sa_dtor) {
+                                        int ii;
+                                        void *obj = s->s_addr;
+                                        for (ii = 0; ii < a->sa_slab_nobjs; ii++) {
+                                                a->sa_dtor(user_obj(obj));
+                                                obj = next_obj(a, obj);
+                                        }
+                                }
+
                                 page_free_n(s->s_addr, npages);
                                 npages_freed += npages;
+                                a->sa_nslabs--;
                         } else {
                                 prev = &(s->s_next);
                         }
@@ -378,6 +580,353 @@ slab_allocators_reclaim(int target)
         return npages_freed;
 }
 
+size_t
+slab_allocators_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        struct slab_allocator *a;
+        slab_shrinker_t *shrinker;
+        uint32_t npages = 0;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "%-16s %7s %7s %7s %6s %5s %3s %9s %9s %6s %5s\n",
+                "NAME", "ACTIVE", "TOTAL", "PEAK", "OBJSZ", "SLABS", "PPS",
+                "ALLOCS", "FREES", "GROWS", "FAILS");
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                iprintf(&buf, &size, "%-16s %7u %7u %7u %6u %5u %3u %9u %9u %6u %5u\n",
+                        a->sa_name, a->sa_nactive,
+                        a->sa_nslabs * a->sa_slab_nobjs, a->sa_peak,
+                        a->sa_objsize, a->sa_nslabs, 1 << a->sa_order,
+                        a->sa_nallocs, a->sa_nfrees, a->sa_ngrows,
+                        a->sa_nfails);
+                npages += a->sa_nslabs << a->sa_order;
+        }
+        iprintf(&buf, &size, "total: %u pages in slabs\n", npages);
+
+        if (!list_empty(&slab_shrinkers)) {
+                iprintf(&buf, &size, "\n%-16s %9s %9s %9s\n", "SHRINKER",
+                        "SCANNED", "FREED", "PAGES");
+                list_iterate_begin(&slab_shrinkers, shrinker, slab_shrinker_t,
+                                   ss_link) {
+                        iprintf(&buf, &size, "%-16s %9u %9u %9u\n", shrinker->ss_name,
+                                shrinker->ss_nscanned, shrinker->ss_nfreed,
+                                shrinker->ss_npages);
+                } list_iterate_end();
+        }
+
+        return size;
+}
+
+#ifdef SLAB_TRACE
+struct slab_trace_site {
+        struct slab_allocator   *ts_allocator;
+        void                    *ts_caller;
+        uint32_t                 ts_count;      /* number of objects */
+        uint32_t                 ts_oldest;     /* sb_time of the oldest object */
+        void                    *ts_example;    /* one of the objects */
+};
+
+static struct slab_trace_site slab_trace_sites[SLAB_TRACE_NSITES];
+static int slab_trace_nsites;
+static uint32_t slab_trace_nother;      /* objects which did not fit in the table */
+
+/* Bounds of all slabs, used to quickly reject non-pointers while marking */
+static uintptr_t slab_trace_lo, slab_trace_hi;
+
+#define slab_stride(allocator)  ((allocator)->sa_objsize + sizeof(struct slab_bufctl))
+
+/*
+ * Groups every live object (or, if leaked is true, every live object
+ * slab_leak_info() could not reach) into slab_trace_sites by call site,
+ * most objects first.
+ */
+static void
+_slab_trace_collect(int leaked)
+{
+        struct slab_allocator *a;
+        struct slab *s;
+        int i, j;
+
+        memset(slab_trace_sites, 0, sizeof(slab_trace_sites));
+        slab_trace_nsites = 0;
+        slab_trace_nother = 0;
+
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                for (s = a->sa_slabs; NULL != s; s = s->s_next) {
+                        void *obj = s->s_addr;
+                        for (i = 0; i < a->sa_slab_nobjs; i++, obj = next_obj(a, obj)) {
+                                struct slab_bufctl *bc = obj_bufctl(a, obj);
+                                struct slab_trace_site *ts;
+
+                                if (NULL == bc->sb_caller)
+                                        continue;
+                                if (leaked && SLAB_MARK_NONE != bc->sb_mark)
+                                        continue;
+
+                                for (j = 0; j < slab_trace_nsites; j++) {
+                                        ts = &slab_trace_sites[j];
+                                        if (ts->ts_allocator == a && ts->ts_caller == bc->sb_caller)
+                                                break;
+                                }
+                                if (j == slab_trace_nsites) {
+                                        if (SLAB_TRACE_NSITES == slab_trace_nsites) {
+                                                slab_trace_nother++;
+                                                continue;
+                                        }
+                                        ts = &slab_trace_sites[slab_trace_nsites++];
+                                        ts->ts_allocator = a;
+                                        ts->ts_caller = bc->sb_caller;
+                                        ts->ts_oldest = bc->sb_time;
+                                        ts->ts_example = user_obj(obj);
+                                }
+                                ts->ts_count++;
+                                /* (wraps around like the clock does) */
+                                if ((int32_t)(bc->sb_time - ts->ts_oldest) < 0)
+                                        ts->ts_oldest = bc->sb_time;
+                        }
+                }
+        }
+
+        /* There are few enough sites that a selection sort will do */
+        for (i = 0; i < slab_trace_nsites; i++) {
+                int max = i;
+                for (j = i + 1; j < slab_trace_nsites; j++)
+                        if (slab_trace_sites[j].ts_count > slab_trace_sites[max].ts_count)
+                                max = j;
+                if (max != i) {
+                        struct slab_trace_site tmp = slab_trace_sites[i];
+                        slab_trace_sites[i] = slab_trace_sites[max];
+                        slab_trace_sites[max] = tmp;
+                }
+        }
+}
+
+static void
+_slab_trace_print(char **buf, size_t *size)
+{
+        uint32_t now = slab_trace_now();
+        int i;
+
+        iprintf(buf, size, "%-16s %-10s %7s %9s %10s %-10s\n", "ALLOCATOR",
+                "CALLER", "OBJECTS", "BYTES", "MAX AGE", "EXAMPLE");
+        for (i = 0; i < slab_trace_nsites; i++) {
+                struct slab_trace_site *ts = &slab_trace_sites[i];
+                iprintf(buf, size, "%-16s 0x%.8x %7u %9u %10u 0x%.8x\n",
+                        ts->ts_allocator->sa_name, (uintptr_t)ts->ts_caller,
+                        ts->ts_count, ts->ts_count * ts->ts_allocator->sa_objsize,
+                        now - ts->ts_oldest, (uintptr_t)ts->ts_example);
+        }
+        if (0 < slab_trace_nother)
+                iprintf(buf, size, "(%u objects from other call sites)\n",
+                        slab_trace_nother);
+        iprintf(buf, size, "(ages are in units of 2^%d cycles)\n",
+                SLAB_TRACE_TSC_SHIFT);
+}
+
+size_t
+slab_trace_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        _slab_trace_collect(0);
+        _slab_trace_print(&buf, &size);
+        return size;
+}
+
+/*
+ * If addr points into a live object, returns the start of that object
+ * (including its front redzone), otherwise NULL.
+ */
+static void *
+_slab_trace_find(uintptr_t addr, struct slab_allocator **ap)
+{
+        struct slab_allocator *a;
+        struct slab *s;
+
+        if (addr < slab_trace_lo || addr >= slab_trace_hi)
+                return NULL;
+
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                for (s = a->sa_slabs; NULL != s; s = s->s_next) {
+                        uintptr_t start = (uintptr_t)s->s_addr;
+                        uintptr_t off = addr - start;
+                        void *obj;
+
+                        if (addr < start || off >= slab_stride(a) * a->sa_slab_nobjs)
+                                continue;
+                        if (off % slab_stride(a) >= a->sa_objsize)
+                                return NULL; /* points at a bufctl */
+
+                        obj = (void *)(start + (off / slab_stride(a)) * slab_stride(a));
+                        if (NULL == obj_bufctl(a, obj)->sb_caller)
+                                return NULL; /* points at a free object */
+                        *ap = a;
+                        return obj;
+                }
+        }
+        return NULL;
+}
+
+/* Marks every live object pointed to by a word in [start, end). */
+static void
+_slab_trace_mark(const void *start, const void *end)
+{
+        const uintptr_t *word = (const uintptr_t *)
+                                (((uintptr_t)start + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1));
+
+        for (; (const void *)(word + 1) <= end; word++) {
+                struct slab_allocator *a;
+                void *obj;
+
+                if (NULL != (obj = _slab_trace_find(*word, &a))
+                    && SLAB_MARK_NONE == obj_bufctl(a, obj)->sb_mark)
+                        obj_bufctl(a, obj)->sb_mark = SLAB_MARK_REACHED;
+        }
+}
+
+size_t
+slab_leak_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        struct slab_allocator *a;
+        struct slab *s;
+        proc_t *p;
+        kthread_t *thr;
+        int i, scanned;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        /* Forget the results of the last run, they would mark objects */
+        memset(slab_trace_sites, 0, sizeof(slab_trace_sites));
+        slab_trace_nsites = 0;
+
+        /* Unmark everything */
+        slab_trace_lo = (uintptr_t) -1;
+        slab_trace_hi = 0;
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                for (s = a->sa_slabs; NULL != s; s = s->s_next) {
+                        void *obj = s->s_addr;
+                        for (i = 0; i < a->sa_slab_nobjs; i++, obj = next_obj(a, obj))
+                                obj_bufctl(a, obj)->sb_mark = SLAB_MARK_NONE;
+                        slab_trace_lo = MIN(slab_trace_lo, (uintptr_t)s->s_addr);
+                        slab_trace_hi = MAX(slab_trace_hi, (uintptr_t)obj);
+                }
+        }
+
+        /* Roots: global variables and the stacks of all threads */
+        _slab_trace_mark(&kernel_start_data, &kernel_end_bss);
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                list_iterate_begin(&p->p_threads, thr, kthread_t, kt_plink) {
+                        _slab_trace_mark(thr->kt_kstack, thr->kt_kstack + DEFAULT_STACK_SIZE);
+                } list_iterate_end();
+        } list_iterate_end();
+        _slab_trace_mark(curthr->kt_kstack, curthr->kt_kstack + DEFAULT_STACK_SIZE);
+
+        /* Everything reachable from a reachable object is reachable */
+        do {
+                scanned = 0;
+                for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                        for (s = a->sa_slabs; NULL != s; s = s->s_next) {
+                                void *obj = s->s_addr;
+                                for (i = 0; i < a->sa_slab_nobjs; i++, obj = next_obj(a, obj)) {
+                                        struct slab_bufctl *bc = obj_bufctl(a, obj);
+                                        if (NULL == bc->sb_caller || SLAB_MARK_REACHED != bc->sb_mark)
+                                                continue;
+                                        bc->sb_mark = SLAB_MARK_SCANNED;
+                                        _slab_trace_mark(obj, (char *)obj + a->sa_objsize);
+                                        scanned++;
+                                }
+                        }
+                }
+        } while (0 < scanned);
+
+        _slab_trace_collect(1);
+        iprintf(&buf, &size, "unreachable objects:\n");
+        _slab_trace_print(&buf, &size);
+        return size;
+}
+#endif /* SLAB_TRACE */
+
+void
+slab_shrinker_register(slab_shrinker_t *shrinker)
+{
+        KASSERT(NULL != shrinker->ss_count && NULL != shrinker->ss_scan);
+        KASSERT(!list_link_is_linked(&shrinker->ss_link));
+
+        shrinker->ss_nscanned = 0;
+        shrinker->ss_nfreed = 0;
+        shrinker->ss_npages = 0;
+        list_insert_tail(&slab_shrinkers, &shrinker->ss_link);
+}
+
+void
+slab_shrinker_unregister(slab_shrinker_t *shrinker)
+{
+        KASSERT(list_link_is_linked(&shrinker->ss_link));
+        list_remove(&shrinker->ss_link);
+}
+
+int
+slab_shrink(int target)
+{
+        static int shrinking = 0;
+        int npages_freed = 0;
+        int priority;
+
+        /* A shrinker which needs memory to give back memory (e.g. to
+         * write back an inode) must not recurse into the shrinkers. */
+        if (shrinking)
+                return slab_allocators_reclaim(target);
+        shrinking = 1;
+
+        for (priority = SLAB_SHRINK_PRIORITIES - 1; priority >= 0; --priority) {
+                slab_shrinker_t *shrinker;
+
+                list_iterate_begin(&slab_shrinkers, shrinker, slab_shrinker_t, ss_link) {
+                        int count, nscan, n, npages = 0;
+
+                        if (0 >= (count = shrinker->ss_count()))
+                                continue;
+                        if (0 == (nscan = count >> priority))
+                                nscan = 1;
+
+                        n = shrinker->ss_scan(nscan, &npages);
+                        KASSERT(0 <= n && 0 <= npages);
+                        shrinker->ss_nscanned += nscan;
+                        shrinker->ss_nfreed += n;
+                        shrinker->ss_npages += npages;
+                        npages_freed += npages;
+
+                        dbg(DBG_MM, "shrinker %s: scanned %d of %d, freed %d "
+                            "and %d pages (priority %d)\n", shrinker->ss_name,
+                            nscan, count, n, npages, priority);
+                } list_iterate_end();
+
+                if (target > 0) {
+                        /* The pages the shrinkers freed may satisfy the request */
+                        if (npages_freed >= target)
+                                break;
+                        npages_freed += slab_allocators_reclaim(target - npages_freed);
+                        if (npages_freed >= target)
+                                break;
+                } else {
+                        npages_freed += slab_allocators_reclaim(0);
+                }
+        }
+
+        shrinking = 0;
+
+        dbg(DBG_MM, "slab_shrink: freed %d pages (target %d)\n",
+            npages_freed, target);
+        return npages_freed;
+}
+
 #define KMALLOC_SIZE_MIN_ORDER  (6)
 #define KMALLOC_SIZE_MAX_ORDER  (18)
 
@@ -418,7 +967,7 @@ kmalloc(size_t size)
         cs = kmalloc_allocators;
         for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
                 if ((size_t)(1 << order) >= size) {
-                        addr = slab_obj_alloc(*cs);
+                        addr = _slab_obj_alloc(*cs, __builtin_return_address(0));
                         if (!addr) {
                                 dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
                                 return NULL;
@@ -480,7 +1029,8 @@ slab_init()
         struct slab_allocator **cs;
 
         /* Special case initialization of the kmem_cache_t cache. */
-        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator));
+        _allocator_init(&slab_allocator_allocator, "slab_allocators",
+                        sizeof(struct slab_allocator), NULL, NULL);
 
         /*
          * Allocate the power of two buckets for generic
@@ -488,7 +1038,7 @@ slab_init()
          */
         cs = kmalloc_allocators;
         for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
-                if (NULL == (*cs = slab_allocator_create(kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER], (1 << order)))) {
+                if (NULL == (*cs = slab_allocator_create(kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER], (1 << order), NULL, NULL))) {
                         panic("Couldn't create kmalloc allocators!\n");
                 }
         }
@@ -0,0 +1,70 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+
+#include "proc/kthread.h"
+#include "proc/krwlock.h"
+
+/*
+ * Like mutexes, these locks are handed over to the threads waiting for
+ * them on unlock: a woken thread already holds the lock. They can only
+ * be used from a thread context.
+ */
+
+void
+krwlock_init(krwlock_t *lock)
+{
+        sched_queue_init(&lock->krw_rdq);
+        sched_queue_init(&lock->krw_wrq);
+        lock->krw_readers = 0;
+        lock->krw_writer = NULL;
+}
+
+void
+krwlock_rdlock(krwlock_t *lock)
+{
+        KASSERT(curthr != lock->krw_writer && "the current thread already has the lock");
+
+        if (NULL != lock->krw_writer || !sched_queue_empty(&lock->krw_wrq)) {
+                sched_sleep_on(&lock->krw_rdq);
+                KASSERT(0 < lock->krw_readers);
+        } else {
+                lock->krw_readers++;
+        }
+}
+
+void
+krwlock_wrlock(krwlock_t *lock)
+{
+        KASSERT(curthr != lock->krw_writer && "the current thread already has the lock");
+
+        if (NULL != lock->krw_writer || 0 < lock->krw_readers) {
+                sched_sleep_on(&lock->krw_wrq);
+                KASSERT(curthr == lock->krw_writer);
+        } else {
+                lock->krw_writer = curthr;
+        }
+}
+
+void
+krwlock_unlock(krwlock_t *lock)
+{
+        if (NULL != lock->krw_writer) {
+                KASSERT(curthr == lock->krw_writer);
+                lock->krw_writer = NULL;
+
+                /* The readers which waited for this writer go first */
+                if (!sched_queue_empty(&lock->krw_rdq)) {
+                        lock->krw_readers = lock->krw_rdq.tq_size;
+                        sched_broadcast_on(&lock->krw_rdq);
+                        return;
+                }
+        } else {
+                KASSERT(0 < lock->krw_readers);
+                if (0 < --lock->krw_readers)
+                        return;
+        }
+
+        lock->krw_writer = sched_wakeup_on(&lock->krw_wrq);
+}
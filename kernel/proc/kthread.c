@@ -28,10 +28,31 @@ static list_t kthread_reapd_deadlist; /* Threads to be cleaned */
 static void *kthread_reapd_run(int arg1, void *arg2);
 #endif
 
+/*
+ * Slab constructor for threads. kthread_destroy() returns threads to the
+ * allocator off of every queue and process thread list.
+ */
+static void
+kthread_ctor(void *obj)
+{
+        kthread_t *thr = (kthread_t *)obj;
+
+        thr->kt_kstack = NULL;
+        thr->kt_retval = NULL;
+        thr->kt_wchan = NULL;
+        list_link_init(&thr->kt_qlink);
+        list_link_init(&thr->kt_plink);
+#ifdef __MTP__
+        thr->kt_detached = 0;
+        sched_queue_init(&thr->kt_joinq);
+#endif
+}
+
 void
 kthread_init()
 {
-        kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t));
+        kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t),
+                                                  kthread_ctor, NULL);
         KASSERT(NULL != kthread_allocator);
 }
 
@@ -87,10 +108,12 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
         
         temp_thread->kt_proc=p;
        temp_thread->kt_state=KT_NO_STATE;
-		list_link_init(&temp_thread->kt_qlink);
-		list_link_init(&temp_thread->kt_plink);
+		KASSERT(!list_link_is_linked(&temp_thread->kt_qlink));
+		KASSERT(!list_link_is_linked(&temp_thread->kt_plink));
 		temp_thread->kt_wchan=NULL;
 		temp_thread->kt_cancelled=0;  
+		temp_thread->kt_journal=NULL;
+		temp_thread->kt_journal_nest=0;
 		
 		if(p->p_pid>0)
 		{
@@ -32,11 +32,32 @@ static slab_allocator_t *proc_allocator = NULL;
 static list_t _proc_list;
 static proc_t *proc_initproc = NULL; /* Pointer to the init process (PID 1) */
 
+/*
+ * Slab constructor for processes. A process is returned to the allocator
+ * with no threads or children, off of the process and child lists, and
+ * with nobody waiting on it.
+ */
+static void
+proc_ctor(void *obj)
+{
+        proc_t *p = (proc_t *)obj;
+
+        list_init(&p->p_threads);
+        list_init(&p->p_children);
+        sched_queue_init(&p->p_wait);
+        list_link_init(&p->p_list_link);
+        list_link_init(&p->p_child_link);
+        memset(p->p_files, 0, sizeof(p->p_files));
+        p->p_cwd = NULL;
+        p->p_vmmap = NULL;
+}
+
 void
 proc_init()
 {
         list_init(&_proc_list);
-        proc_allocator = slab_allocator_create("proc", sizeof(proc_t));
+        proc_allocator = slab_allocator_create("proc", sizeof(proc_t),
+                                               proc_ctor, NULL);
         KASSERT(proc_allocator != NULL);
 }
 
@@ -85,13 +106,9 @@ proc_create(char *name)
 		proc_t *temp_proc=slab_obj_alloc(proc_allocator);
 		temp_proc->p_pid=_proc_getid();
 		strcpy(temp_proc->p_comm, name);
-		list_init(&temp_proc->p_threads);
-		list_init(&temp_proc->p_children);
-		list_link_init(&temp_proc->p_list_link);
-		list_link_init(&temp_proc->p_child_link);
+		/* lists and p_wait were set up by proc_ctor() */
 		temp_proc->p_pagedir=pt_create_pagedir();
 		temp_proc->p_state = PROC_RUNNING;
-		sched_queue_init(&temp_proc->p_wait);
 		temp_proc->p_pproc=NULL;
 	
 			list_insert_tail(&_proc_list, &temp_proc->p_list_link);
@@ -346,6 +363,16 @@ do_waitpid(pid_t pid, int options, int *status)
 								kthread_destroy(child_thr);
 													 	
 						 } list_iterate_end();
+						 /* return it to the allocator constructed */
+						 if (list_link_is_linked(&child->p_child_link))
+							 list_remove(&child->p_child_link);
+						 if (list_link_is_linked(&child->p_list_link))
+							 list_remove(&child->p_list_link);
+						 /* the constructor set these up only once, so leave
+						  * them the way it did for the next process */
+						 memset(child->p_files, 0, sizeof(child->p_files));
+						 child->p_cwd = NULL;
+						 child->p_vmmap = NULL;
 						 slab_obj_free(proc_allocator, child);
 					 	 return temp_pid;
 				 	}
@@ -0,0 +1,203 @@
+#include "kernel.h"
+#include "errno.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "proc/sched.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+
+#include "mm/page.h"
+
+#include "test/diskbench.h"
+
+#define DISKBENCH_NDISKS        2       /* disks benchmarked at most */
+#define DISKBENCH_DEPTH         2       /* requests in flight per disk */
+#define DISKBENCH_CHUNK         32      /* blocks per request */
+#define DISKBENCH_NBLOCKS       4096    /* blocks transferred per disk and run */
+
+/* Throughput is reported in KiB per 2^DISKBENCH_MCYCLE_SHIFT cycles */
+#define DISKBENCH_MCYCLE_SHIFT  20
+
+typedef struct diskbench_stream {
+        blockdev_t     *ds_bdev;
+        blockdev_req_t  ds_reqs[DISKBENCH_DEPTH];
+        char           *ds_bufs[DISKBENCH_DEPTH];
+        int             ds_write;
+        blocknum_t      ds_region;      /* blocks of the disk we cycle through */
+        uint32_t        ds_nsubmitted;  /* blocks submitted so far */
+        int             ds_inflight;
+        int             ds_err;
+        uint64_t        ds_start;
+        uint64_t        ds_cycles;
+} diskbench_stream_t;
+
+static diskbench_stream_t diskbench_streams[DISKBENCH_NDISKS];
+
+/* Woken up when a stream finishes */
+static ktqueue_t diskbench_waitq;
+static int diskbench_nrunning;
+
+static void diskbench_done(blockdev_req_t *req);
+
+/* Submits the stream's next chunk using req. Called with disk
+ * interrupts blocked. */
+static void
+diskbench_submit(diskbench_stream_t *s, blockdev_req_t *req, char *buf)
+{
+        blocknum_t block = s->ds_nsubmitted % s->ds_region;
+
+        s->ds_nsubmitted += DISKBENCH_CHUNK;
+        blockdev_req_init(req, s->ds_bdev, s->ds_write, buf, block,
+                          DISKBENCH_CHUNK, diskbench_done, s);
+        blockdev_submit(req);
+}
+
+static void
+diskbench_done(blockdev_req_t *req)
+{
+        diskbench_stream_t *s = (diskbench_stream_t *)req->br_private;
+
+        if (0 > req->br_status)
+                s->ds_err = req->br_status;
+
+        if (0 == s->ds_err && s->ds_nsubmitted < DISKBENCH_NBLOCKS) {
+                diskbench_submit(s, req, req->br_buf);
+                return;
+        }
+
+        if (0 == --s->ds_inflight) {
+                s->ds_cycles = rdtsc() - s->ds_start;
+                diskbench_nrunning--;
+                sched_broadcast_on(&diskbench_waitq);
+        }
+}
+
+/* KiB per 2^DISKBENCH_MCYCLE_SHIFT cycles */
+static uint32_t
+diskbench_rate(uint32_t nblocks, uint64_t cycles)
+{
+        uint32_t mcycles = (uint32_t)(cycles >> DISKBENCH_MCYCLE_SHIFT);
+
+        return nblocks * (BLOCK_SIZE / 1024) / (mcycles ? mcycles : 1);
+}
+
+/* Runs streams [first, first + n) at the same time */
+static int
+diskbench_run(int first, int n)
+{
+        uint64_t cycles = 0;
+        uint8_t oldipl;
+        int i, j;
+
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+
+        diskbench_nrunning = n;
+        for (i = first; i < first + n; i++) {
+                diskbench_stream_t *s = &diskbench_streams[i];
+
+                s->ds_nsubmitted = 0;
+                s->ds_inflight = DISKBENCH_DEPTH;
+                s->ds_err = 0;
+                s->ds_start = rdtsc();
+        }
+        /* Submitting with interrupts blocked makes every disk start
+         * before any of them finishes a chunk */
+        for (i = first; i < first + n; i++) {
+                for (j = 0; j < DISKBENCH_DEPTH; j++) {
+                        diskbench_submit(&diskbench_streams[i],
+                                         &diskbench_streams[i].ds_reqs[j],
+                                         diskbench_streams[i].ds_bufs[j]);
+                }
+        }
+        while (0 < diskbench_nrunning)
+                sched_sleep_on(&diskbench_waitq);
+
+        intr_setipl(oldipl);
+
+        for (i = first; i < first + n; i++) {
+                diskbench_stream_t *s = &diskbench_streams[i];
+
+                if (0 > s->ds_err) {
+                        dbg(DBG_TEST, "disk%u: failed: %d\n",
+                            MINOR(s->ds_bdev->bd_id), s->ds_err);
+                        return s->ds_err;
+                }
+                dbg(DBG_TEST, "disk%u: %u KiB in %u Mcycles, %u KiB/Mcycle\n",
+                    MINOR(s->ds_bdev->bd_id), DISKBENCH_NBLOCKS * (BLOCK_SIZE / 1024),
+                    (uint32_t)(s->ds_cycles >> DISKBENCH_MCYCLE_SHIFT),
+                    diskbench_rate(DISKBENCH_NBLOCKS, s->ds_cycles));
+                if (s->ds_cycles > cycles)
+                        cycles = s->ds_cycles;
+        }
+        if (1 < n) {
+                dbg(DBG_TEST, "aggregate: %u KiB/Mcycle\n",
+                    diskbench_rate(n * DISKBENCH_NBLOCKS, cycles));
+        }
+        return 0;
+}
+
+int
+diskbench_main(int argc, char **argv)
+{
+        int write = 0;
+        int ndisks, i, j;
+        int err = 0;
+
+        if (argc > 2 || (argc == 2 && strcmp(argv[1], "-w"))) {
+                dbg(DBG_TEST, "USAGE: diskbench [-w]\n");
+                return 1;
+        }
+        write = (argc == 2);
+
+        sched_queue_init(&diskbench_waitq);
+        memset(diskbench_streams, 0, sizeof(diskbench_streams));
+
+        for (ndisks = 0; ndisks < DISKBENCH_NDISKS; ndisks++) {
+                diskbench_stream_t *s = &diskbench_streams[ndisks];
+
+                if (NULL == (s->ds_bdev = blockdev_lookup(MKDEVID(DISK_MAJOR, ndisks))))
+                        break;
+                s->ds_write = write;
+                s->ds_region = s->ds_bdev->bd_nblocks
+                               - s->ds_bdev->bd_nblocks % DISKBENCH_CHUNK;
+                if (0 == s->ds_region) {
+                        dbg(DBG_TEST, "disk%d is too small\n", ndisks);
+                        break;
+                }
+                for (j = 0; j < DISKBENCH_DEPTH; j++) {
+                        if (NULL == (s->ds_bufs[j] = page_alloc_n(DISKBENCH_CHUNK))) {
+                                err = -ENOMEM;
+                                goto out;
+                        }
+                }
+        }
+        if (0 == ndisks) {
+                dbg(DBG_TEST, "no disks to benchmark\n");
+                return 1;
+        }
+
+        dbg(DBG_TEST, "streaming %s %u KiB per disk, %d x %u KiB in flight\n",
+            (write ? "writes" : "reads"), DISKBENCH_NBLOCKS * (BLOCK_SIZE / 1024),
+            DISKBENCH_DEPTH, DISKBENCH_CHUNK * (BLOCK_SIZE / 1024));
+        for (i = 0; i < ndisks && 0 == err; i++)
+                err = diskbench_run(i, 1);
+        if (1 < ndisks && 0 == err)
+                err = diskbench_run(0, ndisks);
+
+out:
+        for (i = 0; i < DISKBENCH_NDISKS; i++) {
+                for (j = 0; j < DISKBENCH_DEPTH; j++) {
+                        if (NULL != diskbench_streams[i].ds_bufs[j])
+                                page_free_n(diskbench_streams[i].ds_bufs[j], DISKBENCH_CHUNK);
+                }
+        }
+        return err ? 1 : 0;
+}
@@ -10,8 +10,21 @@
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 #endif
+#ifdef __S5FS__
+#include "fs/vfs.h"
+#include "fs/s5fs/s5fs.h"
+#endif
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/iosched.h"
+
+#include "mm/page.h"
+#include "mm/slab.h"
 
 #include "test/kshell/io.h"
+#include "test/slabtest.h"
+#include "test/diskbench.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -60,6 +73,179 @@ int kshell_echo(kshell_t *ksh, int argc, char **argv)
         return 0;
 }
 
+int kshell_slabinfo(kshell_t *ksh, int argc, char **argv)
+{
+        char *buf;
+        size_t len;
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: slabinfo\n");
+                return 0;
+        }
+
+        if (NULL == (buf = page_alloc_n(SLABINFO_NPAGES)))
+                return -ENOMEM;
+        len = SLABINFO_NPAGES * PAGE_SIZE
+              - slab_allocators_info(NULL, buf, SLABINFO_NPAGES * PAGE_SIZE);
+        kshell_write_all(ksh, buf, len);
+        page_free_n(buf, SLABINFO_NPAGES);
+
+        return 0;
+}
+
+int kshell_slabtest(kshell_t *ksh, int argc, char **argv)
+{
+        return slabtest_main(argc, argv);
+}
+
+static void kshell_iosched_show(kshell_t *ksh, blockdev_t *bd)
+{
+        char buf[256];
+        size_t len;
+
+        kprintf(ksh, "disk%u: ", MINOR(bd->bd_id));
+        len = sizeof(buf) - iosched_info(bd->bd_iosched, buf, sizeof(buf));
+        kshell_write_all(ksh, buf, len);
+}
+
+int kshell_iosched(kshell_t *ksh, int argc, char **argv)
+{
+        blockdev_t *bd;
+        unsigned int minor = 0;
+        char *c;
+        int err;
+
+        if (argc == 1) {
+                for (minor = 0;
+                     NULL != (bd = blockdev_lookup(MKDEVID(DISK_MAJOR, minor)));
+                     minor++) {
+                        if (NULL != bd->bd_iosched)
+                                kshell_iosched_show(ksh, bd);
+                }
+                return 0;
+        }
+
+        if (argc > 3 || '\0' == *argv[1])
+                goto usage;
+        for (c = argv[1]; '\0' != *c; c++) {
+                if (*c < '0' || *c > '9')
+                        goto usage;
+                minor = minor * 10 + (*c - '0');
+        }
+
+        bd = blockdev_lookup(MKDEVID(DISK_MAJOR, minor));
+        if (NULL == bd || NULL == bd->bd_iosched) {
+                kprintf(ksh, "iosched: no such disk: %s\n", argv[1]);
+                return 0;
+        }
+
+        if (argc == 3 && 0 > (err = iosched_set(bd->bd_iosched, argv[2]))) {
+                kprintf(ksh, "iosched: cannot switch to %s: %s\n", argv[2],
+                        (-EBUSY == err ? "disk is busy" : "unknown scheduler"));
+                return 0;
+        }
+        kshell_iosched_show(ksh, bd);
+        return 0;
+
+usage:
+        kprintf(ksh, "Usage: iosched [<disk> [noop|deadline]]\n");
+        return 0;
+}
+
+/* The detailed view includes two histograms */
+#define IOSTAT_NPAGES 1
+
+int kshell_iostat(kshell_t *ksh, int argc, char **argv)
+{
+        blockdev_t *bd = NULL;
+        char *buf;
+        size_t len;
+
+        if (argc > 2) {
+                kprintf(ksh, "Usage: iostat [<device>]\n");
+                return 0;
+        }
+        if (argc == 2 && NULL == (bd = blockdev_lookup_name(argv[1]))) {
+                kprintf(ksh, "iostat: no such device: %s\n", argv[1]);
+                return 0;
+        }
+
+        if (NULL == (buf = page_alloc_n(IOSTAT_NPAGES)))
+                return -ENOMEM;
+        len = IOSTAT_NPAGES * PAGE_SIZE
+              - blockdev_info(bd, buf, IOSTAT_NPAGES * PAGE_SIZE);
+        kshell_write_all(ksh, buf, len);
+        page_free_n(buf, IOSTAT_NPAGES);
+
+        return 0;
+}
+
+int kshell_diskbench(kshell_t *ksh, int argc, char **argv)
+{
+        return diskbench_main(argc, argv);
+}
+
+#ifdef SLAB_TRACE
+/* The call site table can get long */
+#define KMEMTRACE_NPAGES 4
+
+int kshell_kmemtrace(kshell_t *ksh, int argc, char **argv)
+{
+        char *buf;
+        size_t len;
+
+        if (argc > 2 || (argc == 2 && strcmp(argv[1], "-l"))) {
+                kprintf(ksh, "Usage: kmemtrace [-l]\n");
+                return 0;
+        }
+
+        if (NULL == (buf = page_alloc_n(KMEMTRACE_NPAGES)))
+                return -ENOMEM;
+        if (argc == 2) {
+                len = KMEMTRACE_NPAGES * PAGE_SIZE
+                      - slab_leak_info(NULL, buf, KMEMTRACE_NPAGES * PAGE_SIZE);
+        } else {
+                len = KMEMTRACE_NPAGES * PAGE_SIZE
+                      - slab_trace_info(NULL, buf, KMEMTRACE_NPAGES * PAGE_SIZE);
+        }
+        kshell_write_all(ksh, buf, len);
+        page_free_n(buf, KMEMTRACE_NPAGES);
+
+        return 0;
+}
+#endif
+
+#ifdef __S5FS__
+/* Enough for the problems s5fs_fsck() describes, and its summary */
+#define FSCK_NPAGES 2
+
+int kshell_fsck(kshell_t *ksh, int argc, char **argv)
+{
+        fs_t *fs = vfs_root_vn->vn_fs;
+        char *buf;
+        int ret;
+
+        if (argc > 1) {
+                kprintf(ksh, "Usage: fsck\n");
+                return 0;
+        }
+        if (strcmp(fs->fs_type, "s5fs")) {
+                kprintf(ksh, "fsck: the root file system is %s, not s5fs\n", fs->fs_type);
+                return 0;
+        }
+
+        if (NULL == (buf = page_alloc_n(FSCK_NPAGES)))
+                return -ENOMEM;
+        if (0 > (ret = s5fs_fsck(fs, buf, FSCK_NPAGES * PAGE_SIZE)))
+                kprintf(ksh, "fsck: could not check the file system: %d\n", ret);
+        else
+                kshell_write_all(ksh, buf, strlen(buf));
+        page_free_n(buf, FSCK_NPAGES);
+
+        return 0;
+}
+#endif
+
 #ifdef __VFS__
 int kshell_cat(kshell_t *ksh, int argc, char **argv)
 {
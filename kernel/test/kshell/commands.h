@@ -2,12 +2,25 @@
 
 #include "test/kshell/kshell.h"
 
+#include "mm/slab.h"
+
 #define KSHELL_CMD(name) \
         int kshell_ ## name(kshell_t *ksh, int argc, char **argv)
 
 KSHELL_CMD(help);
 KSHELL_CMD(exit);
 KSHELL_CMD(echo);
+KSHELL_CMD(slabinfo);
+KSHELL_CMD(slabtest);
+KSHELL_CMD(iosched);
+KSHELL_CMD(iostat);
+KSHELL_CMD(diskbench);
+#ifdef SLAB_TRACE
+KSHELL_CMD(kmemtrace);
+#endif
+#ifdef __S5FS__
+KSHELL_CMD(fsck);
+#endif
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -34,6 +34,20 @@ static __attribute__((unused)) void kshell_init()
         kshell_add_command("help", kshell_help,
                            "prints a list of available commands");
         kshell_add_command("echo", kshell_echo, "display a line of text");
+        kshell_add_command("slabinfo", kshell_slabinfo,
+                           "display slab allocator statistics");
+        kshell_add_command("slabtest", kshell_slabtest,
+                           "run the slab allocator stress test");
+        kshell_add_command("iosched", kshell_iosched,
+                           "display disk queue statistics or switch schedulers");
+        kshell_add_command("iostat", kshell_iostat,
+                           "display block device statistics and latency histograms");
+        kshell_add_command("diskbench", kshell_diskbench,
+                           "measure disk throughput, alone and in parallel (-w: write)");
+#ifdef SLAB_TRACE
+        kshell_add_command("kmemtrace", kshell_kmemtrace,
+                           "display live allocations by call site (-l: leaks)");
+#endif
 #ifdef __VFS__
         kshell_add_command("cat", kshell_cat,
                            "concatenate files and print on the standard output");
@@ -47,6 +61,11 @@ static __attribute__((unused)) void kshell_init()
         kshell_add_command("mkdir", kshell_mkdir, "make directories");
         kshell_add_command("stat", kshell_stat, "display file status");
 #endif
+#ifdef __S5FS__
+        kshell_add_command("fsck", kshell_fsck,
+                           "check the root s5fs file system for consistency "
+                           "(while nothing else uses it)");
+#endif
 
         kshell_add_command("exit", kshell_exit, "exits the shell");
 }
@@ -0,0 +1,176 @@
+#include "kernel.h"
+#include "globals.h"
+#include "errno.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "mm/slab.h"
+
+#include "test/usertest.h"
+#include "test/slabtest.h"
+
+#define SLABTEST_NTHREADS       4       /* threads allocating at once */
+#define SLABTEST_NSLOTS         64      /* objects each thread holds at most */
+#define SLABTEST_NITERS         4096    /* alloc/free operations per thread */
+#define SLABTEST_NMAILBOX       32      /* objects waiting for a remote free */
+
+#define SLABTEST_LIVE           0x11fe11fe
+#define SLABTEST_DEAD           0xdeadde11
+
+typedef struct slabtest_obj {
+        uint32_t        so_magic;       /* SLABTEST_LIVE while allocated */
+        int             so_owner;       /* thread which allocated it */
+        int             so_slot;        /* where its owner keeps it */
+        char            so_pad[52];     /* filled with so_slot */
+} slabtest_obj_t;
+
+/* Allocators can not be destroyed, so every run shares this one */
+static slab_allocator_t *slabtest_allocator = NULL;
+
+/* Objects handed from one thread to another to be freed remotely */
+static slabtest_obj_t *slabtest_mailbox[SLABTEST_NMAILBOX];
+static int slabtest_nmail;
+
+static int slabtest_nextid;
+
+static uint32_t
+slabtest_rand(uint32_t *seed)
+{
+        *seed = *seed * 1103515245 + 12345;
+        return (*seed >> 16) & 0x7fff;
+}
+
+static int
+slabtest_intact(slabtest_obj_t *obj, int owner, int slot)
+{
+        int i;
+
+        if (SLABTEST_LIVE != obj->so_magic)
+                return 0;
+        if ((0 <= owner && obj->so_owner != owner) || (0 <= slot && obj->so_slot != slot))
+                return 0;
+        for (i = 0; i < (int)sizeof(obj->so_pad); i++)
+                if ((char)obj->so_slot != obj->so_pad[i])
+                        return 0;
+        return 1;
+}
+
+/* Frees an object which was handed to us by another thread */
+static void
+slabtest_free_mail(void)
+{
+        slabtest_obj_t *obj = slabtest_mailbox[--slabtest_nmail];
+
+        test_assert(slabtest_intact(obj, -1, -1), "object corrupted in mailbox");
+        obj->so_magic = SLABTEST_DEAD;
+        slab_obj_free_remote(slabtest_allocator, obj);
+}
+
+static void *
+slabtest_worker(int arg1, void *arg2)
+{
+        slabtest_obj_t *slots[SLABTEST_NSLOTS];
+        int id = slabtest_nextid++;
+        uint32_t seed = id + 1;
+        int i;
+
+        memset(slots, 0, sizeof(slots));
+
+        for (i = 0; i < SLABTEST_NITERS; i++) {
+                int slot = slabtest_rand(&seed) % SLABTEST_NSLOTS;
+                slabtest_obj_t *obj = slots[slot];
+
+                if (NULL == obj) {
+                        obj = slab_obj_alloc(slabtest_allocator);
+                        test_assert(NULL != obj, "out of memory");
+                        if (NULL == obj)
+                                break;
+                        test_assert(SLABTEST_LIVE != obj->so_magic,
+                                    "object allocated twice");
+                        obj->so_magic = SLABTEST_LIVE;
+                        obj->so_owner = id;
+                        obj->so_slot = slot;
+                        memset(obj->so_pad, (char)slot, sizeof(obj->so_pad));
+                        slots[slot] = obj;
+                } else {
+                        test_assert(slabtest_intact(obj, id, slot), "object corrupted");
+                        slots[slot] = NULL;
+                        if ((slabtest_rand(&seed) & 1) && slabtest_nmail < SLABTEST_NMAILBOX) {
+                                slabtest_mailbox[slabtest_nmail++] = obj;
+                        } else {
+                                obj->so_magic = SLABTEST_DEAD;
+                                slab_obj_free(slabtest_allocator, obj);
+                        }
+                }
+
+                if (0 < slabtest_nmail && 0 == slabtest_rand(&seed) % 3)
+                        slabtest_free_mail();
+
+                /* Let the other threads interleave with us */
+                if (0 == slabtest_rand(&seed) % 16) {
+                        sched_make_runnable(curthr);
+                        sched_switch();
+                }
+        }
+
+        for (i = 0; i < SLABTEST_NSLOTS; i++) {
+                if (NULL != slots[i]) {
+                        test_assert(slabtest_intact(slots[i], id, i), "object corrupted");
+                        slots[i]->so_magic = SLABTEST_DEAD;
+                        slab_obj_free(slabtest_allocator, slots[i]);
+                }
+        }
+
+        return NULL;
+}
+
+int
+slabtest_main(int argc, char **argv)
+{
+        int i;
+
+        if (argc != 1) {
+                dbg(DBG_TEST, "USAGE: slabtest\n");
+                return 1;
+        }
+
+        test_init();
+
+        if (NULL == slabtest_allocator)
+                slabtest_allocator = slab_allocator_create("slabtest", sizeof(slabtest_obj_t),
+                                                           NULL, NULL);
+        test_assert(NULL != slabtest_allocator, "could not create allocator");
+        if (NULL == slabtest_allocator)
+                return 1;
+
+        slabtest_nextid = 0;
+        slabtest_nmail = 0;
+        for (i = 0; i < SLABTEST_NTHREADS; i++) {
+                proc_t *p = proc_create("slabtest");
+                kthread_t *thr;
+
+                test_assert(NULL != p, "could not create process");
+                thr = kthread_create(p, slabtest_worker, 0, NULL);
+                test_assert(NULL != thr, "could not create thread");
+                sched_make_runnable(thr);
+        }
+
+        for (i = 0; i < SLABTEST_NTHREADS; i++)
+                test_assert(0 < do_waitpid(-1, 0, NULL), "lost a child");
+
+        while (0 < slabtest_nmail)
+                slabtest_free_mail();
+
+        /* Reclaiming drains the remote free lists first, so this also
+         * checks their counts add up (see the KASSERT in the drain) */
+        slab_allocators_reclaim(0);
+
+        test_fini();
+        return 0;
+}
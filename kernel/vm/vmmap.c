@@ -30,9 +30,9 @@ static slab_allocator_t *vmarea_allocator;
 void
 vmmap_init(void)
 {
-        vmmap_allocator = slab_allocator_create("vmmap", sizeof(vmmap_t));
+        vmmap_allocator = slab_allocator_create("vmmap", sizeof(vmmap_t), NULL, NULL);
         KASSERT(NULL != vmmap_allocator && "failed to create vmmap allocator!");
-        vmarea_allocator = slab_allocator_create("vmarea", sizeof(vmarea_t));
+        vmarea_allocator = slab_allocator_create("vmarea", sizeof(vmarea_t), NULL, NULL);
         KASSERT(NULL != vmarea_allocator && "failed to create vmarea allocator!");
 }
 
@@ -1,22 +1,65 @@
 import os
 import math
 import struct
+import bisect
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 6
 S5_BLOCK_SIZE = 4096
+S5_BITS_PER_BLOCK = S5_BLOCK_SIZE * 8
 
 S5_NBLKS_PER_FNODE = 30
-S5_NDIRECT_BLOCKS = 28
-S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
-S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
+S5_NDIRECT_BLOCKS = 26
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE / 4
+S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS ** 2 + S5_NIDIRECT_BLOCKS ** 3
+# the triple indirect block reaches further than the kernel's off_t
+S5_MAX_FILE_SIZE = min(S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE, 0x7fffffff)
 
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
 
-S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
+# the block pointers, or the root of the extent tree
+S5_MAP_OFFSET = 12
+S5_MAP_SIZE = (S5_NDIRECT_BLOCKS + 3) * 4
+
+S5_INODE_SIZE = S5_MAP_OFFSET + S5_MAP_SIZE
 S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
 
+S5_INODE_EXTENTS = 0x01
+S5_INODE_INDEXED = 0x02
+S5_INODE_INLINE = 0x04
+S5_INODE_NOINDEX = 0x08
+S5_FEATURE_EXTENTS = 0x01
+S5_FEATURE_DIR_INDEX = 0x02
+S5_FEATURE_JOURNAL = 0x04
+S5_FEATURE_INLINE_DATA = 0x08
+
+# the data of small files can take the place of their block map
+S5_INLINE_SIZE = S5_MAP_SIZE
+
+S5_JOURNAL_MAGIC = 0x4a524e4c
+S5_JOURNAL_DESCRIPTOR = 1
+S5_JOURNAL_REVOKE = 2
+S5_JOURNAL_COMMIT = 3
+S5_JOURNAL_HEADER_SIZE = 20
+S5_JOURNAL_TAGS_PER_BLOCK = (S5_BLOCK_SIZE - S5_JOURNAL_HEADER_SIZE) / 4
+S5_JOURNAL_MIN_BLOCKS = 16
+
+S5_EXTENT_MAGIC = 0xe5e5
+S5_EXTENT_HEADER_SIZE = 8
+S5_EXTENT_SIZE = 12
+S5_EXTENTS_PER_INODE = (S5_MAP_SIZE - S5_EXTENT_HEADER_SIZE) / S5_EXTENT_SIZE
+S5_EXTENTS_PER_BLOCK = (S5_BLOCK_SIZE - S5_EXTENT_HEADER_SIZE) / S5_EXTENT_SIZE
+
+S5_DINDEX_MAGIC = 0xd1d1
+S5_DINDEX_BLOCK = 0x40000
+S5_DINDEX_HEADER_SIZE = 8
+S5_DINDEX_ENTRY_SIZE = 8
+S5_DINDEX_ENTRIES_PER_BLOCK = (S5_BLOCK_SIZE - S5_DINDEX_HEADER_SIZE) / S5_DINDEX_ENTRY_SIZE
+S5_DINDEX_MIN_DIRENTS = S5_BLOCK_SIZE / S5_DIRENT_SIZE
+# leaves are made 3/4 full, leaving the kernel room to add entries
+S5_DINDEX_LEAF_FILL = S5_DINDEX_ENTRIES_PER_BLOCK * 3 / 4
+
 S5_TYPE_FREE = 0x0
 S5_TYPE_DATA = 0x1
 S5_TYPE_DIR = 0x2
@@ -68,15 +111,7 @@ class Block:
             self._simdisk._simfile.write('\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
-            self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
-            self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
-        else:
-            for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                self.write(i * 4, struct.pack("I", self._simdisk.get_free_block(i)))
-            self.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self._simdisk.get_last_free_block()))
-            self._simdisk.set_last_free_block(self._blockno)
-            self._simdisk.set_nfree(0)
+        self._simdisk.free_block(self._blockno)
 
 class Dirent:
     
@@ -88,6 +123,7 @@ class Dirent:
 
     def remove(self):
         self._parent.write(self._offset + 4, '\0')
+        self._parent.reindex()
 
 class Inode:
 
@@ -121,11 +157,28 @@ class Inode:
 
     def get_type(self):
         self._simfile.seek(int(self._offset + 8))
-        return struct.unpack("H", self._simfile.read(2))[0]
+        return struct.unpack("B", self._simfile.read(1))[0]
 
     def set_type(self, val):
         self._simfile.seek(int(self._offset + 8))
-        self._simfile.write(struct.pack("H", val))
+        self._simfile.write(struct.pack("B", val))
+
+    def get_flags(self):
+        self._simfile.seek(int(self._offset + 9))
+        return struct.unpack("B", self._simfile.read(1))[0]
+
+    def set_flags(self, val):
+        self._simfile.seek(int(self._offset + 9))
+        self._simfile.write(struct.pack("B", val))
+
+    def uses_extents(self):
+        return (self.get_flags() & S5_INODE_EXTENTS) != 0
+
+    def is_indexed(self):
+        return (self.get_flags() & S5_INODE_INDEXED) != 0
+
+    def is_inline(self):
+        return (self.get_flags() & S5_INODE_INLINE) != 0
 
     def get_link_count(self):
         self._simfile.seek(int(self._offset + 10))
@@ -149,14 +202,233 @@ class Inode:
         else:
             raise S5fsException("direct block index {0} greater than max {1}".format(index, S5_NDIRECT_BLOCKS))
 
-    def get_indirect_blockno(self):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+    def get_indirect_blockno(self, depth=1):
+        """Returns the single (depth 1), double (2) or triple (3)
+        indirect block"""
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + depth - 1)))
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_indirect_blockno(self, val):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+    def set_indirect_blockno(self, val, depth=1):
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + depth - 1)))
         self._simfile.write(struct.pack("I", val))
 
+    def init_block_map(self, inline=None):
+        if (inline == None):
+            inline = (self._simdisk.get_features() & S5_FEATURE_INLINE_DATA) and self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ])
+        if (inline):
+            self.set_flags(S5_INODE_INLINE)
+            self._simfile.seek(int(self._offset + S5_MAP_OFFSET))
+            self._simfile.write('\0' * S5_MAP_SIZE)
+        elif (self._simdisk.get_features() & S5_FEATURE_EXTENTS):
+            self.set_flags(S5_INODE_EXTENTS)
+            self._simfile.seek(int(self._offset + S5_MAP_OFFSET))
+            self._simfile.write(self._pack_extent_node(S5_EXTENTS_PER_INODE, 0, []).ljust(S5_MAP_SIZE, '\0'))
+        else:
+            self.set_flags(0)
+            for i in xrange(S5_NDIRECT_BLOCKS):
+                self.set_direct_blockno(i, 0)
+            for depth in xrange(1, 4):
+                self.set_indirect_blockno(0, depth)
+
+    def _unpack_extent_node(self, data, depth=None):
+        (magic, count, maxcount, ndepth) = struct.unpack("HHHH", data[:S5_EXTENT_HEADER_SIZE])
+        if (magic != S5_EXTENT_MAGIC or count > maxcount or (depth != None and ndepth != depth)):
+            raise S5fsException("inode {0} has a bad extent tree node".format(self._number))
+        entries = []
+        for i in xrange(count):
+            offset = S5_EXTENT_HEADER_SIZE + i * S5_EXTENT_SIZE
+            entries.append(struct.unpack("III", data[offset:offset + S5_EXTENT_SIZE]))
+        return (ndepth, entries)
+
+    def _pack_extent_node(self, maxcount, depth, entries):
+        res = struct.pack("HHHH", S5_EXTENT_MAGIC, len(entries), maxcount, depth)
+        for entry in entries:
+            res += struct.pack("III", *entry)
+        return res
+
+    def get_extent_tree(self):
+        """Returns the (file block, disk block, length) extents of the
+        inode in file block order, the blocks of the nodes of its extent
+        tree and the depth of the tree"""
+        self._simfile.seek(int(self._offset + S5_MAP_OFFSET))
+        (depth, entries) = self._unpack_extent_node(self._simfile.read(S5_MAP_SIZE))
+        nodes = []
+        for level in xrange(depth - 1, -1, -1):
+            children = []
+            for (fblock, blockno, length) in entries:
+                nodes.append(blockno)
+                children += self._unpack_extent_node(self._simdisk.get_block(blockno).read(), level)[1]
+            entries = children
+        return (entries, nodes, depth)
+
+    def set_extents(self, extents):
+        """Replaces the extent tree with one mapping the given extents, in
+        full nodes like a file the kernel writes sequentially gets"""
+        for blockno in self.get_extent_tree()[1]:
+            self._simdisk.free_block(blockno)
+        depth = 0
+        entries = extents
+        while (len(entries) > S5_EXTENTS_PER_INODE):
+            parents = []
+            for i in xrange(0, len(entries), S5_EXTENTS_PER_BLOCK):
+                node = entries[i:i + S5_EXTENTS_PER_BLOCK]
+                block = self._simdisk.alloc_block()
+                block.zero()
+                block.write(0, self._pack_extent_node(S5_EXTENTS_PER_BLOCK, depth, node))
+                parents.append((node[0][0], block.get_blockno(), 0))
+            entries = parents
+            depth += 1
+        self._simfile.seek(int(self._offset + S5_MAP_OFFSET))
+        self._simfile.write(self._pack_extent_node(S5_EXTENTS_PER_INODE, depth, entries).ljust(S5_MAP_SIZE, '\0'))
+
+    def _extent_index(self, extents, index):
+        # the last extent starting at or before index, or -1
+        return bisect.bisect_right(extents, (index, 0xffffffff, 0xffffffff)) - 1
+
+    def _extent_blockno(self, extents, index):
+        i = self._extent_index(extents, index)
+        if (i >= 0 and index < extents[i][0] + extents[i][2]):
+            return extents[i][1] + index - extents[i][0]
+        return 0
+
+    def _extent_alloc(self, extents, index):
+        # allocates a block for the sparse file block index next to the
+        # extent before it, extending it if possible, like the kernel
+        i = self._extent_index(extents, index)
+        goal = None
+        if (i >= 0):
+            goal = extents[i][1] + index - extents[i][0]
+        block = self._simdisk.alloc_block(goal)
+        if (i >= 0 and extents[i][0] + extents[i][2] == index and extents[i][1] + extents[i][2] == block.get_blockno()):
+            extents[i] = (extents[i][0], extents[i][1], extents[i][2] + 1)
+        else:
+            extents.insert(i + 1, (index, block.get_blockno(), 1))
+        return block
+
+    def get_blockno(self, index):
+        if (self.uses_extents()):
+            return self._extent_blockno(self.get_extent_tree()[0], index)
+        return self._map_block(index)
+
+    def _block_path(self, index):
+        # the depth of the indirect block above file block index (0 if
+        # it is direct), and the index into each indirect block on the
+        # way down, like s5_block_path() in the kernel
+        if (index < S5_NDIRECT_BLOCKS):
+            return (0, [ index ])
+        rest = index - S5_NDIRECT_BLOCKS
+        for depth in xrange(1, 4):
+            if (rest < S5_NIDIRECT_BLOCKS ** depth):
+                path = []
+                for level in xrange(depth - 1, -1, -1):
+                    path.append((rest / (S5_NIDIRECT_BLOCKS ** level)) % S5_NIDIRECT_BLOCKS)
+                return (depth, path)
+            rest -= S5_NIDIRECT_BLOCKS ** depth
+        raise S5fsException("file block {0} is past the maximum of {1}".format(index, S5_MAX_FILE_BLOCKS - 1))
+
+    def _map_block(self, index, alloc=False):
+        # the disk block of file block index, or 0 if it is sparse and
+        # alloc is false; new blocks (indirect ones too) are zeroed
+        (depth, path) = self._block_path(index)
+        if (depth == 0):
+            blockno = self.get_direct_blockno(index)
+        else:
+            blockno = self.get_indirect_blockno(depth)
+        parent = None
+        for level in xrange(depth + 1):
+            if (blockno == 0):
+                if (not alloc):
+                    return 0
+                block = self._simdisk.alloc_block(self._alloc_goal(index))
+                block.zero()
+                blockno = block.get_blockno()
+                if (parent != None):
+                    parent.write(path[level - 1] * 4, struct.pack("I", blockno))
+                elif (depth == 0):
+                    self.set_direct_blockno(index, blockno)
+                else:
+                    self.set_indirect_blockno(blockno, depth)
+            if (level == depth):
+                return blockno
+            parent = self._simdisk.get_block(blockno)
+            blockno = struct.unpack("I", parent.read(path[level] * 4, 4))[0]
+
+    def _indirect_blocknos(self, blockno, depth):
+        res = [ blockno ]
+        entries = struct.unpack("{0}I".format(S5_NIDIRECT_BLOCKS), self._simdisk.get_block(blockno).read())
+        for entry in entries:
+            if (entry != 0):
+                res += self._indirect_blocknos(entry, depth - 1) if depth > 1 else [ entry ]
+        return res
+
+    def _truncate_indirect(self, blockno, depth, first, nblocks):
+        # frees what the indirect block of the given depth, which maps
+        # the file blocks from first on, maps from file block nblocks
+        # on, and the block itself if that is everything; returns
+        # whether it was freed
+        block = self._simdisk.get_block(blockno)
+        span = S5_NIDIRECT_BLOCKS ** (depth - 1)
+        for i in xrange(S5_NIDIRECT_BLOCKS):
+            if (first + (i + 1) * span <= nblocks):
+                continue
+            entry = struct.unpack("I", block.read(i * 4, 4))[0]
+            if (entry == 0):
+                continue
+            if (depth == 1):
+                self._simdisk.free_block(entry)
+            elif (not self._truncate_indirect(entry, depth - 1, first + i * span, nblocks)):
+                continue
+            block.write(i * 4, struct.pack("I", 0))
+        if (first >= nblocks):
+            self._simdisk.free_block(blockno)
+            return True
+        return False
+
+    def _read_inline(self):
+        self._simfile.seek(int(self._offset + S5_MAP_OFFSET))
+        return self._simfile.read(S5_INLINE_SIZE)
+
+    def _write_inline(self, data):
+        self._simfile.seek(int(self._offset + S5_MAP_OFFSET))
+        self._simfile.write(data.ljust(S5_INLINE_SIZE, '\0'))
+
+    def _inline_expand(self):
+        # moves the data out into a block mapped the usual way, like the
+        # kernel does when a file grows too big for its inode
+        data = self._read_inline()[:self.get_size()]
+        self.init_block_map(inline=False)
+        if (len(data) > 0):
+            try:
+                self.write(0, data)
+            except S5fsException as e:
+                self.init_block_map(inline=True)
+                self._write_inline(data)
+                raise e
+
+    def _alloc_goal(self, index):
+        # right after the previous block of the file, so that files are
+        # laid out contiguously
+        if (index > 0 and self.get_blockno(index - 1) != 0):
+            return self.get_blockno(index - 1) + 1
+        return None
+
+    def get_blocknos(self):
+        if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
+            return []
+        if (self.is_inline()):
+            return []
+        if (self.uses_extents()):
+            (extents, nodes, depth) = self.get_extent_tree()
+            res = list(nodes)
+            for (fblock, blockno, length) in extents:
+                res += range(blockno, blockno + length)
+            return res
+        res = [ self.get_direct_blockno(i) for i in xrange(S5_NDIRECT_BLOCKS) ]
+        for depth in xrange(1, 4):
+            if (self.get_indirect_blockno(depth) != 0):
+                res += self._indirect_blocknos(self.get_indirect_blockno(depth), depth)
+        return [ b for b in res if b != 0 ]
+
     def get_type_str(self, short=False):
         t = self.get_type()
         name = "INV" if short else "INVALID"
@@ -187,6 +459,20 @@ class Inode:
             elif (self.get_type() == S5_TYPE_DIR):
                 res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
             res += "\n"
+            if (self.is_inline()):
+                if (self.get_size() > S5_INLINE_SIZE):
+                    res += "inline data (INVALID, at most {0} bytes fit in the inode)\n".format(S5_INLINE_SIZE)
+                else:
+                    res += "inline data ({0} bytes)\n".format(self.get_size())
+                return res[:-1]
+            if (self.uses_extents()):
+                (extents, nodes, depth) = self.get_extent_tree()
+                res += "extents ({0}, tree depth {1}):\n".format(len(extents), depth)
+                for (fblock, blockno, length) in extents:
+                    res += "  file blocks {0}-{1} at {2}-{3}\n".format(fblock, fblock + length - 1, blockno, blockno + length - 1)
+                if (len(nodes) > 0):
+                    res += "extent tree blocks: {0}\n".format(" ".join([ str(b) for b in nodes ]))
+                return (res + self._get_index_summary())[:-1]
             res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
             for i in xrange(S5_NDIRECT_BLOCKS):
                 res += " {0:5}".format(self.get_direct_blockno(i))
@@ -195,31 +481,42 @@ class Inode:
             if (res[-1] != "\n"):
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
+            res += "double indirect block: {0}\n".format(self.get_indirect_blockno(2))
+            res += "triple indirect block: {0}\n".format(self.get_indirect_blockno(3))
+            res += self._get_index_summary()
         elif (self.get_type() == S5_TYPE_FREE):
             res += "next free: {0}\n".format(self.get_next_free())
         res = res[:-1]
         return res
 
+    def _get_index_summary(self):
+        if (not self.is_indexed()):
+            return ""
+        try:
+            (leaves, nblocks) = self.get_dindex()
+            return "hash index: {0} leaves, {1} entries\n".format(len(leaves), sum([ len(l) for (k, l) in leaves ]))
+        except S5fsException as e:
+            return "hash index: INVALID ({0})\n".format(str(e))
+
     def read(self, offset=0, size=None):
         if (size == None):
             size = self.get_size()
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot read from inode of type " + self.get_type_str())
         size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
+        if (self.is_inline()):
+            return self._read_inline()[offset:offset + max(size, 0)]
         res = ""
+        if (self.uses_extents()):
+            extents = self.get_extent_tree()[0]
         while (size > 0):
             blockno = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
+            if (self.uses_extents()):
+                blockno = self._extent_blockno(extents, int(blockno))
             else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
+                blockno = self._map_block(int(blockno))
             if (blockno == 0):
                 for i in xrange(ammount):
                     res += '\0'
@@ -234,74 +531,152 @@ class Inode:
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
         if (offset + len(data) > S5_MAX_FILE_SIZE):
             raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
+        if (self.is_inline()):
+            if (offset + len(data) <= S5_INLINE_SIZE):
+                inline = self._read_inline()
+                self._write_inline(inline[:offset] + data + inline[offset + len(data):])
+                if (offset + len(data) > self.get_size()):
+                    self.set_size(offset + len(data))
+                return
+            self._inline_expand()
         remaining = len(data)
-        while (remaining > 0):
-            blockloc = math.floor(offset / S5_BLOCK_SIZE)
-            blockoff = offset % S5_BLOCK_SIZE
-            ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
+        if (self.uses_extents()):
+            extents = self.get_extent_tree()[0]
+        try:
+            while (remaining > 0):
+                blockloc = math.floor(offset / S5_BLOCK_SIZE)
+                blockoff = offset % S5_BLOCK_SIZE
+                ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
+                if (self.uses_extents()):
+                    blockno = self._extent_blockno(extents, int(blockloc))
+                    if (blockno == 0):
+                        block = self._extent_alloc(extents, int(blockloc))
+                        block.zero()
+                        blockno = block.get_blockno()
                 else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
-            else:
+                    blockno = self._map_block(int(blockloc), alloc=True)
                 block = self._simdisk.get_block(blockno)
-            if (remaining == ammount):
-                block.write(blockoff, data[-remaining:])
-            else:
-                block.write(blockoff, data[-remaining:-remaining+ammount])
-            remaining -= ammount
-            offset += ammount
+                if (remaining == ammount):
+                    block.write(blockoff, data[-remaining:])
+                else:
+                    block.write(blockoff, data[-remaining:-remaining+ammount])
+                remaining -= ammount
+                offset += ammount
+        finally:
+            # also keeps what was written before running out of space
+            if (self.uses_extents()):
+                self.set_extents(extents)
         if (offset > self.get_size()):
             self.set_size(offset)
 
     def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
-        while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
-            curr -= 1
-        while (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_direct_blockno(0)
+        if (self.is_inline()):
+            if (size > S5_INLINE_SIZE):
+                self._inline_expand()
             else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
+                self._write_inline(self._read_inline()[:size])
+                self.set_size(size)
+                return
+        if (self.uses_extents()):
+            nblocks = (size + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE
+            extents = []
+            for (fblock, blockno, length) in self.get_extent_tree()[0]:
+                keep = max(0, min(length, nblocks - fblock))
+                for i in xrange(blockno + keep, blockno + length):
+                    self._simdisk.free_block(i)
+                if (keep > 0):
+                    extents.append((fblock, blockno, keep))
+            self.set_extents(extents)
+            self.set_size(size)
+            return
+        nblocks = (size + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE
+        for i in xrange(nblocks, S5_NDIRECT_BLOCKS):
+            if (self.get_direct_blockno(i) != 0):
+                self._simdisk.free_block(self.get_direct_blockno(i))
+                self.set_direct_blockno(i, 0)
+        first = S5_NDIRECT_BLOCKS
+        for depth in xrange(1, 4):
+            blockno = self.get_indirect_blockno(depth)
+            if (blockno != 0 and self._truncate_indirect(blockno, depth, first, nblocks)):
+                self.set_indirect_blockno(0, depth)
+            first += S5_NIDIRECT_BLOCKS ** depth
         self.set_size(size)
 
+    @staticmethod
+    def dindex_hash(name):
+        # FNV-1a, as in the kernel
+        h = 2166136261
+        for c in name:
+            h = ((h ^ ord(c)) * 16777619) & 0xffffffff
+        return h
+
+    def get_dindex(self):
+        """Returns the (hash, slot) entries of each leaf of the hash index
+        of a directory, in the order of the root, and the root's count of
+        index blocks in use. Raises an exception if the index blocks are
+        malformed."""
+        def node(i, depth):
+            data = self._read_index_block(i)
+            (magic, count, d, nblocks) = struct.unpack("HHHH", data[:S5_DINDEX_HEADER_SIZE])
+            if (magic != S5_DINDEX_MAGIC or d != depth or count > S5_DINDEX_ENTRIES_PER_BLOCK):
+                raise S5fsException("bad index block {0} in directory {1}".format(i, self._number))
+            entries = []
+            for j in xrange(count):
+                entries.append(struct.unpack_from("II", data, S5_DINDEX_HEADER_SIZE + j * S5_DINDEX_ENTRY_SIZE))
+            return (entries, nblocks)
+        (root, nblocks) = node(0, 1)
+        if (len(root) == 0 or nblocks > S5_DINDEX_ENTRIES_PER_BLOCK + 1):
+            raise S5fsException("bad index root in directory {0}".format(self._number))
+        leaves = []
+        for (key, leaf) in root:
+            if (leaf == 0 or leaf >= nblocks):
+                raise S5fsException("index root of directory {0} points at block {1} of {2}".format(self._number, leaf, nblocks))
+            leaves.append((key, node(leaf, 0)[0]))
+        return (leaves, nblocks)
+
+    def _read_index_block(self, i):
+        blockno = self.get_blockno(S5_DINDEX_BLOCK + i)
+        if (blockno == 0):
+            return '\0' * S5_BLOCK_SIZE
+        return self._simdisk.get_block(blockno).read()
+
+    def reindex(self):
+        """Throws away the hash index of a directory after its entries
+        changed, and indexes it again if it is big enough."""
+        if (self.is_indexed()):
+            # the index is all that is past the end of a directory
+            self.truncate(self.get_size())
+            self.set_flags(self.get_flags() & ~S5_INODE_INDEXED)
+        self.set_flags(self.get_flags() & ~S5_INODE_NOINDEX)
+        if (not (self._simdisk.get_features() & S5_FEATURE_DIR_INDEX) or self.get_size() / S5_DIRENT_SIZE <= S5_DINDEX_MIN_DIRENTS):
+            return
+        entries = []
+        for dirent in self.getdents():
+            entries.append((Inode.dindex_hash(dirent.name), dirent._offset / S5_DIRENT_SIZE))
+        entries.sort()
+        leaves = [ entries[i:i + S5_DINDEX_LEAF_FILL] for i in xrange(0, len(entries), S5_DINDEX_LEAF_FILL) ]
+        if (len(leaves) == 0):
+            leaves = [ [] ]
+        if (len(leaves) > S5_DINDEX_ENTRIES_PER_BLOCK):
+            self.set_flags(self.get_flags() | S5_INODE_NOINDEX)
+            return
+        root = [ (0 if i == 0 else leaf[0][0], i + 1) for (i, leaf) in enumerate(leaves) ]
+        size = self.get_size()
+        base = S5_DINDEX_BLOCK * S5_BLOCK_SIZE
+        try:
+            for (i, (entries, depth)) in enumerate([ (root, 1) ] + [ (leaf, 0) for leaf in leaves ]):
+                data = struct.pack("HHHH", S5_DINDEX_MAGIC, len(entries), depth, len(leaves) + 1 if depth else 0)
+                data += "".join([ struct.pack("II", h, v) for (h, v) in entries ])
+                self.write(base + i * S5_BLOCK_SIZE, data.ljust(S5_BLOCK_SIZE, '\0'))
+        except S5fsException:
+            self.truncate(size)
+            self.set_flags(self.get_flags() | S5_INODE_NOINDEX)
+            return
+        finally:
+            # writing the index must not make it part of the entries
+            self.set_size(size)
+        self.set_flags(self.get_flags() | S5_INODE_INDEXED)
+
     def _find_dirent(self, name, types=S5_TYPES):
         if (self.get_type() != S5_TYPE_DIR):
             raise S5fsException("cannot remove directory entry in non-directory inode of type " + self.get_type_str())
@@ -372,6 +747,7 @@ class Inode:
         else:
             self.write(self.get_size(), struct.pack("I", inode))
             self.write(self.get_size(), name.ljust(S5_NAME_LEN, '\0'))
+        self.reindex()
 
     def create(self, name):
         inode = self._simdisk.alloc_inode()
@@ -379,9 +755,25 @@ class Inode:
             inode.set_type(S5_TYPE_DATA)
             inode.set_size(0)
             inode.set_link_count(1)
-            for i in xrange(S5_NDIRECT_BLOCKS):
-                inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            inode.init_block_map()
+            self._make_dirent(inode.get_number(), name)
+            return inode
+        except S5fsException as e:
+            inode.free()
+            raise e
+
+    def mknod(self, name, type, devid):
+        if (type != S5_TYPE_CHR and type != S5_TYPE_BLK):
+            raise S5fsException("cannot make a device node of type {0}".format(type))
+        inode = self._simdisk.alloc_inode()
+        try:
+            inode.set_type(type)
+            inode.set_size(0)
+            inode.set_link_count(1)
+            inode.init_block_map(inline=False)
+            inode.set_flags(0)
+            # the kernel keeps the device id of a device node here
+            inode.set_indirect_blockno(devid)
             self._make_dirent(inode.get_number(), name)
             return inode
         except S5fsException as e:
@@ -394,9 +786,7 @@ class Inode:
             inode.set_type(S5_TYPE_DIR)
             inode.set_size(0)
             inode.set_link_count(1)
-            for i in xrange(S5_NDIRECT_BLOCKS):
-                inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            inode.init_block_map()
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -462,6 +852,7 @@ class Inode:
         if (self.get_size() != 0):
             self.truncate()
         self.set_type(S5_TYPE_FREE)
+        self.set_flags(0)
         self.set_next_free(self._simdisk.get_free_inode())
         self._simdisk.set_free_inode(self._number)
 
@@ -494,28 +885,6 @@ class Simdisk:
         self._simfile.seek(8)
         self._simfile.write(struct.pack("I", val))
 
-    def get_free_block(self, index):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            return struct.unpack("I", self._simfile.read(4))[0]
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
-
-    def set_free_block(self, index, val):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            self._simfile.write(struct.pack("I", val))
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
-
-    def get_last_free_block(self):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
-        return struct.unpack("I", self._simfile.read(4))[0]
-
-    def set_last_free_block(self, val):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
-        self._simfile.write(struct.pack("I", val))
-
     def get_root_inode(self):
         self._simfile.seek(12 + 4 * S5_NBLKS_PER_FNODE)
         return struct.unpack("I", self._simfile.read(4))[0]
@@ -536,6 +905,267 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def get_num_blocks(self):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_num_blocks(self, val):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_block(self):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_block(self, val):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_num_blocks(self):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_num_blocks(self, val):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_features(self):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_features(self, val):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_block(self):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_block(self, val):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_num_blocks(self):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_num_blocks(self, val):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_data_block(self):
+        """Returns the first block after the metadata"""
+        if (self.get_features() & S5_FEATURE_JOURNAL):
+            return self.get_journal_block() + self.get_journal_num_blocks()
+        return self.get_bitmap_block() + self.get_bitmap_num_blocks()
+
+    def _bitmap_loc(self, blockno):
+        if (blockno >= self.get_num_blocks()):
+            raise S5fsException("block {0} is past the end of the disk ({1} blocks)".format(blockno, self.get_num_blocks()))
+        block = self.get_bitmap_block() + blockno / S5_BITS_PER_BLOCK
+        return (S5_BLOCK_SIZE * block + (blockno % S5_BITS_PER_BLOCK) / 8, 1 << (blockno % 8))
+
+    def is_block_used(self, blockno):
+        (offset, mask) = self._bitmap_loc(blockno)
+        self._simfile.seek(offset)
+        return (ord(self._simfile.read(1)) & mask) != 0
+
+    def set_block_used(self, blockno, used):
+        (offset, mask) = self._bitmap_loc(blockno)
+        self._simfile.seek(offset)
+        byte = ord(self._simfile.read(1))
+        byte = (byte | mask) if used else (byte & ~mask)
+        self._simfile.seek(offset)
+        self._simfile.write(chr(byte))
+
+    def check_block_bitmap(self):
+        """Compares the free block bitmap with the blocks the inodes use,
+        returns a list of problems"""
+        res = []
+        nblocks = self.get_num_blocks()
+        meta = self.get_data_block()
+        owner = {}
+        for i in xrange(self.get_num_inodes()):
+            inode = self.get_inode(i)
+            if (inode.get_type() == S5_TYPE_FREE):
+                continue
+            for blockno in inode.get_blocknos():
+                if (blockno < meta or blockno >= nblocks):
+                    res.append("inode {0} uses invalid block {1}".format(i, blockno))
+                elif (blockno in owner):
+                    res.append("block {0} is used by inodes {1} and {2}".format(blockno, owner[blockno], i))
+                else:
+                    owner[blockno] = i
+        nfree = 0
+        for blockno in xrange(nblocks):
+            used = self.is_block_used(blockno)
+            if (not used):
+                nfree += 1
+            if (blockno < meta and not used):
+                res.append("metadata block {0} is marked free".format(blockno))
+            elif (blockno >= meta and used and blockno not in owner):
+                res.append("block {0} is marked in use but no inode uses it".format(blockno))
+            elif (not used and blockno in owner):
+                res.append("block {0} is used by inode {1} but marked free".format(blockno, owner[blockno]))
+        if (nfree != self.get_nfree()):
+            res.append("superblock counts {0} free blocks, bitmap has {1}".format(self.get_nfree(), nfree))
+        return res
+
+    def fsck(self):
+        """Checks the whole file system: the blocks the inodes use against
+        each other and the free block bitmap, the free inode list, the
+        link counts and the directory tree. Reads every inode and
+        directory once, keeping what it found in flat arrays, so that it
+        stays quick on large disks. Returns a list of problems"""
+        res = []
+        ninodes = self.get_num_inodes()
+        nblocks = self.get_num_blocks()
+        meta = self.get_data_block()
+        root = self.get_root_inode()
+
+        # one pass over the inodes: types, link counts and blocks
+        used = bytearray((nblocks + 7) / 8)
+        for blockno in xrange(min(meta, nblocks)):
+            used[blockno / 8] |= 1 << (blockno % 8)
+        types = bytearray(ninodes)
+        links = [ 0 ] * ninodes
+        nextfree = {}
+        dirs = []
+        for i in xrange(ninodes):
+            inode = self.get_inode(i)
+            t = inode.get_type()
+            if (inode.get_number() != i):
+                res.append("inode {0} is numbered {1}".format(i, inode.get_number()))
+            if (t not in S5_TYPES):
+                res.append("inode {0} has bad type 0x{1:02x}".format(i, t))
+                types[i] = 0xff
+                continue
+            types[i] = t
+            if (t == S5_TYPE_FREE):
+                nextfree[i] = inode.get_next_free()
+                continue
+            links[i] = inode.get_link_count()
+            if (links[i] < 0):
+                res.append("inode {0} has link count {1}".format(i, links[i]))
+            if (t not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
+                continue
+            if (inode.get_size() > S5_MAX_FILE_SIZE):
+                res.append("inode {0} has size {1}, max file size is {2}".format(i, inode.get_size(), S5_MAX_FILE_SIZE))
+            if (inode.is_inline() and inode.get_size() > S5_INLINE_SIZE):
+                res.append("inode {0} has {1} bytes of inline data".format(i, inode.get_size()))
+            if (t == S5_TYPE_DIR):
+                if (inode.get_size() % S5_DIRENT_SIZE != 0):
+                    res.append("directory {0} has size {1}, which is not a multiple of the entry size".format(i, inode.get_size()))
+                else:
+                    dirs.append(i)
+            try:
+                blocknos = inode.get_blocknos()
+            except S5fsException as e:
+                res.append("inode {0}: {1}".format(i, str(e)))
+                continue
+            for blockno in blocknos:
+                if (blockno < meta or blockno >= nblocks):
+                    res.append("inode {0} maps block {1}, which is {2}".format(i, blockno, "metadata" if blockno < meta else "past the end of the disk"))
+                elif (used[blockno / 8] & (1 << (blockno % 8))):
+                    res.append("inode {0} maps block {1}, which is used already".format(i, blockno))
+                else:
+                    used[blockno / 8] |= 1 << (blockno % 8)
+
+        # the free inode list
+        listed = bytearray(ninodes)
+        i = self.get_free_inode()
+        while (i != 0xffffffff):
+            if (i >= ninodes or types[i] != S5_TYPE_FREE):
+                res.append("the free inode list has inode {0}, which is not free".format(i))
+                break
+            if (listed[i]):
+                res.append("the free inode list loops at inode {0}".format(i))
+                break
+            listed[i] = 1
+            i = nextfree[i]
+        for i in sorted(nextfree):
+            if (not listed[i]):
+                res.append("inode {0} is free, but not on the free inode list".format(i))
+
+        # the directories, counting the entries naming each inode
+        refs = [ 0 ] * ninodes
+        parent = {}
+        dotdot = {}
+        for i in dirs:
+            data = self.get_inode(i).read()
+            ndot = ndotdot = 0
+            for offset in xrange(0, len(data) - len(data) % S5_DIRENT_SIZE, S5_DIRENT_SIZE):
+                child = struct.unpack("I", data[offset:offset + 4])[0]
+                parts = data[offset + 4:offset + S5_DIRENT_SIZE].split('\0', 1)
+                if (len(parts) == 1):
+                    res.append("directory {0} has a bad name in entry {1}".format(i, offset / S5_DIRENT_SIZE))
+                    continue
+                name = parts[0]
+                if (len(name) == 0):
+                    continue
+                if (child >= ninodes or types[child] in set([ S5_TYPE_FREE, 0xff ])):
+                    res.append("entry {0} of directory {1} names inode {2}, which is not in use".format(name, i, child))
+                    continue
+                if (name == "."):
+                    ndot += 1
+                    if (child != i):
+                        res.append("\".\" of directory {0} is inode {1}".format(i, child))
+                    continue
+                refs[child] += 1
+                if (name == ".."):
+                    ndotdot += 1
+                    dotdot[i] = child
+                    if (types[child] != S5_TYPE_DIR):
+                        res.append("\"..\" of directory {0} is inode {1}, which is not a directory".format(i, child))
+                elif (types[child] == S5_TYPE_DIR):
+                    if (child in parent):
+                        res.append("directory {0} is in directories {1} and {2}".format(child, parent[child], i))
+                    else:
+                        parent[child] = i
+            if (ndot != 1 or ndotdot != 1):
+                res.append("directory {0} has {1} \".\" and {2} \"..\" entries".format(i, ndot, ndotdot))
+
+        # the link counts and the directory tree
+        if (root >= ninodes or types[root] != S5_TYPE_DIR):
+            res.append("the root inode {0} is not a directory".format(root))
+        for i in xrange(ninodes):
+            if (types[i] in set([ S5_TYPE_FREE, 0xff ])):
+                continue
+            if (types[i] == S5_TYPE_DIR):
+                if (i == root):
+                    if (dotdot.get(i) != root):
+                        res.append("\"..\" of the root directory is inode {0}".format(dotdot.get(i)))
+                elif (i not in parent):
+                    res.append("directory {0} is in no directory".format(i))
+                elif (parent[i] != dotdot.get(i)):
+                    res.append("directory {0} is in directory {1}, but its \"..\" is {2}".format(i, parent[i], dotdot.get(i)))
+            if (refs[i] == 0):
+                res.append("inode {0} is in use, but in no directory".format(i))
+            elif (refs[i] != links[i]):
+                res.append("inode {0} has link count {1}, but {2} entries name it".format(i, links[i], refs[i]))
+
+        # the free block bitmap, which has the same layout as used
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_bitmap_block())
+        bitmap = bytearray(self._simfile.read(len(used)).ljust(len(used), '\0'))
+        if (nblocks % 8 != 0):
+            bitmap[-1] &= (1 << (nblocks % 8)) - 1
+        nfree = nblocks - sum([ bin(byte).count("1") for byte in bitmap ])
+        for byte in xrange(len(used)):
+            if (bitmap[byte] == used[byte]):
+                continue
+            first = byte * 8
+            disk = bitmap[byte]
+            mine = used[byte]
+            count = min(8, nblocks - first)
+            for bit in xrange(count):
+                if ((mine >> bit) & 1 and not (disk >> bit) & 1):
+                    res.append("block {0} is in use, but marked free".format(first + bit))
+                elif ((disk >> bit) & 1 and not (mine >> bit) & 1):
+                    res.append("block {0} is marked in use, but nothing uses it".format(first + bit))
+        if (nfree != self.get_nfree()):
+            res.append("superblock counts {0} free blocks, bitmap has {1}".format(self.get_nfree(), nfree))
+        return res
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
@@ -543,25 +1173,26 @@ class Simdisk:
         res += "num inodes: {0}\n".format(self.get_num_inodes())
         res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
-        res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
-        for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
-            res += "  {0}".format(self.get_free_block(i))
-            if ((i + 1) % 10 == 0):
-                res += "\n"
-        if (res[-1] != "\n"):
-            res += "\n"
-        res += "  last free block: {0}\n".format(self.get_last_free_block())
+        res += "num blocks: {0}\n".format(self.get_num_blocks())
+        res += "free blocks: {0}{1}\n".format(self.get_nfree(), "" if self.get_nfree() < self.get_num_blocks() else " (INVALID)")
+        res += "bitmap:     {0} blocks at block {1}\n".format(self.get_bitmap_num_blocks(), self.get_bitmap_block())
+        res += "features:   0x{0:x}{1}{2}{3}{4}\n".format(self.get_features(), " (extents)" if self.get_features() & S5_FEATURE_EXTENTS else "", " (dir_index)" if self.get_features() & S5_FEATURE_DIR_INDEX else "", " (journal)" if self.get_features() & S5_FEATURE_JOURNAL else "", " (inline_data)" if self.get_features() & S5_FEATURE_INLINE_DATA else "")
+        if (self.get_features() & S5_FEATURE_JOURNAL):
+            res += "journal:    {0} blocks at block {1}\n".format(self.get_journal_num_blocks(), self.get_journal_block())
         return res
 
-    def format(self, inodes, size):
+    def format(self, inodes, size, extents=False, dir_index=False, journal=0, inline_data=False):
         if (inodes < 1):
             raise S5fsException("cannot format disk with {0} inodes, must have at least one".format(inodes))
         if (size % S5_BLOCK_SIZE != 0):
             raise S5fsException("cannot format disk to size {0} which is not a multiple of the block size {1}".format(size, S5_BLOCK_SIZE))
         blocks = int(size / S5_BLOCK_SIZE)
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
-        if (iblocks + 1 >= blocks):
-            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        bmblocks = int((blocks + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK)
+        if (journal and journal < S5_JOURNAL_MIN_BLOCKS):
+            raise S5fsException("cannot make a journal of {0} blocks, it must have at least {1}".format(journal, S5_JOURNAL_MIN_BLOCKS))
+        if (1 + iblocks + bmblocks + journal >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes, free block bitmap and journal require at least {2} bytes of space".format(size, inodes, (1 + iblocks + bmblocks + journal) * S5_BLOCK_SIZE))
         self._simfile.truncate()
         self._simfile.seek(size)
         self._simfile.write("")
@@ -577,26 +1208,26 @@ class Simdisk:
         inode.set_next_free(0xffffffff)
         self.set_free_inode(0)
 
-        self.set_last_free_block(0xffffffff)
-        i = 0
-        for num in xrange(iblocks, blocks):
-            if (i == S5_NBLKS_PER_FNODE - 1):
-                block = self.get_block(num)
-                for j in xrange(S5_NBLKS_PER_FNODE - 1):
-                    block.write(j * 4, struct.pack("I", self.get_free_block(j)))
-                block.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self.get_last_free_block()))
-                self.set_last_free_block(num)
-                i = 0
-            else:
-                self.set_free_block(i, num)
-                i += 1
-        self.set_nfree(i)
+        # the superblock, inode blocks, bitmap and journal are in use,
+        # everything after them is free
+        meta = 1 + iblocks + bmblocks + journal
+        self.set_num_blocks(blocks)
+        self.set_bitmap_block(1 + iblocks)
+        self.set_bitmap_num_blocks(bmblocks)
+        for num in xrange(1 + iblocks, 1 + iblocks + bmblocks):
+            self.get_block(num).zero()
+        for num in xrange(meta):
+            self.set_block_used(num, True)
+        self.set_nfree(blocks - meta)
+        self.set_features((S5_FEATURE_EXTENTS if extents else 0) | (S5_FEATURE_DIR_INDEX if dir_index else 0) | (S5_FEATURE_JOURNAL if journal else 0) | (S5_FEATURE_INLINE_DATA if inline_data else 0))
+        if (journal):
+            self.set_journal_block(1 + iblocks + bmblocks)
+            self.set_journal_num_blocks(journal)
+            self._set_journal_sequence(1)
 
         root = self.alloc_inode()
-        for i in xrange(S5_NDIRECT_BLOCKS):
-            root.set_direct_blockno(i, 0)
-        root.set_indirect_blockno(0)
         root.set_type(S5_TYPE_DIR)
+        root.init_block_map()
         root.set_size(0)
         root.set_link_count(1)
         root._make_dirent(root.get_number(), ".")
@@ -630,22 +1261,109 @@ class Simdisk:
         offset = S5_BLOCK_SIZE * index
         return Block(self, offset, index)
 
-    def alloc_block(self):
-        if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
-            raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
+    def alloc_block(self, goal=None):
+        # the first free block at or after goal, wrapping around, like
+        # the kernel does
         if (self.get_nfree() == 0):
-            if (self.get_last_free_block() == 0xffffffff):
-                raise S5fsDiskSpaceException()
-            else:
-                block = self.get_block(self.get_last_free_block())
-                for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                    self.set_free_block(i, struct.unpack("I", block.read(i * 4, 4))[0])
-                self.set_last_free_block(struct.unpack("I", block.read((S5_NBLKS_PER_FNODE - 1) * 4, 4))[0])
-                self.set_nfree(S5_NBLKS_PER_FNODE - 1)
-            return block
-        else:
-            self.set_nfree(self.get_nfree() - 1)
-            return self.get_block(self.get_free_block(self.get_nfree()))
+            raise S5fsDiskSpaceException()
+        nblocks = self.get_num_blocks()
+        if (goal == None or goal >= nblocks):
+            goal = self.get_data_block()
+        for i in xrange(nblocks):
+            blockno = (goal + i) % nblocks
+            if (not self.is_block_used(blockno)):
+                self.set_block_used(blockno, True)
+                self.set_nfree(self.get_nfree() - 1)
+                return self.get_block(blockno)
+        raise S5fsException("superblock counts {0} free blocks, but the bitmap is full".format(self.get_nfree()))
+
+    def free_block(self, blockno):
+        if (blockno < self.get_data_block()):
+            raise S5fsException("cannot free metadata block {0}".format(blockno))
+        if (not self.is_block_used(blockno)):
+            raise S5fsException("cannot free block {0}, it is already free".format(blockno))
+        self.set_block_used(blockno, False)
+        self.set_nfree(self.get_nfree() + 1)
 
     def open(self, path, create=False):
         return self.get_inode(self.get_root_inode()).open(path, create=create)
+
+    def _set_journal_sequence(self, sequence):
+        block = self.get_block(self.get_journal_block())
+        block.zero()
+        block.write(0, struct.pack("III", S5_JOURNAL_MAGIC, self.get_journal_num_blocks(), sequence))
+
+    def _read_journal_header(self, i, kind, sequence):
+        """Returns the tags of the header block of the given kind of
+        transaction sequence at block i of the journal, or None if it is
+        not one, along with the block"""
+        if (i >= self.get_journal_num_blocks()):
+            return (None, None)
+        data = self.get_block(self.get_journal_block() + i).read()
+        (magic, t, seq, count, checksum) = struct.unpack_from("IIIII", data)
+        if (magic != S5_JOURNAL_MAGIC or t != kind or seq != sequence or count > S5_JOURNAL_TAGS_PER_BLOCK):
+            return (None, data)
+        return (list(struct.unpack_from("{0}I".format(count), data, S5_JOURNAL_HEADER_SIZE)), data)
+
+    @staticmethod
+    def _journal_checksum(checksum, data):
+        for w in struct.unpack("{0}I".format(S5_BLOCK_SIZE / 4), data):
+            checksum = (((checksum << 1) | (checksum >> 31)) & 0xffffffff) ^ w
+        return checksum
+
+    def get_journal_transactions(self):
+        """Returns the transactions committed to the journal, which are
+        still to be copied into place, as a list of (sequence, the blocks
+        copied, where to, and the blocks revoked)"""
+        if (not (self.get_features() & S5_FEATURE_JOURNAL)):
+            return []
+        start = self.get_journal_block()
+        (magic, nblocks, sequence) = struct.unpack_from("III", self.get_block(start).read())
+        if (magic != S5_JOURNAL_MAGIC or nblocks != self.get_journal_num_blocks()):
+            raise S5fsException("bad journal superblock")
+        res = []
+        pos = 1
+        while True:
+            (tags, data) = self._read_journal_header(pos, S5_JOURNAL_DESCRIPTOR, sequence)
+            if (tags == None or pos + 1 + len(tags) >= nblocks):
+                break
+            checksum = self._journal_checksum(sequence, data)
+            copies = range(pos + 1, pos + 1 + len(tags))
+            for i in copies:
+                checksum = self._journal_checksum(checksum, self.get_block(start + i).read())
+            pos += 1 + len(tags)
+            (revoked, data) = self._read_journal_header(pos, S5_JOURNAL_REVOKE, sequence)
+            if (revoked != None):
+                checksum = self._journal_checksum(checksum, data)
+                pos += 1
+                (commit, data) = self._read_journal_header(pos, S5_JOURNAL_COMMIT, sequence)
+            else:
+                (commit, data) = self._read_journal_header(pos, S5_JOURNAL_COMMIT, sequence)
+                revoked = []
+            if (commit == None or struct.unpack_from("IIIII", data)[4] != checksum):
+                break
+            res.append((sequence, copies, tags, revoked))
+            pos += 1
+            sequence += 1
+        return res
+
+    def replay_journal(self):
+        """Copies the transactions committed to the journal into place,
+        as the kernel does when mounting, and empties the journal.
+        Returns the number of transactions"""
+        txns = self.get_journal_transactions()
+        if (len(txns) == 0):
+            return 0
+        start = self.get_journal_block()
+        nblocks = self.get_num_blocks()
+        revoked = {}
+        for (sequence, copies, tags, revokes) in txns:
+            for blockno in revokes:
+                revoked[blockno] = sequence
+        for (sequence, copies, tags, revokes) in txns:
+            for (i, blockno) in zip(copies, tags):
+                if (blockno == 0 or blockno >= nblocks or revoked.get(blockno, -1) >= sequence):
+                    continue
+                self.get_block(blockno).write(0, self.get_block(start + i).read())
+        self._set_journal_sequence(txns[-1][0] + 1)
+        return len(txns)
@@ -32,6 +32,10 @@ class FsmakerShell(cmd.Cmd):
         cmd.Cmd.__init__(self)
 
         self._parse_superblock = OptionParser(usage="usage: %prog", prog="superblock", description="prints a summary of the superblock's contents")
+        self._parse_superblock.add_option("-c", "--check", action="store_true", default=False,
+                                          help="checks that the free block bitmap matches the blocks used by the inodes")
+
+        self._parse_fsck = OptionParser(usage="usage: %prog", prog="fsck", description="checks the consistency of the whole file system: the free block bitmap and inode list, link counts and directories")
 
         self._parse_inode = OptionParser(usage="usage: %prog <nums...>", prog="inode", description="prints a summary of the specified inode's contents")
         self._parse_inode.add_option("-i", "--indirect", action="store_true", default=False,
@@ -57,17 +61,26 @@ class FsmakerShell(cmd.Cmd):
 
         self._parse_touch = OptionParser(usage="usage: %prog <dirs...>", prog="touch", description="creates a plain data file")
         self._parse_mkdir = OptionParser(usage="usage: %prog <dirs...>", prog="mkdir", description="creates an empty directory")
+        self._parse_mknod = OptionParser(usage="usage: %prog <c|b> <major> <minor> <path>", prog="mknod", description="creates a character (c) or block (b) device node")
 
         self._parse_getfile = OptionParser(usage="usage: %prog <source> <dest>", prog="getfile", description="gets a file from the real disk and puts it on the simdisk")
         self._parse_putfile = OptionParser(usage="usage: %prog <source> <dest>", prog="putfile", description="puts a file from the simdisk onto the real disk")
 
-        self._parse_format = OptionParser(usage="usage: %prog -i <inode count> [-s <size>|-b <blocks>]", prog="format", description="formats the simdisk to an empty file system")
+        self._parse_format = OptionParser(usage="usage: %prog -i <inode count> [-s <size>|-b <blocks>] [-x] [-I] [-j <blocks>] [-N]", prog="format", description="formats the simdisk to an empty file system")
         self._parse_format.add_option("-s", "--size", action="store", type="int", default=None,
                                       help="size for the new file system in bytes, must specify either this option or -b but not both")
         self._parse_format.add_option("-b", "--blocks", action="store", type="int", default=None,
                                       help="size for the new file system in blocks, must specify either this option or -s but not both")
         self._parse_format.add_option("-i", "--inodes", action="store", type="int", default=None,
                                       help="number of inodes to put on the disk, this must be specified and be compatible with the size of the disk (there must be enough space for the inodes)")
+        self._parse_format.add_option("-x", "--extents", action="store_true", default=False,
+                                      help="maps the blocks of new files with extents instead of direct and indirect blocks")
+        self._parse_format.add_option("-I", "--dir-index", action="store_true", default=False,
+                                      help="keeps a hash index of the entries of large directories")
+        self._parse_format.add_option("-j", "--journal", action="store", type="int", default=0,
+                                      help="reserves a journal of the given number of blocks for the kernel to log metadata changes to")
+        self._parse_format.add_option("-N", "--inline-data", action="store_true", default=False,
+                                      help="keeps the data of small files and directories in their inode instead of a block")
         self._parse_format.add_option("-d", "--directory", action="store", type="str", default=None,
                                       help="initializes the disk with the contents of the specified directory")
 
@@ -264,6 +277,11 @@ class FsmakerShell(cmd.Cmd):
             self._parse_superblock.error("command does not take arguments")
         else:
             print(self._simdisk.get_super_block_summary())
+            if (options.check):
+                problems = self._simdisk.check_block_bitmap()
+                for problem in problems:
+                    print(problem)
+                print("free block bitmap: {0} problem(s)".format(len(problems)))
 
     def help_superblock(self):
         self._parse_superblock.print_help()
@@ -271,6 +289,27 @@ class FsmakerShell(cmd.Cmd):
     def complete_superblock(self, text, line, begidx, endidx):
         return []
 
+    def do_fsck(self, args):
+        try:
+            (options, args) = self._parse_fsck.parse_args(shlex.split(args))
+        except ValueError as e:
+            self._parse_fsck.error(str(e))
+            return
+
+        if (len(args) != 0):
+            self._parse_fsck.error("command does not take arguments")
+        else:
+            problems = self._simdisk.fsck()
+            for problem in problems:
+                print(problem)
+            print("fsck: {0} problem(s)".format(len(problems)))
+
+    def help_fsck(self):
+        self._parse_fsck.print_help()
+
+    def complete_fsck(self, text, line, begidx, endidx):
+        return []
+
     def do_inode(self, args):
         try:
             (options, args) = self._parse_inode.parse_args(shlex.split(args))
@@ -294,7 +333,7 @@ class FsmakerShell(cmd.Cmd):
                 else:
                     try:
                         print(inode.get_summary())
-                        if (options.indirect and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ]) and inode.get_indirect_blockno() != 0):
+                        if (options.indirect and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ]) and not inode.uses_extents() and not inode.is_inline() and inode.get_indirect_blockno() != 0):
                             try:
                                 iblock = self._simdisk.get_block(inode.get_indirect_blockno())
                                 for i in xrange(api.S5_BLOCK_SIZE / 4):
@@ -545,6 +584,33 @@ class FsmakerShell(cmd.Cmd):
     def complete_mkdir(self, text, line, begin, end):
         return self.filepath_completion(text, line, begin, end)
 
+    def do_mknod(self, args):
+        try:
+            (options, args) = self._parse_mknod.parse_args(shlex.split(args))
+        except ValueError as e:
+            self._parse_mknod.error(str(e))
+            return
+
+        if (len(args) != 4 or args[0] not in ("c", "b")):
+            self._parse_mknod.error("command requires a device type, a major and a minor number and a path")
+            return
+        try:
+            devid = (int(args[1]) << 8) | int(args[2])
+        except ValueError as e:
+            self._parse_mknod.error(str(e))
+            return
+        try:
+            parentdir, name = self.get_parentdir(args[3])
+            parentdir.mknod(name, api.S5_TYPE_CHR if args[0] == "c" else api.S5_TYPE_BLK, devid)
+        except api.S5fsException as e:
+            self._parse_mknod.error(str(e))
+
+    def help_mknod(self):
+        self._parse_mknod.print_help()
+
+    def complete_mknod(self, text, line, begin, end):
+        return self.filepath_completion(text, line, begin, end)
+
     def getfile(self, source, dest):
         dest.truncate()
         
@@ -648,7 +714,7 @@ class FsmakerShell(cmd.Cmd):
                 size = options.size
             else:
                 size = options.blocks * api.S5_BLOCK_SIZE
-            self._simdisk.format(options.inodes, size)
+            self._simdisk.format(options.inodes, size, extents=options.extents, dir_index=options.dir_index, journal=options.journal, inline_data=options.inline_data)
 
         if (options.directory):
             q = Queue.Queue()
@@ -700,7 +766,15 @@ try:
         fs = FsmakerShell(api.Simdisk(tempfile.TemporaryFile()))
     else:
         try:
-            fs = FsmakerShell(api.Simdisk(open(args[0], 'rb+')))
+            simdisk = api.Simdisk(open(args[0], 'rb+'))
+            # what the kernel committed to the journal before it stopped
+            # is part of the file system
+            if (os.path.getsize(args[0]) >= api.S5_BLOCK_SIZE and simdisk.get_magic() == api.S5_MAGIC
+                and simdisk.get_version() == api.S5_CURRENT_VERSION):
+                n = simdisk.replay_journal()
+                if (n > 0):
+                    print("replayed {0} journal transactions".format(n))
+            fs = FsmakerShell(simdisk)
         except IOError as e:
             if (e.errno == errno.ENOENT):
                 fs = FsmakerShell(api.Simdisk(open(args[0], 'wb+')))
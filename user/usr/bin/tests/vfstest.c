@@ -889,6 +889,174 @@ vfstest_s5fs_vm(void)
 
         syscall_success(chdir(".."));
 }
+
+/*
+ * Writes a few strings spread over a sparse file as large as off_t
+ * allows, far enough apart to go through the direct blocks and the
+ * single and double indirect blocks up to the last one off_t can reach
+ * (or a multi-level extent tree), and reads them and a hole between
+ * them back. The triple indirect blocks start past 4 GiB, beyond any
+ * offset a 32-bit off_t can seek to.
+ */
+static void
+vfstest_s5fs_bigfile(void)
+{
+#define BIGFILE_SIZE 0x7fffffff
+#define BIGFILE_HOLE 4096
+
+        static const off_t offsets[] = {
+                0, 64 * 1024 + 1, 1024 * 1024 - 3, 6 * 1024 * 1024,
+                100 * 1024 * 1024 + 5, 333 * 1024 * 1024,
+                1024 * 1024 * 1024 + 7, 0x60000000,
+                BIGFILE_SIZE - sizeof(SHORTSTR) + 1
+        };
+        char buf[BIGFILE_HOLE];
+        struct stat s;
+        unsigned int i;
+        int fd, ret;
+
+        syscall_success(mkdir("bigfile", 0));
+        syscall_success(chdir("bigfile"));
+
+        syscall_success(fd = open("file01", O_RDWR | O_CREAT, 0));
+        for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+                test_assert(offsets[i] == lseek(fd, offsets[i], SEEK_SET), NULL);
+                syscall_success(ret = write(fd, SHORTSTR, strlen(SHORTSTR)));
+                test_assert((int)strlen(SHORTSTR) == ret, "write at %d returned %d",
+                            offsets[i], ret);
+        }
+        syscall_success(close(fd));
+
+        syscall_success(stat("file01", &s));
+        test_assert(BIGFILE_SIZE == s.st_size, "actual size: %d", s.st_size);
+
+        syscall_success(fd = open("file01", O_RDONLY, 0));
+        for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+                test_assert(offsets[i] == lseek(fd, offsets[i], SEEK_SET), NULL);
+                read_fd(fd, strlen(SHORTSTR), SHORTSTR);
+        }
+
+        /* The holes read as zeros */
+        test_assert(200 * 1024 * 1024 == lseek(fd, 200 * 1024 * 1024, SEEK_SET), NULL);
+        syscall_success(ret = read(fd, buf, BIGFILE_HOLE));
+        test_assert(BIGFILE_HOLE == ret, "read returned %d", ret);
+        for (i = 0; i < BIGFILE_HOLE && 0 == buf[i]; i++)
+                ;
+        test_assert(BIGFILE_HOLE == i, "nonzero byte at %d of a hole", i);
+        syscall_success(close(fd));
+
+        /* Frees the blocks under all the indirect blocks */
+        syscall_success(unlink("file01"));
+
+        syscall_success(chdir(".."));
+        syscall_success(rmdir("bigfile"));
+}
+
+/*
+ * Writes every other block of a file from the last one back to the
+ * first, syncing after each so that the blocks get mapped in that
+ * order. On disks with extents each block is a new extent before the
+ * first key of the tree, enough of them to split the leftmost leaf,
+ * and they all have to read back.
+ */
+static void
+vfstest_s5fs_backwards(void)
+{
+#define BACKWARDS_NBLOCKS 360
+#define BACKWARDS_BLOCK 4096
+
+        char name[32];
+        int fd, i;
+
+        syscall_success(mkdir("backwards", 0));
+        syscall_success(chdir("backwards"));
+
+        syscall_success(fd = open("file01", O_RDWR | O_CREAT, 0));
+        for (i = BACKWARDS_NBLOCKS - 1; i >= 0; i--) {
+                snprintf(name, sizeof(name), "block%03d", i);
+                test_assert(2 * i * BACKWARDS_BLOCK
+                            == lseek(fd, 2 * i * BACKWARDS_BLOCK, SEEK_SET), NULL);
+                test_assert((int)strlen(name) == write(fd, name, strlen(name)), NULL);
+                sync();
+        }
+        syscall_success(close(fd));
+
+        syscall_success(fd = open("file01", O_RDONLY, 0));
+        for (i = 0; i < BACKWARDS_NBLOCKS; i++) {
+                snprintf(name, sizeof(name), "block%03d", i);
+                test_assert(2 * i * BACKWARDS_BLOCK
+                            == lseek(fd, 2 * i * BACKWARDS_BLOCK, SEEK_SET), NULL);
+                read_fd(fd, strlen(name), name);
+        }
+        syscall_success(close(fd));
+
+        syscall_success(unlink("file01"));
+
+        syscall_success(chdir(".."));
+        syscall_success(rmdir("backwards"));
+}
+
+/*
+ * Fills a directory with more entries than a leaf of a directory index
+ * holds, to get it indexed and its first leaf split on disks with
+ * directory indexes, and looks them up while unlinking some. The
+ * entries are links to a few files, as there are fewer inodes than
+ * that on the disk.
+ */
+static void
+vfstest_s5fs_bigdir(void)
+{
+#define BIGDIR_NENTRIES 600
+#define BIGDIR_NFILES 8
+
+        char name[32], file[32];
+        struct stat s, fs;
+        int i;
+
+        syscall_success(mkdir("bigdir", 0));
+        syscall_success(chdir("bigdir"));
+
+        for (i = 0; i < BIGDIR_NENTRIES; i++) {
+                snprintf(name, sizeof(name), "file%03d", i);
+                if (i < BIGDIR_NFILES) {
+                        create_file(name);
+                } else {
+                        snprintf(file, sizeof(file), "file%03d", i % BIGDIR_NFILES);
+                        syscall_success(link(file, name));
+                }
+        }
+        for (i = 0; i < BIGDIR_NENTRIES; i++) {
+                snprintf(name, sizeof(name), "file%03d", i);
+                snprintf(file, sizeof(file), "file%03d", i % BIGDIR_NFILES);
+                syscall_success(stat(name, &s));
+                syscall_success(stat(file, &fs));
+                test_assert(s.st_ino == fs.st_ino, "%s is not a link to %s", name, file);
+        }
+        syscall_fail(stat("file", &s), ENOENT);
+
+        /* Removing entries moves others around */
+        for (i = BIGDIR_NFILES; i < BIGDIR_NENTRIES; i += 2) {
+                snprintf(name, sizeof(name), "file%03d", i);
+                syscall_success(unlink(name));
+        }
+        for (i = 0; i < BIGDIR_NENTRIES; i++) {
+                snprintf(name, sizeof(name), "file%03d", i);
+                if (i < BIGDIR_NFILES || i % 2)
+                        syscall_success(stat(name, &s));
+                else
+                        syscall_fail(stat(name, &s), ENOENT);
+        }
+        syscall_fail(mkdir("file001", 0), EEXIST);
+
+        for (i = 0; i < BIGDIR_NENTRIES; i++) {
+                snprintf(name, sizeof(name), "file%03d", i);
+                if (i < BIGDIR_NFILES || i % 2)
+                        syscall_success(unlink(name));
+        }
+
+        syscall_success(chdir(".."));
+        syscall_success(rmdir("bigdir"));
+}
 #endif
 
 /*
@@ -921,6 +1089,9 @@ int vfstest_main(int argc, char **argv)
 
 #ifdef __VM__
         vfstest_s5fs_vm();
+        vfstest_s5fs_bigfile();
+        vfstest_s5fs_backwards();
+        vfstest_s5fs_bigdir();
 #endif
 
         /*vfstest_infinite();*/